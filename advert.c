@@ -0,0 +1,331 @@
+/**
+* @file advert.c
+* @brief Decodes ManufacturerData and ServiceData into typed beacon fields.
+*/
+#include "advert.h"
+
+//! Append only: a layout is filled in before num_layouts publishes it and
+//! never changes after, so the pool worker reads the table without a lock
+//! while commands register more, and Advert.custom.layout stays valid.
+static AdvertLayout layouts[ADVERT_MAX_LAYOUTS];
+static gint num_layouts = 0;
+static GMutex layouts_lock;  /** Serializes registrations. */
+
+static const char *url_schemes[] = { "http://www.", "https://www.", "http://", "https://" };
+static const char *url_expansions[] = {
+   ".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+   ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov"
+};
+static const char *field_types[] = { "u8", "s8", "u16le", "u16be", "s16le", "s16be", "u32le", "u32be" };
+static const guint8 field_sizes[] = { 1, 1, 2, 2, 2, 2, 4, 4 };
+
+static guint16 read_u16_be(const guint8 *p) { return (p[0] << 8) | p[1]; }
+static guint16 read_u16_le(const guint8 *p) { return (p[1] << 8) | p[0]; }
+static guint32 read_u32_be(const guint8 *p) { return ((guint32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static guint32 read_u32_le(const guint8 *p) { return ((guint32)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]; }
+
+static gint64 advert_read_field(const AdvertField *field, const guint8 *data)
+{
+   const guint8 *p = data + field->offset;
+
+   switch (field->type)
+   {
+      case FIELD_U8:
+         return p[0];
+      case FIELD_S8:
+         return (gint8)p[0];
+      case FIELD_U16_LE:
+         return read_u16_le(p);
+      case FIELD_U16_BE:
+         return read_u16_be(p);
+      case FIELD_S16_LE:
+         return (gint16)read_u16_le(p);
+      case FIELD_S16_BE:
+         return (gint16)read_u16_be(p);
+      case FIELD_U32_LE:
+         return read_u32_le(p);
+      case FIELD_U32_BE:
+         return read_u32_be(p);
+   }
+   return 0;
+}
+
+/**
+ * @brief Decodes one ManufacturerData entry. Registered layouts win over
+ *  the built in formats.
+ *
+ * @param company_id Bluetooth SIG company identifier.
+ * @param data Payload, read in place.
+ * @param len Payload length.
+ * @param out Filled on success.
+ *
+ * @returns TRUE if the payload is a known format.
+ */
+gboolean advert_decode_manufacturer(guint16 company_id, const guint8 *data, gsize len, Advert *out)
+{
+   gint published = g_atomic_int_get(&num_layouts);
+
+   for (int i = 0; i < published; i++)
+   {
+      const AdvertLayout *layout = &layouts[i];
+      if (layout->company_id != company_id || len < layout->min_length)
+         continue;
+
+      out->kind = ADVERT_CUSTOM;
+      out->custom.layout = layout;
+      for (int f = 0; f < layout->num_fields; f++)
+         out->custom.values[f] = advert_read_field(&layout->fields[f], data);
+      return TRUE;
+   }
+
+   // iBeacon: 0x02 0x15, UUID, major, minor (big endian), tx power.
+   if (company_id == COMPANY_APPLE && len >= 23 && data[0] == 0x02 && data[1] == 0x15)
+   {
+      out->kind = ADVERT_IBEACON;
+      memcpy(out->ibeacon.uuid, data + 2, 16);
+      out->ibeacon.major = read_u16_be(data + 18);
+      out->ibeacon.minor = read_u16_be(data + 20);
+      out->ibeacon.tx_power = (gint8)data[22];
+      return TRUE;
+   }
+   return FALSE;
+}
+
+static void advert_decode_url(const guint8 *data, gsize len, gchar *url)
+{
+   gsize pos = 0;
+
+   url[0] = '\0';
+   if (len < 1 || data[0] >= G_N_ELEMENTS(url_schemes))
+      return;
+
+   pos = g_strlcpy(url, url_schemes[data[0]], ADVERT_URL_MAX);
+   for (gsize i = 1; i < len && pos < ADVERT_URL_MAX - 1; i++)
+   {
+      if (data[i] < G_N_ELEMENTS(url_expansions))
+         pos = g_strlcat(url, url_expansions[data[i]], ADVERT_URL_MAX);
+      else if (data[i] > 0x20 && data[i] < 0x7f)
+      {
+         url[pos++] = data[i];
+         url[pos] = '\0';
+      }
+   }
+}
+
+/**
+ * @brief Decodes one ServiceData entry (Eddystone frames).
+ *
+ * @returns TRUE if the payload is a known format.
+ */
+gboolean advert_decode_service(const char *uuid, const guint8 *data, gsize len, Advert *out)
+{
+   if (g_ascii_strcasecmp(uuid, EDDYSTONE_UUID) != 0 || len < 2)
+      return FALSE;
+
+   switch (data[0])
+   {
+      case 0x00: // UID
+         if (len < 18)
+            return FALSE;
+         out->kind = ADVERT_EDDYSTONE_UID;
+         out->uid.tx_power = (gint8)data[1];
+         memcpy(out->uid.namespace_id, data + 2, 10);
+         memcpy(out->uid.instance_id, data + 12, 6);
+         return TRUE;
+      case 0x10: // URL
+         if (len < 3)
+            return FALSE;
+         out->kind = ADVERT_EDDYSTONE_URL;
+         out->url.tx_power = (gint8)data[1];
+         advert_decode_url(data + 2, len - 2, out->url.url);
+         return TRUE;
+      case 0x20: // Unencrypted TLM
+         if (len < 14 || data[1] != 0x00)
+            return FALSE;
+         out->kind = ADVERT_EDDYSTONE_TLM;
+         out->tlm.battery_mv = read_u16_be(data + 2);
+         out->tlm.temperature = (gint16)read_u16_be(data + 4);
+         out->tlm.adv_count = read_u32_be(data + 6);
+         out->tlm.uptime = read_u32_be(data + 10);
+         return TRUE;
+   }
+   return FALSE;
+}
+
+/**
+ * @brief Counts the entries of a ManufacturerData or ServiceData value,
+ *  an upper bound for advert_decode_property(). 0 for other properties.
+ */
+int advert_count_property(const char *prop, GVariant *val)
+{
+   if ((g_str_equal(prop, "ManufacturerData") && g_variant_is_of_type(val, G_VARIANT_TYPE("a{qv}")))
+       || (g_str_equal(prop, "ServiceData") && g_variant_is_of_type(val, G_VARIANT_TYPE_VARDICT)))
+      return g_variant_n_children(val);
+   return 0;
+}
+
+/**
+ * @brief Decodes a ManufacturerData (a{qv}) or ServiceData (a{sv}) value.
+ *  The byte arrays are read in place, nothing is copied.
+ *
+ * @param prop Property name, ManufacturerData or ServiceData.
+ * @param val Property value.
+ * @param out Array to fill.
+ * @param max Size of out.
+ *
+ * @returns Number of entries written to out.
+ */
+int advert_decode_property(const char *prop, GVariant *val, Advert *out, int max)
+{
+   int n = 0;
+   int count = advert_count_property(prop, val);
+   gboolean manufacturer = g_str_equal(prop, "ManufacturerData");
+
+   for (int i = 0; i < count && n < max; i++)
+   {
+      GVariant *entry = g_variant_get_child_value(val, i);
+      GVariant *key = g_variant_get_child_value(entry, 0);
+      GVariant *boxed = g_variant_get_child_value(entry, 1);
+      GVariant *bytes = g_variant_get_variant(boxed);
+      gsize len = 0;
+
+      if (g_variant_is_of_type(bytes, G_VARIANT_TYPE_BYTESTRING))
+      {
+         const guint8 *data = g_variant_get_fixed_array(bytes, &len, 1);
+         gboolean ok = manufacturer
+            ? advert_decode_manufacturer(g_variant_get_uint16(key), data, len, &out[n])
+            : advert_decode_service(g_variant_get_string(key, NULL), data, len, &out[n]);
+         n += ok ? 1 : 0;
+      }
+
+      g_variant_unref(bytes);
+      g_variant_unref(boxed);
+      g_variant_unref(key);
+      g_variant_unref(entry);
+   }
+   return n;
+}
+
+static void advert_hex(const guint8 *bytes, gsize len, char *out)
+{
+   static const char digits[] = "0123456789abcdef";
+   for (gsize i = 0; i < len; i++)
+   {
+      out[2 * i] = digits[bytes[i] >> 4];
+      out[2 * i + 1] = digits[bytes[i] & 0xf];
+   }
+   out[2 * len] = '\0';
+}
+
+/**
+ * @brief Formats a decoded advertisement as "kind key=value ..." into buf.
+ *
+ * @returns buf.
+ */
+char *advert_to_string(const Advert *advert, char *buf, gsize len)
+{
+   char hex_a[33];
+   char hex_b[13];
+   gsize pos = 0;
+
+   switch (advert->kind)
+   {
+      case ADVERT_IBEACON:
+         advert_hex(advert->ibeacon.uuid, 16, hex_a);
+         g_snprintf(buf, len, "ibeacon uuid=%s major=%u minor=%u tx=%d",
+                    hex_a, advert->ibeacon.major, advert->ibeacon.minor, advert->ibeacon.tx_power);
+         break;
+      case ADVERT_EDDYSTONE_UID:
+         advert_hex(advert->uid.namespace_id, 10, hex_a);
+         advert_hex(advert->uid.instance_id, 6, hex_b);
+         g_snprintf(buf, len, "eddystone-uid namespace=%s instance=%s tx=%d",
+                    hex_a, hex_b, advert->uid.tx_power);
+         break;
+      case ADVERT_EDDYSTONE_URL:
+         g_snprintf(buf, len, "eddystone-url url=%s tx=%d", advert->url.url, advert->url.tx_power);
+         break;
+      case ADVERT_EDDYSTONE_TLM:
+         g_snprintf(buf, len, "eddystone-tlm battery_mv=%u temp=%.2f adv_count=%u uptime_s=%u",
+                    advert->tlm.battery_mv, advert->tlm.temperature / 256.0,
+                    advert->tlm.adv_count, advert->tlm.uptime / 10);
+         break;
+      case ADVERT_CUSTOM:
+         pos = g_snprintf(buf, len, "company=0x%04x", advert->custom.layout->company_id);
+         for (int f = 0; f < advert->custom.layout->num_fields && pos < len; f++)
+            pos += g_snprintf(buf + pos, len - pos, " %s=%lld",
+                              advert->custom.layout->fields[f].name,
+                              (long long)advert->custom.values[f]);
+         break;
+      default:
+         g_strlcpy(buf, "unknown", len);
+         break;
+   }
+   return buf;
+}
+
+/**
+ * @brief Parses and registers a layout spec of the form
+ *  "<company>:<name>=<type>@<offset>,..." where type is one of u8, s8,
+ *  u16le, u16be, s16le, s16be, u32le, u32be, e.g.
+ *  "0x0499:temp=s16le@1,humidity=u16le@3".
+ *
+ * @returns FALSE if the spec couldn't be parsed or the table is full.
+ */
+gboolean advert_register_layout(const char *spec)
+{
+   AdvertLayout layout = {0};
+   gchar *end = NULL;
+   gchar **fields = NULL;
+   gboolean ok = TRUE;
+   gint count = 0;
+
+   guint64 company = g_ascii_strtoull(spec, &end, 0);
+   if (end == spec || *end != ':' || company > 0xffff)
+      return FALSE;
+   layout.company_id = company;
+
+   fields = g_strsplit(end + 1, ",", ADVERT_MAX_FIELDS + 1);
+   for (int i = 0; ok && fields[i] != NULL; i++)
+   {
+      AdvertField *field = &layout.fields[layout.num_fields];
+      gchar *eq = strchr(fields[i], '=');
+      gchar *at = eq ? strchr(eq, '@') : NULL;
+      int type = -1;
+
+      ok = eq != NULL && at != NULL && layout.num_fields < ADVERT_MAX_FIELDS;
+      if (!ok)
+         break;
+      *eq = '\0';
+      *at = '\0';
+      for (int t = 0; t < G_N_ELEMENTS(field_types); t++)
+      {
+         if (g_str_equal(eq + 1, field_types[t]))
+            type = t;
+      }
+
+      guint64 offset = g_ascii_strtoull(at + 1, &end, 0);
+      ok = type >= 0 && *end == '\0' && offset + field_sizes[type] <= 255;
+      if (!ok)
+         break;
+
+      g_strlcpy(field->name, fields[i], sizeof(field->name));
+      field->type = type;
+      field->offset = offset;
+      layout.min_length = MAX(layout.min_length, offset + field_sizes[type]);
+      layout.num_fields += 1;
+   }
+   g_strfreev(fields);
+
+   if (!ok || layout.num_fields == 0)
+      return FALSE;
+
+   g_mutex_lock(&layouts_lock);
+   count = g_atomic_int_get(&num_layouts);
+   if (count < ADVERT_MAX_LAYOUTS)
+   {
+      layouts[count] = layout;
+      g_atomic_int_set(&num_layouts, count + 1);
+   }
+   g_mutex_unlock(&layouts_lock);
+   return count < ADVERT_MAX_LAYOUTS;
+}
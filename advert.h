@@ -0,0 +1,163 @@
+/**
+* @file advert.h
+* @brief Decodes ManufacturerData and ServiceData into typed beacon fields.
+*/
+#ifndef ADVERT_H
+#define ADVERT_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#define COMPANY_APPLE 0x004C
+#define EDDYSTONE_UUID "0000feaa-0000-1000-8000-00805f9b34fb"
+#define ADVERT_MAX_FIELDS 8
+#define ADVERT_MAX_LAYOUTS 16
+#define ADVERT_URL_MAX 64
+#define ADVERT_STR_MAX 160
+
+/** @brief Formats the decoder knows. */
+typedef enum _AdvertKind
+{
+   ADVERT_NONE,
+   ADVERT_IBEACON,
+   ADVERT_EDDYSTONE_UID,
+   ADVERT_EDDYSTONE_URL,
+   ADVERT_EDDYSTONE_TLM,
+   ADVERT_CUSTOM
+} AdvertKind;
+
+/** @brief Field encodings of a registered layout. */
+typedef enum _AdvertFieldType
+{
+   FIELD_U8,
+   FIELD_S8,
+   FIELD_U16_LE,
+   FIELD_U16_BE,
+   FIELD_S16_LE,
+   FIELD_S16_BE,
+   FIELD_U32_LE,
+   FIELD_U32_BE
+} AdvertFieldType;
+
+/** @brief One field of a registered layout. */
+typedef struct _AdvertField
+{
+   gchar name[16];
+   AdvertFieldType type;
+   guint8 offset;
+} AdvertField;
+
+/** @brief A user registered ManufacturerData layout for one company ID. */
+typedef struct _AdvertLayout
+{
+   guint16 company_id;
+   guint8 min_length;  /** Payloads shorter than this are ignored. */
+   int num_fields;
+   AdvertField fields[ADVERT_MAX_FIELDS];
+} AdvertLayout;
+
+typedef struct _IBeacon
+{
+   guint8 uuid[16];
+   guint16 major;
+   guint16 minor;
+   gint8 tx_power;  /** Calibrated RSSI at 1 m. */
+} IBeacon;
+
+typedef struct _EddystoneUid
+{
+   gint8 tx_power;  /** Calibrated RSSI at 0 m. */
+   guint8 namespace_id[10];
+   guint8 instance_id[6];
+} EddystoneUid;
+
+typedef struct _EddystoneUrl
+{
+   gint8 tx_power;
+   gchar url[ADVERT_URL_MAX];
+} EddystoneUrl;
+
+typedef struct _EddystoneTlm
+{
+   guint16 battery_mv;
+   gint16 temperature;  /** Signed 8.8 fixed point degrees C, -128.0 if unsupported. */
+   guint32 adv_count;
+   guint32 uptime;      /** In 0.1 s units. */
+} EddystoneTlm;
+
+typedef struct _AdvertCustom
+{
+   const AdvertLayout *layout;
+   gint64 values[ADVERT_MAX_FIELDS];
+} AdvertCustom;
+
+/** @brief One decoded advertisement payload. */
+typedef struct _Advert
+{
+   AdvertKind kind;
+   union
+   {
+      IBeacon ibeacon;
+      EddystoneUid uid;
+      EddystoneUrl url;
+      EddystoneTlm tlm;
+      AdvertCustom custom;
+   };
+} Advert;
+
+/**
+ * @brief Decodes one ManufacturerData entry. Registered layouts win over
+ *  the built in formats.
+ *
+ * @param company_id Bluetooth SIG company identifier.
+ * @param data Payload, read in place.
+ * @param len Payload length.
+ * @param out Filled on success.
+ *
+ * @returns TRUE if the payload is a known format.
+ */
+gboolean advert_decode_manufacturer(guint16 company_id, const guint8 *data, gsize len, Advert *out);
+
+/**
+ * @brief Decodes one ServiceData entry (Eddystone frames).
+ *
+ * @returns TRUE if the payload is a known format.
+ */
+gboolean advert_decode_service(const char *uuid, const guint8 *data, gsize len, Advert *out);
+
+/**
+ * @brief Decodes a ManufacturerData (a{qv}) or ServiceData (a{sv}) value.
+ *  The byte arrays are read in place, nothing is copied.
+ *
+ * @param prop Property name, ManufacturerData or ServiceData.
+ * @param val Property value.
+ * @param out Array to fill.
+ * @param max Size of out.
+ *
+ * @returns Number of entries written to out.
+ */
+int advert_decode_property(const char *prop, GVariant *val, Advert *out, int max);
+
+/**
+ * @brief Counts the entries of a ManufacturerData or ServiceData value,
+ *  an upper bound for advert_decode_property(). 0 for other properties.
+ */
+int advert_count_property(const char *prop, GVariant *val);
+
+/**
+ * @brief Formats a decoded advertisement as "kind key=value ..." into buf.
+ *
+ * @returns buf.
+ */
+char *advert_to_string(const Advert *advert, char *buf, gsize len);
+
+/**
+ * @brief Parses and registers a layout spec of the form
+ *  "<company>:<name>=<type>@<offset>,..." where type is one of u8, s8,
+ *  u16le, u16be, s16le, s16be, u32le, u32be, e.g.
+ *  "0x0499:temp=s16le@1,humidity=u16le@3".
+ *
+ * @returns FALSE if the spec couldn't be parsed or the table is full.
+ */
+gboolean advert_register_layout(const char *spec);
+
+#endif // ADVERT_H
@@ -1,13 +1,52 @@
 #include "app.h"
-#define DEV_ARRAY_INIT_SIZE 40
 #define CLI 1
 
 static GDBusConnection *conn = NULL;
 static GMainLoop *main_loop = NULL;
-static GSource *timeout_source = NULL;
+static GIOChannel *stdin_channel = NULL;
+static guint stdin_watch = 0;
+static guint sigint_watch = 0;
+static guint sigterm_watch = 0;
+static guint dispatch_source = 0;
+static GQueue commands = G_QUEUE_INIT;
+static gboolean command_pending = FALSE;
+static gboolean app_persist = FALSE;
+static DevicePool *pool = NULL;
 static Device *devices = NULL;
 static gsize num_devices = 0;
-static guint prop_changed;
+static guint prop_changed = 0;
+static gboolean tui_active = FALSE;
+static DiscoveryConfig scan_config = {0};
+static Discovery *scan = NULL;
+static gchar *found_path = NULL;
+static GHashTable *last_seen = NULL;
+static guint started_secs = 0;
+static guint seen_subs[2] = {0};
+static guint watch_source = 0;
+static gboolean watch_busy = FALSE;
+static guint tui_subs[3] = {0};
+static gboolean app_offline = FALSE;
+static gchar *record_file = NULL;
+static gchar *metrics_spec = NULL;
+static Replay *replay = NULL;
+static LoadGen *load = NULL;
+static Presence *presence = NULL;
+static Supervisor *supervisor = NULL;
+static Telemetry *telemetry = NULL;
+static GattCache *gatt = NULL;
+static GattWrite *gatt_write = NULL;
+static NotifyHub *notify = NULL;
+static guint notify_source = 0;
+static GArray *notify_last = NULL;  /** Last NotifySample of each stream. */
+static GArray *notify_seen = NULL;  /** Samples of each stream at the last report. */
+static GDBusConnection *session_bus = NULL;
+static Obex *obex = NULL;
+static gboolean obex_waiting = FALSE;  /** A -O command waits for its transfers. */
+static History *history = NULL;
+static gchar *history_query = NULL;  /** Key -H reports on, NULL for none. */
+static guint history_minutes = 60;
+static guint history_step = 60;
+static guint history_source = 0;
 #if CLI
 static struct option long_options[] = 
 {
@@ -15,10 +54,34 @@ static struct option long_options[] =
    {"scan", required_argument, 0, 's'},
    {"debug", no_argument, 0, 'e'},
    {"list", no_argument, 0, 'l'},
-   {"pair", no_argument, 0, 'p'},
-   {"connect", no_argument, 0, 'c'},
-   {"remove", no_argument, 0, 'r'},
+   {"pair", optional_argument, 0, 'p'},
+   {"connect", optional_argument, 0, 'c'},
+   {"disconnect", optional_argument, 0, 'd'},
+   {"remove", optional_argument, 0, 'r'},
    {"quit", no_argument, 0, 'q'},
+   {"tui", no_argument, 0, 't'},
+   {"fps", required_argument, 0, 'f'},
+   {"watch", required_argument, 0, 'w'},
+   {"match", required_argument, 0, 'm'},
+   {"duty", required_argument, 0, 'y'},
+   {"purge", required_argument, 0, 'x'},
+   {"adapter", required_argument, 0, 'a'},
+   {"beacon", required_argument, 0, 'b'},
+   {"record", required_argument, 0, 'R'},
+   {"replay", required_argument, 0, 'P'},
+   {"loadgen", required_argument, 0, 'L'},
+   {"bench", required_argument, 0, 'B'},
+   {"metrics", required_argument, 0, 'M'},
+   {"output", required_argument, 0, 'o'},
+   {"presence", required_argument, 0, 'z'},
+   {"keep", required_argument, 0, 'k'},
+   {"telemetry", required_argument, 0, 'T'},
+   {"gatt", required_argument, 0, 'g'},
+   {"write", required_argument, 0, 'W'},
+   {"notify", required_argument, 0, 'N'},
+   {"send", required_argument, 0, 'O'},
+   {"inbox", required_argument, 0, 'I'},
+   {"history", optional_argument, 0, 'H'},
    {0, 0, 0, 0}
 };
 #endif
@@ -39,12 +102,87 @@ void handle_properties_changed(GDBusConnection *sig,
 	(void)signal_name;
    (void)parameters;
    (void)user_data;
-   g_print("Sender Name: %s\n", sender_name);
-   g_print("Object Path: %s\n", object_path);
-   g_print("Interface  : %s\n", interface);
-   g_print("Signal Name: %s\n", signal_name);
-   g_print(g_variant_print(parameters, FALSE));
-   g_print("\n");
+   output_record_begin("signal");
+   output_str("sender", sender_name);
+   output_str("path", object_path);
+   output_str("interface", interface);
+   output_str("member", signal_name);
+   output_value("args", parameters);
+   output_record_end();
+}
+
+void handle_tui_signal(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   const gchar *path = NULL;
+   GVariant *dict = NULL;
+
+   if (g_str_equal(signal_name, "PropertiesChanged"))
+   {
+      g_variant_get(parameters, "(&s@a{sv}@as)", NULL, &dict, NULL);
+      curses_device_update(object_path, dict, TRUE);
+      g_variant_unref(dict);
+   }
+   else if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &dict);
+      GVariant *props = g_variant_lookup_value(dict, "org.bluez.Device1", G_VARIANT_TYPE_VARDICT);
+      if (props != NULL)
+      {
+         curses_device_update(path, props, TRUE);
+         g_variant_unref(props);
+      }
+      g_variant_unref(dict);
+   }
+   else if (g_str_equal(signal_name, "InterfacesRemoved"))
+   {
+      const gchar **ifaces = NULL;
+      g_variant_get(parameters, "(&o^a&s)", &path, &ifaces);
+      for (int i = 0; ifaces[i] != NULL; i++)
+      {
+         if (g_str_equal(ifaces[i], "org.bluez.Device1"))
+            curses_device_remove(path);
+      }
+      g_free(ifaces);
+   }
+}
+
+void handle_seen_signal(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   static const char *heard[] = { "RSSI", "ManufacturerData", "ServiceData", "TxPower" };
+   const gchar *path = object_path;
+   gboolean seen = FALSE;
+   GVariant *dict = NULL;
+
+   if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &dict);
+      seen = g_variant_lookup(dict, BLUEZ_DEVICE_IFACE, "@a{sv}", NULL);
+   }
+   else
+   {
+      g_variant_get(parameters, "(&s@a{sv}@as)", NULL, &dict, NULL);
+      for (int i = 0; !seen && i < G_N_ELEMENTS(heard); i++)
+         seen = g_variant_lookup(dict, heard[i], "*", NULL);
+   }
+   if (presence != NULL || history != NULL)
+      app_presence_feed(path, dict, signal_name);
+   g_variant_unref(dict);
+
+   if (seen)
+      g_hash_table_replace(last_seen, g_strdup(path),
+                           GUINT_TO_POINTER(g_get_monotonic_time() / G_USEC_PER_SEC));
 }
 
 int app_run()
@@ -55,40 +193,121 @@ int app_run()
 
 int app_quit()
 {
+   if (scan != NULL)
+      discovery_stop(scan);
+   discovery_match_clear(&scan_config.match);
+   g_free(found_path);
+   if (tui_active)
+   {
+      for (int i = 0; i < G_N_ELEMENTS(tui_subs); i++)
+         g_dbus_connection_signal_unsubscribe(conn, tui_subs[i]);
+      discovery_release(conn);
+      curses_end();
+   }
+   if (watch_source)
+   {
+      g_source_remove(watch_source);
+      discovery_release(conn);
+   }
+   telemetry_free(telemetry);
+   gatt_write_cancel(gatt_write);
+   obex_free(obex);
+   g_clear_object(&session_bus);
+   if (notify_source)
+      g_source_remove(notify_source);
+   notify_hub_free(notify);
+   if (notify_last != NULL)
+   {
+      g_array_free(notify_last, TRUE);
+      g_array_free(notify_seen, TRUE);
+   }
+   gatt_cache_free(gatt);
+   if (supervisor != NULL)
+   {
+      supervisor_free(supervisor);
+      discovery_release(conn);
+   }
+   if (presence != NULL)
+   {
+      presence_free(presence);
+      if (conn != NULL)
+         discovery_release(conn);
+   }
+   if (history_source)
+      g_source_remove(history_source);
+   g_free(history_query);
+   if (history != NULL)
+   {
+      history_free(history);
+      if (conn != NULL)
+         discovery_release(conn);
+   }
+   replay_free(replay);
+   loadgen_free(load);
+   record_stop();
+   g_free(record_file);
+   metrics_stop();
+   g_free(metrics_spec);
+   output_close();
    g_print("Shutting down\n");
+   if (dispatch_source)
+      g_source_remove(dispatch_source);
+   if (stdin_watch)
+      g_source_remove(stdin_watch);
+   if (stdin_channel)
+      g_io_channel_unref(stdin_channel);
+   g_source_remove(sigint_watch);
+   g_source_remove(sigterm_watch);
+   g_queue_clear_full(&commands, (GDestroyNotify)app_command_free);
    g_main_loop_unref(main_loop);
-   g_source_unref(timeout_source);
-	g_dbus_connection_signal_unsubscribe(conn, prop_changed);
+   g_hash_table_destroy(last_seen);
+
+   if (conn != NULL)
+   {
+      if (prop_changed)
+         g_dbus_connection_signal_unsubscribe(conn, prop_changed);
+      for (int i = 0; i < G_N_ELEMENTS(seen_subs); i++)
+         g_dbus_connection_signal_unsubscribe(conn, seen_subs[i]);
 
-   bluez_adapter_set_property(conn, "Pairable", g_variant_new_boolean(0));
-   // Turn off the adapter.
-   bluez_adapter_set_property(conn, "Powered", g_variant_new_boolean(0));
+      bluez_adapter_set_property(conn, "Pairable", g_variant_new_boolean(0));
+      // Turn off the adapter.
+      bluez_adapter_set_property(conn, "Powered", g_variant_new_boolean(0));
 
-   /****** CLOSE CONNECTION START ******/
-   dbus_close_bus(conn);
-   /****** CLOSE CONNECTION END ******/
+      /****** CLOSE CONNECTION START ******/
+      dbus_close_bus(conn);
+      /****** CLOSE CONNECTION END ******/
+   }
 
    /****** CLEANUP START ******/
-   bluez_devices_free(devices, num_devices);
+   device_pool_free(pool);
    /****** CLEANUP END ******/
    return 0;
 }
 
 int app_init()
 {
-   conn = dbus_connect_bus(); // Establish a connection with dbus
-
-   //! Main loop settings.
+   //! Main loop settings. Everything below is driven by event sources,
+   //! the loop sleeps in poll() until one of them fires.
    main_loop = g_main_loop_new(NULL, FALSE);
-   timeout_source = g_timeout_source_new_seconds(45);
-   g_source_set_callback(timeout_source,
-                        (GSourceFunc)timeout_cb,
-                        main_loop,
-                        NULL);
-   g_source_attach(timeout_source, NULL);
-   g_idle_add((GSourceFunc)idle_function, NULL);
-   
+   sigint_watch = g_unix_signal_add(SIGINT, app_signal_cb, NULL);
+   sigterm_watch = g_unix_signal_add(SIGTERM, app_signal_cb, NULL);
+   started_secs = g_get_monotonic_time() / G_USEC_PER_SEC;
+   last_seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   pool = device_pool_new();
+   if (metrics_spec != NULL)
+      app_metrics(metrics_spec);
 
+   //! Replays and load runs feed the handlers themselves, no bus needed.
+   if (app_offline)
+   {
+      app_command_done();
+      return 0;
+   }
+
+   conn = dbus_connect_bus(); // Establish a connection with dbus
+   metrics_watch(conn);
+   if (record_file != NULL)
+      app_record(record_file);
 
    //! Adapter properties and agent setup.
    bluez_adapter_set_property(conn, "Powered", g_variant_new_boolean(1));
@@ -97,121 +316,1295 @@ int app_init()
    if (rc) 
       fprintf(stderr, "CRITICAL ERROR\n");
 
-   //! Initial device array.
-   devices = (Device *)malloc(sizeof(Device) * DEV_ARRAY_INIT_SIZE);
-   num_devices = bluez_adapter_get_objects(conn, devices, DEV_ARRAY_INIT_SIZE);
-   devices = realloc(devices, sizeof(Device) * (num_devices));
+   //! Track when each device was last heard, for purging stale ones.
+   seen_subs[0] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		FREE_OBJECT_MANAGER,
+		"InterfacesAdded",
+		NULL,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		handle_seen_signal,
+		NULL,
+		NULL);
+   seen_subs[1] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		FREE_PROPERTIES,
+		"PropertiesChanged",
+		NULL,
+		BLUEZ_DEVICE_IFACE,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		handle_seen_signal,
+		NULL,
+		NULL);
+
+   //! Initial device array. Commands wait in the queue until it lands.
+   command_pending = TRUE;
+   device_pool_refresh_async(pool, conn, NULL, app_devices_loaded_cb, NULL);
    return 0;
 }
 
-/**** SIGNAL HANDLERS ****/
-void sig_handler(int signo)
+/**** COMMAND QUEUE ****/
+void app_command_free(AppCommand *command)
 {
-   #if CLI
-   if (signo == SIGINT)
+   g_free(command->arg);
+   g_free(command);
+}
+
+void app_queue_command(char cmd, const char *arg)
+{
+   AppCommand *command = g_new0(AppCommand, 1);
+   command->cmd = cmd;
+   command->arg = g_strdup(arg);
+   g_queue_push_tail(&commands, command);
+
+   //! Before app_init() the queue only fills up, app_init() starts it.
+   if (main_loop != NULL && !dispatch_source && !command_pending)
+      dispatch_source = g_idle_add((GSourceFunc)app_dispatch_cb, NULL);
+}
+
+void app_command_done()
+{
+   command_pending = FALSE;
+   if (!dispatch_source)
+      dispatch_source = g_idle_add((GSourceFunc)app_dispatch_cb, NULL);
+}
+
+int app_command(char cmd, const char *arg)
+{
+   if (conn == NULL && strchr(APP_BUS_COMMANDS, cmd))
    {
-      app_quit();
-      exit(EXIT_SUCCESS);
+      fprintf(stderr, "tuxdrop: -%c needs the bus, skipped during replay.\n", cmd);
+      return APP_CMD_DONE;
    }
-   #else
-   if (signo == SIGINT)
-      g_main_loop_quit(main_loop);
-   #endif
+
+   switch (cmd)
+   {
+      case 'h':
+         usage();
+         break;
+      case 's': // Discovery
+         return app_discovery(arg ? atoi(arg) : 5);
+      case 'm': // Stop scans at the first matching device
+         app_set_match(arg);
+         break;
+      case 'y': // Duty cycled scans
+         app_set_duty_cycle(arg);
+         break;
+      case 'x': // Remove stale devices
+         return app_purge(arg ? atoi(arg) : 0);
+      case 'a': // Adapter properties
+         return app_adapter_config(arg);
+      case 'b': // Beacon layout
+         if (arg == NULL || !advert_register_layout(arg))
+            fprintf(stderr, "tuxdrop: bad beacon layout '%s'\n", arg ? arg : "");
+         break;
+      case 'R': // Record bluez traffic
+         return app_record(arg);
+      case 'P': // Replay a recording
+         return app_replay(arg);
+      case 'L': // Synthetic load on a private bus
+         return app_loadgen(arg);
+      case 'B': // Snapshot read benchmark
+         return app_bench(arg);
+      case 'M': // Export metrics
+         return app_metrics(arg);
+      case 'e': // List devices
+         app_debug_list_devices();
+         break;
+      case 'l': // List devices
+         return app_list_devices();
+      case 'p': // Pairing
+         app_pair(arg);
+         break;
+      case 'c': // Connecting
+         app_connect(arg);
+         break;
+      case 'd': // Disconnect
+         app_disconnect(arg);
+         break;
+      case 'r': // Remove device
+         app_remove(arg);
+         break;
+      case 't': // Live device table
+         app_tui();
+         break;
+      case 'f': // Table frame rate
+         curses_set_fps(arg ? atoi(arg) : FPS_DEFAULT);
+         break;
+      case 'w': // Print changes every x seconds
+         app_watch(arg ? atoi(arg) : 5);
+         break;
+      case 'z': // Zone presence events
+         app_presence(arg);
+         break;
+      case 'k': // Keep devices connected
+         app_keep(arg);
+         break;
+      case 'T': // Fleet telemetry reports
+         app_telemetry(arg);
+         break;
+      case 'g': // GATT tree of a device
+         app_gatt(arg);
+         break;
+      case 'W': // Bulk write to a characteristic
+         return app_gatt_write(arg);
+      case 'N': // Stream notifications
+         app_notify(arg);
+         break;
+      case 'O': // Push files
+         return app_obex_send(arg);
+      case 'I': // Accept pushed files
+         app_obex_receive(arg);
+         break;
+      case 'H': // RSSI history
+         app_history(arg);
+         break;
+      case 'q':
+         return APP_CMD_QUIT;
+      default:
+         usage();
+         break;
+   }
+   return APP_CMD_DONE;
 }
-/**** END SIGNAL HANDLERS ****/
+/**** END COMMAND QUEUE ****/
 
 /**** GMAINLOOP CALLBACKS ****/
-gboolean timeout_cb(gpointer arg)
+gboolean app_signal_cb(gpointer arg)
 {
-   return TRUE;
+   g_main_loop_quit(main_loop);
+   return G_SOURCE_CONTINUE;
 }
 
-gboolean idle_function(gpointer arg)
+gboolean app_dispatch_cb(gpointer arg)
 {
-   int ret = -1;
+   // One command per iteration so signals and input stay serviced in
+   // between, and nothing more runs while a command waits on the bus.
+   AppCommand *command = g_queue_pop_head(&commands);
+   if (command != NULL)
+   {
+      // Records of the last command come before anything this one prints.
+      output_flush();
+      int ret = app_command(command->cmd, command->arg);
+      app_command_free(command);
+
+      if (ret == APP_CMD_QUIT)
+      {
+         g_queue_clear_full(&commands, (GDestroyNotify)app_command_free);
+         g_main_loop_quit(main_loop);
+         dispatch_source = 0;
+         return G_SOURCE_REMOVE;
+      }
+      command_pending = (ret == APP_CMD_PENDING);
+      if (!command_pending && !g_queue_is_empty(&commands))
+         return G_SOURCE_CONTINUE;
+   }
+
+   dispatch_source = 0;
    #if CLI
-   ret = app_main(0, NULL);
-   #else
-   ret = app_main();
+   if (!command_pending && !app_persist)
+      g_main_loop_quit(main_loop);
    #endif
+   return G_SOURCE_REMOVE;
+}
 
-   if (ret == -1)
-      g_main_loop_quit(main_loop);
+gboolean app_stdin_cb(GIOChannel *source, GIOCondition cond, gpointer arg)
+{
+   gchar *line = NULL;
+   GIOStatus status = G_IO_STATUS_NORMAL;
 
-   if (signal(SIGINT, sig_handler) == SIG_ERR)
+   if (cond & (G_IO_HUP | G_IO_ERR))
+      status = G_IO_STATUS_EOF;
+   else
+      status = g_io_channel_read_line(source, &line, NULL, NULL, NULL);
+
+   if (status == G_IO_STATUS_EOF || status == G_IO_STATUS_ERROR)
    {
-      fprintf(stderr, "Couldn't catch signal.\n");
+      stdin_watch = 0;
       g_main_loop_quit(main_loop);
+      return G_SOURCE_REMOVE;
    }
-   return TRUE;
+
+   if (line != NULL)
+   {
+      g_strstrip(line);
+      if (*line != '\0')
+      {
+         gchar *arg_str = g_strstrip(line + 1);
+         app_queue_command(line[0], *arg_str ? arg_str : NULL);
+      }
+      g_free(line);
+   }
+   return G_SOURCE_CONTINUE;
 }
+/**** END GMAINLOOP CALLBACKS ****/
 
 void usage()
 {
-   fprintf(stderr, "\t-s x Scan for x seconds.\n");
+   fprintf(stderr, "\t-s x Scan for x seconds, 0 scans until interrupted.\n");
+   fprintf(stderr, "\t-m x Stop scans at the first device matching x: a MAC address,\n");
+   fprintf(stderr, "\t     name:<prefix> or uuid:<uuid>. Later commands default to it.\n");
+   fprintf(stderr, "\t-y n:m Duty cycle scans, n seconds on and m seconds off.\n");
    fprintf(stderr, "\t-l List current devices.\n");
    fprintf(stderr, "\t-e List debug info.\n");
    fprintf(stderr, "\t-c Connect to a device.\n");
    fprintf(stderr, "\t-d Disconnect from a device.\n");
    fprintf(stderr, "\t-r Remove a device.\n");
    fprintf(stderr, "\t-p Pair a device.\n");
+   fprintf(stderr, "\t-x x Remove every unpaired, unconnected device not seen in x minutes.\n");
+   fprintf(stderr, "\t     Minutes count from tuxdrop's start, so scan first: -s 1800 -x 30.\n");
+   fprintf(stderr, "\t-a p=v,... Set adapter properties, e.g. Discoverable=on,Alias=gw.\n");
+   fprintf(stderr, "\t-b id:name=type@off,... Decode ManufacturerData of company id,\n");
+   fprintf(stderr, "\t     e.g. 0x0499:temp=s16le@1. Types u8 s8 u16le u16be s16le s16be\n");
+   fprintf(stderr, "\t     u32le u32be. iBeacon and Eddystone are decoded by default.\n");
+   fprintf(stderr, "\t   -c, -d, -r and -p take an optional index, object path or\n");
+   fprintf(stderr, "\t   MAC address (--connect=AA:BB:CC:DD:EE:FF), otherwise prompt.\n");
+   fprintf(stderr, "\t-R file Record every bluez signal and reply to file.\n");
+   fprintf(stderr, "\t-P file[@x] Replay a recording without the bus, at x times real\n");
+   fprintf(stderr, "\t     time (default 1, 0 as fast as possible), and report throughput.\n");
+   fprintf(stderr, "\t-L n:s:r,... Emit synthetic signals for n devices on a private bus,\n");
+   fprintf(stderr, "\t     s seconds at each rate r/s, and report lag percentiles and misses.\n");
+   fprintf(stderr, "\t-o fmt[:thread] Write listings, changes and signals as human text,\n");
+   fprintf(stderr, "\t     json lines or tlv binary records, optionally from a writer thread.\n");
+   fprintf(stderr, "\t-M unix:path|file:path[@s] Export Prometheus metrics on a unix socket,\n");
+   fprintf(stderr, "\t     or rewrite a textfile every s seconds (default 15).\n");
+   fprintf(stderr, "\t-B n[:s] Read device snapshots from up to n threads, s seconds per\n");
+   fprintf(stderr, "\t     step (default 2), while another commits, and report reads/s.\n");
+   fprintf(stderr, "\t-t Live device table, keeps scanning until q.\n");
+   fprintf(stderr, "\t-f x Cap the device table to x frames per second.\n");
+   fprintf(stderr, "\t-w x Keep scanning, print only what changed every x seconds.\n");
+   fprintf(stderr, "\t-k mac,... Keep devices connected, reconnecting as soon as they drop or\n");
+   fprintf(stderr, "\t     are heard again, with a jittered backoff while out of range.\n");
+   fprintf(stderr, "\t-g key[@uuid] Print the GATT services of a device, or the characteristic\n");
+   fprintf(stderr, "\t     with that UUID (2a1c or 128-bit). Trees are kept across reconnects.\n");
+   fprintf(stderr, "\t-W key@uuid=file Write a file to a characteristic, over the AcquireWrite\n");
+   fprintf(stderr, "\t     socket when it takes writes without response, else pipelined.\n");
+   fprintf(stderr, "\t-N key@uuid,... Stream notifications over AcquireNotify sockets, reporting\n");
+   fprintf(stderr, "\t     the rate and last value of each characteristic every second.\n");
+   fprintf(stderr, "\t-O key=file,...[;key=file,...] Push files over OBEX, to several devices at\n");
+   fprintf(stderr, "\t     once, and wait until every transfer ended.\n");
+   fprintf(stderr, "\t-I dir Accept OBEX pushes into dir, which obexd must be allowed to write.\n");
+   fprintf(stderr, "\t-H[key[@min[:step]]] Keep scanning and record the RSSI of every device.\n");
+   fprintf(stderr, "\t     With a key, every step seconds print its last min minutes in step\n");
+   fprintf(stderr, "\t     second buckets (default 60:60). The key is attached, -HAA:..@60:60\n");
+   fprintf(stderr, "\t     or --history=AA:..@60:60.\n");
+   fprintf(stderr, "\t-T s[:age] Report battery and link state of every device each s seconds,\n");
+   fprintf(stderr, "\t     fetching only devices without news for age seconds (default 600).\n");
+   fprintf(stderr, "\t-z enter[:near[:h[:s]]] Keep scanning, report tags entering and leaving\n");
+   fprintf(stderr, "\t     the zone at enter dBm and getting near at near dBm, leaving again\n");
+   fprintf(stderr, "\t     h dB lower or after s seconds unheard (default -80:-60:5:10).\n");
+}
+
+void app_discovery_done_cb(Discovery *disc, const char *path, gpointer arg)
+{
+   scan = NULL;
+   if (path != NULL)
+   {
+      g_free(found_path);
+      found_path = g_strdup(path);
+      printf("Found %s\n", path);
+   }
+   printf("Done scanning\n");
+
+   // The command completes once the refreshed device list is in.
+   device_pool_refresh_async(pool, conn, NULL, app_devices_loaded_cb, NULL);
 }
 
 int app_discovery(int scan_time)
 {
-   bluez_devices_free(devices, num_devices);
+   if (scan != NULL)
+      return APP_CMD_DONE;
+
+   scan_config.timeout = scan_time;
    printf("Scanning...\n");
-   devices = discovery_get_remote_devices(conn, DEV_ARRAY_INIT_SIZE, &num_devices, scan_time);
-   printf("Done scanning\n");
+   scan = discovery_start(conn, &scan_config, app_discovery_done_cb, NULL);
+   return APP_CMD_PENDING;
+}
+
+int app_set_match(const char *spec)
+{
+   if (spec == NULL)
+   {
+      discovery_match_clear(&scan_config.match);
+      return 0;
+   }
+   if (!discovery_match_parse(&scan_config.match, spec))
+   {
+      fprintf(stderr, "tuxdrop: Bad match %s\n", spec);
+      return -1;
+   }
    return 0;
 }
 
-int app_debug_list_devices()
+int app_set_duty_cycle(const char *spec)
 {
-   bluez_print_devices(devices, num_devices);
+   guint window = 0;
+   guint pause = 0;
+
+   if (spec == NULL || sscanf(spec, "%u:%u", &window, &pause) != 2)
+   {
+      scan_config.window = scan_config.pause = 0;
+      return -1;
+   }
+   scan_config.window = window;
+   scan_config.pause = pause;
    return 0;
 }
 
-int app_list_devices()
+void app_batch_done_cb(guint succeeded, guint failed, gint64 elapsed_us, gpointer arg)
 {
-   bluez_devices_free(devices, num_devices);
+   printf("%s: %u done, %u failed in %.2f s\n",
+          (const char *)arg, succeeded, failed, elapsed_us / (double)G_USEC_PER_SEC);
+   device_pool_refresh_async(pool, conn, NULL, app_devices_loaded_cb, NULL);
+}
+
+int app_purge(int minutes)
+{
+   guint now = g_get_monotonic_time() / G_USEC_PER_SEC;
+   BluezBatch *batch = bluez_batch_new(conn, 0);
+   guint queued = 0;
+   guint unknown = 0;
 
-   devices = (Device *)malloc(sizeof(Device) * DEV_ARRAY_INIT_SIZE);
-   num_devices = bluez_adapter_get_objects(conn, devices, DEV_ARRAY_INIT_SIZE);
-   devices = realloc(devices, sizeof(Device) * (num_devices));
-   
    for (int i = 0; i < num_devices; i++)
-      g_print("%d | %s\n", i, devices[i].obj_path);  
+   {
+      Device *dev = &devices[i];
+      gpointer val = NULL;
+      guint seen = started_secs;
+      gboolean heard = FALSE;
+
+      if (bluez_device_get_address(dev) == NULL
+          || schema_flag(&dev->info, Paired)
+          || schema_flag(&dev->info, Bonded)
+          || schema_flag(&dev->info, Connected))
+         continue;
+
+      //! Bluez only keeps RSSI while a device is being heard.
+      //! Bluez has no last seen time, so unheard devices count from our start.
+      if ((heard = g_hash_table_lookup_extended(last_seen, dev->obj_path, NULL, &val)))
+         seen = GPOINTER_TO_UINT(val);
+      if (schema_has(&dev->info, RSSI))
+         seen = now;
+      if (now - seen < (guint)minutes * 60)
+      {
+         unknown += !heard && !schema_has(&dev->info, RSSI);
+         continue;
+      }
+
+      bluez_batch_add_remove_device(batch, dev->obj_path);
+      queued += 1;
+   }
+
+   printf("Removing %u devices...\n", queued);
+   if (unknown > 0)
+      printf("Kept %u devices not heard since tuxdrop started %u minutes ago, scan first (-s).\n",
+             unknown, (now - started_secs) / 60);
+   bluez_batch_run(batch, app_batch_done_cb, "RemoveDevice");
+   return APP_CMD_PENDING;
+}
+
+GVariant *app_parse_value(const char *str)
+{
+   gchar *end = NULL;
+   guint64 num = 0;
+
+   if (!g_ascii_strcasecmp(str, "on") || !g_ascii_strcasecmp(str, "true") || !g_ascii_strcasecmp(str, "yes"))
+      return g_variant_new_boolean(TRUE);
+   if (!g_ascii_strcasecmp(str, "off") || !g_ascii_strcasecmp(str, "false") || !g_ascii_strcasecmp(str, "no"))
+      return g_variant_new_boolean(FALSE);
+
+   num = g_ascii_strtoull(str, &end, 10);
+   if (*str != '\0' && *end == '\0' && num <= G_MAXUINT32)
+      return g_variant_new_uint32(num);
+   return g_variant_new_string(str);
+}
+
+int app_adapter_config(const char *spec)
+{
+   gchar **pairs = NULL;
+   BluezBatch *batch = NULL;
+
+   if (spec == NULL)
+      return APP_CMD_DONE;
+
+   batch = bluez_batch_new(conn, 0);
+   pairs = g_strsplit(spec, ",", -1);
+   for (int i = 0; pairs[i] != NULL; i++)
+   {
+      gchar *eq = strchr(pairs[i], '=');
+      if (eq == NULL)
+      {
+         fprintf(stderr, "tuxdrop: Expected property=value, got %s\n", pairs[i]);
+         continue;
+      }
+      *eq = '\0';
+      bluez_batch_add_adapter_property(batch, pairs[i], app_parse_value(eq + 1));
+   }
+   g_strfreev(pairs);
+
+   bluez_batch_run(batch, app_batch_done_cb, "Set");
+   return APP_CMD_PENDING;
+}
+
+void app_watch_loaded_cb(DevicePool *refreshed, gsize changed, gpointer arg)
+{
+   //! Changes were printed as the pool applied them.
+   if (changed)
+      fflush(stdout);
+
+   devices = device_pool_devices(refreshed, &num_devices);
+   if (gatt != NULL)
+      gatt_cache_update(gatt, devices, num_devices);
+   watch_busy = FALSE;
+}
+
+gboolean app_watch_cb(gpointer arg)
+{
+   // A slow reply just skips a tick instead of stacking up requests.
+   if (!watch_busy)
+   {
+      watch_busy = TRUE;
+      device_pool_refresh_async(pool, conn, diff_print_entry, app_watch_loaded_cb, NULL);
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+int app_watch(int interval)
+{
+   if (watch_source)
+      g_source_remove(watch_source);
+   else
+      discovery_hold(conn);
+
+   watch_source = g_timeout_add_seconds(MAX(interval, 1), app_watch_cb, NULL);
+   app_persist = TRUE;
    return 0;
 }
 
-int app_pair()
+void app_presence_event_cb(const PresenceEvent *event, gpointer arg)
 {
-   Device temp_dev = bluez_choose_device(devices, num_devices);
-   char path[40];
-   bluez_device_pair(temp_dev, conn); 
-   obj_to_str(temp_dev.obj_path, path);
-   g_print(path);
-   prop_changed = g_dbus_connection_signal_subscribe(conn,
-		"org.bluez",
-		"org.freedesktop.DBus.Properties",
+   output_line_begin("presence");
+   output_str("event", presence_event_name(event->kind));
+   output_str("path", event->path);
+   output_int("rssi", (gint64)event->rssi);
+   output_int("time", event->time);
+   output_int("present", presence_count(presence));
+   output_record_end();
+}
+
+void app_presence_feed(const char *path, GVariant *dict, const char *signal_name)
+{
+   GVariant *props = dict;
+   gint16 rssi = 0;
+
+   if (g_str_equal(signal_name, "InterfacesAdded"))
+      props = g_variant_lookup_value(dict, BLUEZ_DEVICE_IFACE, G_VARIANT_TYPE_VARDICT);
+   if (props == NULL)
+      return;
+   if (g_variant_lookup(props, "RSSI", "n", &rssi))
+   {
+      if (presence != NULL)
+         presence_sample(presence, path, rssi);
+      if (history != NULL)
+         history_add(history, history_key(path), g_get_real_time() / 1000, rssi);
+   }
+   if (props != dict)
+      g_variant_unref(props);
+}
+
+int app_presence(const char *spec)
+{
+   PresenceConfig config;
+
+   if (!presence_parse_config(spec, &config))
+   {
+      fprintf(stderr, "tuxdrop: -z takes enter[:near[:hysteresis[:seconds]]]\n");
+      return APP_CMD_DONE;
+   }
+
+   //! A second -z changes the thresholds, tags start over.
+   if (presence != NULL)
+      presence_free(presence);
+   else if (conn != NULL)
+      discovery_hold(conn);
+   presence = presence_new(&config, app_presence_event_cb, NULL);
+   // Replays end on their own, the events come from the recording.
+   app_persist |= (conn != NULL);
+   return APP_CMD_DONE;
+}
+
+int app_keep(const char *spec)
+{
+   gchar **addresses = NULL;
+
+   if (spec == NULL)
+      return APP_CMD_DONE;
+   if (supervisor == NULL)
+   {
+      //! Adverts are what tells the supervisor a device is back.
+      supervisor = supervisor_new(conn);
+      discovery_hold(conn);
+   }
+
+   addresses = g_strsplit(spec, ",", -1);
+   for (int i = 0; addresses[i] != NULL; i++)
+   {
+      const char *address = g_strstrip(addresses[i]);
+      Device *dev = strchr(address, ':') ? bluez_find_device(devices, num_devices, address) : NULL;
+
+      if (!supervisor_watch(supervisor, address, dev ? dev->obj_path : NULL,
+                            dev && schema_flag(&dev->info, Connected)))
+         fprintf(stderr, "tuxdrop: -k takes MAC addresses, not '%s'\n", address);
+   }
+   g_strfreev(addresses);
+   app_persist = TRUE;
+   return APP_CMD_DONE;
+}
+
+int app_telemetry(const char *spec)
+{
+   guint interval = TELEMETRY_INTERVAL;
+   guint max_age = TELEMETRY_MAX_AGE;
+
+   if (spec != NULL && sscanf(spec, "%u:%u", &interval, &max_age) < 1)
+   {
+      fprintf(stderr, "tuxdrop: -T takes seconds[:max age]\n");
+      return APP_CMD_DONE;
+   }
+
+   telemetry_free(telemetry);
+   telemetry = telemetry_new(conn, interval, max_age);
+   telemetry_track(telemetry, devices, num_devices);
+   app_persist = TRUE;
+   return APP_CMD_DONE;
+}
+
+int app_gatt(const char *spec)
+{
+   gchar **parts = g_strsplit(spec ? spec : "", "@", 2);
+   Device *dev = app_select_device(*parts[0] ? parts[0] : NULL);
+   const GattTree *tree = NULL;
+   GattUuid uuid;
+
+   if (dev == NULL)
+   {
+      g_strfreev(parts);
+      return APP_CMD_DONE;
+   }
+   if (gatt == NULL)
+      gatt = gatt_cache_new();
+   gatt_cache_update(gatt, devices, num_devices);
+
+   tree = gatt_cache_get(gatt, dev->info.address.value);
+   if (tree == NULL)
+   {
+      fprintf(stderr, "tuxdrop: no GATT services known for %s\n", dev->obj_path);
+   }
+   else if (parts[1] == NULL)
+   {
+      gatt_tree_print(tree);
+   }
+   else if (!gatt_uuid_parse(parts[1], &uuid))
+   {
+      fprintf(stderr, "tuxdrop: bad UUID '%s'\n", parts[1]);
+   }
+   else
+   {
+      const GattChar *chr = gatt_tree_find(tree, &uuid);
+      char buf[GATT_UUID_STRLEN];
+
+      if (chr == NULL)
+      {
+         fprintf(stderr, "tuxdrop: no characteristic %s on %s\n", parts[1], dev->obj_path);
+      }
+      else
+      {
+         output_line_begin("characteristic");
+         output_str("uuid", gatt_uuid_format(&chr->uuid, buf));
+         output_int("handle", chr->handle);
+         output_int("flags", chr->flags);
+         output_str("path", chr->path);
+         output_record_end();
+      }
+   }
+   g_strfreev(parts);
+   return APP_CMD_DONE;
+}
+
+void app_gatt_write_progress_cb(gsize sent, gsize total, gpointer arg)
+{
+   output_line_begin("progress");
+   output_str("path", arg);
+   output_int("sent", sent);
+   output_int("total", total);
+   output_record_end();
+}
+
+void app_gatt_write_done_cb(const GattWriteStats *stats, const GError *error, gpointer arg)
+{
+   gatt_write = NULL;
+   if (error != NULL)
+      fprintf(stderr, "tuxdrop: write to %s failed after %" G_GSIZE_FORMAT " bytes: %s\n",
+              (char *)arg, stats->bytes, error->message);
+
+   output_record_begin("write");
+   output_str("path", arg);
+   output_int("bytes", stats->bytes);
+   output_int("chunks", stats->chunks);
+   output_int("payload", stats->payload);
+   output_str("method", stats->acquired ? "fd" : "WriteValue");
+   output_int("elapsed_us", stats->elapsed_us);
+   output_int("bytes_per_s", stats->elapsed_us > 0 ? stats->bytes * G_USEC_PER_SEC / stats->elapsed_us : 0);
+   output_int("ok", error == NULL);
+   output_record_end();
+   g_free(arg);
+   app_command_done();
+}
+
+/**
+ * @brief Finds a characteristic from "key@uuid" in the GATT cache,
+ *  complaining on stderr when it can't.
+ */
+const GattChar *app_select_char(const char *spec)
+{
+   gchar **target = g_strsplit(spec, "@", 2);
+   Device *dev = NULL;
+   const GattTree *tree = NULL;
+   const GattChar *chr = NULL;
+   GattUuid uuid;
+
+   if (target[0] == NULL || target[1] == NULL || !gatt_uuid_parse(target[1], &uuid))
+   {
+      fprintf(stderr, "tuxdrop: expected key@uuid, got '%s'\n", spec);
+   }
+   else if ((dev = app_select_device(*target[0] ? target[0] : NULL)) != NULL)
+   {
+      if (gatt == NULL)
+         gatt = gatt_cache_new();
+      gatt_cache_update(gatt, devices, num_devices);
+      tree = gatt_cache_get(gatt, dev->info.address.value);
+      if ((chr = tree ? gatt_tree_find(tree, &uuid) : NULL) == NULL)
+         fprintf(stderr, "tuxdrop: no characteristic %s on %s\n", target[1], dev->obj_path);
+   }
+   g_strfreev(target);
+   return chr;
+}
+
+int app_gatt_write(const char *spec)
+{
+   gchar **parts = g_strsplit(spec ? spec : "", "=", 2);
+   const GattChar *chr = NULL;
+   GMappedFile *file = NULL;
+   GError *error = NULL;
+   int ret = APP_CMD_DONE;
+
+   if (parts[0] == NULL || parts[1] == NULL)
+   {
+      fprintf(stderr, "tuxdrop: -W takes key@uuid=file\n");
+   }
+   else if (gatt_write != NULL)
+   {
+      fprintf(stderr, "tuxdrop: a write is already running\n");
+   }
+   else if ((chr = app_select_char(parts[0])) != NULL && (file = g_mapped_file_new(parts[1], FALSE, &error)) == NULL)
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error->message);
+      g_error_free(error);
+   }
+   else if (chr != NULL && g_mapped_file_get_length(file) == 0)
+   {
+      fprintf(stderr, "tuxdrop: %s is empty\n", parts[1]);
+      g_mapped_file_unref(file);
+   }
+   else if (chr != NULL)
+   {
+      //! The mapping stays alive through the bytes until the write ends.
+      GBytes *data = g_mapped_file_get_bytes(file);
+      gatt_write = gatt_write_start(conn, chr, data, 0, app_gatt_write_progress_cb,
+                                    app_gatt_write_done_cb, g_strdup(chr->path));
+      g_bytes_unref(data);
+      g_mapped_file_unref(file);
+      ret = APP_CMD_PENDING;
+   }
+   g_strfreev(parts);
+   return ret;
+}
+
+void app_notify_sample_cb(const NotifySample *sample, const NotifyStream *stream, gpointer arg)
+{
+   g_array_index(notify_last, NotifySample, sample->stream) = *sample;
+}
+
+/**
+ * @brief Drains the ring and writes one "notify" record with the rate
+ *  and last sample of each stream.
+ */
+gboolean app_notify_cb(gpointer arg)
+{
+   static const char *states[] = { "acquiring", "streaming", "closed" };
+   static gint64 last_report = 0;
+   guint num = notify_hub_num_streams(notify);
+   gint64 now = g_get_monotonic_time();
+   gint64 span = MAX(now - last_report, 1);
+
+   g_array_set_size(notify_last, num);
+   g_array_set_size(notify_seen, num);
+   notify_hub_drain(notify, app_notify_sample_cb, NULL);
+
+   output_record_begin("notify");
+   output_int("dropped", notify_hub_dropped(notify));
+   output_array_begin("streams");
+   for (guint i = 0; i < num; i++)
+   {
+      const NotifyStream *stream = notify_hub_stream(notify, i);
+      const NotifySample *last = &g_array_index(notify_last, NotifySample, i);
+      guint64 *seen = &g_array_index(notify_seen, guint64, i);
+
+      output_object_begin(NULL);
+      output_str("path", stream->path);
+      output_str("state", states[stream->state]);
+      if (stream->error != NULL)
+         output_str("error", stream->error);
+      output_int("samples", stream->samples);
+      output_int("per_s", last_report ? (stream->samples - *seen) * G_USEC_PER_SEC / span : 0);
+      output_int("bytes", stream->bytes);
+      output_int("truncated", stream->truncated);
+      if (last->time != 0)
+      {
+         GVariant *value = g_variant_ref_sink(g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE,
+                                                                        last->data, last->len, 1));
+         output_value("last", value);
+         g_variant_unref(value);
+      }
+      output_object_end();
+      *seen = stream->samples;
+   }
+   output_array_end();
+   output_record_end();
+   last_report = now;
+   return G_SOURCE_CONTINUE;
+}
+
+int app_notify(const char *spec)
+{
+   gchar **targets = g_strsplit(spec ? spec : "", ",", -1);
+
+   if (notify == NULL && (notify = notify_hub_new(conn, 0)) == NULL)
+   {
+      fprintf(stderr, "tuxdrop: epoll: %s\n", g_strerror(errno));
+      g_strfreev(targets);
+      return APP_CMD_DONE;
+   }
+   for (int i = 0; targets[i] != NULL; i++)
+   {
+      const GattChar *chr = app_select_char(targets[i]);
+      if (chr != NULL)
+         notify_hub_add(notify, chr);
+   }
+   g_strfreev(targets);
+
+   if (!notify_source)
+   {
+      notify_last = g_array_new(FALSE, TRUE, sizeof(NotifySample));
+      notify_seen = g_array_new(FALSE, TRUE, sizeof(guint64));
+      notify_source = g_timeout_add_seconds(1, app_notify_cb, NULL);
+   }
+   app_persist = TRUE;
+   return APP_CMD_DONE;
+}
+
+/**
+ * @brief Writes a "transfer" line while a file moves, and a "transfer"
+ *  record with its throughput when it ended.
+ */
+void app_obex_cb(const ObexTransfer *transfer, gpointer arg)
+{
+   gboolean ended = transfer->status == OBEX_COMPLETE || transfer->status == OBEX_ERROR;
+   gint64 elapsed = (ended ? transfer->finished : g_get_monotonic_time()) - transfer->started;
+
+   if (ended)
+      output_record_begin("transfer");
+   else
+      output_line_begin("transfer");
+   output_str("direction", transfer->incoming ? "in" : "out");
+   if (transfer->address != NULL)
+      output_str("address", transfer->address);
+   output_str("file", transfer->file);
+   output_str("status", obex_status_name(transfer->status));
+   output_int("size", transfer->size);
+   output_int("transferred", transfer->transferred);
+   if (transfer->started != 0)
+   {
+      output_int("elapsed_us", elapsed);
+      output_int("bytes_per_s", elapsed > 0 ? transfer->transferred * G_USEC_PER_SEC / elapsed : 0);
+   }
+   if (transfer->error != NULL)
+      output_str("error", transfer->error);
+   output_record_end();
+
+   //! Checked after the callback returns, the session is freed by then.
+   if (ended && !transfer->incoming && obex_waiting)
+      g_idle_add((GSourceFunc)app_obex_idle_cb, NULL);
+}
+
+gboolean app_obex_idle_cb(gpointer arg)
+{
+   if (obex_waiting && obex_idle(obex))
+   {
+      obex_waiting = FALSE;
+      app_command_done();
+   }
+   return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Connects to the session bus obexd lives on, once.
+ */
+Obex *app_obex()
+{
+   GError *error = NULL;
+
+   if (obex != NULL)
+      return obex;
+   if ((session_bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error)) == NULL)
+   {
+      fprintf(stderr, "tuxdrop: session bus: %s\n", error->message);
+      g_error_free(error);
+      return NULL;
+   }
+   obex = obex_new(session_bus, app_obex_cb, NULL);
+   return obex;
+}
+
+int app_obex_send(const char *spec)
+{
+   gchar **groups = g_strsplit(spec ? spec : "", ";", -1);
+   guint queued = 0;
+
+   for (int i = 0; groups[i] != NULL && app_obex() != NULL; i++)
+   {
+      gchar **parts = g_strsplit(groups[i], "=", 2);
+      gchar **files = parts[0] && parts[1] ? g_strsplit(parts[1], ",", -1) : NULL;
+      Device *dev = parts[0] ? bluez_find_device(devices, num_devices, parts[0]) : NULL;
+      const char *address = parts[0];
+
+      // The key matched an adapter or a device without an Address yet.
+      if (dev != NULL && bluez_device_get_address(dev) != NULL)
+         address = bluez_device_get_address(dev);
+
+      if (files == NULL)
+         fprintf(stderr, "tuxdrop: -O takes key=file,...\n");
+      for (int j = 0; files != NULL && files[j] != NULL; j++)
+      {
+         if (obex_send(obex, address, files[j]))
+            queued += 1;
+         else
+            fprintf(stderr, "tuxdrop: can't send %s to %s\n", files[j], address);
+      }
+      g_strfreev(files);
+      g_strfreev(parts);
+   }
+   g_strfreev(groups);
+
+   if (queued == 0)
+      return APP_CMD_DONE;
+   obex_waiting = TRUE;
+   return APP_CMD_PENDING;
+}
+
+int app_obex_receive(const char *dir)
+{
+   GError *error = NULL;
+
+   if (dir == NULL || !g_file_test(dir, G_FILE_TEST_IS_DIR))
+   {
+      fprintf(stderr, "tuxdrop: -I takes a directory\n");
+      return APP_CMD_DONE;
+   }
+   if (app_obex() == NULL)
+      return APP_CMD_DONE;
+   if (!obex_receive(obex, dir, &error))
+   {
+      fprintf(stderr, "tuxdrop: obex agent: %s\n", error->message);
+      g_error_free(error);
+      return APP_CMD_DONE;
+   }
+   app_persist = TRUE;
+   return APP_CMD_DONE;
+}
+
+/**
+ * @brief Writes a "history" record of the queried device's last minutes
+ *  in buckets of min/max/mean RSSI.
+ */
+gboolean app_history_cb(gpointer arg)
+{
+   Device *dev = NULL;
+   HistoryBucket *buckets = NULL;
+   guint num = MAX(history_minutes * 60 / history_step, 1);
+   guint64 key = 0;
+   gint64 now = g_get_real_time() / 1000;
+
+   //! Devices bluez forgot still have their history under the address.
+   dev = bluez_find_device(devices, num_devices, history_query);
+   key = history_key(dev && bluez_device_get_address(dev) ? bluez_device_get_address(dev) : history_query);
+   buckets = g_new(HistoryBucket, num);
+   history_aggregate(history, key, now - (gint64)num * history_step * 1000, history_step * 1000, buckets, num);
+
+   output_record_begin("history");
+   output_str("key", history_query);
+   output_int("devices", history_num_devices(history));
+   output_int("memory", history_memory(history));
+   output_array_begin("buckets");
+   for (guint i = 0; i < num; i++)
+   {
+      if (buckets[i].count == 0)
+         continue;
+      output_object_begin(NULL);
+      output_int("start", buckets[i].start);
+      output_int("count", buckets[i].count);
+      output_int("min", buckets[i].min);
+      output_int("max", buckets[i].max);
+      output_int("mean", buckets[i].sum / (gint)buckets[i].count);
+      output_object_end();
+   }
+   output_array_end();
+   output_record_end();
+   g_free(buckets);
+   return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Starts recording on first use. With a key, reports the device
+ *  every step seconds from then on, the store only fills while we run.
+ */
+int app_history(const char *spec)
+{
+   gchar **parts = g_strsplit(spec ? spec : "", "@", 2);
+   guint minutes = 60;
+   guint step = 60;
+
+   if (history == NULL)
+   {
+      history = history_new(0);
+      if (conn != NULL)
+         discovery_hold(conn);
+      app_persist |= (conn != NULL);
+   }
+   if (parts[0] == NULL || *parts[0] == '\0')
+   {
+      g_strfreev(parts);
+      return APP_CMD_DONE;
+   }
+
+   if (parts[1] != NULL && sscanf(parts[1], "%u:%u", &minutes, &step) < 1)
+   {
+      fprintf(stderr, "tuxdrop: -H takes key[@minutes[:step]]\n");
+      g_strfreev(parts);
+      return APP_CMD_DONE;
+   }
+
+   //! A later -H replaces the query.
+   g_free(history_query);
+   history_query = g_strdup(parts[0]);
+   history_minutes = minutes;
+   history_step = MAX(step, 1);
+   if (history_source)
+      g_source_remove(history_source);
+   history_source = g_timeout_add_seconds(history_step, app_history_cb, NULL);
+   g_strfreev(parts);
+   return APP_CMD_DONE;
+}
+
+int app_tui()
+{
+   if (tui_active)
+      return 0;
+
+   //! The table reads keys from stdin itself.
+   if (stdin_watch)
+   {
+      g_source_remove(stdin_watch);
+      stdin_watch = 0;
+   }
+   curses_initialize();
+
+   for (int i = 0; i < num_devices; i++)
+   {
+      for (int j = 0; j < devices[i].num_ifaces; j++)
+      {
+         Iface *iface = &devices[i].ifaces[j];
+         if (!g_str_equal(iface->iface, BLUEZ_DEVICE_IFACE))
+            continue;
+         for (int k = 0; k < iface->num_properties; k++)
+            curses_device_set_property(devices[i].obj_path, iface->props[k].prop, iface->props[k].val, FALSE);
+      }
+   }
+
+   tui_subs[0] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		FREE_OBJECT_MANAGER,
+		"InterfacesAdded",
+		NULL,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		handle_tui_signal,
+		NULL,
+		NULL);
+   tui_subs[1] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		FREE_OBJECT_MANAGER,
+		"InterfacesRemoved",
+		NULL,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		handle_tui_signal,
+		NULL,
+		NULL);
+   tui_subs[2] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		FREE_PROPERTIES,
 		"PropertiesChanged",
-		path,
+		NULL,
 		"org.bluez.Device1",
 		G_DBUS_SIGNAL_FLAGS_NONE,
-		handle_properties_changed,
+		handle_tui_signal,
 		NULL,
 		NULL);
-   
+
+   discovery_hold(conn);
+   curses_start(main_loop);
+   tui_active = TRUE;
+   app_persist = TRUE;
    return 0;
 }
 
-int app_connect()
+int app_record(const char *file)
 {
-   Device temp_dev = bluez_choose_device(devices, num_devices);
-   char path[40];
-   bluez_device_connect(temp_dev, conn);
-   obj_to_str(temp_dev.obj_path, path);
+   GError *error = NULL;
+
+   if (file == NULL || !record_start(conn, file, &error))
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error ? error->message : "-R needs a file");
+      g_clear_error(&error);
+   }
+   return APP_CMD_DONE;
+}
+
+void app_route_signal(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   const gchar *iface = NULL;
+
+   //! Signals go to the handlers whose subscriptions would match them.
+   if (g_str_equal(signal_name, "PropertiesChanged"))
+   {
+      if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(sa{sv}as)")))
+         return;
+      g_variant_get(parameters, "(&s@a{sv}@as)", &iface, NULL, NULL);
+      if (!g_str_equal(iface, BLUEZ_DEVICE_IFACE))
+         return;
+   }
+   else if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(oa{sa{sv}})")))
+         return;
+   }
+   else if (!g_str_equal(signal_name, "InterfacesRemoved")
+            || !g_variant_is_of_type(parameters, G_VARIANT_TYPE("(oas)")))
+      return;
+
+   if (!g_str_equal(signal_name, "InterfacesRemoved"))
+      handle_seen_signal(sig, sender_name, object_path, interface, signal_name, parameters, NULL);
+   if (tui_active)
+      handle_tui_signal(sig, sender_name, object_path, interface, signal_name, parameters, NULL);
+}
+
+void app_replay_event_cb(const RecordEvent *event, gpointer arg)
+{
+   //! Replies refresh the device array, as the live ones do.
+   if (event->kind != RECORD_SIGNAL)
+   {
+      if (event->kind == RECORD_REPLY && g_str_equal(event->member, "GetManagedObjects"))
+      {
+         device_pool_update(pool, event->body, NULL, NULL);
+         devices = device_pool_devices(pool, &num_devices);
+      }
+      return;
+   }
+   app_route_signal(NULL, event->sender, event->path, event->iface, event->member, event->body, NULL);
+}
+
+void app_replay_done_cb(Replay *done, gpointer arg)
+{
+   if (!tui_active)
+      replay_print_stats(done);
+   replay_free(done);
+   replay = NULL;
+   app_command_done();
+}
+
+int app_replay(const char *spec)
+{
+   GError *error = NULL;
+   gdouble speed = 1;
+   gchar **parts = NULL;
+
+   if (spec == NULL || replay != NULL)
+   {
+      fprintf(stderr, "tuxdrop: -P needs a recording, one at a time.\n");
+      return APP_CMD_DONE;
+   }
+
+   //! "file@x" plays at x times real time.
+   parts = g_strsplit(spec, "@", 2);
+   if (parts[1] != NULL)
+      speed = g_ascii_strtod(parts[1], NULL);
+   replay = replay_open(parts[0], &error);
+   g_strfreev(parts);
+   if (replay == NULL)
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error->message);
+      g_error_free(error);
+      return APP_CMD_DONE;
+   }
+
+   replay_start(replay, MAX(speed, 0), app_replay_event_cb, app_replay_done_cb, NULL);
+   return APP_CMD_PENDING;
+}
+
+void app_loadgen_done_cb(LoadGen *gen, gpointer arg)
+{
+   loadgen_print_results(gen);
+   app_command_done();
+}
+
+int app_loadgen(const char *spec)
+{
+   GError *error = NULL;
+   guint rates[LOADGEN_MAX_RATES];
+   guint num_rates = 0;
+   gchar **parts = NULL;
+   gchar **list = NULL;
+
+   //! "devices:seconds:rate,rate,..." runs one pass per rate.
+   parts = spec ? g_strsplit(spec, ":", 3) : NULL;
+   if (parts == NULL || g_strv_length(parts) != 3)
+   {
+      fprintf(stderr, "tuxdrop: -L takes devices:seconds:rate[,rate...]\n");
+      g_strfreev(parts);
+      return APP_CMD_DONE;
+   }
+   list = g_strsplit(parts[2], ",", LOADGEN_MAX_RATES);
+   for (int i = 0; list[i] != NULL && num_rates < LOADGEN_MAX_RATES; i++)
+   {
+      if (atoi(list[i]) > 0)
+         rates[num_rates++] = atoi(list[i]);
+   }
+   g_strfreev(list);
+
+   loadgen_free(load);
+   load = num_rates ? loadgen_new(atoi(parts[0]), atoi(parts[1]), rates, num_rates,
+                                  app_route_signal, app_loadgen_done_cb, NULL, &error)
+                    : NULL;
+   g_strfreev(parts);
+   if (load == NULL)
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error ? error->message : "-L needs at least one rate");
+      g_clear_error(&error);
+      return APP_CMD_DONE;
+   }
+   return APP_CMD_PENDING;
+}
+
+int app_bench(const char *spec)
+{
+   gchar **parts = NULL;
+
+   //! "readers[:seconds]", runs on this thread until done.
+   parts = spec ? g_strsplit(spec, ":", 2) : NULL;
+   if (parts == NULL || atoi(parts[0]) <= 0)
+   {
+      fprintf(stderr, "tuxdrop: -B takes readers[:seconds]\n");
+      g_strfreev(parts);
+      return APP_CMD_DONE;
+   }
+   bench_device_pool(atoi(parts[0]), parts[1] ? atoi(parts[1]) : 2);
+   g_strfreev(parts);
+   return APP_CMD_DONE;
+}
+
+int app_metrics(const char *spec)
+{
+   GError *error = NULL;
+
+   if (spec == NULL || !metrics_serve(spec, &error))
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error ? error->message : "-M needs unix:path or file:path");
+      g_clear_error(&error);
+   }
+   return APP_CMD_DONE;
+}
+
+int app_debug_list_devices()
+{
+   bluez_print_devices(devices, num_devices);
+   device_pool_print_stats(pool);
+   return 0;
+}
+
+void app_devices_loaded_cb(DevicePool *refreshed, gsize changed, gpointer arg)
+{
+   gboolean print = GPOINTER_TO_INT(arg);
+
+   devices = device_pool_devices(refreshed, &num_devices);
+
+   if (print)
+   {
+      for (int i = 0; i < num_devices; i++)
+      {
+         char buf[ADVERT_STR_MAX];
+         g_print("%d | %s\n", i, devices[i].obj_path);  
+         for (int j = 0; j < devices[i].num_adverts; j++)
+            g_print("  @ %s\n", advert_to_string(&devices[i].adverts[j], buf, sizeof(buf)));
+      }
+   }
+   app_command_done();
+}
+
+int app_list_devices()
+{
+   device_pool_refresh_async(pool, conn, NULL, app_devices_loaded_cb, GINT_TO_POINTER(TRUE));
+   return APP_CMD_PENDING;
+}
+
+Device *app_select_device(const char *key)
+{
+   Device *dev = NULL;
+
+   //! The device a scan stopped at is the default target.
+   if (key == NULL)
+      key = found_path;
+
+   if (key != NULL)
+      dev = bluez_find_device(devices, num_devices, key);
+   else
+      dev = bluez_choose_device(devices, num_devices);
+
+   if (dev == NULL)
+      fprintf(stderr, "tuxdrop: No such device.\n");
+   return dev;
+}
+
+void app_watch_device(const char *path)
+{
+   if (prop_changed)
+      g_dbus_connection_signal_unsubscribe(conn, prop_changed);
    prop_changed = g_dbus_connection_signal_subscribe(conn,
 		"org.bluez",
 		"org.freedesktop.DBus.Properties",
@@ -222,21 +1615,49 @@ int app_connect()
 		handle_properties_changed,
 		NULL,
 		NULL);
+}
+
+int app_pair(const char *key)
+{
+   Device *dev = app_select_device(key);
+   if (dev == NULL)
+      return -1;
+
+   bluez_device_pair(dev, conn); 
+   g_print("%s\n", dev->obj_path);
+   app_watch_device(dev->obj_path);
+   return 0;
+}
+
+int app_connect(const char *key)
+{
+   Device *dev = app_select_device(key);
+   if (dev == NULL)
+      return -1;
+
+   bluez_device_connect(dev, conn);
+   app_watch_device(dev->obj_path);
    return 0;
 }
 
-int app_disconnect()
+int app_disconnect(const char *key)
 {
-   Device temp_dev = bluez_choose_device(devices, num_devices);
-   bluez_device_disconnect(temp_dev, conn);
+   Device *dev = app_select_device(key);
+   if (dev == NULL)
+      return -1;
+
+   bluez_device_disconnect(dev, conn);
    return 0;
 }
 
 
-int app_remove()
+int app_remove(const char *key)
 {
-   Device temp_dev = bluez_choose_device(devices, num_devices);
-   bluez_adapter_remove_device(temp_dev, conn);
+   Device *dev = app_select_device(key);
+   if (dev == NULL)
+      return -1;
+
+   bluez_adapter_remove_device(dev, conn);
    return 0;
 }
 
@@ -248,7 +1669,6 @@ int app_main()
 {
    #if CLI 
    int c = 0;
-   signal(SIGINT, sig_handler);
 
    if (argc == 1)
    {
@@ -259,81 +1679,44 @@ int app_main()
    while (1)
    {
       int option_index = 0;
-      c = getopt_long(argc, argv, "hs:elpcdrq", long_options, &option_index);
+      c = getopt_long(argc, argv, "hs:elp::c::d::r::qtf:w:m:y:x:a:b:R:P:L:B:M:o:z:k:T:g:W:N:O:I:H::", long_options, &option_index);
       if (c == -1)
       {
          break;
       }
 
-      switch (c)
+      //! Recording starts with the connection, to catch the first reply.
+      if (c == 'R')
       {
-         case 'h':
-            usage();
-            break;
-         case 's':
-            int time_seconds = atoi(optarg);
-            app_discovery(time_seconds);
-            break;
-         case 'e': // List devices
-            app_debug_list_devices();
-            break;
-         case 'l': // List devices
-            app_list_devices();
-            break;
-         case 'p': // Pairing
-            app_pair();
-            break;
-         case 'c': // Connecting
-            app_connect();
-            break;
-         case 'd': // Disconnect
-            app_disconnect();
-            break;
-         case 'r': // Remove device
-            app_remove();
-            break;
-         case 'q':
-            return -1;
-         default:
-            usage();
-            break;
+         g_free(record_file);
+         record_file = g_strdup(optarg);
+         continue;
       }
-   }
-   #else
-   char c = 0;
-   scanf("%c", &c);
-   if (c != -1)
-   {
-      switch(c)
+      if (c == 'o')
       {
-         case 's': // Discovery
-            app_discovery(5);
-            break;
-         case 'e': // List devices
-            app_debug_list_devices();
-            break;
-         case 'l': // List devices
-            app_list_devices();
-            break;
-         case 'p': // Pairing
-            app_pair();
-            break;
-         case 'c': // Connecting
-            app_connect();
-            break;
-         case 'd': // Disconnect
-            app_disconnect();
-            break;
-         case 'r':
-            app_remove();
-            break;
-         case 'q':
-            return -1;
-         default:
-            usage();
-            break;
+         if (!output_open(optarg, STDOUT_FILENO))
+            fprintf(stderr, "tuxdrop: -o takes human, json or tlv, optionally :thread\n");
+         continue;
       }
+      // So does exporting, to count the first calls.
+      if (c == 'M')
+      {
+         g_free(metrics_spec);
+         metrics_spec = g_strdup(optarg);
+         continue;
+      }
+      app_offline |= (c == 'P' || c == 'L' || c == 'B');
+
+      // Options run from the main loop in order, once it is started.
+      app_queue_command(c, strchr("sfwmyxabpcdrPLBzkTgWNOIH", c) ? optarg : NULL);
    }
+   #else
+   //! Commands are read a line at a time, "s 10" scans for 10 seconds.
+   stdin_channel = g_io_channel_unix_new(STDIN_FILENO);
+   stdin_watch = g_io_add_watch(stdin_channel,
+                              G_IO_IN | G_IO_HUP | G_IO_ERR,
+                              (GIOFunc)app_stdin_cb,
+                              NULL);
    #endif
    return 0;
 }
@@ -5,23 +5,58 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
 #include <getopt.h>
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 
 #include "curses.h"
 #include "dbus.h"
 #include "bluez.h"
 #include "discovery.h"
+#include "diff.h"
+#include "record.h"
+#include "loadgen.h"
+#include "pool.h"
+#include "bench.h"
+#include "metrics.h"
+#include "presence.h"
+#include "supervisor.h"
+#include "telemetry.h"
+#include "gatt.h"
+#include "gattwrite.h"
+#include "notify.h"
+#include "obex.h"
+#include "history.h"
 
 #define CLI 1
 
+/** Return values of app_command(). **/
+#define APP_CMD_DONE     0
+#define APP_CMD_PENDING  1
+#define APP_CMD_QUIT    -1
 
+/** Commands that need the bus, skipped while replaying without one. **/
+#define APP_BUS_COMMANDS "smyxaelpcdrtwRkTgWN"
 
-void sig_handler(int signo);
-gboolean timeout_cb(gpointer arg);
-gboolean idle_function(gpointer arg);
+/** @brief A queued user command, either from argv or a line on stdin. */
+typedef struct _AppCommand
+{
+   char cmd;
+   gchar *arg;
+} AppCommand;
+
+gboolean app_signal_cb(gpointer arg);
+gboolean app_dispatch_cb(gpointer arg);
+gboolean app_stdin_cb(GIOChannel *source, GIOCondition cond, gpointer arg);
+
+void app_command_free(AppCommand *command);
+void app_queue_command(char cmd, const char *arg);
+void app_command_done();
+int app_command(char cmd, const char *arg);
+void usage();
 
 void handle_properties_changed(GDBusConnection *sig,
 				const gchar *sender_name,
@@ -31,6 +66,21 @@ void handle_properties_changed(GDBusConnection *sig,
 				GVariant *parameters,
 				gpointer user_data);
 
+void handle_tui_signal(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data);
+
+void handle_seen_signal(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data);
 
 #if CLI
 int app_main(int argc, char **argv);
@@ -38,19 +88,77 @@ int app_main(int argc, char **argv);
 int app_main();
 #endif
 
+void app_discovery_done_cb(Discovery *disc, const char *path, gpointer arg);
 int app_discovery(int scan_time);
+int app_set_match(const char *spec);
+int app_set_duty_cycle(const char *spec);
 
 int app_debug_list_devices();
 
+void app_devices_loaded_cb(DevicePool *refreshed, gsize changed, gpointer arg);
+
 int app_list_devices();
 
-int app_pair();
+Device *app_select_device(const char *key);
+
+void app_watch_device(const char *path);
+
+int app_pair(const char *key);
+
+int app_connect(const char *key);
+
+int app_disconnect(const char *key);
+
+int app_remove(const char *key);
+
+void app_batch_done_cb(guint succeeded, guint failed, gint64 elapsed_us, gpointer arg);
+int app_purge(int minutes);
+GVariant *app_parse_value(const char *str);
+int app_adapter_config(const char *spec);
+
+void app_watch_loaded_cb(DevicePool *refreshed, gsize changed, gpointer arg);
+gboolean app_watch_cb(gpointer arg);
+int app_watch(int interval);
 
-int app_connect();
+void app_presence_event_cb(const PresenceEvent *event, gpointer arg);
+void app_presence_feed(const char *path, GVariant *dict, const char *signal_name);
+int app_presence(const char *spec);
+int app_keep(const char *spec);
+int app_telemetry(const char *spec);
+int app_gatt(const char *spec);
+void app_gatt_write_progress_cb(gsize sent, gsize total, gpointer arg);
+void app_gatt_write_done_cb(const GattWriteStats *stats, const GError *error, gpointer arg);
+const GattChar *app_select_char(const char *spec);
+int app_gatt_write(const char *spec);
+void app_notify_sample_cb(const NotifySample *sample, const NotifyStream *stream, gpointer arg);
+gboolean app_notify_cb(gpointer arg);
+int app_notify(const char *spec);
+void app_obex_cb(const ObexTransfer *transfer, gpointer arg);
+gboolean app_obex_idle_cb(gpointer arg);
+Obex *app_obex();
+int app_obex_send(const char *spec);
+int app_obex_receive(const char *dir);
+gboolean app_history_cb(gpointer arg);
+int app_history(const char *spec);
 
-int app_disconnect();
+int app_tui();
+
+void app_route_signal(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data);
 
-int app_remove();
+void app_replay_event_cb(const RecordEvent *event, gpointer arg);
+void app_replay_done_cb(Replay *replay, gpointer arg);
+int app_replay(const char *spec);
+int app_record(const char *file);
+void app_loadgen_done_cb(LoadGen *gen, gpointer arg);
+int app_loadgen(const char *spec);
+int app_bench(const char *spec);
+int app_metrics(const char *spec);
 
 int app_init();
 int app_run();
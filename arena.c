@@ -0,0 +1,162 @@
+/**
+* @file arena.c
+* @brief Bump allocator whose memory is released all at once.
+*/
+#include "arena.h"
+
+/** @brief One block of arena memory, chained newest first. */
+typedef struct _ArenaChunk
+{
+   struct _ArenaChunk *next;
+   gsize size;
+   gsize used;
+   guint8 *data;
+} ArenaChunk;
+
+struct _Arena
+{
+   ArenaChunk *chunks;
+   gsize chunk_size;
+   gsize used;
+   GPtrArray *kept;  /** GVariant references, created on first use. */
+};
+
+static ArenaChunk *arena_chunk_new(gsize size)
+{
+   // Header and data in one block, data starts aligned.
+   gsize header = (sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1);
+   ArenaChunk *chunk = g_malloc(header + size);
+   chunk->next = NULL;
+   chunk->size = size;
+   chunk->used = 0;
+   chunk->data = (guint8 *)chunk + header;
+   return chunk;
+}
+
+/**
+ * @brief Creates an empty arena.
+ *
+ * @param chunk_size Bytes reserved at a time, ARENA_CHUNK_DEFAULT if 0.
+ */
+Arena *arena_new(gsize chunk_size)
+{
+   Arena *arena = g_new0(Arena, 1);
+   arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_DEFAULT;
+   return arena;
+}
+
+/**
+ * @brief Returns size bytes aligned to ARENA_ALIGN. The memory is not
+ *  cleared and lives until arena_free() or arena_reset().
+ */
+gpointer arena_alloc(Arena *arena, gsize size)
+{
+   ArenaChunk *chunk = arena->chunks;
+   size = (MAX(size, 1) + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1);
+
+   if (chunk == NULL || chunk->size - chunk->used < size)
+   {
+      // Big requests get a chunk of their own behind the current one, so
+      // the space left in the current chunk isn't wasted.
+      if (chunk != NULL && size > arena->chunk_size / 4)
+      {
+         ArenaChunk *big = arena_chunk_new(size);
+         big->used = size;
+         big->next = chunk->next;
+         chunk->next = big;
+         arena->used += size;
+         return big->data;
+      }
+      chunk = arena_chunk_new(MAX(size, arena->chunk_size));
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+   }
+
+   gpointer mem = chunk->data + chunk->used;
+   chunk->used += size;
+   arena->used += size;
+   return mem;
+}
+
+/**
+ * @brief Like arena_alloc(), but zero filled.
+ */
+gpointer arena_alloc0(Arena *arena, gsize size)
+{
+   return memset(arena_alloc(arena, size), 0, size);
+}
+
+/**
+ * @brief Copies str into the arena.
+ */
+gchar *arena_strdup(Arena *arena, const gchar *str)
+{
+   if (str == NULL)
+      return NULL;
+   gsize len = strlen(str) + 1;
+   return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * @brief Hands the caller's reference to val over to the arena, which
+ *  drops it on release. Strings borrowed from val stay valid as long as
+ *  the arena does.
+ */
+void arena_keep(Arena *arena, GVariant *val)
+{
+   if (arena->kept == NULL)
+      arena->kept = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+   g_ptr_array_add(arena->kept, g_variant_take_ref(val));
+}
+
+/**
+ * @brief Bytes handed out so far.
+ */
+gsize arena_used(const Arena *arena)
+{
+   return arena->used;
+}
+
+/**
+ * @brief Releases every allocation and kept value but holds on to the
+ *  first chunk, so refilling the arena doesn't touch malloc.
+ */
+void arena_reset(Arena *arena)
+{
+   ArenaChunk *keep = NULL;
+
+   // Kept values may point into the chunks, drop them first.
+   if (arena->kept != NULL)
+      g_ptr_array_set_size(arena->kept, 0);
+
+   for (ArenaChunk *chunk = arena->chunks; chunk != NULL;)
+   {
+      ArenaChunk *next = chunk->next;
+      if (keep == NULL && chunk->size == arena->chunk_size)
+         keep = chunk;
+      else
+         g_free(chunk);
+      chunk = next;
+   }
+   if (keep != NULL)
+   {
+      keep->next = NULL;
+      keep->used = 0;
+   }
+   arena->chunks = keep;
+   arena->used = 0;
+}
+
+/**
+ * @brief Releases the arena and everything allocated from it.
+ */
+void arena_free(Arena *arena)
+{
+   if (arena == NULL)
+      return;
+   arena_reset(arena);
+   g_free(arena->chunks);
+   if (arena->kept != NULL)
+      g_ptr_array_unref(arena->kept);
+   g_free(arena);
+}
@@ -0,0 +1,65 @@
+/**
+* @file arena.h
+* @brief Bump allocator whose memory is released all at once.
+*/
+#ifndef ARENA_H
+#define ARENA_H
+#include <string.h>
+#include <glib.h>
+
+#define ARENA_CHUNK_DEFAULT (16 * 1024)
+#define ARENA_ALIGN 8
+
+/** @brief A set of allocations that share one lifetime. */
+typedef struct _Arena Arena;
+
+/**
+ * @brief Creates an empty arena.
+ *
+ * @param chunk_size Bytes reserved at a time, ARENA_CHUNK_DEFAULT if 0.
+ */
+Arena *arena_new(gsize chunk_size);
+
+/**
+ * @brief Returns size bytes aligned to ARENA_ALIGN. The memory is not
+ *  cleared and lives until arena_free() or arena_reset().
+ */
+gpointer arena_alloc(Arena *arena, gsize size);
+
+/**
+ * @brief Like arena_alloc(), but zero filled.
+ */
+gpointer arena_alloc0(Arena *arena, gsize size);
+
+/** @brief Allocates n zeroed structs of type from an arena. */
+#define arena_new0(arena, type, n) ((type *)arena_alloc0((arena), sizeof(type) * (n)))
+
+/**
+ * @brief Copies str into the arena.
+ */
+gchar *arena_strdup(Arena *arena, const gchar *str);
+
+/**
+ * @brief Hands the caller's reference to val over to the arena, which
+ *  drops it on release. Strings borrowed from val stay valid as long as
+ *  the arena does.
+ */
+void arena_keep(Arena *arena, GVariant *val);
+
+/**
+ * @brief Bytes handed out so far.
+ */
+gsize arena_used(const Arena *arena);
+
+/**
+ * @brief Releases every allocation and kept value but holds on to the
+ *  first chunk, so refilling the arena doesn't touch malloc.
+ */
+void arena_reset(Arena *arena);
+
+/**
+ * @brief Releases the arena and everything allocated from it.
+ */
+void arena_free(Arena *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,205 @@
+/**
+* @file bench.c
+* @brief Read throughput of device pool snapshots under a busy writer.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "pool.h"
+
+/** @brief State of one reader thread, alone on its cache line. */
+typedef struct _BenchReader
+{
+   union
+   {
+      struct
+      {
+         DevicePool *pool;
+         gint *stop;
+         guint64 reads;
+         guint64 torn;      /** Snapshots that weren't complete. */
+         guint64 sum;       /** Keeps the walk from being optimized out. */
+      };
+      guint8 line[EPOCH_CACHE_LINE];
+   };
+} BenchReader;
+
+/** @brief State of the writer thread. */
+typedef struct _BenchWriter
+{
+   DevicePool *pool;
+   gint *stop;
+   GVariant *replies[2];
+   guint64 commits;
+} BenchWriter;
+
+/**
+ * @brief A GetManagedObjects reply of BENCH_DEVICES devices. Every other
+ *  device gets a different RSSI in each variant, so commits alternate
+ *  between reparsing half the records and keeping the rest.
+ */
+static GVariant *bench_reply(gint variant)
+{
+   GVariantBuilder objects;
+
+   g_variant_builder_init(&objects, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+   for (gint i = 0; i < BENCH_DEVICES; i++)
+   {
+      GVariantBuilder ifaces;
+      GVariantBuilder props;
+      gchar *path = g_strdup_printf("/org/bluez/hci0/dev_00_00_00_00_%02X_%02X", i >> 8, i & 0xFF);
+      gchar *address = g_strdup_printf("00:00:00:00:%02X:%02X", i >> 8, i & 0xFF);
+      gchar *name = g_strdup_printf("bench-%d", i);
+
+      g_variant_builder_init(&props, G_VARIANT_TYPE("a{sv}"));
+      g_variant_builder_add(&props, "{sv}", "Address", g_variant_new_string(address));
+      g_variant_builder_add(&props, "{sv}", "Name", g_variant_new_string(name));
+      g_variant_builder_add(&props, "{sv}", "Paired", g_variant_new_boolean(FALSE));
+      g_variant_builder_add(&props, "{sv}", "Connected", g_variant_new_boolean(FALSE));
+      g_variant_builder_add(&props, "{sv}", "RSSI",
+                            g_variant_new_int16(-60 - ((i & 1) ? variant * 10 : 0)));
+      g_variant_builder_init(&ifaces, G_VARIANT_TYPE("a{sa{sv}}"));
+      g_variant_builder_add(&ifaces, "{sa{sv}}", BLUEZ_DEVICE_IFACE, &props);
+      g_variant_builder_add(&objects, "{oa{sa{sv}}}", path, &ifaces);
+
+      g_free(path);
+      g_free(address);
+      g_free(name);
+   }
+   return g_variant_ref_sink(g_variant_new("(a{oa{sa{sv}}})", &objects));
+}
+
+static gpointer bench_writer_thread(gpointer arg)
+{
+   BenchWriter *writer = arg;
+
+   while (!g_atomic_int_get(writer->stop))
+   {
+      device_pool_update(writer->pool, writer->replies[writer->commits & 1], NULL, NULL);
+      writer->commits += 1;
+   }
+   return NULL;
+}
+
+static gpointer bench_reader_thread(gpointer arg)
+{
+   BenchReader *bench = arg;
+   EpochReader *reader = device_pool_reader_new(bench->pool);
+   guint64 reads = 0;
+   guint64 torn = 0;
+   guint64 sum = 0;
+
+   while (!g_atomic_int_get(bench->stop))
+   {
+      const DeviceSnapshot *snap = device_pool_read_begin(bench->pool, reader);
+
+      //! Touch every record, a recycled one would show up as torn or crash.
+      if (snap->num_devices != BENCH_DEVICES)
+         torn += 1;
+      for (gsize i = 0; i < snap->num_devices; i++)
+      {
+         const Device *dev = &snap->devices[i];
+         sum += dev->num_ifaces + (guchar)dev->obj_path[strlen(dev->obj_path) - 1];
+         if (dev->num_ifaces > 0)
+            sum += dev->ifaces[0].num_properties;
+      }
+      device_pool_read_end(reader);
+      reads += 1;
+   }
+   device_pool_reader_free(reader);
+
+   bench->reads = reads;
+   bench->torn = torn;
+   bench->sum = sum;
+   return NULL;
+}
+
+/**
+ * @brief Runs one step with num_readers readers.
+ *
+ * @returns Snapshots read per second by all readers together.
+ */
+static gdouble bench_step(DevicePool *pool, GVariant **replies, guint num_readers, guint seconds)
+{
+   gint stop = 0;
+   BenchWriter writer = { pool, &stop, { replies[0], replies[1] }, 0 };
+   BenchReader *readers = NULL;
+   gpointer readers_mem = NULL;
+   GThread **threads = g_new0(GThread *, num_readers);
+   GThread *writer_thread = NULL;
+   guint64 reads = 0;
+   guint64 torn = 0;
+   gint64 start = 0;
+   gdouble elapsed = 0;
+
+   // Cache line aligned, so readers never write to a shared line.
+   readers_mem = g_malloc0((num_readers + 1) * sizeof(BenchReader));
+   readers = (BenchReader *)(((guintptr)readers_mem + EPOCH_CACHE_LINE - 1)
+                             & ~(guintptr)(EPOCH_CACHE_LINE - 1));
+
+   start = g_get_monotonic_time();
+   writer_thread = g_thread_new("bench-writer", bench_writer_thread, &writer);
+   for (guint i = 0; i < num_readers; i++)
+   {
+      readers[i].pool = pool;
+      readers[i].stop = &stop;
+      threads[i] = g_thread_new("bench-reader", bench_reader_thread, &readers[i]);
+   }
+
+   g_usleep(seconds * G_USEC_PER_SEC);
+   g_atomic_int_set(&stop, 1);
+
+   for (guint i = 0; i < num_readers; i++)
+   {
+      g_thread_join(threads[i]);
+      reads += readers[i].reads;
+      torn += readers[i].torn;
+   }
+   g_thread_join(writer_thread);
+   elapsed = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+   printf("%7u %14.0f %14.0f %10.0f %6" G_GUINT64_FORMAT "\n",
+          num_readers, reads / elapsed, reads / elapsed / num_readers,
+          writer.commits / elapsed, torn);
+
+   g_free(threads);
+   g_free(readers_mem);
+   return reads / elapsed;
+}
+
+/**
+ * @brief Runs the benchmark with 1, 2, 4... up to max_readers reader
+ *  threads and prints a line per step.
+ *
+ * @param max_readers Most reader threads, up to EPOCH_MAX_READERS.
+ * @param seconds How long each step runs.
+ */
+void bench_device_pool(guint max_readers, guint seconds)
+{
+   DevicePool *pool = device_pool_new();
+   GVariant *replies[2] = { bench_reply(0), bench_reply(1) };
+   gdouble single = 0;
+
+   max_readers = CLAMP(max_readers, 1, EPOCH_MAX_READERS);
+   seconds = MAX(seconds, 1);
+   device_pool_update(pool, replies[0], NULL, NULL);
+
+   printf("%d devices, %u s per step, %u CPUs\n", BENCH_DEVICES, seconds, g_get_num_processors());
+   printf("%7s %14s %14s %10s %6s\n", "readers", "reads/s", "per reader", "commits/s", "torn");
+   for (guint n = 1;; n = MIN(n * 2, max_readers))
+   {
+      gdouble rate = bench_step(pool, replies, n, seconds);
+      if (n == 1)
+         single = rate;
+      else if (single > 0)
+         printf("%7s %13.2fx\n", "", rate / single);
+      if (n == max_readers)
+         break;
+   }
+
+   device_pool_print_stats(pool);
+   device_pool_free(pool);
+   g_variant_unref(replies[0]);
+   g_variant_unref(replies[1]);
+}
@@ -0,0 +1,24 @@
+/**
+* @file bench.h
+* @brief Read throughput of device pool snapshots under a busy writer.
+*
+* A writer thread keeps committing synthetic replies to a pool while a
+* growing number of reader threads walk the latest snapshot. Reads never
+* lock, so reads per second should grow with the number of readers.
+*/
+#ifndef BENCH_H
+#define BENCH_H
+#include <glib.h>
+
+#define BENCH_DEVICES 256
+
+/**
+ * @brief Runs the benchmark with 1, 2, 4... up to max_readers reader
+ *  threads and prints a line per step.
+ *
+ * @param max_readers Most reader threads, up to EPOCH_MAX_READERS.
+ * @param seconds How long each step runs.
+ */
+void bench_device_pool(guint max_readers, guint seconds);
+
+#endif // BENCH_H
@@ -8,116 +8,90 @@
 #define DEBUG 0
 
 /**
-* @brief Scans for advertisements and returns object names found.
-*
-* @param conn Connection handle to dbus.
-* @param devices_found An array of Devices.
-* @param object_path_array_size The max amount of devices that can be found array.
-*
-* @returns The size of the Devices struct array found.
-*/
-gsize bluez_adapter_get_objects(
-   GDBusConnection *conn, 
-   Device *devices_found, 
-   gsize object_path_array_size)
+ * @brief Decodes the beacon payloads of a Device1 interface into the
+ *  device record.
+ */
+static void bluez_parse_adverts(Device *dev, const Iface *iface)
 {
-   GVariant *result = NULL;
-   GVariant *array_of_objects = NULL; 
-   GError *error = NULL;
+   int max_adverts = 0;
 
-   result = g_dbus_connection_call_sync(conn,
-            BLUEZ_ORG,
-            "/",
-            FREE_OBJECT_MANAGER,
-            "GetManagedObjects",
-            NULL,
-            NULL,
-            G_DBUS_CALL_FLAGS_NONE,
-            -1,
-            NULL,
-            &error);
-   dbus_check_error(error);
+   for (int k = 0; k < iface->num_properties; k++)
+      max_adverts += advert_count_property(iface->props[k].prop, iface->props[k].val);
+   if (max_adverts == 0)
+      return;
 
-   array_of_objects = g_variant_get_child_value(result, 0);
+   dev->adverts = arena_new0(dev->arena, Advert, max_adverts);
+   for (int k = 0; k < iface->num_properties; k++)
+      dev->num_adverts += advert_decode_property(iface->props[k].prop, iface->props[k].val,
+                                                 &dev->adverts[dev->num_adverts],
+                                                 max_adverts - dev->num_adverts);
+}
 
-   gboolean iter_bool = 0;
-   GVariantIter iter;
-   GVariant *object = NULL;
-   GVariant *interface_array = NULL;
-   int i = 0;
-
-   g_variant_iter_init(&iter, array_of_objects);
-   while ((iter_bool = 
-            g_variant_iter_loop(&iter, 
-            "{@o@a*}", 
-            &object, 
-            &interface_array))) 
+/**
+ * @brief Fills dev from one object of a GetManagedObjects reply. The
+ * interface and property arrays are sized from the reply, nothing is
+ * truncated. Everything lands in dev->arena, names are borrowed from
+ * interface_array, which must outlive the arena.
+ *
+ * @param dev Device to fill, dev->arena set.
+ * @param path Object path, borrowed.
+ * @param interface_array Interfaces of the object, type a{sa{sv}}.
+ */
+void bluez_parse_object(Device *dev, const char *path, GVariant *interface_array)
+{
+   dev->obj_path = (char *)path;
+   dev->num_ifaces = g_variant_n_children(interface_array);
+   dev->ifaces = arena_new0(dev->arena, Iface, dev->num_ifaces);
+   dev->num_adverts = 0;
+   dev->adverts = NULL;
+   dev->info = (SchemaInfo){ 0 };
+
+   /**** INTERFACES START****/
+   GVariantIter iter_interfaces;
+   const gchar *interface_string = NULL;
+   GVariant *property_array = NULL;
+
+   int num_ifaces = 0;
+   g_variant_iter_init(&iter_interfaces, interface_array);
+   while (g_variant_iter_loop(&iter_interfaces,
+            "{&s@a{sv}}",
+            &interface_string,
+            &property_array))
    {
-
-      // These strings will have to be freed externally.
-      devices_found[i].obj_path = g_variant_print(object, FALSE);
-
-
-      /**** INTERFACES START****/
-      GVariantIter iter_interfaces;
-      const gchar *interface_string = NULL;
-      GVariant *property_array = NULL;
-      gboolean iter_bool_interface = 0;
-
-      int num_ifaces = 0;
-      g_variant_iter_init(&iter_interfaces, interface_array);
-      while ((iter_bool_interface = 
-               g_variant_iter_loop(&iter_interfaces,
-               "{&s@a*}",
-               &interface_string,
-               &property_array)))
+      Iface *iface = &dev->ifaces[num_ifaces];
+      iface->iface = (char *)interface_string;
+      iface->num_properties = g_variant_n_children(property_array);
+      iface->props = arena_new0(dev->arena, Prop, iface->num_properties);
+      guint schema_ifaces = schema_iface(interface_string);
+      dev->info.ifaces |= schema_ifaces;
+
+      /**** METHODS START ****/
+      GVariantIter iter_properties;
+      const gchar *property_string = NULL;
+      GVariant *val = NULL;
+      g_variant_iter_init(&iter_properties, property_array);
+
+      int num_properties = 0;
+      while (g_variant_iter_loop(&iter_properties,
+               "{&s@v}",
+               &property_string,
+               &val))
       {
-         // Must be freed.
-         devices_found[i].ifaces[num_ifaces].iface = g_strdup(interface_string);
-
-         /**** METHODS START ****/
-         GVariantIter iter_properties;
-         const gchar *property_string = NULL;
-         GVariant *val = NULL;
-         gboolean iter_bool_property = 0;
-         g_variant_iter_init(&iter_properties, property_array);
-
-         int num_properties = 0;
-         while ((iter_bool_property = 
-                  g_variant_iter_loop(&iter_properties,
-                  "{&s@v}",
-                  &property_string,
-                  &val)))
-         {
-            // Must be freed
-            devices_found[i].ifaces[num_ifaces].props[num_properties].prop = g_strdup(property_string);
-            // Must be freed
-            devices_found[i].ifaces[num_ifaces].props[num_properties].val = g_variant_get_variant(val);
-
-            num_properties += 1;
-            if (num_properties > MAX_PROPS - 1)
-               break;
-         }
-         devices_found[i].ifaces[num_ifaces].num_properties = num_properties;
-         num_ifaces += 1;
-         if (num_ifaces > MAX_IFACES - 1)
-            break;
+         Prop *prop = &iface->props[num_properties];
+         prop->prop = (char *)property_string;
+         // Shares the reply's memory, the arena drops the reference.
+         prop->val = g_variant_get_variant(val);
+         arena_keep(dev->arena, prop->val);
+         // Known properties also land typed, the rest only stay generic.
+         schema_decode(&dev->info, schema_ifaces, property_string, prop->val);
+         num_properties += 1;
       }
-
-      devices_found[i].num_ifaces = num_ifaces;
-
-      i += 1;
-      if (i > object_path_array_size - 1)
-         break;
-
+      if (g_str_equal(iface->iface, BLUEZ_DEVICE_IFACE))
+         bluez_parse_adverts(dev, iface);
+      num_ifaces += 1;
    }
-
-   g_variant_unref(array_of_objects);
-   g_variant_unref(result);
-   return i;
 }
 
-
 /**
 * @brief Starts and stops device discovery. 
 *
@@ -220,12 +194,12 @@ void bluez_adapter_print_properties(GDBusConnection *conn)
 }
 
 /**
- * @brief Prints out every device found after scanning. Debug function.
+ * @brief Writes a "device" record per device through the output writer.
  *
  * @param devices Pointer to Device array.
  * @param num_devices Size of Device array.
  */
-void bluez_print_devices(Device *devices, gsize num_devices)
+void bluez_print_devices(const Device *devices, gsize num_devices)
 {
    if (devices == NULL)
    {
@@ -234,72 +208,144 @@ void bluez_print_devices(Device *devices, gsize num_devices)
    }
    for (int i = 0; i < num_devices; i++)
    {
-      Device dev = devices[i];
-      g_print("obj: %s\n", dev.obj_path);
-      g_print("num_ifaces: %d\n", dev.num_ifaces);
-      for (int j = 0; j < dev.num_ifaces; j++)
+      const Device *dev = &devices[i];
+      output_record_begin("device");
+      output_str("obj", dev->obj_path);
+      output_int("num_ifaces", dev->num_ifaces);
+      output_array_begin("ifaces");
+      for (int j = 0; j < dev->num_ifaces; j++)
+      {
+         const Iface *iface = &dev->ifaces[j];
+         output_object_begin(NULL);
+         output_str("iface", iface->iface);
+         output_object_begin("props");
+         for (int k = 0; k < iface->num_properties; k++)
+            output_value(iface->props[k].prop, iface->props[k].val);
+         output_object_end();
+         output_object_end();
+      }
+      output_array_end();
+      output_array_begin("adverts");
+      for (int j = 0; j < dev->num_adverts; j++)
       {
-         Iface iface = dev.ifaces[j];
-         g_print(" | iface: %s\n", iface.iface);
-         for (int k = 0; k < iface.num_properties; k++)
-         {
-            Prop prop = iface.props[k];
-            g_print("  | prop: %s\n", prop.prop);
-            gchar *val = g_variant_print(prop.val, FALSE);
-            g_print("   | val: %s\n", val);
-            free(val);
-         }
+         char buf[ADVERT_STR_MAX];
+         output_str(NULL, advert_to_string(&dev->adverts[j], buf, sizeof(buf)));
       }
+      output_array_end();
+      output_record_end();
    }
 }
 
 /**
- * @brief Frees all Device in the devices array.
+ * @brief Returns a property of one of the device's interfaces.
  *
- * @param devices Pointer to Device array.
- * @param num_devices Size of Device array.
+ * @param dev The device.
+ * @param iface Interface name, e.g. org.bluez.Device1.
+ * @param prop Property name.
+ *
+ * @returns The value, owned by the device, or NULL.
  */
-void bluez_devices_free(Device *devices, gsize num_devices)
+GVariant *bluez_device_get_property(const Device *dev, const char *iface, const char *prop)
 {
-   if (devices == NULL)
-      return;
-   for (int i = 0; i < num_devices; i++)
+   for (int j = 0; j < dev->num_ifaces; j++)
    {
+      if (!g_str_equal(dev->ifaces[j].iface, iface))
+         continue;
+      for (int k = 0; k < dev->ifaces[j].num_properties; k++)
+      {
+         if (g_str_equal(dev->ifaces[j].props[k].prop, prop))
+            return dev->ifaces[j].props[k].val;
+      }
+   }
+   return NULL;
+}
+
+/**
+ * @brief Returns the Bluetooth address of a device, or NULL if the object
+ * isn't a device.
+ */
+const char *bluez_device_get_address(const Device *dev)
+{
+   // Adapters have an Address too.
+   if (!(dev->info.ifaces & SCHEMA_DEVICE))
+      return NULL;
+   return dev->info.address.str;
+}
 
-      Device dev = devices[i];
-      free(dev.obj_path);
-      for (int j = 0; j < dev.num_ifaces; j++)
+/**
+ * @brief Returns a boolean Device1 property such as Paired, FALSE when
+ * it's missing. Use schema_flag() on dev->info when the name is fixed.
+ */
+gboolean bluez_device_get_flag(const Device *dev, const char *prop)
+{
+   gint slot = schema_slot(prop);
+   GVariant *val = NULL;
+
+   if (slot >= 0)
+      return (dev->info.ifaces & SCHEMA_DEVICE) && ((dev->info.flags >> slot) & 1);
+   val = bluez_device_get_property(dev, BLUEZ_DEVICE_IFACE, prop);
+   return val != NULL && g_variant_is_of_type(val, G_VARIANT_TYPE_BOOLEAN)
+          && g_variant_get_boolean(val);
+}
+
+/**
+ * @brief Looks up a device in the store. Nothing is copied, the returned
+ * pointer is valid until the array is freed.
+ *
+ * @param devices A Device struct array.
+ * @param num_devices The number of devices in the array.
+ * @param key An index into the array, an object path or a MAC address.
+ *
+ * @returns The matching device, or NULL.
+ */
+Device *bluez_find_device(Device *devices, gsize num_devices, const char *key)
+{
+   gchar *end = NULL;
+   guint64 index = 0;
+
+   if (devices == NULL || key == NULL || *key == '\0')
+      return NULL;
+
+   if (*key == '/')
+   {
+      for (gsize i = 0; i < num_devices; i++)
       {
-         Iface iface = dev.ifaces[j];
-         free(iface.iface);
-         for (int k = 0; k < iface.num_properties; k++)
-         {
-            Prop prop = iface.props[k];
-            free(prop.prop);
-            g_variant_unref(prop.val);
-         }
+         if (g_str_equal(devices[i].obj_path, key))
+            return &devices[i];
       }
+      return NULL;
+   }
+
+   index = g_ascii_strtoull(key, &end, 10);
+   if (*end == '\0')
+      return index < num_devices ? &devices[index] : NULL;
+
+   for (gsize i = 0; i < num_devices; i++)
+   {
+      const char *address = bluez_device_get_address(&devices[i]);
+      if (address != NULL && g_ascii_strcasecmp(address, key) == 0)
+         return &devices[i];
    }
-   free(devices);
+   return NULL;
 }
 
 /**
-* @brief Connects a device. 
-*
-* @param dev A Device struct.
-* @param conn Connection handle to dbus.
-*/
-void bluez_device_connect(Device dev, GDBusConnection *conn)
+ * @brief Calls a no argument org.bluez.Device1 method on a device path.
+ *
+ * @param path Object path of the device.
+ * @param method The method to be called, e.g. Connect.
+ * @param conn Connection handle to dbus.
+ */
+void bluez_device_call_method(const char *path, const char *method, GDBusConnection *conn)
 {
    GError *error = NULL;
-   char path[40];
-   obj_to_str(dev.obj_path, path);
+   GVariant *result = NULL;
 
-   g_dbus_connection_call_sync(conn,
+   result = g_dbus_connection_call_sync(conn,
             BLUEZ_ORG,
             path,
-            "org.bluez.Device1",
-            "Connect",
+            BLUEZ_DEVICE_IFACE,
+            method,
             NULL,
             NULL,
             G_DBUS_CALL_FLAGS_NONE,
@@ -307,7 +353,19 @@ void bluez_device_connect(Device dev, GDBusConnection *conn)
             NULL,
             &error);
    dbus_check_error(error);
-   g_print("Connected to %s\n", dev.obj_path);
+   g_variant_unref(result);
+}
+
+/**
+* @brief Connects a device. 
+*
+* @param dev The device.
+* @param conn Connection handle to dbus.
+*/
+void bluez_device_connect(const Device *dev, GDBusConnection *conn)
+{
+   bluez_device_call_method(dev->obj_path, "Connect", conn);
+   g_print("Connected to %s\n", dev->obj_path);
 }
 
 /**
@@ -315,71 +373,43 @@ void bluez_device_connect(Device dev, GDBusConnection *conn)
 *
 * @param devices A Device struct array.
 * @param num_devices The number of devices in the array.
+*
+* @returns The chosen device, or NULL on bad input.
 */
-Device bluez_choose_device(Device *devices, int num_devices)
+Device *bluez_choose_device(Device *devices, gsize num_devices)
 {
+   char line[64];
+
    for (int i = 0; i < num_devices; i++)
       g_print("%d | %s\n", i, devices[i].obj_path);  
    
    g_print("Input Dev Index: ");
-   // ADD ERROR CHECK HERE THIS IS TOTALLY NOT SAFE LOL
-   int index = 0;
-   scanf("%d", &index);
+   if (fgets(line, sizeof(line), stdin) == NULL)
+      return NULL;
 
-   
-   return devices[index];
+   return bluez_find_device(devices, num_devices, g_strstrip(line));
 }
 
 /**
 * @brief Pairs a device. 
 *
-* @param dev A Device struct.
+* @param dev The device.
 * @param conn Connection handle to dbus.
 */
-void bluez_device_pair(Device dev, GDBusConnection *conn)
+void bluez_device_pair(const Device *dev, GDBusConnection *conn)
 {
-   GError *error = NULL;
-   char path[40];
-   obj_to_str(dev.obj_path, path);
-
-   g_dbus_connection_call_sync(conn,
-            BLUEZ_ORG,
-            path,
-            "org.bluez.Device1",
-            "Pair",
-            NULL,
-            NULL,
-            G_DBUS_CALL_FLAGS_NONE,
-            -1,
-            NULL,
-            &error);
-   dbus_check_error(error);
+   bluez_device_call_method(dev->obj_path, "Pair", conn);
 }
 
 /**
 * @brief Disconnects a device. Removes all pairing information.
 *
-* @param dev A Device struct.
+* @param dev The device.
 * @param conn Connection handle to dbus.
 */
-void bluez_device_disconnect(Device dev, GDBusConnection *conn)
+void bluez_device_disconnect(const Device *dev, GDBusConnection *conn)
 {
-   GError *error = NULL;
-   char path[40];
-   obj_to_str(dev.obj_path, path);
-
-   g_dbus_connection_call_sync(conn,
-            BLUEZ_ORG,
-            path,
-            "org.bluez.Device1",
-            "Disconnect",
-            NULL,
-            NULL,
-            G_DBUS_CALL_FLAGS_NONE,
-            -1,
-            NULL,
-            &error);
-   dbus_check_error(error);
+   bluez_device_call_method(dev->obj_path, "Disconnect", conn);
 }
 
 /**
@@ -462,21 +492,202 @@ void bluez_adapter_connect_addr(char *bt_addr, char *path, GDBusConnection *conn
 }
 
 
+/** @brief A call waiting in a batch. */
+typedef struct _BatchCall
+{
+   BluezBatch *batch;
+   gchar *path;
+   const char *iface;
+   gchar *method;
+   GVariant *params;
+} BatchCall;
+
+struct _BluezBatch
+{
+   GDBusConnection *conn;
+   GQueue calls;
+   guint window;
+   guint in_flight;
+   guint succeeded;
+   guint failed;
+   gint64 started;
+   BluezBatchFunc callback;
+   BluezBatchReplyFunc reply_func;
+   gpointer user_data;
+};
+
+static void bluez_batch_pump(BluezBatch *batch);
+
 /**
-* @brief Removes a device. Removes all pairing information.
+ * @brief Creates an empty batch of bluez method calls.
+ *
+ * @param conn Connection handle to dbus.
+ * @param window Calls kept in flight at once, 0 for BLUEZ_BATCH_WINDOW.
+ */
+BluezBatch *bluez_batch_new(GDBusConnection *conn, guint window)
+{
+   BluezBatch *batch = g_new0(BluezBatch, 1);
+   batch->conn = conn;
+   batch->window = window ? window : BLUEZ_BATCH_WINDOW;
+   g_queue_init(&batch->calls);
+   return batch;
+}
+
+/**
+ * @brief Queues a method call on the batch.
+ *
+ * @param batch The batch.
+ * @param path Object path to call.
+ * @param iface Interface of the method.
+ * @param method Method name.
+ * @param params Parameters, a floating reference is consumed. May be NULL.
+ */
+void bluez_batch_add(BluezBatch *batch, const char *path, const char *iface,
+                     const char *method, GVariant *params)
+{
+   BatchCall *call = g_new0(BatchCall, 1);
+   call->batch = batch;
+   call->path = g_strdup(path);
+   call->iface = iface;
+   call->method = g_strdup(method);
+   call->params = params ? g_variant_ref_sink(params) : NULL;
+   g_queue_push_tail(&batch->calls, call);
+}
+
+/**
+ * @brief Queues an Adapter1.RemoveDevice call for path.
+ */
+void bluez_batch_add_remove_device(BluezBatch *batch, const char *path)
+{
+   bluez_batch_add(batch, BLUEZ_ADAPTER_OBJECT, BLUEZ_ADAPTER_IFACE,
+                   "RemoveDevice", g_variant_new("(o)", path));
+}
+
+/**
+ * @brief Queues a Properties.GetAll of one interface of path.
+ */
+void bluez_batch_add_get_all(BluezBatch *batch, const char *path, const char *iface)
+{
+   bluez_batch_add(batch, path, FREE_PROPERTIES, "GetAll", g_variant_new("(s)", iface));
+}
+
+/**
+ * @brief Hands every successful reply to func as it arrives, for calls
+ *  whose results matter.
+ */
+void bluez_batch_set_reply_func(BluezBatch *batch, BluezBatchReplyFunc func)
+{
+   batch->reply_func = func;
+}
+
+/**
+ * @brief Queues a Properties.Set of an Adapter1 property.
+ *
+ * @param val Must be used with g_variant_new object, will be freed. 
+ */
+void bluez_batch_add_adapter_property(BluezBatch *batch, const gchar *prop, GVariant *val)
+{
+   bluez_batch_add(batch, BLUEZ_ADAPTER_OBJECT, FREE_PROPERTIES,
+                   "Set", g_variant_new("(ssv)", BLUEZ_ADAPTER_IFACE, prop, val));
+}
+
+static void bluez_batch_call_free(BatchCall *call)
+{
+   if (call->params)
+      g_variant_unref(call->params);
+   g_free(call->path);
+   g_free(call->method);
+   g_free(call);
+}
+
+static void bluez_batch_reply_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   BatchCall *call = arg;
+   BluezBatch *batch = call->batch;
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+   // One failed call (device already gone, read-only property...) must
+   // not take the rest of the batch down with it.
+   if (result == NULL)
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error->message);
+      g_error_free(error);
+      batch->failed += 1;
+   }
+   else
+   {
+      if (batch->reply_func)
+         batch->reply_func(call->path, call->params, result, batch->user_data);
+      g_variant_unref(result);
+      batch->succeeded += 1;
+   }
+   bluez_batch_call_free(call);
+
+   batch->in_flight -= 1;
+   bluez_batch_pump(batch);
+}
+
+/**
+ * @brief Tops the batch up to window calls in flight, and finishes it
+ * once nothing is queued or in flight. Calls live until their reply.
+ */
+static void bluez_batch_pump(BluezBatch *batch)
+{
+   BatchCall *call = NULL;
+
+   while (batch->in_flight < batch->window && (call = g_queue_pop_head(&batch->calls)))
+   {
+      g_dbus_connection_call(batch->conn,
+               BLUEZ_ORG,
+               call->path,
+               call->iface,
+               call->method,
+               call->params,
+               NULL,
+               G_DBUS_CALL_FLAGS_NONE,
+               -1,
+               NULL,
+               bluez_batch_reply_cb,
+               call);
+      batch->in_flight += 1;
+   }
+
+   if (batch->in_flight == 0)
+   {
+      batch->callback(batch->succeeded, batch->failed,
+                      g_get_monotonic_time() - batch->started, batch->user_data);
+      g_free(batch);
+   }
+}
+
+/**
+ * @brief Issues the queued calls, at most window at a time, and frees
+ * the batch after calling callback. Failures are printed to stderr.
+ */
+void bluez_batch_run(BluezBatch *batch, BluezBatchFunc callback, gpointer user_data)
+{
+   batch->callback = callback;
+   batch->user_data = user_data;
+   batch->started = g_get_monotonic_time();
+   bluez_batch_pump(batch);
+}
+
+/**
+* @brief Removes a device by object path.
 *
-* @param dev A Device struct.
+* @param path Object path of the device.
 * @param conn Connection handle to dbus.
 */
-void bluez_adapter_remove_device(Device dev, GDBusConnection *conn)
+void bluez_adapter_remove_path(const char *path, GDBusConnection *conn)
 {
    GError *error = NULL;
-   char path[40];
-   obj_to_str(dev.obj_path, path);
-   g_dbus_connection_call_sync(conn,
+   GVariant *result = NULL;
+
+   result = g_dbus_connection_call_sync(conn,
             BLUEZ_ORG,
-            "/org/bluez/hci0",
-            "org.bluez.Adapter1",
+            BLUEZ_ADAPTER_OBJECT,
+            BLUEZ_ADAPTER_IFACE,
             "RemoveDevice",
             g_variant_new("(o)", path),
             NULL,
@@ -486,16 +697,17 @@ void bluez_adapter_remove_device(Device dev, GDBusConnection *conn)
             &error);
 
    dbus_check_error(error);
-   g_print("%s removed.\n", dev.obj_path);
+   g_variant_unref(result);
+   g_print("%s removed.\n", path);
 }
 
 /**
- * @brief Internal function to convert paths. This will be moved. It's not safe...
- */
-void obj_to_str(char *obj_path, char *path)
+* @brief Removes a device. Removes all pairing information.
+*
+* @param dev The device.
+* @param conn Connection handle to dbus.
+*/
+void bluez_adapter_remove_device(const Device *dev, GDBusConnection *conn)
 {
-   // This will have to go in a different place
-   for (int i = 1; i < 38; i++)
-      path[i - 1] = obj_path[i];
-   path[37] = '\0';
+   bluez_adapter_remove_path(dev->obj_path, conn);
 }
@@ -11,16 +11,23 @@
 #include <gio/gio.h>
 
 #include "dbus.h"
+#include "arena.h"
+#include "advert.h"
+#include "record.h"
+#include "output.h"
+#include "schema.h"
 
 /** Macros **/
 #define BLUEZ_ORG "org.bluez" /** Bluez Org **/
 #define BLUEZ_ADAPTER_IFACE "org.bluez.Adapter1"
 #define BLUEZ_ADAPTER_OBJECT "/org/bluez/hci0" 
+#define BLUEZ_DEVICE_IFACE "org.bluez.Device1"
+#define BLUEZ_BATTERY_IFACE "org.bluez.Battery1"
+#define BLUEZ_GATT_CHR_IFACE "org.bluez.GattCharacteristic1"
 #define FREE_PROPERTIES "org.freedesktop.DBus.Properties"
 #define FREE_OBJECT_MANAGER "org.freedesktop.DBus.ObjectManager"
 #define AGENT_PATH "/org/bluez/AutoPinAgent"
-#define MAX_IFACES 10
-#define MAX_PROPS  20
+#define BLUEZ_BATCH_WINDOW 32 /** Default calls in flight per batch. */
 
 
 /** @brief GLib Prop struct */
@@ -36,7 +43,7 @@ typedef struct _Iface
 {
    char *iface;
    int num_properties;
-   Prop props[MAX_PROPS];
+   Prop *props;
 } Iface;
 
 /** @brief A preliminary struct to hold device information. */
@@ -44,9 +51,37 @@ typedef struct _Device
 {
    char *obj_path; 
    int num_ifaces;
-   Iface ifaces[MAX_IFACES];
+   Iface *ifaces;
+   int num_adverts;  /** Decoded ManufacturerData and ServiceData entries. */
+   Advert *adverts;
+   SchemaInfo info;  /** Known properties of all interfaces, typed. */
+   Arena *arena;     /** Storage of the record, owned by its pool record. */
 } Device;
 
+/** @brief A set of method calls issued concurrently, see bluez_batch_new(). */
+typedef struct _BluezBatch BluezBatch;
+
+/**
+ * @brief Receives the result of a batch once every call has returned.
+ *
+ * @param succeeded Number of calls that returned without error.
+ * @param failed Number of calls that returned an error.
+ * @param elapsed_us Time from bluez_batch_run() to the last reply.
+ * @param user_data Passed to bluez_batch_run().
+ */
+typedef void (*BluezBatchFunc)(guint succeeded, guint failed, gint64 elapsed_us, gpointer user_data);
+
+/**
+ * @brief Receives each successful reply of a batch, see
+ *  bluez_batch_set_reply_func().
+ *
+ * @param path Object path the call went to.
+ * @param params Parameters of the call, NULL if there were none.
+ * @param result The reply, owned by the batch.
+ * @param user_data Passed to bluez_batch_run().
+ */
+typedef void (*BluezBatchReplyFunc)(const char *path, GVariant *params, GVariant *result, gpointer user_data);
+
 /**
 * @brief Prints the properties of hci0 controller. 
 *
@@ -75,60 +110,94 @@ void bluez_adapter_set_property(
 void bluez_adapter_discovery(GDBusConnection *conn, gboolean power);
 
 /**
-* @brief Scans for advertisements and returns object names found.
-*
-* @brief TODO: This information will all need to be stored in structs.
-*
-* @param conn Connection handle to dbus.
-* @param devices_found An array of Devices.
-* @param object_path_array_size The max amount of devices that can be found array.
-*
-* @returns The size of the Devices struct array found.
-*/
-gsize bluez_adapter_get_objects(
-   GDBusConnection *conn, 
-   Device *devices_found, 
-   gsize object_path_array_size);
+ * @brief Fills dev from one object of a GetManagedObjects reply. The
+ * interface and property arrays are sized from the reply, nothing is
+ * truncated. Everything lands in dev->arena, names are borrowed from
+ * interface_array, which must outlive the arena.
+ *
+ * @param dev Device to fill, dev->arena set.
+ * @param path Object path, borrowed.
+ * @param interface_array Interfaces of the object, type a{sa{sv}}.
+ */
+void bluez_parse_object(Device *dev, const char *path, GVariant *interface_array);
 
 /**
- * @brief Prints out every device found after scanning. Debug function.
+ * @brief Writes a "device" record per device through the output writer.
  *
  * @param devices Pointer to Device array.
  * @param num_devices Size of Device array.
  */
-void bluez_print_devices(Device *devices, gsize num_devices);
+void bluez_print_devices(const Device *devices, gsize num_devices);
 
 /**
- * @brief Frees all Device in the devices array.
+ * @brief Looks up a device in the store. Nothing is copied, the returned
+ * pointer is valid until the array is freed.
  *
- * @param devices Pointer to Device array.
- * @param num_devices Size of Device array.
+ * @param devices A Device struct array.
+ * @param num_devices The number of devices in the array.
+ * @param key An index into the array, an object path or a MAC address.
+ *
+ * @returns The matching device, or NULL.
+ */
+Device *bluez_find_device(Device *devices, gsize num_devices, const char *key);
+
+/**
+ * @brief Returns a property of one of the device's interfaces.
+ *
+ * @param dev The device.
+ * @param iface Interface name, e.g. org.bluez.Device1.
+ * @param prop Property name.
+ *
+ * @returns The value, owned by the device, or NULL.
+ */
+GVariant *bluez_device_get_property(const Device *dev, const char *iface, const char *prop);
+
+/**
+ * @brief Returns the Bluetooth address of a device, or NULL if the object
+ * isn't a device.
+ */
+const char *bluez_device_get_address(const Device *dev);
+
+/**
+ * @brief Returns a boolean Device1 property such as Paired, FALSE when
+ * it's missing. Use schema_flag() on dev->info when the name is fixed.
+ */
+gboolean bluez_device_get_flag(const Device *dev, const char *prop);
+
+/**
+ * @brief Calls a no argument org.bluez.Device1 method on a device path.
+ *
+ * @param path Object path of the device.
+ * @param method The method to be called, e.g. Connect.
+ * @param conn Connection handle to dbus.
  */
-void bluez_devices_free(Device *devices, gsize num_devices);
+void bluez_device_call_method(const char *path, const char *method, GDBusConnection *conn);
 
 /**
 * @brief Connects a device. 
 *
-* @param dev A Device struct.
+* @param dev The device.
 * @param conn Connection handle to dbus.
 */
-void bluez_device_connect(Device dev, GDBusConnection *conn);
+void bluez_device_connect(const Device *dev, GDBusConnection *conn);
 
 /**
 * @brief Pairs a device. 
 *
-* @param dev A Device struct.
+* @param dev The device.
 * @param conn Connection handle to dbus.
 */
-void bluez_device_pair(Device dev, GDBusConnection *conn);
+void bluez_device_pair(const Device *dev, GDBusConnection *conn);
 
 /**
 * @brief A way to select devices. 
 *
 * @param devices A Device struct array.
 * @param num_devices The number of devices in the array.
+*
+* @returns The chosen device, or NULL on bad input.
 */
-Device bluez_choose_device(Device *devices, int num_devices);
+Device *bluez_choose_device(Device *devices, gsize num_devices);
 
 /**
  * @brief Calls a given method with parameters to the agent manager.
@@ -149,23 +218,75 @@ int bluez_register_autopair_agent(GDBusConnection *conn);
 /**
 * @brief Disconnects a device. Removes all pairing information.
 *
-* @param dev A Device struct.
+* @param dev The device.
 * @param conn Connection handle to dbus.
 */
-void bluez_device_disconnect(Device dev, GDBusConnection *conn);
+void bluez_device_disconnect(const Device *dev, GDBusConnection *conn);
 
 /**
 * @brief Removes a device. Removes all pairing information.
 *
-* @param dev A Device struct.
+* @param dev The device.
 * @param conn Connection handle to dbus.
 *
 */
-void bluez_adapter_remove_device(Device dev, GDBusConnection *conn);
+void bluez_adapter_remove_device(const Device *dev, GDBusConnection *conn);
+
+/**
+ * @brief Creates an empty batch of bluez method calls.
+ *
+ * @param conn Connection handle to dbus.
+ * @param window Calls kept in flight at once, 0 for BLUEZ_BATCH_WINDOW.
+ */
+BluezBatch *bluez_batch_new(GDBusConnection *conn, guint window);
+
+/**
+ * @brief Queues a method call on the batch.
+ *
+ * @param batch The batch.
+ * @param path Object path to call.
+ * @param iface Interface of the method.
+ * @param method Method name.
+ * @param params Parameters, a floating reference is consumed. May be NULL.
+ */
+void bluez_batch_add(BluezBatch *batch, const char *path, const char *iface,
+                     const char *method, GVariant *params);
+
+/**
+ * @brief Queues an Adapter1.RemoveDevice call for path.
+ */
+void bluez_batch_add_remove_device(BluezBatch *batch, const char *path);
+
+/**
+ * @brief Queues a Properties.GetAll of one interface of path.
+ */
+void bluez_batch_add_get_all(BluezBatch *batch, const char *path, const char *iface);
+
+/**
+ * @brief Hands every successful reply to func as it arrives, for calls
+ *  whose results matter.
+ */
+void bluez_batch_set_reply_func(BluezBatch *batch, BluezBatchReplyFunc func);
+
+/**
+ * @brief Queues a Properties.Set of an Adapter1 property.
+ *
+ * @param val Must be used with g_variant_new object, will be freed. 
+ */
+void bluez_batch_add_adapter_property(BluezBatch *batch, const gchar *prop, GVariant *val);
 
 /**
- * @brief Internal function to convert paths. This will be moved. It's not safe...
+ * @brief Issues the queued calls, at most window at a time, and frees
+ * the batch after calling callback. Failures are printed to stderr.
  */
-void obj_to_str(char *obj_path, char *path);
+void bluez_batch_run(BluezBatch *batch, BluezBatchFunc callback, gpointer user_data);
+
+/**
+* @brief Removes a device by object path.
+*
+* @param path Object path of the device.
+* @param conn Connection handle to dbus.
+*/
+void bluez_adapter_remove_path(const char *path, GDBusConnection *conn);
 
 #endif // BLUEZ_H_HELPER
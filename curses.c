@@ -7,7 +7,376 @@
 #define DEBUG 1
 
 static WINDOW *menu_win = NULL;
-static WINDOW *term_win = NULL; 
+static WINDOW *term_win = NULL;
+
+//! Device table state. Rows are keyed by object path, and rows holds them
+//! in display order.
+static GHashTable *row_table = NULL;
+static GPtrArray *rows = NULL;
+static SortKey sort_key = SORT_RSSI;
+static gboolean order_dirty = FALSE;
+static gboolean stat_dirty = TRUE;
+static int top_row = 0;
+
+//! Frame pacing. Updates only mark rows dirty, a single timeout source
+//! draws them at most fps times a second.
+static guint frame_interval_ms = 1000 / FPS_DEFAULT;
+static guint frame_source = 0;
+static guint input_watch = 0;
+static GIOChannel *input_channel = NULL;
+static GMainLoop *main_loop = NULL;
+static guint64 updates_total = 0;
+
+static void curses_row_free(Row *row)
+{
+   g_free(row->path);
+   g_free(row);
+}
+
+static int curses_row_cmp(const void *a, const void *b)
+{
+   const Row *ra = *(Row * const *)a;
+   const Row *rb = *(Row * const *)b;
+   int ret = 0;
+
+   switch (sort_key)
+   {
+      case SORT_ADDRESS:
+         ret = strcmp(ra->address, rb->address);
+         break;
+      case SORT_NAME:
+         ret = g_ascii_strcasecmp(ra->name, rb->name);
+         break;
+      case SORT_RSSI: // Strongest first, no RSSI last.
+         if (ra->has_rssi != rb->has_rssi)
+            ret = ra->has_rssi ? -1 : 1;
+         else
+            ret = rb->rssi - ra->rssi;
+         break;
+      case SORT_LAST_SEEN: // Most recent first.
+         ret = (ra->last_seen < rb->last_seen) - (ra->last_seen > rb->last_seen);
+         break;
+      case SORT_CONNECTED:
+         ret = rb->connected - ra->connected;
+         break;
+   }
+   return ret ? ret : strcmp(ra->path, rb->path);
+}
+
+static gboolean curses_sorts_on(gint slot)
+{
+   switch (sort_key)
+   {
+      case SORT_ADDRESS:
+         return slot == SCHEMA_Address;
+      case SORT_NAME:
+         return slot == SCHEMA_Name || slot == SCHEMA_Alias;
+      case SORT_RSSI:
+         return slot == SCHEMA_RSSI;
+      case SORT_CONNECTED:
+         return slot == SCHEMA_Connected;
+      default:
+         return TRUE;
+   }
+}
+
+static int curses_visible_rows()
+{
+   int height = getmaxy(menu_win);
+   return height > 1 ? height - 1 : 0;
+}
+
+static void curses_draw_header()
+{
+   static const char *names[] = { "ADDRESS", "NAME", "RSSI", "LAST SEEN", "CONN" };
+   char title[5][16];
+
+   for (int i = 0; i < 5; i++)
+      g_snprintf(title[i], sizeof(title[i]), "%s%s", names[i], i == sort_key ? "*" : "");
+
+   wattron(menu_win, A_REVERSE);
+   wmove(menu_win, 0, 0);
+   wclrtoeol(menu_win);
+   mvwprintw(menu_win, 0, 0, "%-18s %-31s %6s %10s %5s",
+             title[0], title[1], title[2], title[3], title[4]);
+   wattroff(menu_win, A_REVERSE);
+}
+
+static void curses_draw_row(Row *row, int line)
+{
+   char rssi[8] = "-";
+   char seen[12] = "-";
+
+   if (row->has_rssi)
+      g_snprintf(rssi, sizeof(rssi), "%d", row->rssi);
+   if (row->last_seen)
+   {
+      time_t secs = row->last_seen / G_USEC_PER_SEC;
+      struct tm tm;
+      localtime_r(&secs, &tm);
+      strftime(seen, sizeof(seen), "%H:%M:%S", &tm);
+   }
+
+   wmove(menu_win, line, 0);
+   wclrtoeol(menu_win);
+   mvwprintw(menu_win, line, 0, "%-18s %-31s %6s %10s %5s",
+             row->address, row->name, rssi, seen, row->connected ? "yes" : "");
+}
+
+static void curses_draw_stat()
+{
+   werase(term_win);
+   box(term_win, 0, 0);
+   mvwprintw(term_win, 0, 0, "Stat");
+   mvwprintw(term_win, 1, 1,
+             "%u devices | %llu updates | %u fps | sort: a/n/r/s/c | scroll: j/k | q: quit",
+             rows->len, (unsigned long long)updates_total, 1000 / frame_interval_ms);
+   wnoutrefresh(term_win);
+}
+
+/**
+ * @brief Draws one frame. Only rows that changed or moved are redrawn.
+ */
+static gboolean curses_frame_cb(gpointer arg)
+{
+   int visible = curses_visible_rows();
+
+   frame_source = 0;
+   if (order_dirty)
+   {
+      qsort(rows->pdata, rows->len, sizeof(gpointer), curses_row_cmp);
+      order_dirty = FALSE;
+   }
+
+   if (top_row > (int)rows->len - 1)
+      top_row = rows->len > 0 ? rows->len - 1 : 0;
+
+   for (int line = 1; line <= visible; line++)
+   {
+      int index = top_row + line - 1;
+      if (index >= (int)rows->len)
+      {
+         wmove(menu_win, line, 0);
+         wclrtoeol(menu_win);
+         continue;
+      }
+
+      Row *row = g_ptr_array_index(rows, index);
+      if (row->dirty || row->drawn_line != line)
+      {
+         curses_draw_row(row, line);
+         row->dirty = FALSE;
+         row->drawn_line = line;
+      }
+   }
+
+   // Rows scrolled off screen must be redrawn when they come back.
+   for (int i = 0; i < (int)rows->len; i++)
+   {
+      if (i < top_row || i >= top_row + visible)
+         ((Row *)g_ptr_array_index(rows, i))->drawn_line = -1;
+   }
+
+   wnoutrefresh(menu_win);
+   if (stat_dirty)
+   {
+      curses_draw_stat();
+      stat_dirty = FALSE;
+   }
+   doupdate();
+   return G_SOURCE_REMOVE;
+}
+
+static void curses_schedule_frame()
+{
+   stat_dirty = TRUE;
+   if (!frame_source && menu_win != NULL)
+      frame_source = g_timeout_add(frame_interval_ms, curses_frame_cb, NULL);
+}
+
+static void curses_invalidate()
+{
+   for (guint i = 0; i < rows->len; i++)
+      ((Row *)g_ptr_array_index(rows, i))->drawn_line = -1;
+   order_dirty = TRUE;
+   curses_schedule_frame();
+}
+
+static void curses_resize()
+{
+   int height = 0;
+   int width = 0;
+
+   endwin();
+   refresh();
+   getmaxyx(stdscr, height, width);
+   wresize(menu_win, height - STAT_HEIGHT, width);
+   wresize(term_win, STAT_HEIGHT, width);
+   mvwin(term_win, height - STAT_HEIGHT, 0);
+   werase(menu_win);
+   curses_draw_header();
+   curses_invalidate();
+}
+
+static Row *curses_get_row(const char *path)
+{
+   Row *row = g_hash_table_lookup(row_table, path);
+   if (row == NULL)
+   {
+      row = g_new0(Row, 1);
+      row->path = g_strdup(path);
+      row->drawn_line = -1;
+      // Until an Address shows up, use the one embedded in the path.
+      const char *dev = strstr(path, "dev_");
+      g_strlcpy(row->address, dev ? dev + 4 : path, sizeof(row->address));
+      g_strdelimit(row->address, "_", ':');
+      g_hash_table_insert(row_table, row->path, row);
+      g_ptr_array_add(rows, row);
+      order_dirty = TRUE;
+   }
+   return row;
+}
+
+void curses_set_fps(guint fps)
+{
+   frame_interval_ms = 1000 / CLAMP(fps, 1, 1000);
+}
+
+void curses_device_set_property(const char *path, const char *prop, GVariant *val, gboolean seen)
+{
+   SchemaInfo info = { 0 };
+   Row *row = NULL;
+   gint slot = -1;
+
+   if (row_table == NULL)
+      return;
+
+   row = curses_get_row(path);
+   slot = schema_decode(&info, SCHEMA_DEVICE, prop, val);
+   if (slot == SCHEMA_Address)
+   {
+      g_strlcpy(row->address, info.address.str, sizeof(row->address));
+   }
+   else if (slot == SCHEMA_Name || (slot == SCHEMA_Alias && row->name[0] == '\0'))
+   {
+      g_strlcpy(row->name, slot == SCHEMA_Name ? info.name : info.alias, sizeof(row->name));
+   }
+   else if (slot == SCHEMA_RSSI)
+   {
+      row->rssi = info.rssi;
+      row->has_rssi = TRUE;
+   }
+   else if (slot == SCHEMA_Connected)
+   {
+      row->connected = schema_flag(&info, Connected);
+   }
+   else if (!seen)
+   {
+      return;
+   }
+
+   if (seen)
+   {
+      row->last_seen = g_get_real_time();
+      if (sort_key == SORT_LAST_SEEN)
+         order_dirty = TRUE;
+   }
+   if (curses_sorts_on(slot))
+      order_dirty = TRUE;
+
+   row->dirty = TRUE;
+   updates_total += 1;
+   curses_schedule_frame();
+}
+
+void curses_device_update(const char *path, GVariant *props, gboolean seen)
+{
+   GVariantIter iter;
+   const gchar *prop = NULL;
+   GVariant *val = NULL;
+
+   g_variant_iter_init(&iter, props);
+   while (g_variant_iter_loop(&iter, "{&sv}", &prop, &val))
+      curses_device_set_property(path, prop, val, seen);
+}
+
+void curses_device_remove(const char *path)
+{
+   Row *row = NULL;
+
+   if (row_table == NULL || (row = g_hash_table_lookup(row_table, path)) == NULL)
+      return;
+
+   // The array owns the row, so drop the hash entry first.
+   g_hash_table_remove(row_table, path);
+   g_ptr_array_remove(rows, row);
+   order_dirty = TRUE;
+   curses_schedule_frame();
+}
+
+static gboolean curses_input_cb(GIOChannel *source, GIOCondition cond, gpointer arg)
+{
+   int input = 0;
+   SortKey new_key = sort_key;
+
+   if (cond & (G_IO_HUP | G_IO_ERR))
+   {
+      g_main_loop_quit(main_loop);
+      input_watch = 0;
+      return G_SOURCE_REMOVE;
+   }
+
+   while ((input = wgetch(menu_win)) != ERR)
+   {
+      switch (input)
+      {
+         case 'q':
+            g_main_loop_quit(main_loop);
+            break;
+         case 'a':
+            new_key = SORT_ADDRESS;
+            break;
+         case 'n':
+            new_key = SORT_NAME;
+            break;
+         case 'r':
+            new_key = SORT_RSSI;
+            break;
+         case 's':
+            new_key = SORT_LAST_SEEN;
+            break;
+         case 'c':
+            new_key = SORT_CONNECTED;
+            break;
+         case 'j':
+         case KEY_DOWN:
+            top_row += 1;
+            break;
+         case 'k':
+         case KEY_UP:
+            top_row = MAX(top_row - 1, 0);
+            break;
+         case KEY_NPAGE:
+            top_row += curses_visible_rows();
+            break;
+         case KEY_PPAGE:
+            top_row = MAX(top_row - curses_visible_rows(), 0);
+            break;
+         case KEY_RESIZE:
+            curses_resize();
+            break;
+      }
+   }
+
+   if (new_key != sort_key)
+   {
+      sort_key = new_key;
+      curses_draw_header();
+      order_dirty = TRUE;
+   }
+   curses_schedule_frame();
+   return G_SOURCE_CONTINUE;
+}
 
 int curses_initialize()
 {
@@ -18,42 +387,65 @@ int curses_initialize()
    initscr();
 
    // Allows exit by ctrl-c
-   cbreak(); 
+   cbreak();
    noecho();
+   curs_set(0);
    getmaxyx(stdscr, height, width);
 
-   menu_win = newwin(height >> 1, width, 0, 0);
-   term_win = newwin(height >> 1, width, height >> 1, 0);
+   menu_win = newwin(height - STAT_HEIGHT, width, 0, 0);
+   term_win = newwin(STAT_HEIGHT, width, height - STAT_HEIGHT, 0);
+   keypad(menu_win, TRUE);
+   nodelay(menu_win, TRUE);
    refresh();
 
-   box(menu_win, 0, 0);
-   mvwprintw(menu_win, 0, 0, "Menu");
+   row_table = g_hash_table_new(g_str_hash, g_str_equal);
+   rows = g_ptr_array_new_with_free_func((GDestroyNotify)curses_row_free);
 
-   box(term_win, 0, 0);
-   mvwprintw(term_win, 0, 0, "Stat");
-
-   wrefresh(menu_win);
-   wrefresh(term_win);
+   curses_draw_header();
+   wnoutrefresh(menu_win);
+   curses_draw_stat();
+   doupdate();
 
    return 0;
 }
 
 void curses_end()
 {
+   if (menu_win == NULL)
+      return;
+
+   if (frame_source)
+      g_source_remove(frame_source);
+   if (input_watch)
+      g_source_remove(input_watch);
+   if (input_channel)
+      g_io_channel_unref(input_channel);
+   frame_source = input_watch = 0;
+   input_channel = NULL;
+
+   delwin(menu_win);
+   delwin(term_win);
+   menu_win = term_win = NULL;
+
+   g_hash_table_destroy(row_table);
+   g_ptr_array_unref(rows);
+   row_table = NULL;
+   rows = NULL;
+
    // deallocates memory
    endwin();
 }
 
-int curses_start()
+int curses_start(GMainLoop *loop)
 {
-   char input = 0;
+   main_loop = loop;
 
-   while (1)
-   {
-      input = wgetch(menu_win);
-      mvwprintw(menu_win, 1, 1, "%c", input);
-      wrefresh(menu_win);
-      wrefresh(term_win);
-   }
+   // Keys are read whenever stdin is readable, nothing polls.
+   input_channel = g_io_channel_unix_new(STDIN_FILENO);
+   input_watch = g_io_add_watch(input_channel,
+                              G_IO_IN | G_IO_HUP | G_IO_ERR,
+                              (GIOFunc)curses_input_cb,
+                              NULL);
+   curses_schedule_frame();
    return 0;
 }
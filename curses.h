@@ -7,17 +7,75 @@
 #define CURSES_H
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include <ncurses.h>
 
+#include <glib.h>
+
+#include "schema.h"
+
 /** Ncurses Macros **/
 #define X_POS_DEFAULT 10
 #define Y_POS_DEFAULT 10
 #define HEIGHT_DEFAULT 50
 #define WIDTH_DEFAULT 50
+#define FPS_DEFAULT 10
+#define STAT_HEIGHT 3
+
+/** @brief Columns the device table can be sorted by. */
+typedef enum _SortKey
+{
+   SORT_ADDRESS,
+   SORT_NAME,
+   SORT_RSSI,
+   SORT_LAST_SEEN,
+   SORT_CONNECTED
+} SortKey;
+
+/** @brief One line of the device table. */
+typedef struct _Row
+{
+   gchar *path;
+   gchar address[18];
+   gchar name[32];
+   gint16 rssi;
+   gboolean has_rssi;
+   gint64 last_seen;
+   gboolean connected;
+   gboolean dirty;  /** Content changed since it was last drawn. */
+   int drawn_line;  /** Screen line it was last drawn on, -1 if none. */
+} Row;
 
 /** Ncurses Functions **/
 int curses_initialize();
 void curses_end();
-int curses_start();
+int curses_start(GMainLoop *loop);
+
+/**
+ * @brief Caps table redraws to fps frames per second.
+ */
+void curses_set_fps(guint fps);
+
+/**
+ * @brief Updates a single Device1 property of the row for path.
+ *
+ * @param path Object path of the device.
+ * @param prop Property name.
+ * @param val Property value, not consumed.
+ * @param seen TRUE when the update came from the radio (signal), which
+ *        bumps the last seen time.
+ */
+void curses_device_set_property(const char *path, const char *prop, GVariant *val, gboolean seen);
+
+/**
+ * @brief Updates the row for path from an a{sv} of Device1 properties.
+ */
+void curses_device_update(const char *path, GVariant *props, gboolean seen);
+
+/**
+ * @brief Drops the row for path.
+ */
+void curses_device_remove(const char *path);
 
-#endif 
+#endif
@@ -0,0 +1,140 @@
+/**
+* @file diff.c
+* @brief Compares two device snapshots and reports what changed.
+*/
+#include "diff.h"
+
+static const Iface *diff_find_iface(const Device *dev, const char *name)
+{
+   for (int j = 0; j < dev->num_ifaces; j++)
+   {
+      if (g_str_equal(dev->ifaces[j].iface, name))
+         return &dev->ifaces[j];
+   }
+   return NULL;
+}
+
+static const Prop *diff_find_prop(const Iface *iface, const char *name, int hint)
+{
+   // Bluez keeps property order stable, so the same index usually matches.
+   if (hint < iface->num_properties && g_str_equal(iface->props[hint].prop, name))
+      return &iface->props[hint];
+
+   for (int k = 0; k < iface->num_properties; k++)
+   {
+      if (g_str_equal(iface->props[k].prop, name))
+         return &iface->props[k];
+   }
+   return NULL;
+}
+
+static gsize diff_emit(DiffFunc callback, gpointer user_data, DiffKind kind,
+                       const char *path, const char *iface, const char *prop, GVariant *val)
+{
+   DiffEntry entry = { kind, path, iface, prop, val };
+   callback(&entry, user_data);
+   return 1;
+}
+
+/**
+ * @brief Emits the property level changes of one object.
+ */
+static gsize diff_props(const Device *old_dev, const Device *new_dev,
+                        DiffFunc callback, gpointer user_data)
+{
+   gsize n = 0;
+   const char *path = new_dev->obj_path;
+
+   for (int j = 0; j < new_dev->num_ifaces; j++)
+   {
+      const Iface *new_iface = &new_dev->ifaces[j];
+      const Iface *old_iface = old_dev ? diff_find_iface(old_dev, new_iface->iface) : NULL;
+
+      for (int k = 0; k < new_iface->num_properties; k++)
+      {
+         const Prop *new_prop = &new_iface->props[k];
+         const Prop *old_prop = old_iface ? diff_find_prop(old_iface, new_prop->prop, k) : NULL;
+
+         if (old_prop == NULL || !g_variant_equal(old_prop->val, new_prop->val))
+            n += diff_emit(callback, user_data, DIFF_CHANGED,
+                           path, new_iface->iface, new_prop->prop, new_prop->val);
+      }
+
+      if (old_iface == NULL)
+         continue;
+      for (int k = 0; k < old_iface->num_properties; k++)
+      {
+         const Prop *old_prop = &old_iface->props[k];
+         if (diff_find_prop(new_iface, old_prop->prop, k) == NULL)
+            n += diff_emit(callback, user_data, DIFF_CLEARED,
+                           path, new_iface->iface, old_prop->prop, NULL);
+      }
+   }
+
+   if (old_dev == NULL)
+      return n;
+   for (int j = 0; j < old_dev->num_ifaces; j++)
+   {
+      if (diff_find_iface(new_dev, old_dev->ifaces[j].iface) == NULL)
+         n += diff_emit(callback, user_data, DIFF_CLEARED,
+                        path, old_dev->ifaces[j].iface, NULL, NULL);
+   }
+   return n;
+}
+
+/**
+ * @brief Compares two versions of one object.
+ *
+ * @param old_dev The earlier version, NULL if the object is new.
+ * @param new_dev The later version, NULL if the object is gone.
+ * @param callback Called for every change.
+ * @param user_data Passed to callback.
+ *
+ * @returns The number of entries emitted.
+ */
+gsize diff_device(const Device *old_dev, const Device *new_dev, DiffFunc callback, gpointer user_data)
+{
+   if (new_dev == NULL)
+      return old_dev ? diff_emit(callback, user_data, DIFF_REMOVED, old_dev->obj_path, NULL, NULL, NULL) : 0;
+   if (old_dev == NULL)
+      return diff_emit(callback, user_data, DIFF_ADDED, new_dev->obj_path, NULL, NULL, NULL)
+             + diff_props(NULL, new_dev, callback, user_data);
+   return diff_props(old_dev, new_dev, callback, user_data);
+}
+
+/**
+ * @brief A DiffFunc that writes a "change" line record per entry, in
+ *  human form "+ path", "- path", "~ path iface prop value" or
+ *  "! path iface [prop]". Decodable beacon payloads follow their "~"
+ *  line as "advert" records, "@ path fields".
+ */
+void diff_print_entry(const DiffEntry *entry, gpointer user_data)
+{
+   static const char *ops[] = { "+", "-", "~", "!" };
+   Advert adverts[4];
+   char buf[ADVERT_STR_MAX];
+   int num_adverts = 0;
+
+   output_line_begin("change");
+   output_str("op", ops[entry->kind]);
+   output_str("path", entry->path);
+   if (entry->iface != NULL)
+      output_str("iface", entry->iface);
+   if (entry->prop != NULL)
+      output_str("prop", entry->prop);
+   if (entry->kind == DIFF_CHANGED)
+      output_value("val", entry->val);
+   output_record_end();
+
+   if (entry->kind != DIFF_CHANGED)
+      return;
+   num_adverts = advert_decode_property(entry->prop, entry->val, adverts, G_N_ELEMENTS(adverts));
+   for (int i = 0; i < num_adverts; i++)
+   {
+      output_line_begin("advert");
+      output_str("op", "@");
+      output_str("path", entry->path);
+      output_str("advert", advert_to_string(&adverts[i], buf, sizeof(buf)));
+      output_record_end();
+   }
+}
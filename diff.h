@@ -0,0 +1,56 @@
+/**
+* @file diff.h
+* @brief Compares two device snapshots and reports what changed.
+*/
+#ifndef DIFF_H
+#define DIFF_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "bluez.h"
+
+/** @brief Kind of a single change between two snapshots. */
+typedef enum _DiffKind
+{
+   DIFF_ADDED,    /** Object appeared, its properties follow as DIFF_CHANGED. */
+   DIFF_REMOVED,  /** Object disappeared. */
+   DIFF_CHANGED,  /** Property is new or has a different value. */
+   DIFF_CLEARED   /** Property (or whole interface) disappeared. */
+} DiffKind;
+
+/** @brief One entry of a change set. Everything is borrowed from the snapshots. */
+typedef struct _DiffEntry
+{
+   DiffKind kind;
+   const char *path;
+   const char *iface;  /** NULL for DIFF_ADDED and DIFF_REMOVED. */
+   const char *prop;   /** NULL for those, and when a whole interface is cleared. */
+   GVariant *val;      /** New value for DIFF_CHANGED, NULL otherwise. */
+} DiffEntry;
+
+/**
+ * @brief Receives the entries of a change set, one at a time.
+ */
+typedef void (*DiffFunc)(const DiffEntry *entry, gpointer user_data);
+
+/**
+ * @brief Compares two versions of one object.
+ *
+ * @param old_dev The earlier version, NULL if the object is new.
+ * @param new_dev The later version, NULL if the object is gone.
+ * @param callback Called for every change.
+ * @param user_data Passed to callback.
+ *
+ * @returns The number of entries emitted.
+ */
+gsize diff_device(const Device *old_dev, const Device *new_dev, DiffFunc callback, gpointer user_data);
+
+/**
+ * @brief A DiffFunc that writes a "change" line record per entry, in
+ *  human form "+ path", "- path", "~ path iface prop value" or
+ *  "! path iface [prop]". Decodable beacon payloads follow their "~"
+ *  line as "advert" records, "@ path fields".
+ */
+void diff_print_entry(const DiffEntry *entry, gpointer user_data);
+
+#endif // DIFF_H
@@ -1,31 +1,408 @@
 #include "discovery.h"
 
+/** @brief A running scan. */
+struct _Discovery
+{
+   GDBusConnection *conn;
+   DiscoveryConfig config;
+   gboolean scanning;
+   guint timeout_source;
+   guint cycle_source;
+   guint subs[2];
+   GHashTable *checked;  /** Paths already fetched with GetAll. */
+   GCancellable *cancel;
+   DiscoveryFunc callback;
+   gpointer user_data;
+};
+
+static int scan_users = 0;
+
+static gboolean discovery_window_begin_cb(gpointer arg);
+
+/**
+ * @brief Starts adapter discovery, or joins the one already running.
+ *  Discovery stays on until every hold is released.
+ *
+ * @param conn Connection handle to dbus.
+ */
+void discovery_hold(GDBusConnection *conn)
+{
+   if (scan_users++ == 0)
+      bluez_adapter_discovery(conn, 1);
+}
+
 /**
- * @brief Returns a pointer to a Device array. See bluez.h:Device for struct info.
+ * @brief Drops a hold taken with discovery_hold().
  *
  * @param conn Connection handle to dbus.
- * @param init_size Size to initialize the size of Device array. Must be freed.
- * @param num_devices A pointer to an integer to hold the number of devices found.  
- * @param scan_time The amount of time in seconds to scan.
  */
-Device *discovery_get_remote_devices(
-   GDBusConnection *conn, 
-   gsize init_size, 
-   gsize *num_devices,
-   int scan_time)
+void discovery_release(GDBusConnection *conn)
+{
+   if (scan_users > 0 && --scan_users == 0)
+      bluez_adapter_discovery(conn, 0);
+}
+
+/**
+ * @brief Frees the strings of a match and clears it.
+ */
+void discovery_match_clear(DiscoveryMatch *match)
+{
+   g_free(match->address);
+   g_free(match->name_prefix);
+   g_free(match->uuid);
+   match->address = match->name_prefix = match->uuid = NULL;
+}
+
+/**
+ * @brief Fills a match from a spec: "name:<prefix>", "uuid:<uuid>",
+ *  "addr:<mac>" or a bare MAC address. Short 16/32-bit UUIDs are
+ *  expanded with the Bluetooth base UUID.
+ *
+ * @returns FALSE if the spec couldn't be parsed.
+ */
+gboolean discovery_match_parse(DiscoveryMatch *match, const char *spec)
+{
+   if (spec == NULL || *spec == '\0')
+      return FALSE;
+
+   if (g_str_has_prefix(spec, "name:"))
+   {
+      g_free(match->name_prefix);
+      match->name_prefix = g_strdup(spec + 5);
+   }
+   else if (g_str_has_prefix(spec, "uuid:"))
+   {
+      const char *uuid = spec + 5;
+      gsize len = strlen(uuid);
+      g_free(match->uuid);
+      if (len == 4)
+         match->uuid = g_strdup_printf("0000%s" BLUETOOTH_BASE_UUID, uuid);
+      else if (len == 8)
+         match->uuid = g_strdup_printf("%s" BLUETOOTH_BASE_UUID, uuid);
+      else if (len == 36)
+         match->uuid = g_strdup(uuid);
+      else
+         return FALSE;
+      // Bluez reports UUIDs in lower case.
+      for (char *c = match->uuid; *c; c++)
+         *c = g_ascii_tolower(*c);
+   }
+   else
+   {
+      const char *address = g_str_has_prefix(spec, "addr:") ? spec + 5 : spec;
+      if (strlen(address) != 17)
+         return FALSE;
+      g_free(match->address);
+      match->address = g_strdup(address);
+   }
+   return TRUE;
+}
+
+static gboolean discovery_match_empty(const DiscoveryMatch *match)
+{
+   return !match->address && !match->name_prefix && !match->uuid;
+}
+
+static gboolean discovery_has_uuid(GVariant *props, const char *uuid)
+{
+   GVariant *uuids = g_variant_lookup_value(props, "UUIDs", G_VARIANT_TYPE_STRING_ARRAY);
+   GVariant *service_data = g_variant_lookup_value(props, "ServiceData", G_VARIANT_TYPE_VARDICT);
+   gboolean found = FALSE;
+
+   if (uuids != NULL)
+   {
+      GVariantIter iter;
+      const gchar *str = NULL;
+      g_variant_iter_init(&iter, uuids);
+      while (!found && g_variant_iter_next(&iter, "&s", &str))
+         found = g_ascii_strcasecmp(str, uuid) == 0;
+      g_variant_unref(uuids);
+   }
+   if (service_data != NULL)
+   {
+      GVariant *val = g_variant_lookup_value(service_data, uuid, NULL);
+      found = found || val != NULL;
+      if (val != NULL)
+         g_variant_unref(val);
+      g_variant_unref(service_data);
+   }
+   return found;
+}
+
+/**
+ * @brief Tests Device1 properties against the match. The address is
+ *  taken from the object path when props doesn't carry it.
+ */
+static gboolean discovery_match_props(const DiscoveryMatch *match, const char *path, GVariant *props)
+{
+   if (match->address)
+   {
+      char from_path[18] = "";
+      const gchar *address = NULL;
+      const char *dev = strstr(path, "dev_");
+
+      if (!g_variant_lookup(props, "Address", "&s", &address) && dev != NULL)
+      {
+         g_strlcpy(from_path, dev + 4, sizeof(from_path));
+         g_strdelimit(from_path, "_", ':');
+         address = from_path;
+      }
+      if (address == NULL || g_ascii_strcasecmp(address, match->address) != 0)
+         return FALSE;
+   }
+
+   if (match->name_prefix)
+   {
+      const gchar *name = NULL;
+      if (!g_variant_lookup(props, "Name", "&s", &name)
+          && !g_variant_lookup(props, "Alias", "&s", &name))
+         return FALSE;
+      if (!g_str_has_prefix(name, match->name_prefix))
+         return FALSE;
+   }
+
+   if (match->uuid && !discovery_has_uuid(props, match->uuid))
+      return FALSE;
+
+   return TRUE;
+}
+
+static void discovery_teardown(Discovery *disc)
+{
+   g_cancellable_cancel(disc->cancel);
+   g_object_unref(disc->cancel);
+   for (int i = 0; i < G_N_ELEMENTS(disc->subs); i++)
+   {
+      if (disc->subs[i])
+         g_dbus_connection_signal_unsubscribe(disc->conn, disc->subs[i]);
+   }
+   if (disc->timeout_source)
+      g_source_remove(disc->timeout_source);
+   if (disc->cycle_source)
+      g_source_remove(disc->cycle_source);
+   if (disc->scanning)
+      discovery_release(disc->conn);
+   if (disc->checked)
+      g_hash_table_destroy(disc->checked);
+   discovery_match_clear(&disc->config.match);
+}
+
+/**
+ * @brief Stops a running scan without calling its callback, and frees it.
+ */
+void discovery_stop(Discovery *disc)
+{
+   discovery_teardown(disc);
+   g_free(disc);
+}
+
+static void discovery_finish(Discovery *disc, const char *found_path)
+{
+   gchar *path = g_strdup(found_path);
+
+   discovery_teardown(disc);
+   disc->callback(disc, path, disc->user_data);
+   g_free(path);
+   g_free(disc);
+}
+
+static void discovery_get_all_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *props = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+   // Cancelled means the session is already gone, any other error means
+   // the device went away before we asked. Neither is fatal.
+   if (result == NULL)
+   {
+      g_error_free(error);
+      g_free(((gpointer *)arg)[1]);
+      g_free(arg);
+      return;
+   }
+
+   Discovery *disc = ((gpointer *)arg)[0];
+   gchar *path = ((gpointer *)arg)[1];
+   g_free(arg);
+
+   props = g_variant_get_child_value(result, 0);
+   if (discovery_match_props(&disc->config.match, path, props))
+      discovery_finish(disc, path);
+   g_variant_unref(props);
+   g_variant_unref(result);
+   g_free(path);
+}
+
+static void discovery_check_path(Discovery *disc, const char *path)
+{
+   gpointer *closure = g_new(gpointer, 2);
+
+   //! The call owns its copy, a later check of the same path replaces
+   //! nothing it still uses.
+   if (!g_hash_table_contains(disc->checked, path))
+      g_hash_table_add(disc->checked, g_strdup(path));
+   closure[0] = disc;
+   closure[1] = g_strdup(path);
+   g_dbus_connection_call(disc->conn,
+            BLUEZ_ORG,
+            path,
+            FREE_PROPERTIES,
+            "GetAll",
+            g_variant_new("(s)", BLUEZ_DEVICE_IFACE),
+            G_VARIANT_TYPE("(a{sv})"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            disc->cancel,
+            discovery_get_all_cb,
+            closure);
+}
+
+static void discovery_signal_cb(GDBusConnection *conn,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
 {
-   bluez_adapter_discovery(conn, 1); // Start discovery.
+   Discovery *disc = user_data;
+   const DiscoveryMatch *match = &disc->config.match;
+   const gchar *path = NULL;
+   GVariant *props = NULL;
+
+   if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      GVariant *ifaces = NULL;
+      g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &ifaces);
+      props = g_variant_lookup_value(ifaces, BLUEZ_DEVICE_IFACE, G_VARIANT_TYPE_VARDICT);
+      g_variant_unref(ifaces);
+      if (props == NULL)
+         return;
+      if (discovery_match_props(match, path, props))
+      {
+         g_variant_unref(props);
+         discovery_finish(disc, path);
+         return;
+      }
+      // The rest of the identity may show up later as PropertiesChanged.
+      g_hash_table_add(disc->checked, g_strdup(path));
+      g_variant_unref(props);
+      return;
+   }
+
+   // PropertiesChanged: a cached device was heard again, or learned
+   // more about itself. An address only match needs nothing but the path.
+   g_variant_get(parameters, "(&s@a{sv}@as)", NULL, &props, NULL);
+   if (!match->name_prefix && !match->uuid)
+   {
+      gboolean matched = discovery_match_props(match, object_path, props);
+      g_variant_unref(props);
+      if (matched)
+         discovery_finish(disc, object_path);
+      return;
+   }
 
-   sleep(scan_time); // scan_time 
+   static const char *identity_props[] = { "Name", "Alias", "UUIDs", "ServiceData" };
+   gboolean identity = FALSE;
+   for (int i = 0; !identity && i < G_N_ELEMENTS(identity_props); i++)
+   {
+      GVariant *val = g_variant_lookup_value(props, identity_props[i], NULL);
+      identity = val != NULL;
+      if (val != NULL)
+         g_variant_unref(val);
+   }
+   g_variant_unref(props);
+   if (identity || !g_hash_table_contains(disc->checked, object_path))
+      discovery_check_path(disc, object_path);
+}
 
-   bluez_adapter_discovery(conn, 0); // Stop discovery.
-   
-   Device *devices_found = malloc(sizeof(Device) * init_size);
+static gboolean discovery_timeout_cb(gpointer arg)
+{
+   Discovery *disc = arg;
 
-   *num_devices = bluez_adapter_get_objects(conn, devices_found, init_size);
+   disc->timeout_source = 0;
+   discovery_finish(disc, NULL);
+   return G_SOURCE_REMOVE;
+}
 
-   devices_found = realloc(devices_found, sizeof(Device) * (*num_devices));
+static gboolean discovery_window_end_cb(gpointer arg)
+{
+   Discovery *disc = arg;
+
+   discovery_release(disc->conn);
+   disc->scanning = FALSE;
+   disc->cycle_source = g_timeout_add_seconds(disc->config.pause, discovery_window_begin_cb, disc);
+   return G_SOURCE_REMOVE;
+}
+
+static gboolean discovery_window_begin_cb(gpointer arg)
+{
+   Discovery *disc = arg;
 
-   return (Device *)devices_found;
+   discovery_hold(disc->conn);
+   disc->scanning = TRUE;
+   disc->cycle_source = 0;
+   if (disc->config.window && disc->config.pause)
+      disc->cycle_source = g_timeout_add_seconds(disc->config.window, discovery_window_end_cb, disc);
+   return G_SOURCE_REMOVE;
 }
 
+/**
+ * @brief Starts a scan driven by main loop timers. Nothing blocks, and
+ *  Device1 signals are watched only when config has a match.
+ *
+ * @param conn Connection handle to dbus.
+ * @param config Scan settings, copied.
+ * @param callback Called once when the scan ends.
+ * @param user_data Passed to callback.
+ *
+ * @returns The running session.
+ */
+Discovery *discovery_start(
+   GDBusConnection *conn,
+   const DiscoveryConfig *config,
+   DiscoveryFunc callback,
+   gpointer user_data)
+{
+   Discovery *disc = g_new0(Discovery, 1);
+
+   disc->conn = conn;
+   disc->config = *config;
+   disc->config.match.address = g_strdup(config->match.address);
+   disc->config.match.name_prefix = g_strdup(config->match.name_prefix);
+   disc->config.match.uuid = g_strdup(config->match.uuid);
+   disc->cancel = g_cancellable_new();
+   disc->callback = callback;
+   disc->user_data = user_data;
+
+   if (!discovery_match_empty(&disc->config.match))
+   {
+      disc->checked = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+      disc->subs[0] = g_dbus_connection_signal_subscribe(conn,
+            BLUEZ_ORG,
+            FREE_OBJECT_MANAGER,
+            "InterfacesAdded",
+            NULL,
+            NULL,
+            G_DBUS_SIGNAL_FLAGS_NONE,
+            discovery_signal_cb,
+            disc,
+            NULL);
+      disc->subs[1] = g_dbus_connection_signal_subscribe(conn,
+            BLUEZ_ORG,
+            FREE_PROPERTIES,
+            "PropertiesChanged",
+            NULL,
+            BLUEZ_DEVICE_IFACE,
+            G_DBUS_SIGNAL_FLAGS_NONE,
+            discovery_signal_cb,
+            disc,
+            NULL);
+   }
+
+   if (config->timeout)
+      disc->timeout_source = g_timeout_add_seconds(config->timeout, discovery_timeout_cb, disc);
+   discovery_window_begin_cb(disc);
+   return disc;
+}
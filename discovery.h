@@ -8,19 +8,91 @@
 #include "dbus.h"
 #include "bluez.h"
 
+#define BLUETOOTH_BASE_UUID "-0000-1000-8000-00805f9b34fb"
+
+/** @brief What a scan is looking for. Every field that is set must match. */
+typedef struct _DiscoveryMatch
+{
+   gchar *address;      /** Exact MAC address, case insensitive. */
+   gchar *name_prefix;  /** Prefix of Name (or Alias). */
+   gchar *uuid;         /** 128-bit service UUID in UUIDs or ServiceData. */
+} DiscoveryMatch;
+
+/**
+ * @brief How a scan runs. Together these cover fixed duration
+ *  (timeout), continuous (no timeout) and duty cycled (window + pause)
+ *  scans, any of which stop early once match is satisfied.
+ */
+typedef struct _DiscoveryConfig
+{
+   guint timeout;  /** Seconds until the scan ends, 0 runs until stopped. */
+   guint window;   /** Seconds of scanning per cycle, 0 scans throughout. */
+   guint pause;    /** Seconds without scanning between windows. */
+   DiscoveryMatch match;
+} DiscoveryConfig;
+
+typedef struct _Discovery Discovery;
+
+/**
+ * @brief Called once when a scan ends, either on timeout or on a match.
+ *  The session is freed right after, don't call discovery_stop() on it.
+ *
+ * @param disc The finished session.
+ * @param found_path Object path of the matching device, NULL on timeout.
+ * @param user_data Passed to discovery_start().
+ */
+typedef void (*DiscoveryFunc)(Discovery *disc, const char *found_path, gpointer user_data);
+
 /** Funcs **/
 /**
- * @brief Returns a pointer to a Device array. See bluez.h:Device for struct info.
+ * @brief Starts adapter discovery, or joins the one already running.
+ *  Discovery stays on until every hold is released.
+ *
+ * @param conn Connection handle to dbus.
+ */
+void discovery_hold(GDBusConnection *conn);
+
+/**
+ * @brief Drops a hold taken with discovery_hold().
+ *
+ * @param conn Connection handle to dbus.
+ */
+void discovery_release(GDBusConnection *conn);
+
+/**
+ * @brief Fills a match from a spec: "name:<prefix>", "uuid:<uuid>",
+ *  "addr:<mac>" or a bare MAC address. Short 16/32-bit UUIDs are
+ *  expanded with the Bluetooth base UUID.
+ *
+ * @returns FALSE if the spec couldn't be parsed.
+ */
+gboolean discovery_match_parse(DiscoveryMatch *match, const char *spec);
+
+/**
+ * @brief Frees the strings of a match and clears it.
+ */
+void discovery_match_clear(DiscoveryMatch *match);
+
+/**
+ * @brief Starts a scan driven by main loop timers. Nothing blocks, and
+ *  Device1 signals are watched only when config has a match.
  *
  * @param conn Connection handle to dbus.
- * @param init_size Size to initialize the size of Device array. Must be freed.
- * @param num_devices A pointer to an integer to hold the number of devices found.  
- * @param scan_time The amount of time in seconds to scan.
- */
-Device *discovery_get_remote_devices(
-   GDBusConnection *conn, 
-   gsize init_size, 
-   gsize *num_devices,
-   int scan_time);
+ * @param config Scan settings, copied.
+ * @param callback Called once when the scan ends.
+ * @param user_data Passed to callback.
+ *
+ * @returns The running session.
+ */
+Discovery *discovery_start(
+   GDBusConnection *conn,
+   const DiscoveryConfig *config,
+   DiscoveryFunc callback,
+   gpointer user_data);
+
+/**
+ * @brief Stops a running scan without calling its callback, and frees it.
+ */
+void discovery_stop(Discovery *disc);
 
 #endif // DISCOVERY_H
@@ -0,0 +1,177 @@
+/**
+* @file epoch.c
+* @brief Epoch based reclamation for data published to lock free readers.
+*/
+#include "epoch.h"
+
+/** @brief One reader slot, alone on its cache line. */
+struct _EpochReader
+{
+   union
+   {
+      struct
+      {
+         gint epoch;          /** Epoch the read started in, 0 when idle. */
+         gint used;
+         EpochDomain *domain;
+      };
+      guint8 line[EPOCH_CACHE_LINE];
+   };
+};
+
+/** @brief A value waiting for its readers to leave. */
+typedef struct _EpochRetired
+{
+   gpointer data;
+   GDestroyNotify free_func;
+   gint epoch;                /** Epoch that began once data was unreachable. */
+} EpochRetired;
+
+struct _EpochDomain
+{
+   gint epoch;
+   guint8 pad[EPOCH_CACHE_LINE - sizeof(gint)];  /** Keeps writer state off the line readers load. */
+   gpointer readers_mem;
+   EpochReader *readers;   /** EPOCH_MAX_READERS slots, cache line aligned. */
+   GQueue retired;         /** EpochRetired, oldest first. */
+};
+
+EpochDomain *epoch_domain_new()
+{
+   EpochDomain *domain = g_new0(EpochDomain, 1);
+   domain->epoch = 1;
+   domain->readers_mem = g_malloc0((EPOCH_MAX_READERS + 1) * sizeof(EpochReader));
+   domain->readers = (EpochReader *)(((guintptr)domain->readers_mem + EPOCH_CACHE_LINE - 1)
+                                     & ~(guintptr)(EPOCH_CACHE_LINE - 1));
+   g_queue_init(&domain->retired);
+   return domain;
+}
+
+/**
+ * @brief Claims a reader slot. A slot is used by one thread at a time.
+ *
+ * @returns The slot, NULL if all EPOCH_MAX_READERS are taken.
+ */
+EpochReader *epoch_reader_new(EpochDomain *domain)
+{
+   for (int i = 0; i < EPOCH_MAX_READERS; i++)
+   {
+      EpochReader *reader = &domain->readers[i];
+      if (g_atomic_int_compare_and_exchange(&reader->used, 0, 1))
+      {
+         reader->domain = domain;
+         return reader;
+      }
+   }
+   return NULL;
+}
+
+/**
+ * @brief Gives the slot back. The reader must be outside epoch_enter().
+ */
+void epoch_reader_free(EpochReader *reader)
+{
+   if (reader == NULL)
+      return;
+   g_atomic_int_set(&reader->epoch, 0);
+   g_atomic_int_set(&reader->used, 0);
+}
+
+/**
+ * @brief Starts a read. Values loaded after this stay valid until
+ *  epoch_exit().
+ */
+void epoch_enter(EpochReader *reader)
+{
+   // Both are full barriers, the caller's loads can't move above them.
+   g_atomic_int_set(&reader->epoch, g_atomic_int_get(&reader->domain->epoch));
+}
+
+/**
+ * @brief Ends a read started with epoch_enter().
+ */
+void epoch_exit(EpochReader *reader)
+{
+   g_atomic_int_set(&reader->epoch, 0);
+}
+
+/**
+ * @brief Queues data to be freed once no reader can see it. Writer only,
+ *  call it after data has been replaced where readers load it from.
+ *
+ * @param free_func Called on data from epoch_reclaim().
+ */
+void epoch_retire(EpochDomain *domain, gpointer data, GDestroyNotify free_func)
+{
+   EpochRetired *retired = g_new(EpochRetired, 1);
+   gint epoch = domain->epoch + 1;
+
+   //! Readers that see the new epoch started after data was replaced.
+   // 0 marks an idle reader, skip it when the counter wraps.
+   if (epoch == 0)
+      epoch = 1;
+   g_atomic_int_set(&domain->epoch, epoch);
+
+   retired->data = data;
+   retired->free_func = free_func;
+   retired->epoch = epoch;
+   g_queue_push_tail(&domain->retired, retired);
+}
+
+/**
+ * @brief Frees the retired values no reader can see any more. Writer only.
+ *
+ * @returns How many values were freed.
+ */
+guint epoch_reclaim(EpochDomain *domain)
+{
+   EpochRetired *retired = NULL;
+   gboolean active = FALSE;
+   gint oldest = 0;
+   guint freed = 0;
+
+   if (g_queue_is_empty(&domain->retired))
+      return 0;
+
+   //! The oldest read in progress bounds what may be freed.
+   for (int i = 0; i < EPOCH_MAX_READERS; i++)
+   {
+      gint epoch = g_atomic_int_get(&domain->readers[i].epoch);
+      // Compared as serial numbers, so a wrapped counter still orders.
+      if (epoch != 0 && (!active || (gint)((guint)epoch - (guint)oldest) < 0))
+      {
+         oldest = epoch;
+         active = TRUE;
+      }
+   }
+
+   while ((retired = g_queue_peek_head(&domain->retired)) != NULL)
+   {
+      if (active && (gint)((guint)retired->epoch - (guint)oldest) > 0)
+         break;
+      g_queue_pop_head(&domain->retired);
+      retired->free_func(retired->data);
+      g_free(retired);
+      freed += 1;
+   }
+   return freed;
+}
+
+/**
+ * @brief Frees every retired value and the domain. Every reader must be
+ *  gone.
+ */
+void epoch_domain_free(EpochDomain *domain)
+{
+   EpochRetired *retired = NULL;
+
+   if (domain == NULL)
+      return;
+   while ((retired = g_queue_pop_head(&domain->retired)) != NULL)
+   {
+      retired->free_func(retired->data);
+      g_free(retired);
+   }
+   g_free(domain->readers_mem);
+   g_free(domain);
+}
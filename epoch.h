@@ -0,0 +1,70 @@
+/**
+* @file epoch.h
+* @brief Epoch based reclamation for data published to lock free readers.
+*
+* A single writer replaces a published pointer and retires the old value.
+* Readers bracket every access with epoch_enter() and epoch_exit(), which
+* only store to their own slot. A retired value is freed once every
+* reader that could still see it has left, so readers never wait on the
+* writer and the writer never waits on readers.
+*/
+#ifndef EPOCH_H
+#define EPOCH_H
+#include <glib.h>
+
+#define EPOCH_MAX_READERS 64
+#define EPOCH_CACHE_LINE 64
+
+/** @brief A set of readers and the values retired under them. */
+typedef struct _EpochDomain EpochDomain;
+
+/** @brief The slot of one reader thread, see epoch_reader_new(). */
+typedef struct _EpochReader EpochReader;
+
+EpochDomain *epoch_domain_new();
+
+/**
+ * @brief Claims a reader slot. A slot is used by one thread at a time.
+ *
+ * @returns The slot, NULL if all EPOCH_MAX_READERS are taken.
+ */
+EpochReader *epoch_reader_new(EpochDomain *domain);
+
+/**
+ * @brief Gives the slot back. The reader must be outside epoch_enter().
+ */
+void epoch_reader_free(EpochReader *reader);
+
+/**
+ * @brief Starts a read. Values loaded after this stay valid until
+ *  epoch_exit().
+ */
+void epoch_enter(EpochReader *reader);
+
+/**
+ * @brief Ends a read started with epoch_enter().
+ */
+void epoch_exit(EpochReader *reader);
+
+/**
+ * @brief Queues data to be freed once no reader can see it. Writer only,
+ *  call it after data has been replaced where readers load it from.
+ *
+ * @param free_func Called on data from epoch_reclaim().
+ */
+void epoch_retire(EpochDomain *domain, gpointer data, GDestroyNotify free_func);
+
+/**
+ * @brief Frees the retired values no reader can see any more. Writer only.
+ *
+ * @returns How many values were freed.
+ */
+guint epoch_reclaim(EpochDomain *domain);
+
+/**
+ * @brief Frees every retired value and the domain. Every reader must be
+ *  gone.
+ */
+void epoch_domain_free(EpochDomain *domain);
+
+#endif // EPOCH_H
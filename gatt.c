@@ -0,0 +1,370 @@
+/**
+* @file gatt.c
+* @brief GATT trees of devices, indexed by binary UUID and handle.
+*/
+#include <string.h>
+
+#include "gatt.h"
+
+#define GATT_BASE_HI G_GUINT64_CONSTANT(0x0000000000001000)
+#define GATT_BASE_LO G_GUINT64_CONSTANT(0x800000805f9b34fb)
+
+struct _GattCache
+{
+   GHashTable *trees;   /** Address to GattTree, keys inside the trees. */
+};
+
+/**
+ * @brief Parses "2a1c", "00002a1c" or a full 36 character UUID.
+ *
+ * @returns FALSE if str is none of these.
+ */
+gboolean gatt_uuid_parse(const char *str, GattUuid *uuid)
+{
+   gsize len = strlen(str);
+   guint64 parts[2] = { 0, 0 };
+   int digits = 0;
+
+   if (len == 4 || len == 8)
+   {
+      for (int i = 0; i < len; i++)
+      {
+         if (!g_ascii_isxdigit(str[i]))
+            return FALSE;
+         parts[0] = (parts[0] << 4) | g_ascii_xdigit_value(str[i]);
+      }
+      uuid->hi = (parts[0] << 32) | GATT_BASE_HI;
+      uuid->lo = GATT_BASE_LO;
+      return TRUE;
+   }
+
+   if (len != 36)
+      return FALSE;
+   for (int i = 0; i < len; i++)
+   {
+      if (i == 8 || i == 13 || i == 18 || i == 23)
+      {
+         if (str[i] != '-')
+            return FALSE;
+         continue;
+      }
+      if (!g_ascii_isxdigit(str[i]))
+         return FALSE;
+      parts[digits / 16] = (parts[digits / 16] << 4) | g_ascii_xdigit_value(str[i]);
+      digits += 1;
+   }
+   uuid->hi = parts[0];
+   uuid->lo = parts[1];
+   return TRUE;
+}
+
+/**
+ * @brief Writes the lower case 36 character form into out.
+ */
+char *gatt_uuid_format(const GattUuid *uuid, char out[GATT_UUID_STRLEN])
+{
+   g_snprintf(out, GATT_UUID_STRLEN, "%08x-%04x-%04x-%04x-%012" G_GINT64_MODIFIER "x",
+              (guint)(uuid->hi >> 32), (guint)(uuid->hi >> 16) & 0xffff, (guint)uuid->hi & 0xffff,
+              (guint)(uuid->lo >> 48), uuid->lo & G_GUINT64_CONSTANT(0xffffffffffff));
+   return out;
+}
+
+static guint gatt_uuid_hash(gconstpointer key)
+{
+   const GattUuid *uuid = key;
+   // Base UUIDs only differ in the top half of hi.
+   return (guint)(uuid->hi >> 32) ^ (guint)uuid->hi ^ (guint)(uuid->lo >> 32) ^ (guint)uuid->lo;
+}
+
+static gboolean gatt_uuid_equal(gconstpointer a, gconstpointer b)
+{
+   const GattUuid *ua = a;
+   const GattUuid *ub = b;
+   return ua->hi == ub->hi && ua->lo == ub->lo;
+}
+
+/**
+ * @brief Handle of a GATT object: its Handle property, or the hex number
+ *  bluez ends the object name with (service001a, char001b, desc001d).
+ */
+static guint16 gatt_object_handle(const Device *obj)
+{
+   gsize len = strlen(obj->obj_path);
+
+   if (schema_has(&obj->info, Handle) && obj->info.handle != 0)
+      return obj->info.handle;
+   return len > 4 ? g_ascii_strtoull(obj->obj_path + len - 4, NULL, 16) : 0;
+}
+
+static gint gatt_object_cmp(gconstpointer a, gconstpointer b)
+{
+   return (gint)gatt_object_handle(*(const Device **)a) - (gint)gatt_object_handle(*(const Device **)b);
+}
+
+/**
+ * @brief Sums a hash of the path, handle and UUID of every object, so a
+ *  database rebuilt with the same number of objects still tells apart.
+ *  The order of objects doesn't matter.
+ */
+static guint gatt_objects_fingerprint(GPtrArray *objects)
+{
+   guint sum = 0;
+
+   for (guint i = 0; i < objects->len; i++)
+   {
+      const Device *obj = g_ptr_array_index(objects, i);
+      guint h = g_str_hash(obj->obj_path) ^ gatt_object_handle(obj);
+
+      if (obj->info.uuid != NULL)
+         h = h * 31 + g_str_hash(obj->info.uuid);
+      h *= 0x9e3779b1u;
+      sum += h ^ (h >> 15);
+   }
+   return sum;
+}
+
+static void gatt_tree_free(GattTree *tree)
+{
+   g_hash_table_destroy(tree->by_uuid);
+   g_hash_table_destroy(tree->by_handle);
+   arena_free(tree->arena);
+}
+
+/**
+ * @brief Builds the tree of dev from its GATT objects, which are sorted
+ *  by handle on the way.
+ */
+static GattTree *gatt_tree_build(const Device *dev, GPtrArray *objects, guint fingerprint)
+{
+   Arena *arena = arena_new(GATT_TREE_CHUNK);
+   GattTree *tree = arena_new0(arena, GattTree, 1);
+   GHashTable *chars_by_path = g_hash_table_new(g_str_hash, g_str_equal);
+
+   tree->arena = arena;
+   tree->address = dev->info.address.value;
+   tree->device_path = arena_strdup(arena, dev->obj_path);
+   tree->num_objects = objects->len;
+   tree->fingerprint = fingerprint;
+   tree->by_uuid = g_hash_table_new(gatt_uuid_hash, gatt_uuid_equal);
+   tree->by_handle = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+   g_ptr_array_sort(objects, gatt_object_cmp);
+   for (guint i = 0; i < objects->len; i++)
+   {
+      const SchemaInfo *info = &((const Device *)g_ptr_array_index(objects, i))->info;
+      tree->num_services += (info->ifaces & SCHEMA_GATT_SERVICE) != 0;
+      tree->num_chars += (info->ifaces & SCHEMA_GATT_CHR) != 0;
+      tree->num_descs += (info->ifaces & SCHEMA_GATT_DESC) != 0;
+   }
+   tree->services = arena_new0(arena, GattService, tree->num_services);
+   tree->chars = arena_new0(arena, GattChar, tree->num_chars);
+   tree->descs = arena_new0(arena, GattDesc, tree->num_descs);
+
+   //! Handle order puts every service before its characteristics and
+   //! every characteristic before its descriptors.
+   guint s = 0, c = 0, d = 0;
+   for (guint i = 0; i < objects->len; i++)
+   {
+      const Device *obj = g_ptr_array_index(objects, i);
+      const SchemaInfo *info = &obj->info;
+      GattUuid uuid = { 0, 0 };
+
+      if (info->uuid == NULL || !gatt_uuid_parse(info->uuid, &uuid))
+         continue;
+
+      if (info->ifaces & SCHEMA_GATT_SERVICE)
+      {
+         GattService *svc = &tree->services[s++];
+         svc->uuid = uuid;
+         svc->handle = gatt_object_handle(obj);
+         svc->primary = schema_flag(info, Primary);
+         svc->path = arena_strdup(arena, obj->obj_path);
+      }
+      else if (info->ifaces & SCHEMA_GATT_CHR)
+      {
+         GattChar *chr = &tree->chars[c++];
+         chr->uuid = uuid;
+         chr->handle = gatt_object_handle(obj);
+         chr->flags = info->gatt_flags;
+         chr->mtu = schema_has(info, MTU) ? info->mtu : 0;
+         chr->path = arena_strdup(arena, obj->obj_path);
+         for (guint j = s; j > 0 && info->service != NULL; j--)
+         {
+            if (g_str_equal(tree->services[j - 1].path, info->service))
+            {
+               chr->service = &tree->services[j - 1];
+               break;
+            }
+         }
+         if (!g_hash_table_contains(tree->by_uuid, &chr->uuid))
+            g_hash_table_insert(tree->by_uuid, &chr->uuid, chr);
+         g_hash_table_insert(tree->by_handle, GUINT_TO_POINTER(chr->handle), chr);
+         g_hash_table_insert(chars_by_path, (gpointer)chr->path, chr);
+      }
+      else if (info->ifaces & SCHEMA_GATT_DESC)
+      {
+         GattDesc *desc = &tree->descs[d++];
+         desc->uuid = uuid;
+         desc->handle = gatt_object_handle(obj);
+         desc->path = arena_strdup(arena, obj->obj_path);
+         if (info->characteristic != NULL)
+            desc->chr = g_hash_table_lookup(chars_by_path, info->characteristic);
+      }
+   }
+   // Objects without a usable UUID are left out.
+   tree->num_services = s;
+   tree->num_chars = c;
+   tree->num_descs = d;
+
+   g_hash_table_destroy(chars_by_path);
+   return tree;
+}
+
+/**
+ * @brief Finds a characteristic by UUID, the one with the lowest handle
+ *  if there are several.
+ */
+const GattChar *gatt_tree_find(const GattTree *tree, const GattUuid *uuid)
+{
+   return g_hash_table_lookup(tree->by_uuid, uuid);
+}
+
+const GattChar *gatt_tree_find_handle(const GattTree *tree, guint16 handle)
+{
+   return g_hash_table_lookup(tree->by_handle, GUINT_TO_POINTER(handle));
+}
+
+/**
+ * @brief Writes a tree as a "gatt" record, services holding their
+ *  characteristics holding their descriptors.
+ */
+void gatt_tree_print(const GattTree *tree)
+{
+   char uuid[GATT_UUID_STRLEN];
+
+   output_record_begin("gatt");
+   output_str("path", tree->device_path);
+   output_array_begin("services");
+   for (guint s = 0; s < tree->num_services; s++)
+   {
+      const GattService *svc = &tree->services[s];
+
+      output_object_begin(NULL);
+      output_str("uuid", gatt_uuid_format(&svc->uuid, uuid));
+      output_int("handle", svc->handle);
+      output_int("primary", svc->primary);
+      output_array_begin("characteristics");
+      for (guint c = 0; c < tree->num_chars; c++)
+      {
+         const GattChar *chr = &tree->chars[c];
+         if (chr->service != svc)
+            continue;
+
+         output_object_begin(NULL);
+         output_str("uuid", gatt_uuid_format(&chr->uuid, uuid));
+         output_int("handle", chr->handle);
+         output_int("flags", chr->flags);
+         output_array_begin("descriptors");
+         for (guint d = 0; d < tree->num_descs; d++)
+         {
+            if (tree->descs[d].chr == chr)
+               output_str(NULL, gatt_uuid_format(&tree->descs[d].uuid, uuid));
+         }
+         output_array_end();
+         output_object_end();
+      }
+      output_array_end();
+      output_object_end();
+   }
+   output_array_end();
+   output_record_end();
+}
+
+GattCache *gatt_cache_new()
+{
+   GattCache *cache = g_new0(GattCache, 1);
+   cache->trees = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)gatt_tree_free);
+   return cache;
+}
+
+/**
+ * @brief Builds trees for devices whose services are resolved and that
+ *  have none cached, or whose objects changed since. Devices whose GATT
+ *  objects are gone keep their tree.
+ *
+ * @returns Number of trees built.
+ */
+guint gatt_cache_update(GattCache *cache, const Device *devices, gsize num_devices)
+{
+   GHashTable *objects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+   guint built = 0;
+
+   //! GATT objects live below their device: .../dev_AA_BB_.../service001a/...
+   for (gsize i = 0; i < num_devices; i++)
+   {
+      const char *path = devices[i].obj_path;
+      const char *dev = strstr(path, "/dev_");
+      const char *end = dev ? strchr(dev + 1, '/') : NULL;
+      GPtrArray *list = NULL;
+      gchar *key = NULL;
+
+      if (!(devices[i].info.ifaces & SCHEMA_GATT) || end == NULL)
+         continue;
+      key = g_strndup(path, end - path);
+      if ((list = g_hash_table_lookup(objects, key)) == NULL)
+      {
+         list = g_ptr_array_new();
+         g_hash_table_insert(objects, key, list);
+      }
+      else
+      {
+         g_free(key);
+      }
+      g_ptr_array_add(list, (gpointer)&devices[i]);
+   }
+
+   for (gsize i = 0; i < num_devices; i++)
+   {
+      const Device *dev = &devices[i];
+      const SchemaInfo *info = &dev->info;
+      GPtrArray *list = NULL;
+      GattTree *tree = NULL;
+      guint fingerprint = 0;
+
+      if (!(info->ifaces & SCHEMA_DEVICE) || !schema_has(info, Address)
+          || (list = g_hash_table_lookup(objects, dev->obj_path)) == NULL)
+         continue;
+      // Still being discovered.
+      if (schema_flag(info, Connected) && !schema_flag(info, ServicesResolved))
+         continue;
+      tree = g_hash_table_lookup(cache->trees, &info->address.value);
+      fingerprint = gatt_objects_fingerprint(list);
+      if (tree != NULL && tree->num_objects == list->len && tree->fingerprint == fingerprint
+          && g_str_equal(tree->device_path, dev->obj_path))
+         continue;
+
+      tree = gatt_tree_build(dev, list, fingerprint);
+      g_hash_table_replace(cache->trees, &tree->address, tree);
+      built += 1;
+   }
+
+   g_hash_table_destroy(objects);
+   return built;
+}
+
+/**
+ * @brief Tree of a device by its address as SchemaAddress.value, NULL if
+ *  none was built yet.
+ */
+const GattTree *gatt_cache_get(GattCache *cache, guint64 address)
+{
+   return g_hash_table_lookup(cache->trees, &address);
+}
+
+void gatt_cache_free(GattCache *cache)
+{
+   if (cache == NULL)
+      return;
+   g_hash_table_destroy(cache->trees);
+   g_free(cache);
+}
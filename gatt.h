@@ -0,0 +1,122 @@
+/**
+* @file gatt.h
+* @brief GATT trees of devices, indexed by binary UUID and handle.
+*
+* A tree holds the services, characteristics and descriptors of one
+* device, built from the GattService1/GattCharacteristic1/GattDescriptor1
+* objects of the device array. UUIDs are kept as 128-bit integers, 16 and
+* 32-bit ones expanded with the Bluetooth base UUID. The cache keeps
+* trees by device address across disconnects, and only rebuilds one when
+* its set of objects changes.
+*/
+#ifndef GATT_H
+#define GATT_H
+#include <glib.h>
+
+#include "arena.h"
+#include "bluez.h"
+#include "schema.h"
+#include "output.h"
+
+#define GATT_UUID_STRLEN 37      /** 36 characters and the NUL. */
+#define GATT_TREE_CHUNK 4096
+
+/** @brief A 128-bit UUID, hi holds the first 8 bytes as written. */
+typedef struct _GattUuid
+{
+   guint64 hi;
+   guint64 lo;
+} GattUuid;
+
+typedef struct _GattService
+{
+   GattUuid uuid;
+   guint16 handle;
+   gboolean primary;
+   const char *path;
+} GattService;
+
+typedef struct _GattChar
+{
+   GattUuid uuid;
+   guint16 handle;
+   guint32 flags;                /** SchemaGattFlag bits. */
+   guint16 mtu;                  /** ATT MTU when bluez reports it, else 0. */
+   const char *path;
+   const GattService *service;
+} GattChar;
+
+typedef struct _GattDesc
+{
+   GattUuid uuid;
+   guint16 handle;
+   const char *path;
+   const GattChar *chr;
+} GattDesc;
+
+/** @brief Everything in handle order, stored in one arena. */
+typedef struct _GattTree
+{
+   guint64 address;
+   const char *device_path;
+   guint num_objects;            /** Objects it was built from. */
+   guint fingerprint;            /** Of their paths, handles and UUIDs. */
+   guint num_services;
+   GattService *services;
+   guint num_chars;
+   GattChar *chars;
+   guint num_descs;
+   GattDesc *descs;
+   GHashTable *by_uuid;          /** First characteristic of each UUID. */
+   GHashTable *by_handle;
+   Arena *arena;
+} GattTree;
+
+typedef struct _GattCache GattCache;
+
+/**
+ * @brief Parses "2a1c", "00002a1c" or a full 36 character UUID.
+ *
+ * @returns FALSE if str is none of these.
+ */
+gboolean gatt_uuid_parse(const char *str, GattUuid *uuid);
+
+/**
+ * @brief Writes the lower case 36 character form into out.
+ */
+char *gatt_uuid_format(const GattUuid *uuid, char out[GATT_UUID_STRLEN]);
+
+/**
+ * @brief Finds a characteristic by UUID, the one with the lowest handle
+ *  if there are several.
+ */
+const GattChar *gatt_tree_find(const GattTree *tree, const GattUuid *uuid);
+
+const GattChar *gatt_tree_find_handle(const GattTree *tree, guint16 handle);
+
+/**
+ * @brief Writes a tree as a "gatt" record, services holding their
+ *  characteristics holding their descriptors.
+ */
+void gatt_tree_print(const GattTree *tree);
+
+GattCache *gatt_cache_new();
+
+/**
+ * @brief Builds trees for devices whose services are resolved and that
+ *  have none cached, or whose objects changed since. Devices whose GATT
+ *  objects are gone keep their tree.
+ *
+ * @returns Number of trees built.
+ */
+guint gatt_cache_update(GattCache *cache, const Device *devices, gsize num_devices);
+
+/**
+ * @brief Tree of a device by its address as SchemaAddress.value, NULL if
+ *  none was built yet.
+ */
+const GattTree *gatt_cache_get(GattCache *cache, guint64 address);
+
+void gatt_cache_free(GattCache *cache);
+
+#endif // GATT_H
@@ -0,0 +1,310 @@
+/**
+* @file gattwrite.c
+* @brief Bulk writes to a GATT characteristic.
+*/
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib-unix.h>
+#include <gio/gunixfdlist.h>
+
+#include "gattwrite.h"
+
+struct _GattWrite
+{
+   GDBusConnection *conn;
+   gchar *path;
+   GBytes *data;
+   const guint8 *bytes;
+   gsize total;
+   gsize offset;        /** Handed to the socket, or sent as calls. */
+   gsize acked;         /** Calls answered, fallback only. */
+   guint payload;
+   guint window;
+   guint in_flight;
+   guint chunks;
+   gboolean command;    /** WriteValue without response. */
+   gboolean acquired;
+   int fd;
+   guint fd_source;
+   guint start_source;  /** Idle that sends the first WriteValue calls. */
+   gint64 started;
+   gint64 reported;
+   GCancellable *cancel;
+   GError *error;
+   GattWriteProgressFunc progress;
+   GattWriteDoneFunc done;
+   gpointer user_data;
+};
+
+static void gatt_write_free(GattWrite *write)
+{
+   g_cancellable_cancel(write->cancel);
+   g_object_unref(write->cancel);
+   if (write->fd_source)
+      g_source_remove(write->fd_source);
+   if (write->start_source)
+      g_source_remove(write->start_source);
+   if (write->fd >= 0)
+      close(write->fd);
+   g_clear_error(&write->error);
+   g_bytes_unref(write->data);
+   g_free(write->path);
+   g_free(write);
+}
+
+static void gatt_write_finish(GattWrite *write)
+{
+   GattWriteStats stats;
+
+   stats.bytes = write->acquired ? write->offset : write->acked;
+   stats.chunks = write->chunks;
+   stats.payload = write->payload;
+   stats.acquired = write->acquired;
+   stats.elapsed_us = g_get_monotonic_time() - write->started;
+   if (write->progress && write->error == NULL)
+      write->progress(stats.bytes, write->total, write->user_data);
+   write->done(&stats, write->error, write->user_data);
+   gatt_write_free(write);
+}
+
+static void gatt_write_report(GattWrite *write, gsize sent)
+{
+   gint64 now = g_get_monotonic_time();
+
+   if (write->progress && now - write->reported >= GATT_WRITE_PROGRESS_MS * 1000)
+   {
+      write->reported = now;
+      write->progress(sent, write->total, write->user_data);
+   }
+}
+
+//! Socket path.
+
+/**
+ * @brief Writes up to GATT_WRITE_BURST packets whenever the socket has
+ *  room, so a long transfer doesn't starve the rest of the loop.
+ */
+static gboolean gatt_write_fd_cb(gint fd, GIOCondition cond, gpointer arg)
+{
+   GattWrite *write = arg;
+
+   for (int n = 0; n < GATT_WRITE_BURST && write->offset < write->total; n++)
+   {
+      gsize len = MIN(write->payload, write->total - write->offset);
+      ssize_t ret = send(fd, write->bytes + write->offset, len, MSG_NOSIGNAL);
+
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret < 0 && errno == EAGAIN)
+         break;
+      if (ret < 0)
+      {
+         g_set_error(&write->error, G_IO_ERROR, g_io_error_from_errno(errno),
+                     "write to %s: %s", write->path, g_strerror(errno));
+         break;
+      }
+      write->offset += ret;
+      write->chunks += 1;
+   }
+
+   if (write->error == NULL && write->offset < write->total && !(cond & (G_IO_ERR | G_IO_HUP)))
+   {
+      gatt_write_report(write, write->offset);
+      return G_SOURCE_CONTINUE;
+   }
+   if (write->error == NULL && write->offset < write->total)
+      g_set_error(&write->error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE, "%s closed the socket", write->path);
+
+   write->fd_source = 0;
+   gatt_write_finish(write);
+   return G_SOURCE_REMOVE;
+}
+
+//! WriteValue path.
+
+static void gatt_write_pump(GattWrite *write);
+
+static void gatt_write_value_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+   // Cancelled means the write is already gone.
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   GattWrite *write = arg;
+   write->in_flight -= 1;
+   if (result == NULL)
+   {
+      // Nothing more is queued after the first failure.
+      if (write->error == NULL)
+         write->error = error;
+      else
+         g_error_free(error);
+   }
+   else
+   {
+      g_variant_unref(result);
+      write->acked = MIN(write->total, write->acked + write->payload);
+   }
+   gatt_write_pump(write);
+}
+
+/**
+ * @brief Keeps window WriteValue calls in flight. D-Bus delivers them in
+ *  order, so the peripheral sees the chunks in sequence.
+ */
+static void gatt_write_pump(GattWrite *write)
+{
+   while (write->error == NULL && write->in_flight < write->window && write->offset < write->total)
+   {
+      gsize len = MIN(write->payload, write->total - write->offset);
+      GVariantBuilder options;
+
+      g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add(&options, "{sv}", "type", g_variant_new_string(write->command ? "command" : "request"));
+      g_dbus_connection_call(write->conn,
+               BLUEZ_ORG,
+               write->path,
+               BLUEZ_GATT_CHR_IFACE,
+               "WriteValue",
+               g_variant_new("(@aya{sv})",
+                             g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, write->bytes + write->offset, len, 1),
+                             &options),
+               NULL,
+               G_DBUS_CALL_FLAGS_NONE,
+               -1,
+               write->cancel,
+               gatt_write_value_cb,
+               write);
+      write->offset += len;
+      write->chunks += 1;
+      write->in_flight += 1;
+   }
+
+   if (write->in_flight == 0)
+      gatt_write_finish(write);
+   else
+      gatt_write_report(write, write->acked);
+}
+
+static void gatt_write_acquired_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GUnixFDList *fds = NULL;
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_with_unix_fd_list_finish(G_DBUS_CONNECTION(source), &fds, res, &error);
+   gint32 index = 0;
+   guint16 mtu = 0;
+
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   GattWrite *write = arg;
+   if (result != NULL)
+   {
+      g_variant_get(result, "(hq)", &index, &mtu);
+      write->fd = g_unix_fd_list_get(fds, index, &error);
+      g_variant_unref(result);
+   }
+   g_clear_object(&fds);
+
+   //! NotSupported, NotPermitted or a busy socket: fall back to calls.
+   if (write->fd < 0 || !g_unix_set_fd_nonblocking(write->fd, TRUE, NULL))
+   {
+      g_clear_error(&error);
+      gatt_write_pump(write);
+      return;
+   }
+
+   write->acquired = TRUE;
+   write->payload = MAX(mtu, GATT_DEFAULT_MTU) - GATT_ATT_HEADER;
+   write->fd_source = g_unix_fd_add(write->fd, G_IO_OUT | G_IO_ERR | G_IO_HUP, gatt_write_fd_cb, write);
+}
+
+/**
+ * @brief Sends the first calls from the main loop, so done never runs
+ *  before gatt_write_start returned, even for empty data.
+ */
+static gboolean gatt_write_start_cb(gpointer arg)
+{
+   GattWrite *write = arg;
+
+   write->start_source = 0;
+   gatt_write_pump(write);
+   return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Starts writing data to a characteristic.
+ *
+ * @param conn Connection handle to dbus.
+ * @param chr The characteristic, its flags pick the path and its MTU
+ *  sizes the fallback chunks.
+ * @param data Bytes to write, referenced until the end.
+ * @param window WriteValue calls in flight, 0 for GATT_WRITE_WINDOW.
+ */
+GattWrite *gatt_write_start(GDBusConnection *conn, const GattChar *chr, GBytes *data, guint window,
+                            GattWriteProgressFunc progress, GattWriteDoneFunc done, gpointer user_data)
+{
+   GattWrite *write = g_new0(GattWrite, 1);
+   gsize total = 0;
+
+   write->conn = conn;
+   write->path = g_strdup(chr->path);
+   write->data = g_bytes_ref(data);
+   write->bytes = g_bytes_get_data(data, &total);
+   write->total = total;
+   write->window = window ? window : GATT_WRITE_WINDOW;
+   write->command = (chr->flags & SCHEMA_GATT_WRITE_WITHOUT_RESPONSE) != 0;
+   write->payload = MAX(chr->mtu, GATT_DEFAULT_MTU) - GATT_ATT_HEADER;
+   write->fd = -1;
+   write->cancel = g_cancellable_new();
+   write->progress = progress;
+   write->done = done;
+   write->user_data = user_data;
+   write->started = g_get_monotonic_time();
+   write->reported = write->started;
+
+   // Only characteristics that take writes without response hand out a
+   // write socket.
+   if (!write->command)
+   {
+      write->start_source = g_idle_add(gatt_write_start_cb, write);
+      return write;
+   }
+
+   GVariantBuilder options;
+   g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+   g_dbus_connection_call_with_unix_fd_list(conn,
+            BLUEZ_ORG,
+            write->path,
+            BLUEZ_GATT_CHR_IFACE,
+            "AcquireWrite",
+            g_variant_new("(a{sv})", &options),
+            G_VARIANT_TYPE("(hq)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            write->cancel,
+            gatt_write_acquired_cb,
+            write);
+   return write;
+}
+
+/**
+ * @brief Stops a write without calling its callbacks, and frees it.
+ */
+void gatt_write_cancel(GattWrite *write)
+{
+   if (write != NULL)
+      gatt_write_free(write);
+}
@@ -0,0 +1,66 @@
+/**
+* @file gattwrite.h
+* @brief Bulk writes to a GATT characteristic.
+*
+* The data goes over the socket AcquireWrite hands out, one
+* write-without-response per MTU-sized packet, straight from the buffer.
+* When the characteristic doesn't support that, the chunks go as
+* WriteValue calls with a window of them in flight.
+*/
+#ifndef GATTWRITE_H
+#define GATTWRITE_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "bluez.h"
+#include "gatt.h"
+
+#define GATT_WRITE_WINDOW 16        /** WriteValue calls in flight. */
+#define GATT_WRITE_BURST 64         /** Socket packets per main loop wakeup. */
+#define GATT_WRITE_PROGRESS_MS 250
+#define GATT_ATT_HEADER 3           /** Opcode and handle, out of every MTU. */
+#define GATT_DEFAULT_MTU 23
+
+/** @brief How a write went. */
+typedef struct _GattWriteStats
+{
+   gsize bytes;         /** Written, or acknowledged on the fallback. */
+   guint chunks;
+   guint payload;       /** Bytes per chunk. */
+   gboolean acquired;   /** Went over the AcquireWrite socket. */
+   gint64 elapsed_us;
+} GattWriteStats;
+
+typedef struct _GattWrite GattWrite;
+
+/**
+ * @brief Reports progress at most every GATT_WRITE_PROGRESS_MS.
+ */
+typedef void (*GattWriteProgressFunc)(gsize sent, gsize total, gpointer user_data);
+
+/**
+ * @brief Called once when the write ends, always from the main loop and
+ *  never from within gatt_write_start. The write is freed right after.
+ *
+ * @param error NULL on success.
+ */
+typedef void (*GattWriteDoneFunc)(const GattWriteStats *stats, const GError *error, gpointer user_data);
+
+/**
+ * @brief Starts writing data to a characteristic.
+ *
+ * @param conn Connection handle to dbus.
+ * @param chr The characteristic, its flags pick the path and its MTU
+ *  sizes the fallback chunks.
+ * @param data Bytes to write, referenced until the end.
+ * @param window WriteValue calls in flight, 0 for GATT_WRITE_WINDOW.
+ */
+GattWrite *gatt_write_start(GDBusConnection *conn, const GattChar *chr, GBytes *data, guint window,
+                            GattWriteProgressFunc progress, GattWriteDoneFunc done, gpointer user_data);
+
+/**
+ * @brief Stops a write without calling its callbacks, and frees it.
+ */
+void gatt_write_cancel(GattWrite *write);
+
+#endif // GATTWRITE_H
@@ -0,0 +1,348 @@
+/**
+* @file history.c
+* @brief Compressed RSSI history of every device, in fixed memory.
+*/
+#include <string.h>
+
+#include "history.h"
+
+/** Worst case sample: 4 bit prefix, 32 bit delta of delta, 2 + 8 bit RSSI. */
+#define HISTORY_SAMPLE_BITS 46
+
+struct _History
+{
+   GHashTable *series;           /** Address to HistorySeries, keys inside. */
+   GQueue lru;                   /** Least recently heard first. */
+   guint max_devices;
+};
+
+/** @brief Reads or writes the bits of a block, most significant first. */
+typedef struct _HistoryBits
+{
+   guint8 *data;
+   guint pos;
+} HistoryBits;
+
+static void history_put(HistoryBits *bits, guint64 value, guint n)
+{
+   for (guint i = n; i > 0; i--, bits->pos++)
+   {
+      guint8 mask = 0x80 >> (bits->pos & 7);
+      if ((value >> (i - 1)) & 1)
+         bits->data[bits->pos >> 3] |= mask;
+      else
+         bits->data[bits->pos >> 3] &= ~mask;
+   }
+}
+
+static guint64 history_get(HistoryBits *bits, guint n)
+{
+   guint64 value = 0;
+
+   for (guint i = 0; i < n; i++, bits->pos++)
+      value = (value << 1) | ((bits->data[bits->pos >> 3] >> (7 - (bits->pos & 7))) & 1);
+   return value;
+}
+
+/**
+ * @brief Reads n bits as a two's complement number.
+ */
+static gint64 history_get_signed(HistoryBits *bits, guint n)
+{
+   guint64 value = history_get(bits, n);
+   return (value & (G_GUINT64_CONSTANT(1) << (n - 1))) ? (gint64)(value | (~G_GUINT64_CONSTANT(0) << n)) : (gint64)value;
+}
+
+//! Codes. Delta of delta: 0 | 10 +4 | 110 +7 | 1110 +12 | 1111 +32.
+//! RSSI delta: 0 | 10 +3 | 11 and the raw byte.
+
+static void history_put_dod(HistoryBits *bits, gint64 dod)
+{
+   if (dod == 0)
+      history_put(bits, 0, 1);
+   else if (dod >= -8 && dod < 8)
+   {
+      history_put(bits, 0x2, 2);
+      history_put(bits, dod & 0xf, 4);
+   }
+   else if (dod >= -64 && dod < 64)
+   {
+      history_put(bits, 0x6, 3);
+      history_put(bits, dod & 0x7f, 7);
+   }
+   else if (dod >= -2048 && dod < 2048)
+   {
+      history_put(bits, 0xe, 4);
+      history_put(bits, dod & 0xfff, 12);
+   }
+   else
+   {
+      history_put(bits, 0xf, 4);
+      history_put(bits, dod & 0xffffffff, 32);
+   }
+}
+
+static gint64 history_get_dod(HistoryBits *bits)
+{
+   static const guint widths[] = { 4, 7, 12, 32 };
+   guint ones = 0;
+
+   while (ones < 4 && history_get(bits, 1))
+      ones += 1;
+   return ones == 0 ? 0 : history_get_signed(bits, widths[ones - 1]);
+}
+
+static void history_put_rssi(HistoryBits *bits, gint delta, gint8 rssi)
+{
+   if (delta == 0)
+      history_put(bits, 0, 1);
+   else if (delta >= -4 && delta < 4)
+   {
+      history_put(bits, 0x2, 2);
+      history_put(bits, delta & 0x7, 3);
+   }
+   else
+   {
+      history_put(bits, 0x3, 2);
+      history_put(bits, (guint8)rssi, 8);
+   }
+}
+
+static gint8 history_get_rssi(HistoryBits *bits, gint8 prev)
+{
+   if (!history_get(bits, 1))
+      return prev;
+   if (!history_get(bits, 1))
+      return prev + history_get_signed(bits, 3);
+   return (gint8)history_get(bits, 8);
+}
+
+/**
+ * @brief Starts a fresh block with the sample, giving up the oldest one
+ *  when the ring is full.
+ */
+static void history_block_begin(HistorySeries *series, gint64 ticks, gint8 rssi)
+{
+   HistoryBlock *block = NULL;
+
+   if (series->used == HISTORY_BLOCKS)
+   {
+      series->oldest = (series->oldest + 1) % HISTORY_BLOCKS;
+      series->used -= 1;
+   }
+   block = &series->blocks[(series->oldest + series->used) % HISTORY_BLOCKS];
+   series->used += 1;
+   block->start = ticks;
+   block->end = ticks;
+   block->count = 1;
+   block->bits = 0;
+   block->first_rssi = rssi;
+   series->gap = 0;
+}
+
+/**
+ * @brief The key of a device: its MAC address, or the dev_AA_BB_...
+ *  part of its object path, packed into 48 bits like SchemaAddress.value.
+ */
+guint64 history_key(const char *str)
+{
+   const char *dev = g_strrstr(str, "dev_");
+   guint64 value = 0;
+
+   for (const char *p = dev ? dev + 4 : str; *p && *p != '/'; p++)
+   {
+      if (g_ascii_isxdigit(*p))
+         value = (value << 4) | g_ascii_xdigit_value(*p);
+   }
+   return value;
+}
+
+/**
+ * @param max_devices Devices kept, 0 for HISTORY_MAX_DEVICES.
+ */
+History *history_new(guint max_devices)
+{
+   History *history = g_new0(History, 1);
+
+   history->series = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+   history->max_devices = max_devices ? max_devices : HISTORY_MAX_DEVICES;
+   g_queue_init(&history->lru);
+   return history;
+}
+
+static HistorySeries *history_series(History *history, guint64 address)
+{
+   HistorySeries *series = g_hash_table_lookup(history->series, &address);
+
+   if (series != NULL)
+   {
+      g_queue_unlink(&history->lru, &series->link);
+      g_queue_push_tail_link(&history->lru, &series->link);
+      return series;
+   }
+
+   //! Random addresses come and go, the longest silent device makes room.
+   if (g_hash_table_size(history->series) >= history->max_devices)
+   {
+      GList *old = g_queue_pop_head_link(&history->lru);
+      g_hash_table_remove(history->series, &((HistorySeries *)old->data)->address);
+   }
+   series = g_new0(HistorySeries, 1);
+   series->address = address;
+   series->link.data = series;
+   g_hash_table_insert(history->series, &series->address, series);
+   g_queue_push_tail_link(&history->lru, &series->link);
+   return series;
+}
+
+/**
+ * @brief Appends a sample.
+ *
+ * @param time Milliseconds since the epoch.
+ * @returns FALSE if the sample is older than the newest one kept.
+ */
+gboolean history_add(History *history, guint64 address, gint64 time, gint rssi)
+{
+   HistorySeries *series = history_series(history, address);
+   gint64 ticks = time / HISTORY_TICK_MS;
+   gint8 value = CLAMP(rssi, G_MININT8, G_MAXINT8);
+   HistoryBlock *block = NULL;
+   HistoryBits bits;
+
+   if (series->used == 0)
+   {
+      history_block_begin(series, ticks, value);
+   }
+   else if (ticks < series->last)
+   {
+      return FALSE;
+   }
+   else
+   {
+      block = &series->blocks[(series->oldest + series->used - 1) % HISTORY_BLOCKS];
+      // Gaps past 32 bits of ticks, or a full block, start over.
+      if (block->bits + HISTORY_SAMPLE_BITS > HISTORY_BLOCK_BYTES * 8 || block->count == G_MAXUINT16
+          || ticks - series->last > G_MAXINT32)
+      {
+         history_block_begin(series, ticks, value);
+      }
+      else
+      {
+         bits.data = block->data;
+         bits.pos = block->bits;
+         history_put_dod(&bits, (ticks - series->last) - series->gap);
+         history_put_rssi(&bits, value - series->rssi, value);
+         block->bits = bits.pos;
+         block->count += 1;
+         block->end = ticks;
+         series->gap = ticks - series->last;
+      }
+   }
+   series->last = ticks;
+   series->rssi = value;
+   return TRUE;
+}
+
+/**
+ * @brief Decodes the samples of a device from from to to, milliseconds
+ *  since the epoch, both included.
+ *
+ * @returns Number of samples handed to func.
+ */
+guint history_range(History *history, guint64 address, gint64 from, gint64 to,
+                    HistorySampleFunc func, gpointer user_data)
+{
+   HistorySeries *series = g_hash_table_lookup(history->series, &address);
+   guint count = 0;
+
+   for (guint b = 0; series != NULL && b < series->used; b++)
+   {
+      HistoryBlock *block = &series->blocks[(series->oldest + b) % HISTORY_BLOCKS];
+      HistoryBits bits = { block->data, 0 };
+      gint64 ticks = block->start;
+      gint64 gap = 0;
+      gint8 rssi = block->first_rssi;
+
+      //! Blocks are in time order, so whole ones are skipped by their ends.
+      if (block->end * HISTORY_TICK_MS < from)
+         continue;
+      if (block->start * HISTORY_TICK_MS > to)
+         break;
+
+      for (guint i = 0; i < block->count; i++)
+      {
+         if (i > 0)
+         {
+            gap += history_get_dod(&bits);
+            ticks += gap;
+            rssi = history_get_rssi(&bits, rssi);
+         }
+         if (ticks * HISTORY_TICK_MS > to)
+            break;
+         if (ticks * HISTORY_TICK_MS >= from)
+         {
+            func(ticks * HISTORY_TICK_MS, rssi, user_data);
+            count += 1;
+         }
+      }
+   }
+   return count;
+}
+
+typedef struct _HistoryAggregate
+{
+   gint64 from;
+   gint64 step;
+   HistoryBucket *buckets;
+   guint num;
+} HistoryAggregate;
+
+static void history_aggregate_cb(gint64 time, gint rssi, gpointer arg)
+{
+   HistoryAggregate *agg = arg;
+   HistoryBucket *bucket = &agg->buckets[MIN((time - agg->from) / agg->step, agg->num - 1)];
+
+   bucket->min = bucket->count ? MIN(bucket->min, rssi) : rssi;
+   bucket->max = bucket->count ? MAX(bucket->max, rssi) : rssi;
+   bucket->sum += rssi;
+   bucket->count += 1;
+}
+
+/**
+ * @brief Downsamples a range into num buckets of step milliseconds each,
+ *  the first starting at from.
+ *
+ * @returns Number of samples in the buckets.
+ */
+guint history_aggregate(History *history, guint64 address, gint64 from, gint64 step,
+                        HistoryBucket *buckets, guint num)
+{
+   HistoryAggregate agg = { from, MAX(step, 1), buckets, num };
+
+   if (num == 0)
+      return 0;
+   for (guint i = 0; i < num; i++)
+      buckets[i] = (HistoryBucket){ .start = from + i * agg.step };
+   return history_range(history, address, from, from + num * agg.step - 1, history_aggregate_cb, &agg);
+}
+
+guint history_num_devices(History *history)
+{
+   return g_hash_table_size(history->series);
+}
+
+/**
+ * @brief Bytes the series take, headers included.
+ */
+gsize history_memory(History *history)
+{
+   return g_hash_table_size(history->series) * sizeof(HistorySeries);
+}
+
+void history_free(History *history)
+{
+   if (history == NULL)
+      return;
+   g_hash_table_destroy(history->series);
+   g_free(history);
+}
@@ -0,0 +1,118 @@
+/**
+* @file history.h
+* @brief Compressed RSSI history of every device, in fixed memory.
+*
+* Each device owns a ring of HISTORY_BLOCKS blocks. A block starts with
+* its first sample in full, every later one is bit packed: the timestamp
+* as the change of the gap since the sample before (delta of delta, in
+* HISTORY_TICK_MS ticks), so a steady advert rate costs a bit, and RSSI
+* as a short delta or a raw byte. A full ring gives up its oldest block.
+* Devices beyond the device limit push out the one heard from longest
+* ago, so the store never grows past max_devices * sizeof(HistorySeries).
+*/
+#ifndef HISTORY_H
+#define HISTORY_H
+#include <glib.h>
+
+#define HISTORY_TICK_MS 100        /** Timestamp resolution. */
+#define HISTORY_BLOCK_BYTES 104    /** Packed samples per block, 128 with its header. */
+#define HISTORY_RATE_HZ 1          /** RSSI updates per second the ring is sized for. */
+#define HISTORY_WINDOW_S 3600      /** Seconds kept at that rate. */
+#define HISTORY_SAMPLE_AVG_BITS 8  /** Jittery adverts average 6 to 10 bits a sample. */
+/** Blocks per device, 35 or about 4.4 KB for an hour at 1 Hz. Faster
+ *  devices keep proportionally less. */
+#define HISTORY_BLOCKS ((HISTORY_RATE_HZ * HISTORY_WINDOW_S * HISTORY_SAMPLE_AVG_BITS \
+                         + HISTORY_BLOCK_BYTES * 8 - 1) / (HISTORY_BLOCK_BYTES * 8))
+#define HISTORY_MAX_DEVICES 1024
+
+/** @brief One block of samples, first one in the clear. */
+typedef struct _HistoryBlock
+{
+   gint64 start;                 /** Ticks of the first sample. */
+   gint64 end;                   /** Ticks of the last. */
+   guint16 count;
+   guint16 bits;                 /** Used in data. */
+   gint8 first_rssi;
+   guint8 data[HISTORY_BLOCK_BYTES];
+} HistoryBlock;
+
+/** @brief Everything kept about one device. */
+typedef struct _HistorySeries
+{
+   guint64 address;
+   gint64 last;                  /** Ticks of the newest sample. */
+   gint64 gap;                   /** Ticks between the two newest. */
+   gint8 rssi;                   /** Of the newest sample. */
+   guint8 oldest;                /** Ring index of the oldest block. */
+   guint8 used;                  /** Blocks holding samples. */
+   GList link;                   /** In the store's LRU, data is the series. */
+   HistoryBlock blocks[HISTORY_BLOCKS];
+} HistorySeries;
+
+/** @brief Samples of one step of a downsampled range. */
+typedef struct _HistoryBucket
+{
+   gint64 start;                 /** Milliseconds since the epoch. */
+   guint count;
+   gint min;
+   gint max;
+   gint sum;
+} HistoryBucket;
+
+typedef struct _History History;
+
+/**
+ * @brief Called for each sample of a range, oldest first.
+ *
+ * @param time Milliseconds since the epoch, to HISTORY_TICK_MS.
+ */
+typedef void (*HistorySampleFunc)(gint64 time, gint rssi, gpointer user_data);
+
+/** Funcs **/
+/**
+ * @param max_devices Devices kept, 0 for HISTORY_MAX_DEVICES.
+ */
+History *history_new(guint max_devices);
+
+/**
+ * @brief The key of a device: its MAC address, or the dev_AA_BB_...
+ *  part of its object path, packed into 48 bits like SchemaAddress.value.
+ */
+guint64 history_key(const char *str);
+
+/**
+ * @brief Appends a sample.
+ *
+ * @param time Milliseconds since the epoch.
+ * @returns FALSE if the sample is older than the newest one kept.
+ */
+gboolean history_add(History *history, guint64 address, gint64 time, gint rssi);
+
+/**
+ * @brief Decodes the samples of a device from from to to, milliseconds
+ *  since the epoch, both included.
+ *
+ * @returns Number of samples handed to func.
+ */
+guint history_range(History *history, guint64 address, gint64 from, gint64 to,
+                    HistorySampleFunc func, gpointer user_data);
+
+/**
+ * @brief Downsamples a range into num buckets of step milliseconds each,
+ *  the first starting at from.
+ *
+ * @returns Number of samples in the buckets.
+ */
+guint history_aggregate(History *history, guint64 address, gint64 from, gint64 step,
+                        HistoryBucket *buckets, guint num);
+
+guint history_num_devices(History *history);
+
+/**
+ * @brief Bytes the series take, headers included.
+ */
+gsize history_memory(History *history);
+
+void history_free(History *history);
+
+#endif // HISTORY_H
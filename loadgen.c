@@ -0,0 +1,369 @@
+/**
+* @file loadgen.c
+* @brief Synthetic bluez signal load over a private bus, with lag and
+*  drop measurement.
+*/
+#include "loadgen.h"
+#include "bluez.h"
+
+/** @brief A load sweep in progress. */
+struct _LoadGen
+{
+   guint devices;
+   guint seconds;
+   guint rates[LOADGEN_MAX_RATES];
+   guint num_rates;
+   GDBusSignalCallback handler;
+   LoadGenDoneFunc done;
+   gpointer user_data;
+
+   GDBusServer *server;
+   GCancellable *cancel;          /** Cancels the client connect on teardown. */
+   GDBusConnection *server_conn;  /** Generator side, used from the thread. */
+   GDBusConnection *client;       /** Receiving side, dispatched on the main loop. */
+   guint sub;
+
+   GThread *thread;
+   gint stop;
+   guint run;                     /** Index into rates of the current run. */
+   guint64 received;
+   GArray *lags;                  /** gint64 microseconds, one per received signal. */
+   LoadGenResult results[LOADGEN_MAX_RATES];
+};
+
+static GVariant *loadgen_device_props(LoadGen *gen, guint dev, guint64 seq, gboolean added)
+{
+   GVariantBuilder props;
+   GVariantBuilder mfr;
+   guint8 beacon[23] = { 0x02, 0x15 };
+   gchar address[18];
+
+   //! An iBeacon payload keeps the advert decoder in the measured path.
+   memset(beacon + 2, 0xa5, 16);
+   beacon[18] = dev >> 8;
+   beacon[19] = dev & 0xff;
+   beacon[20] = (seq >> 8) & 0xff;
+   beacon[21] = seq & 0xff;
+   beacon[22] = (guint8)-59;
+
+   g_variant_builder_init(&mfr, G_VARIANT_TYPE("a{qv}"));
+   g_variant_builder_add(&mfr, "{qv}", COMPANY_APPLE,
+                         g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, beacon, sizeof(beacon), 1));
+
+   g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+   if (added)
+   {
+      g_snprintf(address, sizeof(address), "00:00:00:%02X:%02X:%02X",
+                 (dev >> 16) & 0xff, (dev >> 8) & 0xff, dev & 0xff);
+      g_variant_builder_add(&props, "{sv}", "Address", g_variant_new_string(address));
+      g_variant_builder_add(&props, "{sv}", "Name", g_variant_new_printf("load-%u", dev));
+   }
+   g_variant_builder_add(&props, "{sv}", "RSSI", g_variant_new_int16(-40 - (gint16)(seq % 50)));
+   g_variant_builder_add(&props, "{sv}", "ManufacturerData", g_variant_builder_end(&mfr));
+   g_variant_builder_add(&props, "{sv}", "LoadSeq", g_variant_new_uint64(seq));
+   g_variant_builder_add(&props, "{sv}", "LoadSent", g_variant_new_int64(g_get_monotonic_time()));
+   return g_variant_builder_end(&props);
+}
+
+/**
+ * @brief Emits event seq: first one InterfacesAdded per device, then
+ *  PropertiesChanged round robin.
+ */
+static void loadgen_emit(LoadGen *gen, guint64 seq)
+{
+   guint dev = seq % gen->devices;
+   gchar *path = g_strdup_printf("%s/dev_00_00_00_%02X_%02X_%02X", BLUEZ_ADAPTER_OBJECT,
+                                 (dev >> 16) & 0xff, (dev >> 8) & 0xff, dev & 0xff);
+
+   if (seq < gen->devices)
+   {
+      GVariantBuilder ifaces;
+      g_variant_builder_init(&ifaces, G_VARIANT_TYPE("a{sa{sv}}"));
+      g_variant_builder_add(&ifaces, "{s@a{sv}}", BLUEZ_DEVICE_IFACE,
+                            loadgen_device_props(gen, dev, seq, TRUE));
+      g_dbus_connection_emit_signal(gen->server_conn, NULL, "/", FREE_OBJECT_MANAGER,
+                                    "InterfacesAdded",
+                                    g_variant_new("(oa{sa{sv}})", path, &ifaces),
+                                    NULL);
+   }
+   else
+   {
+      g_dbus_connection_emit_signal(gen->server_conn, NULL, path, FREE_PROPERTIES,
+                                    "PropertiesChanged",
+                                    g_variant_new("(s@a{sv}as)", BLUEZ_DEVICE_IFACE,
+                                                  loadgen_device_props(gen, dev, seq, FALSE),
+                                                  NULL),
+                                    NULL);
+   }
+   g_free(path);
+}
+
+static gpointer loadgen_thread(gpointer arg)
+{
+   LoadGen *gen = arg;
+   guint rate = gen->rates[gen->run];
+   guint64 total = (guint64)rate * gen->seconds;
+   gint64 start = g_get_monotonic_time();
+   guint64 sent = 0;
+
+   for (; sent < total && !g_atomic_int_get(&gen->stop); sent++)
+   {
+      // Paced against the start, so oversleeping is caught up in a burst.
+      gint64 due = start + (gint64)(sent * G_USEC_PER_SEC / rate);
+      gint64 now = g_get_monotonic_time();
+      if (due > now)
+         g_usleep(due - now);
+      loadgen_emit(gen, sent);
+   }
+
+   //! Delivered in order after every signal above, so it closes the run.
+   g_dbus_connection_emit_signal(gen->server_conn, NULL, "/", LOADGEN_IFACE, "Done",
+                                 g_variant_new("(tx)", sent, g_get_monotonic_time() - start),
+                                 NULL);
+   g_dbus_connection_flush_sync(gen->server_conn, NULL, NULL);
+   return NULL;
+}
+
+static void loadgen_start_run(LoadGen *gen)
+{
+   gen->received = 0;
+   g_array_set_size(gen->lags, 0);
+   gen->thread = g_thread_new("loadgen", loadgen_thread, gen);
+}
+
+static gint loadgen_compare(gconstpointer a, gconstpointer b)
+{
+   gint64 x = *(const gint64 *)a;
+   gint64 y = *(const gint64 *)b;
+   return (x > y) - (x < y);
+}
+
+static gint64 loadgen_percentile(GArray *sorted, guint p)
+{
+   if (sorted->len == 0)
+      return 0;
+   return g_array_index(sorted, gint64, MIN(sorted->len - 1, (guint64)sorted->len * p / 100));
+}
+
+static void loadgen_finish_run(LoadGen *gen, GVariant *parameters)
+{
+   LoadGenResult *result = &gen->results[gen->run];
+   guint64 sent = 0;
+   gint64 elapsed = 0;
+
+   g_thread_join(gen->thread);
+   gen->thread = NULL;
+   g_variant_get(parameters, "(tx)", &sent, &elapsed);
+   g_array_sort(gen->lags, loadgen_compare);
+
+   result->rate = gen->rates[gen->run];
+   result->achieved = sent * 1e6 / MAX(elapsed, 1);
+   result->sent = sent;
+   result->received = gen->received;
+   result->missed = sent > gen->received ? sent - gen->received : 0;
+   result->p50_us = loadgen_percentile(gen->lags, 50);
+   result->p90_us = loadgen_percentile(gen->lags, 90);
+   result->p99_us = loadgen_percentile(gen->lags, 99);
+   result->max_us = loadgen_percentile(gen->lags, 100);
+
+   gen->run += 1;
+   if (gen->run < gen->num_rates && !g_atomic_int_get(&gen->stop))
+      loadgen_start_run(gen);
+   else
+      gen->done(gen, gen->user_data);
+}
+
+static void loadgen_signal_cb(GDBusConnection *conn,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   LoadGen *gen = user_data;
+   GVariant *props = NULL;
+   gint64 sent = 0;
+
+   if (g_str_equal(interface, LOADGEN_IFACE))
+   {
+      loadgen_finish_run(gen, parameters);
+      return;
+   }
+
+   //! Peer connections have no bus names, present it as bluez.
+   gen->handler(conn, BLUEZ_ORG, object_path, interface, signal_name, parameters, gen->user_data);
+
+   if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      GVariant *ifaces = g_variant_get_child_value(parameters, 1);
+      props = g_variant_lookup_value(ifaces, BLUEZ_DEVICE_IFACE, G_VARIANT_TYPE_VARDICT);
+      g_variant_unref(ifaces);
+   }
+   else if (g_str_equal(signal_name, "PropertiesChanged"))
+      props = g_variant_get_child_value(parameters, 1);
+   if (props == NULL)
+      return;
+
+   if (g_variant_lookup(props, "LoadSent", "x", &sent))
+   {
+      gint64 lag = g_get_monotonic_time() - sent;
+      g_array_append_val(gen->lags, lag);
+      gen->received += 1;
+   }
+   g_variant_unref(props);
+}
+
+static void loadgen_maybe_start(LoadGen *gen)
+{
+   if (gen->server_conn == NULL || gen->client == NULL)
+      return;
+
+   gen->sub = g_dbus_connection_signal_subscribe(gen->client,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		loadgen_signal_cb,
+		gen,
+		NULL);
+   loadgen_start_run(gen);
+}
+
+static gboolean loadgen_new_connection_cb(GDBusServer *server, GDBusConnection *conn, gpointer arg)
+{
+   LoadGen *gen = arg;
+
+   if (gen->server_conn != NULL)
+      return FALSE;
+   gen->server_conn = g_object_ref(conn);
+   loadgen_maybe_start(gen);
+   return TRUE;
+}
+
+static void loadgen_client_ready_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   LoadGen *gen = arg;
+   GError *error = NULL;
+
+   GDBusConnection *client = g_dbus_connection_new_for_address_finish(res, &error);
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+   dbus_check_error(error);
+
+   gen->client = client;
+   loadgen_maybe_start(gen);
+}
+
+/**
+ * @brief Starts a private bus and sweeps the given rates, one run each.
+ *
+ * @param devices Simulated device population.
+ * @param seconds Length of each run.
+ * @param rates Events per second of each run.
+ * @param num_rates Size of rates, at most LOADGEN_MAX_RATES.
+ * @param handler Receives every generated signal, as if bluez sent it.
+ * @param done Called after the last run.
+ * @param user_data Passed to handler and done.
+ * @param error Set if the private bus couldn't be started.
+ *
+ * @returns The sweep, free with loadgen_free(), or NULL.
+ */
+LoadGen *loadgen_new(guint devices, guint seconds, const guint *rates, guint num_rates,
+                     GDBusSignalCallback handler, LoadGenDoneFunc done, gpointer user_data,
+                     GError **error)
+{
+   gchar *guid = g_dbus_generate_guid();
+   GDBusServer *server = g_dbus_server_new_sync("unix:tmpdir=/tmp",
+            G_DBUS_SERVER_FLAGS_NONE,
+            guid,
+            NULL,
+            NULL,
+            error);
+   g_free(guid);
+   if (server == NULL)
+      return NULL;
+
+   LoadGen *gen = g_new0(LoadGen, 1);
+   gen->devices = MAX(devices, 1);
+   gen->seconds = MAX(seconds, 1);
+   gen->num_rates = MIN(num_rates, LOADGEN_MAX_RATES);
+   for (guint i = 0; i < gen->num_rates; i++)
+      gen->rates[i] = MAX(rates[i], 1);
+   gen->handler = handler;
+   gen->done = done;
+   gen->user_data = user_data;
+   gen->lags = g_array_new(FALSE, FALSE, sizeof(gint64));
+   gen->server = server;
+   gen->cancel = g_cancellable_new();
+
+   g_signal_connect(server, "new-connection", G_CALLBACK(loadgen_new_connection_cb), gen);
+   g_dbus_server_start(server);
+   g_dbus_connection_new_for_address(g_dbus_server_get_client_address(server),
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+            NULL,
+            gen->cancel,
+            loadgen_client_ready_cb,
+            gen);
+   return gen;
+}
+
+/**
+ * @brief Results of every finished run.
+ *
+ * @param num_results Set to the number of runs.
+ */
+const LoadGenResult *loadgen_results(const LoadGen *gen, guint *num_results)
+{
+   *num_results = gen->run;
+   return gen->results;
+}
+
+/**
+ * @brief Prints one line per run: rate, lag percentiles and misses.
+ */
+void loadgen_print_results(const LoadGen *gen)
+{
+   g_print("%8s %10s %8s %8s %8s %9s %9s %9s %9s\n",
+           "rate/s", "achieved/s", "sent", "recv", "missed", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+   for (guint i = 0; i < gen->run; i++)
+   {
+      const LoadGenResult *r = &gen->results[i];
+      g_print("%8u %10.0f %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+              " %9.3f %9.3f %9.3f %9.3f\n",
+              r->rate, r->achieved, r->sent, r->received, r->missed,
+              r->p50_us / 1e3, r->p90_us / 1e3, r->p99_us / 1e3, r->max_us / 1e3);
+   }
+}
+
+/**
+ * @brief Stops the generator and tears down the private bus.
+ */
+void loadgen_free(LoadGen *gen)
+{
+   if (gen == NULL)
+      return;
+   g_atomic_int_set(&gen->stop, 1);
+   g_cancellable_cancel(gen->cancel);
+   if (gen->thread)
+      g_thread_join(gen->thread);
+   if (gen->sub)
+      g_dbus_connection_signal_unsubscribe(gen->client, gen->sub);
+   if (gen->client)
+      g_dbus_connection_close_sync(gen->client, NULL, NULL);
+   if (gen->server_conn)
+      g_dbus_connection_close_sync(gen->server_conn, NULL, NULL);
+   g_clear_object(&gen->client);
+   g_clear_object(&gen->server_conn);
+   g_object_unref(gen->cancel);
+   g_signal_handlers_disconnect_by_data(gen->server, gen);
+   g_dbus_server_stop(gen->server);
+   g_object_unref(gen->server);
+   g_array_free(gen->lags, TRUE);
+   g_free(gen);
+}
@@ -0,0 +1,75 @@
+/**
+* @file loadgen.h
+* @brief Synthetic bluez signal load over a private bus, with lag and
+*  drop measurement.
+*
+* A generator thread emits InterfacesAdded for each simulated device, then
+* PropertiesChanged round robin, at a fixed rate onto a peer to peer
+* connection. Every signal carries LoadSeq and LoadSent (monotonic send
+* time). The client side runs the handlers of the app from the main loop
+* and measures how long after sending each one was fully processed.
+*/
+#ifndef LOADGEN_H
+#define LOADGEN_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#define LOADGEN_IFACE "org.tuxdrop.LoadGen"
+#define LOADGEN_MAX_RATES 16
+
+/** @brief A load sweep in progress, see loadgen_new(). */
+typedef struct _LoadGen LoadGen;
+
+/** @brief Results of one rate of the sweep. */
+typedef struct _LoadGenResult
+{
+   guint rate;            /** Requested events per second. */
+   gdouble achieved;      /** Events per second actually sent. */
+   guint64 sent;
+   guint64 received;
+   guint64 missed;        /** Sent but never seen before the run ended. */
+   gint64 p50_us;
+   gint64 p90_us;
+   gint64 p99_us;
+   gint64 max_us;
+} LoadGenResult;
+
+/** @brief Called once every rate has run. */
+typedef void (*LoadGenDoneFunc)(LoadGen *gen, gpointer user_data);
+
+/**
+ * @brief Starts a private bus and sweeps the given rates, one run each.
+ *
+ * @param devices Simulated device population.
+ * @param seconds Length of each run.
+ * @param rates Events per second of each run.
+ * @param num_rates Size of rates, at most LOADGEN_MAX_RATES.
+ * @param handler Receives every generated signal, as if bluez sent it.
+ * @param done Called after the last run.
+ * @param user_data Passed to handler and done.
+ * @param error Set if the private bus couldn't be started.
+ *
+ * @returns The sweep, free with loadgen_free(), or NULL.
+ */
+LoadGen *loadgen_new(guint devices, guint seconds, const guint *rates, guint num_rates,
+                     GDBusSignalCallback handler, LoadGenDoneFunc done, gpointer user_data,
+                     GError **error);
+
+/**
+ * @brief Results of every finished run.
+ *
+ * @param num_results Set to the number of runs.
+ */
+const LoadGenResult *loadgen_results(const LoadGen *gen, guint *num_results);
+
+/**
+ * @brief Prints one line per run: rate, lag percentiles and misses.
+ */
+void loadgen_print_results(const LoadGen *gen);
+
+/**
+ * @brief Stops the generator and tears down the private bus.
+ */
+void loadgen_free(LoadGen *gen);
+
+#endif // LOADGEN_H
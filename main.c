@@ -3,10 +3,15 @@
 //! MAIN START
 int main(int argc, char **argv)
 {
-   app_init();
    #if CLI
-   app_main(argc, argv);
+   //! Options are parsed first, they decide whether the bus is needed.
+   if (app_main(argc, argv) != 0)
+      return 0;
+   app_init();
+   app_run();
    #else
+   app_init();
+   app_main();
    app_run();
    #endif
    app_quit();
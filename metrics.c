@@ -0,0 +1,432 @@
+/**
+* @file metrics.c
+* @brief Counters and gauges exported in the Prometheus text format.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gunixsocketaddress.h>
+
+#include "metrics.h"
+#include "bluez.h"
+
+/** @brief Upper bounds of the call latency buckets, in microseconds. */
+static const gint64 metrics_buckets[] =
+{
+   1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+#define METRICS_BUCKETS G_N_ELEMENTS(metrics_buckets)
+
+/** @brief Names and help lines, in MetricCounter order. */
+static const char *metrics_counter_info[METRIC_COUNTERS][2] =
+{
+   { "adverts", "Device1 updates carrying RSSI, manufacturer or service data." },
+   { "signals", "D-Bus signals received." },
+   { "dbus_calls", "D-Bus method calls sent." },
+   { "dbus_errors", "D-Bus method calls answered with an error." },
+   { "connect_attempts", "Device1.Connect calls." },
+   { "connect_successes", "Device1.Connect calls that succeeded." },
+};
+
+/** @brief Names and help lines, in MetricGauge order. */
+static const char *metrics_gauge_info[METRIC_GAUGES][2] =
+{
+   { "devices", "Devices in the latest snapshot." },
+   { "cache_bytes", "Arena bytes backing the latest snapshot." },
+};
+
+/** @brief The counters of one thread. Only that thread writes them. */
+typedef struct _MetricsShard
+{
+   guint64 counters[METRIC_COUNTERS];
+   guint64 buckets[METRICS_BUCKETS + 1];  /** Last one is +Inf. */
+   guint64 latency_us;
+} MetricsShard;
+
+/** @brief A method call waiting for its reply. */
+typedef struct _MetricsCall
+{
+   gint64 sent;
+   gboolean connect;
+} MetricsCall;
+
+/** @brief A scrape being answered. */
+typedef struct _MetricsClient
+{
+   GSocketConnection *conn;
+   gchar request[METRICS_REQUEST_MAX];
+   gchar *reply;
+} MetricsClient;
+
+static void metrics_shard_release(gpointer arg);
+
+static GPrivate metrics_shard_key = G_PRIVATE_INIT(metrics_shard_release);
+static GMutex metrics_lock;
+static GSList *metrics_shards = NULL;   /** Shards of live threads, under metrics_lock. */
+static MetricsShard metrics_retired;     /** Left by exited threads, under metrics_lock. */
+static gint64 metrics_gauges[METRIC_GAUGES];
+static GHashTable *metrics_pending = NULL;  /** Serial -> MetricsCall, GDBus worker only. */
+static GSocketService *metrics_service = NULL;
+static gchar *metrics_socket = NULL;
+static gchar *metrics_file = NULL;
+static guint metrics_source = 0;
+
+static void metrics_shard_fold(MetricsShard *into, const MetricsShard *shard)
+{
+   for (int i = 0; i < METRIC_COUNTERS; i++)
+      into->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+   for (int i = 0; i <= METRICS_BUCKETS; i++)
+      into->buckets[i] += __atomic_load_n(&shard->buckets[i], __ATOMIC_RELAXED);
+   into->latency_us += __atomic_load_n(&shard->latency_us, __ATOMIC_RELAXED);
+}
+
+static void metrics_shard_release(gpointer arg)
+{
+   MetricsShard *shard = arg;
+
+   // The thread is exiting, keep its counts.
+   g_mutex_lock(&metrics_lock);
+   metrics_shard_fold(&metrics_retired, shard);
+   metrics_shards = g_slist_remove(metrics_shards, shard);
+   g_mutex_unlock(&metrics_lock);
+   g_free(shard);
+}
+
+static MetricsShard *metrics_shard()
+{
+   MetricsShard *shard = g_private_get(&metrics_shard_key);
+
+   //! Only the first use on a thread locks.
+   if (shard == NULL)
+   {
+      shard = g_new0(MetricsShard, 1);
+      g_mutex_lock(&metrics_lock);
+      metrics_shards = g_slist_prepend(metrics_shards, shard);
+      g_mutex_unlock(&metrics_lock);
+      g_private_set(&metrics_shard_key, shard);
+   }
+   return shard;
+}
+
+/** @brief Bumps a counter owned by the calling thread, readers may load it any time. */
+static inline void metrics_bump(guint64 *counter, guint64 n)
+{
+   __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds n to a counter of the calling thread. Lock free.
+ */
+void metrics_add(MetricCounter counter, guint64 n)
+{
+   metrics_bump(&metrics_shard()->counters[counter], n);
+}
+
+/**
+ * @brief Records the duration of one D-Bus call in the latency histogram.
+ */
+void metrics_observe_call(gint64 usecs)
+{
+   MetricsShard *shard = metrics_shard();
+   guint bucket = 0;
+
+   while (bucket < METRICS_BUCKETS && usecs > metrics_buckets[bucket])
+      bucket++;
+   metrics_bump(&shard->buckets[bucket], 1);
+   metrics_bump(&shard->latency_us, MAX(usecs, 0));
+}
+
+/**
+ * @brief Sets a gauge. Lock free.
+ */
+void metrics_set(MetricGauge gauge, gint64 value)
+{
+   __atomic_store_n(&metrics_gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Appends every metric in the Prometheus text format to out.
+ */
+void metrics_render(GString *out)
+{
+   MetricsShard total;
+   guint64 cumulative = 0;
+
+   g_mutex_lock(&metrics_lock);
+   total = metrics_retired;
+   for (GSList *l = metrics_shards; l != NULL; l = l->next)
+      metrics_shard_fold(&total, l->data);
+   g_mutex_unlock(&metrics_lock);
+
+   for (int i = 0; i < METRIC_COUNTERS; i++)
+   {
+      const char *name = metrics_counter_info[i][0];
+      g_string_append_printf(out, "# HELP " METRICS_PREFIX "%s_total %s\n", name, metrics_counter_info[i][1]);
+      g_string_append_printf(out, "# TYPE " METRICS_PREFIX "%s_total counter\n", name);
+      g_string_append_printf(out, METRICS_PREFIX "%s_total %" G_GUINT64_FORMAT "\n", name, total.counters[i]);
+   }
+   for (int i = 0; i < METRIC_GAUGES; i++)
+   {
+      const char *name = metrics_gauge_info[i][0];
+      g_string_append_printf(out, "# HELP " METRICS_PREFIX "%s %s\n", name, metrics_gauge_info[i][1]);
+      g_string_append_printf(out, "# TYPE " METRICS_PREFIX "%s gauge\n", name);
+      g_string_append_printf(out, METRICS_PREFIX "%s %" G_GINT64_FORMAT "\n", name,
+                             (gint64)__atomic_load_n(&metrics_gauges[i], __ATOMIC_RELAXED));
+   }
+
+   //! Buckets are kept apart and only made cumulative here.
+   g_string_append(out, "# HELP " METRICS_PREFIX "dbus_call_seconds Time from sending a method call to its reply.\n");
+   g_string_append(out, "# TYPE " METRICS_PREFIX "dbus_call_seconds histogram\n");
+   for (int i = 0; i < METRICS_BUCKETS; i++)
+   {
+      cumulative += total.buckets[i];
+      g_string_append_printf(out, METRICS_PREFIX "dbus_call_seconds_bucket{le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                             metrics_buckets[i] / (gdouble)G_USEC_PER_SEC, cumulative);
+   }
+   cumulative += total.buckets[METRICS_BUCKETS];
+   g_string_append_printf(out, METRICS_PREFIX "dbus_call_seconds_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT "\n", cumulative);
+   g_string_append_printf(out, METRICS_PREFIX "dbus_call_seconds_sum %.6f\n", total.latency_us / (gdouble)G_USEC_PER_SEC);
+   g_string_append_printf(out, METRICS_PREFIX "dbus_call_seconds_count %" G_GUINT64_FORMAT "\n", cumulative);
+}
+
+/**
+ * @brief Tells whether a bluez signal reports an advertisement: a new
+ *  device, or a Device1 change carrying RSSI or payload data.
+ */
+static gboolean metrics_is_advert(GDBusMessage *message)
+{
+   const gchar *member = g_dbus_message_get_member(message);
+   GVariant *body = g_dbus_message_get_body(message);
+   GVariant *dict = NULL;
+   GVariant *val = NULL;
+   gboolean advert = FALSE;
+
+   if (body == NULL || member == NULL)
+      return FALSE;
+
+   if (!strcmp(member, "PropertiesChanged") && g_variant_is_of_type(body, G_VARIANT_TYPE("(sa{sv}as)")))
+   {
+      const gchar *iface = NULL;
+      g_variant_get_child(body, 0, "&s", &iface);
+      if (strcmp(iface, BLUEZ_DEVICE_IFACE))
+         return FALSE;
+
+      dict = g_variant_get_child_value(body, 1);
+      const char *keys[] = { "RSSI", "ManufacturerData", "ServiceData" };
+      for (int i = 0; i < G_N_ELEMENTS(keys) && !advert; i++)
+      {
+         val = g_variant_lookup_value(dict, keys[i], NULL);
+         advert = (val != NULL);
+         g_clear_pointer(&val, g_variant_unref);
+      }
+      g_variant_unref(dict);
+   }
+   else if (!strcmp(member, "InterfacesAdded") && g_variant_is_of_type(body, G_VARIANT_TYPE("(oa{sa{sv}})")))
+   {
+      dict = g_variant_get_child_value(body, 1);
+      val = g_variant_lookup_value(dict, BLUEZ_DEVICE_IFACE, NULL);
+      advert = (val != NULL);
+      g_clear_pointer(&val, g_variant_unref);
+      g_variant_unref(dict);
+   }
+   return advert;
+}
+
+static GDBusMessage *metrics_filter(GDBusConnection *conn, GDBusMessage *message,
+                                    gboolean incoming, gpointer user_data)
+{
+   GDBusMessageType type = g_dbus_message_get_message_type(message);
+   MetricsCall *call = NULL;
+
+   //! Runs on the GDBus worker for both directions, the pending table is its own.
+   if (!incoming)
+   {
+      if (type != G_DBUS_MESSAGE_TYPE_METHOD_CALL)
+         return message;
+      metrics_add(METRIC_DBUS_CALLS, 1);
+      if (g_dbus_message_get_flags(message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED)
+         return message;
+
+      call = g_new(MetricsCall, 1);
+      call->sent = g_get_monotonic_time();
+      call->connect = !g_strcmp0(g_dbus_message_get_interface(message), BLUEZ_DEVICE_IFACE)
+                      && !g_strcmp0(g_dbus_message_get_member(message), "Connect");
+      if (call->connect)
+         metrics_add(METRIC_CONNECT_ATTEMPTS, 1);
+      g_hash_table_insert(metrics_pending, GUINT_TO_POINTER(g_dbus_message_get_serial(message)), call);
+      return message;
+   }
+
+   switch (type)
+   {
+      case G_DBUS_MESSAGE_TYPE_SIGNAL:
+         metrics_add(METRIC_SIGNALS, 1);
+         if (metrics_is_advert(message))
+            metrics_add(METRIC_ADVERTS, 1);
+         break;
+      case G_DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      case G_DBUS_MESSAGE_TYPE_ERROR:
+         call = g_hash_table_lookup(metrics_pending, GUINT_TO_POINTER(g_dbus_message_get_reply_serial(message)));
+         if (call == NULL)
+            break;
+         metrics_observe_call(g_get_monotonic_time() - call->sent);
+         if (type == G_DBUS_MESSAGE_TYPE_ERROR)
+            metrics_add(METRIC_DBUS_ERRORS, 1);
+         else if (call->connect)
+            metrics_add(METRIC_CONNECT_SUCCESSES, 1);
+         g_hash_table_remove(metrics_pending, GUINT_TO_POINTER(g_dbus_message_get_reply_serial(message)));
+         break;
+      default:
+         break;
+   }
+   return message;
+}
+
+/**
+ * @brief Counts calls, errors, latency, signals, adverts and connects
+ *  on conn from now on.
+ */
+void metrics_watch(GDBusConnection *conn)
+{
+   // Filters may still run after removal, so the table stays for good.
+   if (metrics_pending == NULL)
+      metrics_pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+   g_dbus_connection_add_filter(conn, metrics_filter, NULL, NULL);
+}
+
+static void metrics_client_free(MetricsClient *client)
+{
+   g_object_unref(client->conn);
+   g_free(client->reply);
+   g_free(client);
+}
+
+static void metrics_written_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   MetricsClient *client = arg;
+
+   g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), res, NULL, NULL);
+   g_io_stream_close(G_IO_STREAM(client->conn), NULL, NULL);
+   metrics_client_free(client);
+}
+
+static void metrics_request_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   MetricsClient *client = arg;
+   GString *body = g_string_new(NULL);
+
+   // Whatever was asked for, the answer is the metrics page.
+   g_input_stream_read_finish(G_INPUT_STREAM(source), res, NULL);
+   metrics_render(body);
+   client->reply = g_strdup_printf("HTTP/1.0 200 OK\r\n"
+                                   "Content-Type: text/plain; version=0.0.4\r\n"
+                                   "Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n%s",
+                                   body->len, body->str);
+   g_string_free(body, TRUE);
+
+   g_output_stream_write_all_async(g_io_stream_get_output_stream(G_IO_STREAM(client->conn)),
+                                   client->reply, strlen(client->reply), G_PRIORITY_DEFAULT,
+                                   NULL, metrics_written_cb, client);
+}
+
+static gboolean metrics_incoming_cb(GSocketService *service, GSocketConnection *conn,
+                                    GObject *source, gpointer user_data)
+{
+   MetricsClient *client = g_new0(MetricsClient, 1);
+
+   client->conn = g_object_ref(conn);
+   g_input_stream_read_async(g_io_stream_get_input_stream(G_IO_STREAM(conn)),
+                             client->request, sizeof(client->request), G_PRIORITY_DEFAULT,
+                             NULL, metrics_request_cb, client);
+   return TRUE;
+}
+
+static gboolean metrics_write_file(gpointer arg)
+{
+   GError *error = NULL;
+   GString *out = g_string_new(NULL);
+
+   // Written aside and renamed over, a collector never reads half a file.
+   metrics_render(out);
+   if (!g_file_set_contents(metrics_file, out->str, out->len, &error))
+   {
+      fprintf(stderr, "tuxdrop: %s\n", error->message);
+      g_error_free(error);
+   }
+   g_string_free(out, TRUE);
+   return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Starts exporting.
+ *
+ * @param spec "unix:/path" serves every connection to the socket with a
+ *  minimal HTTP response, "file:/path[@seconds]" rewrites the file every
+ *  METRICS_INTERVAL or given seconds, node exporter textfile style.
+ *
+ * @returns FALSE with error set if the spec is bad or the socket or file
+ *  can't be created.
+ */
+gboolean metrics_serve(const char *spec, GError **error)
+{
+   metrics_stop();
+
+   if (g_str_has_prefix(spec, "unix:") && spec[5] != '\0')
+   {
+      GSocketAddress *address = NULL;
+      gboolean ok = FALSE;
+
+      metrics_socket = g_strdup(spec + 5);
+      unlink(metrics_socket);
+      address = g_unix_socket_address_new(metrics_socket);
+      metrics_service = g_socket_service_new();
+      ok = g_socket_listener_add_address(G_SOCKET_LISTENER(metrics_service), address,
+                                         G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL, NULL, error);
+      g_object_unref(address);
+      if (!ok)
+      {
+         metrics_stop();
+         return FALSE;
+      }
+      g_signal_connect(metrics_service, "incoming", G_CALLBACK(metrics_incoming_cb), NULL);
+      g_socket_service_start(metrics_service);
+      return TRUE;
+   }
+
+   if (g_str_has_prefix(spec, "file:") && spec[5] != '\0' && spec[5] != '@')
+   {
+      const char *at = strrchr(spec, '@');
+      guint interval = at ? atoi(at + 1) : METRICS_INTERVAL;
+
+      metrics_file = at ? g_strndup(spec + 5, at - spec - 5) : g_strdup(spec + 5);
+      metrics_write_file(NULL);
+      metrics_source = g_timeout_add_seconds(MAX(interval, 1), metrics_write_file, NULL);
+      return TRUE;
+   }
+
+   g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+               "metrics go to unix:/path or file:/path[@seconds], not '%s'", spec);
+   return FALSE;
+}
+
+/**
+ * @brief Stops exporting and removes the socket.
+ */
+void metrics_stop()
+{
+   if (metrics_service != NULL)
+   {
+      g_socket_service_stop(metrics_service);
+      g_socket_listener_close(G_SOCKET_LISTENER(metrics_service));
+      g_clear_object(&metrics_service);
+   }
+   if (metrics_socket != NULL)
+      unlink(metrics_socket);
+   if (metrics_source)
+      g_source_remove(metrics_source);
+   metrics_source = 0;
+   g_clear_pointer(&metrics_socket, g_free);
+   g_clear_pointer(&metrics_file, g_free);
+}
@@ -0,0 +1,83 @@
+/**
+* @file metrics.h
+* @brief Counters and gauges exported in the Prometheus text format.
+*
+* Counters are kept per thread, a thread only ever writes its own copy
+* and never takes a lock to do it. Exporting sums the copies of every
+* thread alive plus whatever threads that exited left behind. D-Bus
+* traffic is counted by a filter on the connection, which runs on the
+* GDBus worker thread, off the main loop.
+*/
+#ifndef METRICS_H
+#define METRICS_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#define METRICS_PREFIX "tuxdrop_"
+#define METRICS_INTERVAL 15  /** Seconds between textfile writes by default. */
+#define METRICS_REQUEST_MAX 1024
+
+/** @brief Monotonic counters, exported with a _total suffix. */
+typedef enum
+{
+   METRIC_ADVERTS,            /** Device1 updates carrying RSSI or payloads. */
+   METRIC_SIGNALS,            /** Signals received from the bus. */
+   METRIC_DBUS_CALLS,         /** Method calls sent. */
+   METRIC_DBUS_ERRORS,        /** Method calls answered with an error. */
+   METRIC_CONNECT_ATTEMPTS,   /** Device1.Connect calls. */
+   METRIC_CONNECT_SUCCESSES,  /** Device1.Connect calls that succeeded. */
+   METRIC_COUNTERS
+} MetricCounter;
+
+/** @brief Values that go up and down, set by their owner. */
+typedef enum
+{
+   METRIC_DEVICES,            /** Devices in the latest snapshot. */
+   METRIC_CACHE_BYTES,        /** Arena bytes backing that snapshot. */
+   METRIC_GAUGES
+} MetricGauge;
+
+/**
+ * @brief Adds n to a counter of the calling thread. Lock free.
+ */
+void metrics_add(MetricCounter counter, guint64 n);
+
+/**
+ * @brief Records the duration of one D-Bus call in the latency histogram.
+ */
+void metrics_observe_call(gint64 usecs);
+
+/**
+ * @brief Sets a gauge. Lock free.
+ */
+void metrics_set(MetricGauge gauge, gint64 value);
+
+/**
+ * @brief Appends every metric in the Prometheus text format to out.
+ */
+void metrics_render(GString *out);
+
+/**
+ * @brief Counts calls, errors, latency, signals, adverts and connects
+ *  on conn from now on.
+ */
+void metrics_watch(GDBusConnection *conn);
+
+/**
+ * @brief Starts exporting.
+ *
+ * @param spec "unix:/path" serves every connection to the socket with a
+ *  minimal HTTP response, "file:/path[@seconds]" rewrites the file every
+ *  METRICS_INTERVAL or given seconds, node exporter textfile style.
+ *
+ * @returns FALSE with error set if the spec is bad or the socket or file
+ *  can't be created.
+ */
+gboolean metrics_serve(const char *spec, GError **error);
+
+/**
+ * @brief Stops exporting and removes the socket.
+ */
+void metrics_stop();
+
+#endif // METRICS_H
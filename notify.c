@@ -0,0 +1,278 @@
+/**
+* @file notify.c
+* @brief GATT notification streams read from AcquireNotify sockets.
+*/
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <glib-unix.h>
+#include <gio/gunixfdlist.h>
+
+#include "notify.h"
+
+struct _NotifyHub
+{
+   GDBusConnection *conn;
+   GPtrArray *streams;           /** NotifyStream, by index. */
+   int epfd;
+   guint source;
+   GCancellable *cancel;
+   NotifySample *ring;
+   guint mask;                   /** Capacity - 1. */
+   guint64 head;                 /** Next sample written. */
+   guint64 tail;                 /** Next sample drained. */
+   guint64 dropped;
+};
+
+static void notify_stream_close(NotifyStream *stream, const char *error)
+{
+   if (stream->fd >= 0)
+   {
+      epoll_ctl(stream->hub->epfd, EPOLL_CTL_DEL, stream->fd, NULL);
+      close(stream->fd);
+      stream->fd = -1;
+   }
+   if (error != NULL && stream->error == NULL)
+      stream->error = g_strdup(error);
+   stream->state = NOTIFY_CLOSED;
+}
+
+static void notify_stream_free(NotifyStream *stream)
+{
+   notify_stream_close(stream, NULL);
+   g_free(stream->error);
+   g_free(stream->path);
+   g_free(stream);
+}
+
+/**
+ * @brief Reads what a socket has into the ring. Each recv is one
+ *  notification, straight into its slot, MSG_TRUNC returning its full
+ *  length when it doesn't fit.
+ */
+static void notify_stream_read(NotifyStream *stream)
+{
+   NotifyHub *hub = stream->hub;
+
+   for (int n = 0; n < NOTIFY_READS; n++)
+   {
+      NotifySample *sample = &hub->ring[hub->head & hub->mask];
+      ssize_t len = recv(stream->fd, sample->data, NOTIFY_SAMPLE_MAX, MSG_TRUNC | MSG_DONTWAIT);
+
+      if (len < 0 && errno == EINTR)
+         continue;
+      if (len < 0 && errno == EAGAIN)
+         return;
+      if (len <= 0)
+      {
+         notify_stream_close(stream, len == 0 ? "hung up" : g_strerror(errno));
+         return;
+      }
+
+      sample->time = g_get_monotonic_time();
+      sample->stream = stream->index;
+      sample->len = MIN(len, NOTIFY_SAMPLE_MAX);
+      stream->samples += 1;
+      stream->bytes += len;
+      stream->truncated += len > NOTIFY_SAMPLE_MAX;
+
+      //! A full ring gives up its oldest sample.
+      hub->head += 1;
+      if (hub->head - hub->tail > hub->mask + 1)
+      {
+         hub->tail += 1;
+         hub->dropped += 1;
+      }
+   }
+}
+
+/**
+ * @brief The epoll fd is readable: serves every socket that is. Epoll is
+ *  level triggered, sockets with notifications left over wake it again.
+ */
+static gboolean notify_hub_epoll_cb(gint fd, GIOCondition cond, gpointer arg)
+{
+   NotifyHub *hub = arg;
+   struct epoll_event events[NOTIFY_EVENTS];
+   int count = epoll_wait(fd, events, NOTIFY_EVENTS, 0);
+
+   for (int i = 0; i < count; i++)
+   {
+      NotifyStream *stream = g_ptr_array_index(hub->streams, events[i].data.u32);
+
+      if (stream->fd < 0)
+         continue;
+      if (events[i].events & EPOLLIN)
+         notify_stream_read(stream);
+      if (stream->fd >= 0 && (events[i].events & (EPOLLHUP | EPOLLERR)))
+         notify_stream_close(stream, "hung up");
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+static void notify_hub_acquired_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GUnixFDList *fds = NULL;
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_with_unix_fd_list_finish(G_DBUS_CONNECTION(source), &fds, res, &error);
+   struct epoll_event event = { .events = EPOLLIN };
+   gint32 handle = 0;
+   guint16 mtu = 0;
+
+   // Cancelled means the hub is already gone.
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   NotifyStream *stream = arg;
+   NotifyHub *hub = stream->hub;
+   if (result != NULL)
+   {
+      g_variant_get(result, "(hq)", &handle, &mtu);
+      stream->fd = g_unix_fd_list_get(fds, handle, &error);
+      stream->mtu = mtu;
+      g_variant_unref(result);
+   }
+   g_clear_object(&fds);
+
+   event.data.u32 = stream->index;
+   if (stream->fd >= 0 && epoll_ctl(hub->epfd, EPOLL_CTL_ADD, stream->fd, &event) < 0)
+   {
+      notify_stream_close(stream, g_strerror(errno));
+   }
+   else if (stream->fd < 0)
+   {
+      notify_stream_close(stream, error ? error->message : "no socket");
+   }
+   else
+   {
+      stream->state = NOTIFY_STREAMING;
+   }
+   g_clear_error(&error);
+}
+
+/**
+ * @brief Creates an empty hub and its epoll set.
+ *
+ * @param conn Connection handle to dbus.
+ * @param capacity Samples kept, 0 for NOTIFY_RING_SIZE.
+ * @returns NULL if epoll isn't available.
+ */
+NotifyHub *notify_hub_new(GDBusConnection *conn, guint capacity)
+{
+   int epfd = epoll_create1(EPOLL_CLOEXEC);
+   NotifyHub *hub = NULL;
+   guint size = 1;
+
+   if (epfd < 0)
+      return NULL;
+   while (size < (capacity ? capacity : NOTIFY_RING_SIZE) && size < G_MAXUINT / 2 + 1)
+      size <<= 1;
+
+   hub = g_new0(NotifyHub, 1);
+   hub->conn = conn;
+   hub->streams = g_ptr_array_new_with_free_func((GDestroyNotify)notify_stream_free);
+   hub->epfd = epfd;
+   hub->cancel = g_cancellable_new();
+   hub->ring = g_new(NotifySample, size);
+   hub->mask = size - 1;
+   hub->source = g_unix_fd_add(epfd, G_IO_IN, notify_hub_epoll_cb, hub);
+   return hub;
+}
+
+/**
+ * @brief Asks for the notification socket of a characteristic.
+ *
+ * @returns Index of the stream, also found in its samples.
+ */
+guint notify_hub_add(NotifyHub *hub, const GattChar *chr)
+{
+   NotifyStream *stream = g_new0(NotifyStream, 1);
+   GVariantBuilder options;
+
+   stream->index = hub->streams->len;
+   stream->path = g_strdup(chr->path);
+   stream->fd = -1;
+   stream->hub = hub;
+   g_ptr_array_add(hub->streams, stream);
+
+   // Indications need a confirmation bluez only sends for StartNotify.
+   if (!(chr->flags & SCHEMA_GATT_NOTIFY))
+   {
+      notify_stream_close(stream, "does not notify");
+      return stream->index;
+   }
+
+   stream->state = NOTIFY_ACQUIRING;
+   g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+   g_dbus_connection_call_with_unix_fd_list(hub->conn,
+            BLUEZ_ORG,
+            chr->path,
+            BLUEZ_GATT_CHR_IFACE,
+            "AcquireNotify",
+            g_variant_new("(a{sv})", &options),
+            G_VARIANT_TYPE("(hq)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            hub->cancel,
+            notify_hub_acquired_cb,
+            stream);
+   return stream->index;
+}
+
+guint notify_hub_num_streams(NotifyHub *hub)
+{
+   return hub->streams->len;
+}
+
+const NotifyStream *notify_hub_stream(NotifyHub *hub, guint index)
+{
+   return index < hub->streams->len ? g_ptr_array_index(hub->streams, index) : NULL;
+}
+
+/**
+ * @brief Hands the samples in the ring to func, oldest first, and empties
+ *  it.
+ *
+ * @returns Number of samples drained.
+ */
+guint notify_hub_drain(NotifyHub *hub, NotifySampleFunc func, gpointer user_data)
+{
+   guint count = 0;
+
+   for (; hub->tail < hub->head; hub->tail++, count++)
+   {
+      const NotifySample *sample = &hub->ring[hub->tail & hub->mask];
+      func(sample, g_ptr_array_index(hub->streams, sample->stream), user_data);
+   }
+   return count;
+}
+
+/**
+ * @brief Samples overwritten before they were drained, since the start.
+ */
+guint64 notify_hub_dropped(NotifyHub *hub)
+{
+   return hub->dropped;
+}
+
+/**
+ * @brief Closes every socket and frees the hub.
+ */
+void notify_hub_free(NotifyHub *hub)
+{
+   if (hub == NULL)
+      return;
+   g_cancellable_cancel(hub->cancel);
+   g_object_unref(hub->cancel);
+   g_source_remove(hub->source);
+   g_ptr_array_free(hub->streams, TRUE);
+   close(hub->epfd);
+   g_free(hub->ring);
+   g_free(hub);
+}
@@ -0,0 +1,102 @@
+/**
+* @file notify.h
+* @brief GATT notification streams read from AcquireNotify sockets.
+*
+* Every characteristic gets its own socket from AcquireNotify, so
+* notifications never touch D-Bus. All sockets sit in one epoll set, and
+* the main loop watches the epoll fd alone however many devices stream.
+* Each notification lands, timestamped, straight in a ring of fixed-size
+* samples that the consumer drains at its own pace. When the consumer
+* falls behind, the oldest samples are overwritten and counted.
+*/
+#ifndef NOTIFY_H
+#define NOTIFY_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "bluez.h"
+#include "gatt.h"
+
+#define NOTIFY_RING_SIZE 16384   /** Default samples kept, rounded up to a power of two. */
+#define NOTIFY_SAMPLE_MAX 52     /** Bytes kept per notification, a sample is 64. */
+#define NOTIFY_EVENTS 64         /** Sockets handled per epoll_wait. */
+#define NOTIFY_READS 256         /** Notifications read per socket per wakeup. */
+
+typedef struct _NotifyHub NotifyHub;
+
+/** @brief One notification. */
+typedef struct _NotifySample
+{
+   gint64 time;                  /** Monotonic microseconds when read. */
+   guint16 stream;               /** Index returned by notify_hub_add. */
+   guint16 len;                  /** Bytes in data, see NotifyStream.truncated. */
+   guint8 data[NOTIFY_SAMPLE_MAX];
+} NotifySample;
+
+typedef enum
+{
+   NOTIFY_ACQUIRING,
+   NOTIFY_STREAMING,
+   NOTIFY_CLOSED,                /** Failed or hung up, see error. */
+} NotifyState;
+
+/** @brief A characteristic being streamed. */
+typedef struct _NotifyStream
+{
+   guint index;
+   gchar *path;
+   NotifyState state;
+   gchar *error;
+   int fd;
+   guint16 mtu;
+   guint64 samples;              /** Read since the start. */
+   guint64 bytes;
+   guint64 truncated;            /** Longer than NOTIFY_SAMPLE_MAX. */
+   NotifyHub *hub;
+} NotifyStream;
+
+/**
+ * @brief Called for each drained sample, oldest first.
+ */
+typedef void (*NotifySampleFunc)(const NotifySample *sample, const NotifyStream *stream, gpointer user_data);
+
+/** Funcs **/
+/**
+ * @brief Creates an empty hub and its epoll set.
+ *
+ * @param conn Connection handle to dbus.
+ * @param capacity Samples kept, 0 for NOTIFY_RING_SIZE.
+ * @returns NULL if epoll isn't available.
+ */
+NotifyHub *notify_hub_new(GDBusConnection *conn, guint capacity);
+
+/**
+ * @brief Asks for the notification socket of a characteristic.
+ *
+ * @returns Index of the stream, also found in its samples.
+ */
+guint notify_hub_add(NotifyHub *hub, const GattChar *chr);
+
+guint notify_hub_num_streams(NotifyHub *hub);
+
+const NotifyStream *notify_hub_stream(NotifyHub *hub, guint index);
+
+/**
+ * @brief Hands the samples in the ring to func, oldest first, and empties
+ *  it.
+ *
+ * @returns Number of samples drained.
+ */
+guint notify_hub_drain(NotifyHub *hub, NotifySampleFunc func, gpointer user_data);
+
+/**
+ * @brief Samples overwritten before they were drained, since the start.
+ */
+guint64 notify_hub_dropped(NotifyHub *hub);
+
+/**
+ * @brief Closes every socket and frees the hub.
+ */
+void notify_hub_free(NotifyHub *hub);
+
+#endif // NOTIFY_H
@@ -0,0 +1,635 @@
+/**
+* @file obex.c
+* @brief OBEX Object Push through obexd, both ways.
+*/
+#include <string.h>
+
+#include "obex.h"
+
+static const char obex_agent_xml[] =
+   "<node>"
+   "  <interface name='" OBEX_AGENT_IFACE "'>"
+   "    <method name='Release'/>"
+   "    <method name='AuthorizePush'>"
+   "      <arg type='o' name='transfer' direction='in'/>"
+   "      <arg type='s' name='filename' direction='out'/>"
+   "    </method>"
+   "    <method name='Cancel'/>"
+   "  </interface>"
+   "</node>";
+
+typedef struct _ObexSession ObexSession;
+
+/** @brief A transfer and where it belongs. */
+typedef struct _ObexItem
+{
+   ObexTransfer transfer;        /** First, items are handed out as transfers. */
+   Obex *obex;
+   ObexSession *session;         /** NULL for incoming pushes. */
+   GDBusMethodInvocation *push;  /** AuthorizePush waiting for the file name. */
+} ObexItem;
+
+/** @brief All files for one destination, sent on one session. */
+struct _ObexSession
+{
+   Obex *obex;
+   gchar *address;
+   gchar *path;                  /** NULL until CreateSession returns. */
+   GPtrArray *items;             /** ObexItem, owned. */
+   guint unfinished;
+};
+
+struct _Obex
+{
+   GDBusConnection *conn;
+   GQueue waiting;               /** ObexSession not opened yet. */
+   GQueue opened;                /** ObexSession with calls out. */
+   GHashTable *items;            /** Transfer1 path to ObexItem, not owned. */
+   GPtrArray *incoming;          /** ObexItem, owned. */
+   gchar *inbox;
+   GDBusNodeInfo *agent_info;
+   guint agent_id;
+   guint sub;
+   GCancellable *cancel;
+   ObexFunc func;
+   gpointer user_data;
+};
+
+static void obex_item_free(ObexItem *item)
+{
+   if (item->push != NULL)
+      g_dbus_method_invocation_return_dbus_error(item->push, "org.bluez.obex.Error.Canceled", "Shutting down");
+   g_free(item->transfer.path);
+   g_free(item->transfer.address);
+   g_free(item->transfer.file);
+   g_free(item->transfer.error);
+   g_free(item);
+}
+
+static void obex_session_free(ObexSession *session)
+{
+   g_ptr_array_free(session->items, TRUE);
+   g_free(session->address);
+   g_free(session->path);
+   g_free(session);
+}
+
+static const char *obex_status_names[] = { "queued", "active", "suspended", "complete", "error" };
+
+static ObexStatus obex_status(const char *str)
+{
+   for (int i = 0; i < G_N_ELEMENTS(obex_status_names); i++)
+   {
+      if (g_str_equal(str, obex_status_names[i]))
+         return i;
+   }
+   return OBEX_ERROR;
+}
+
+/**
+ * @brief The Transfer1 Status string of a status.
+ */
+const char *obex_status_name(ObexStatus status)
+{
+   return obex_status_names[status];
+}
+
+/**
+ * @brief Ends a transfer and reports it.
+ *
+ * @param error Why it failed, NULL when the status says enough.
+ */
+static void obex_item_end(Obex *obex, ObexItem *item, ObexStatus status, const char *error)
+{
+   ObexTransfer *transfer = &item->transfer;
+
+   transfer->status = status;
+   transfer->finished = g_get_monotonic_time();
+   if (transfer->started == 0)
+      transfer->started = transfer->finished;
+   if (status == OBEX_COMPLETE)
+      transfer->transferred = MAX(transfer->transferred, transfer->size);
+   if (error != NULL && transfer->error == NULL)
+      transfer->error = g_strdup(error);
+   obex->func(transfer, obex->user_data);
+}
+
+//! Outgoing.
+
+static void obex_schedule(Obex *obex);
+
+/**
+ * @brief Counts a file of the session as ended. The last one closes the
+ *  session and lets the next waiting destination in.
+ */
+static void obex_session_item_done(ObexSession *session)
+{
+   Obex *obex = session->obex;
+
+   if (--session->unfinished > 0)
+      return;
+
+   if (session->path != NULL)
+      g_dbus_connection_call(obex->conn, OBEX_ORG, OBEX_OBJECT, OBEX_CLIENT_IFACE, "RemoveSession",
+                             g_variant_new("(o)", session->path), NULL, G_DBUS_CALL_FLAGS_NONE,
+                             -1, NULL, NULL, NULL);
+   for (guint i = 0; i < session->items->len; i++)
+   {
+      ObexItem *item = g_ptr_array_index(session->items, i);
+      if (item->transfer.path != NULL)
+         g_hash_table_remove(obex->items, item->transfer.path);
+   }
+   g_queue_remove(&obex->opened, session);
+   obex_session_free(session);
+   obex_schedule(obex);
+}
+
+/**
+ * @brief Applies Transfer1 properties and reports progress, or the end.
+ *
+ * @returns TRUE if the transfer ended.
+ */
+static gboolean obex_item_apply(Obex *obex, ObexItem *item, GVariant *props)
+{
+   ObexTransfer *transfer = &item->transfer;
+   ObexStatus prev = transfer->status;
+   const gchar *status = NULL;
+   gboolean moved = g_variant_lookup(props, "Transferred", "t", &transfer->transferred);
+
+   g_variant_lookup(props, "Size", "t", &transfer->size);
+   if (g_variant_lookup(props, "Status", "&s", &status))
+      transfer->status = obex_status(status);
+   if (transfer->status == OBEX_ACTIVE && transfer->started == 0)
+      transfer->started = g_get_monotonic_time();
+
+   if (transfer->status == OBEX_COMPLETE || transfer->status == OBEX_ERROR)
+   {
+      obex_item_end(obex, item, transfer->status, transfer->status == OBEX_ERROR ? "Failed" : NULL);
+      return TRUE;
+   }
+   if (moved || transfer->status != prev)
+      obex->func(transfer, obex->user_data);
+   return FALSE;
+}
+
+static void obex_send_file_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+   GVariant *props = NULL;
+   const gchar *path = NULL;
+
+   // Cancelled means the sessions are already gone.
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   ObexItem *item = arg;
+   ObexSession *session = item->session;
+   Obex *obex = session->obex;
+   if (result == NULL)
+   {
+      obex_item_end(obex, item, OBEX_ERROR, error->message);
+      g_error_free(error);
+      obex_session_item_done(session);
+      return;
+   }
+
+   g_variant_get(result, "(&o@a{sv})", &path, &props);
+   item->transfer.path = g_strdup(path);
+   g_hash_table_insert(obex->items, item->transfer.path, item);
+   if (obex_item_apply(obex, item, props))
+      obex_session_item_done(session);
+   g_variant_unref(props);
+   g_variant_unref(result);
+}
+
+/**
+ * @brief Queues every file of the session on it at once, obexd sends them
+ *  one after the other without waiting for us in between.
+ */
+static void obex_create_session_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   ObexSession *session = arg;
+   Obex *obex = session->obex;
+   if (result == NULL)
+   {
+      for (guint i = 0; i < session->items->len; i++)
+         obex_item_end(obex, g_ptr_array_index(session->items, i), OBEX_ERROR, error->message);
+      g_error_free(error);
+      session->unfinished = 1;
+      obex_session_item_done(session);
+      return;
+   }
+
+   g_variant_get(result, "(o)", &session->path);
+   g_variant_unref(result);
+   for (guint i = 0; i < session->items->len; i++)
+   {
+      ObexItem *item = g_ptr_array_index(session->items, i);
+      g_dbus_connection_call(obex->conn,
+               OBEX_ORG,
+               session->path,
+               OBEX_PUSH_IFACE,
+               "SendFile",
+               g_variant_new("(s)", item->transfer.file),
+               G_VARIANT_TYPE("(oa{sv})"),
+               G_DBUS_CALL_FLAGS_NONE,
+               -1,
+               obex->cancel,
+               obex_send_file_cb,
+               item);
+   }
+}
+
+static ObexSession *obex_find_session(GQueue *sessions, const char *address)
+{
+   for (GList *l = sessions->head; l != NULL; l = l->next)
+   {
+      if (g_str_equal(((ObexSession *)l->data)->address, address))
+         return l->data;
+   }
+   return NULL;
+}
+
+/**
+ * @brief Opens sessions for waiting destinations while fewer than
+ *  OBEX_MAX_SESSIONS are open, one per destination at a time.
+ */
+static void obex_schedule(Obex *obex)
+{
+   GList *next = NULL;
+
+   for (GList *l = obex->waiting.head; l != NULL && obex->opened.length < OBEX_MAX_SESSIONS; l = next)
+   {
+      ObexSession *session = l->data;
+      GVariantBuilder args;
+
+      next = l->next;
+      if (obex_find_session(&obex->opened, session->address) != NULL)
+         continue;
+
+      g_queue_delete_link(&obex->waiting, l);
+      g_queue_push_tail(&obex->opened, session);
+      g_variant_builder_init(&args, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add(&args, "{sv}", "Target", g_variant_new_string("opp"));
+      g_dbus_connection_call(obex->conn,
+               OBEX_ORG,
+               OBEX_OBJECT,
+               OBEX_CLIENT_IFACE,
+               "CreateSession",
+               g_variant_new("(sa{sv})", session->address, &args),
+               G_VARIANT_TYPE("(o)"),
+               G_DBUS_CALL_FLAGS_NONE,
+               -1,
+               obex->cancel,
+               obex_create_session_cb,
+               session);
+   }
+}
+
+/**
+ * @brief Queues a file for a device.
+ *
+ * @param address MAC address of the device.
+ * @param file Path of the file, made absolute for obexd.
+ *
+ * @returns FALSE if the address is not a MAC address or the file isn't a
+ *  regular file.
+ */
+gboolean obex_send(Obex *obex, const char *address, const char *file)
+{
+   ObexSession *session = NULL;
+   ObexItem *item = NULL;
+
+   if (strlen(address) != 17 || !g_file_test(file, G_FILE_TEST_IS_REGULAR))
+      return FALSE;
+   for (int i = 0; i < 17; i++)
+   {
+      if (i % 3 == 2 ? address[i] != ':' : !g_ascii_isxdigit(address[i]))
+         return FALSE;
+   }
+
+   item = g_new0(ObexItem, 1);
+   item->obex = obex;
+   item->transfer.address = g_ascii_strup(address, -1);
+   item->transfer.file = g_canonicalize_filename(file, NULL);
+
+   //! Files join a session until its files are handed to SendFile. Later
+   //! ones wait for the next, the open one may be closing already.
+   session = obex_find_session(&obex->opened, item->transfer.address);
+   if (session == NULL || session->path != NULL)
+      session = obex_find_session(&obex->waiting, item->transfer.address);
+   if (session == NULL)
+   {
+      session = g_new0(ObexSession, 1);
+      session->obex = obex;
+      session->address = g_strdup(item->transfer.address);
+      session->items = g_ptr_array_new_with_free_func((GDestroyNotify)obex_item_free);
+      g_queue_push_tail(&obex->waiting, session);
+   }
+   item->session = session;
+   g_ptr_array_add(session->items, item);
+   session->unfinished += 1;
+   obex_schedule(obex);
+   return TRUE;
+}
+
+//! Incoming.
+
+static void obex_incoming_done(Obex *obex, ObexItem *item)
+{
+   if (item->transfer.path != NULL)
+      g_hash_table_remove(obex->items, item->transfer.path);
+   g_ptr_array_remove_fast(obex->incoming, item);
+}
+
+/**
+ * @brief A free name for a pushed file in the inbox: its own base name,
+ *  or with .1, .2 ... appended if that one is taken.
+ */
+static gchar *obex_inbox_file(Obex *obex, const char *name)
+{
+   gchar *base = g_path_get_basename(name != NULL && *name ? name : "file");
+   gchar *file = NULL;
+
+   if (g_str_equal(base, ".") || g_str_equal(base, "..") || g_str_equal(base, G_DIR_SEPARATOR_S))
+   {
+      g_free(base);
+      base = g_strdup("file");
+   }
+   file = g_build_filename(obex->inbox, base, NULL);
+   for (guint n = 1; g_file_test(file, G_FILE_TEST_EXISTS); n++)
+   {
+      g_free(file);
+      file = g_strdup_printf("%s%c%s.%u", obex->inbox, G_DIR_SEPARATOR, base, n);
+   }
+   g_free(base);
+   return file;
+}
+
+/**
+ * @brief Answers AuthorizePush with the file in the inbox. Progress is
+ *  followed from here on.
+ */
+static void obex_item_authorize(Obex *obex, ObexItem *item)
+{
+   g_dbus_method_invocation_return_value(item->push, g_variant_new("(s)", item->transfer.file));
+   item->push = NULL;
+   g_hash_table_insert(obex->items, item->transfer.path, item);
+}
+
+static void obex_session_props_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+   GVariant *props = NULL;
+
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   ObexItem *item = arg;
+   if (result != NULL)
+   {
+      g_variant_get(result, "(@a{sv})", &props);
+      g_variant_lookup(props, "Destination", "s", &item->transfer.address);
+      g_variant_unref(props);
+      g_variant_unref(result);
+   }
+   g_clear_error(&error);
+   obex_item_authorize(item->obex, item);
+}
+
+/**
+ * @brief Names the file in the inbox after the pushed object, then asks
+ *  the session who pushed it before answering.
+ */
+static void obex_transfer_props_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+   GVariant *props = NULL;
+   const gchar *name = NULL;
+   const gchar *session = NULL;
+
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   ObexItem *item = arg;
+   Obex *obex = item->obex;
+   if (result == NULL)
+   {
+      g_dbus_method_invocation_return_gerror(item->push, error);
+      item->push = NULL;
+      obex_item_end(obex, item, OBEX_ERROR, error->message);
+      obex_incoming_done(obex, item);
+      g_error_free(error);
+      return;
+   }
+
+   g_variant_get(result, "(@a{sv})", &props);
+   g_variant_lookup(props, "Name", "&s", &name);
+   g_variant_lookup(props, "Size", "t", &item->transfer.size);
+   item->transfer.file = obex_inbox_file(obex, name);
+   if (g_variant_lookup(props, "Session", "&o", &session))
+      g_dbus_connection_call(obex->conn, OBEX_ORG, session, "org.freedesktop.DBus.Properties", "GetAll",
+                             g_variant_new("(s)", "org.bluez.obex.Session1"), G_VARIANT_TYPE("(a{sv})"),
+                             G_DBUS_CALL_FLAGS_NONE, -1, obex->cancel, obex_session_props_cb, item);
+   else
+      obex_item_authorize(obex, item);
+   g_variant_unref(props);
+   g_variant_unref(result);
+}
+
+static void obex_agent_method(GDBusConnection *conn,
+            const gchar *sender,
+            const gchar *path,
+            const gchar *interface,
+            const gchar *method,
+            GVariant *params,
+            GDBusMethodInvocation *invocation,
+            gpointer user_data)
+{
+   Obex *obex = user_data;
+   const gchar *transfer = NULL;
+   ObexItem *item = NULL;
+
+   if (!g_str_equal(method, "AuthorizePush"))
+   {
+      g_dbus_method_invocation_return_value(invocation, NULL);
+      return;
+   }
+
+   g_variant_get(params, "(&o)", &transfer);
+   item = g_new0(ObexItem, 1);
+   item->transfer.path = g_strdup(transfer);
+   item->transfer.incoming = TRUE;
+   item->obex = obex;
+   item->push = invocation;
+   g_ptr_array_add(obex->incoming, item);
+   g_dbus_connection_call(obex->conn, OBEX_ORG, transfer, "org.freedesktop.DBus.Properties", "GetAll",
+                          g_variant_new("(s)", OBEX_TRANSFER_IFACE), G_VARIANT_TYPE("(a{sv})"),
+                          G_DBUS_CALL_FLAGS_NONE, -1, obex->cancel, obex_transfer_props_cb, item);
+}
+
+static const GDBusInterfaceVTable obex_agent_vtable = { obex_agent_method, NULL, NULL };
+
+/**
+ * @brief Registers the agent, accepting every push into inbox.
+ *
+ * @returns FALSE if obexd refused the agent.
+ */
+gboolean obex_receive(Obex *obex, const char *inbox, GError **error)
+{
+   GVariant *result = NULL;
+
+   if (obex->agent_id)
+      return TRUE;
+   g_free(obex->inbox);
+   obex->inbox = g_canonicalize_filename(inbox, NULL);
+   obex->agent_info = g_dbus_node_info_new_for_xml(obex_agent_xml, NULL);
+   obex->agent_id = g_dbus_connection_register_object(obex->conn, OBEX_AGENT_PATH, obex->agent_info->interfaces[0],
+                                                      &obex_agent_vtable, obex, NULL, error);
+   if (!obex->agent_id)
+      return FALSE;
+
+   result = g_dbus_connection_call_sync(obex->conn,
+            OBEX_ORG,
+            OBEX_OBJECT,
+            OBEX_AGENT_MANAGER_IFACE,
+            "RegisterAgent",
+            g_variant_new("(o)", OBEX_AGENT_PATH),
+            NULL,
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            error);
+   if (result == NULL)
+   {
+      g_dbus_connection_unregister_object(obex->conn, obex->agent_id);
+      obex->agent_id = 0;
+      return FALSE;
+   }
+   g_variant_unref(result);
+   return TRUE;
+}
+
+//! Progress.
+
+static void obex_properties_changed(GDBusConnection *sig,
+            const gchar *sender_name,
+            const gchar *object_path,
+            const gchar *interface,
+            const gchar *signal_name,
+            GVariant *parameters,
+            gpointer user_data)
+{
+   Obex *obex = user_data;
+   ObexItem *item = g_hash_table_lookup(obex->items, object_path);
+   GVariant *changed = NULL;
+
+   if (item == NULL)
+      return;
+   g_variant_get(parameters, "(&s@a{sv}@as)", NULL, &changed, NULL);
+   if (obex_item_apply(obex, item, changed))
+   {
+      if (item->session != NULL)
+         obex_session_item_done(item->session);
+      else
+         obex_incoming_done(obex, item);
+   }
+   g_variant_unref(changed);
+}
+
+/**
+ * @brief Starts following transfers.
+ *
+ * @param conn Connection handle to the session bus.
+ */
+Obex *obex_new(GDBusConnection *conn, ObexFunc func, gpointer user_data)
+{
+   Obex *obex = g_new0(Obex, 1);
+
+   obex->conn = conn;
+   obex->func = func;
+   obex->user_data = user_data;
+   obex->cancel = g_cancellable_new();
+   obex->items = g_hash_table_new(g_str_hash, g_str_equal);
+   obex->incoming = g_ptr_array_new_with_free_func((GDestroyNotify)obex_item_free);
+   g_queue_init(&obex->waiting);
+   g_queue_init(&obex->opened);
+   obex->sub = g_dbus_connection_signal_subscribe(conn,
+            OBEX_ORG,
+            "org.freedesktop.DBus.Properties",
+            "PropertiesChanged",
+            NULL,
+            OBEX_TRANSFER_IFACE,
+            G_DBUS_SIGNAL_FLAGS_NONE,
+            obex_properties_changed,
+            obex,
+            NULL);
+   return obex;
+}
+
+/**
+ * @brief Whether nothing is queued or going out.
+ */
+gboolean obex_idle(Obex *obex)
+{
+   return g_queue_is_empty(&obex->waiting) && g_queue_is_empty(&obex->opened);
+}
+
+/**
+ * @brief Ends the sessions and unregisters the agent.
+ */
+void obex_free(Obex *obex)
+{
+   ObexSession *session = NULL;
+
+   if (obex == NULL)
+      return;
+   g_cancellable_cancel(obex->cancel);
+   g_object_unref(obex->cancel);
+   g_dbus_connection_signal_unsubscribe(obex->conn, obex->sub);
+   if (obex->agent_id)
+   {
+      g_dbus_connection_call(obex->conn, OBEX_ORG, OBEX_OBJECT, OBEX_AGENT_MANAGER_IFACE, "UnregisterAgent",
+                             g_variant_new("(o)", OBEX_AGENT_PATH), NULL, G_DBUS_CALL_FLAGS_NONE,
+                             -1, NULL, NULL, NULL);
+      g_dbus_connection_unregister_object(obex->conn, obex->agent_id);
+   }
+   if (obex->agent_info != NULL)
+      g_dbus_node_info_unref(obex->agent_info);
+
+   //! obexd keeps sessions until told, or until we leave the bus.
+   while ((session = g_queue_pop_head(&obex->opened)) != NULL)
+   {
+      if (session->path != NULL)
+         g_dbus_connection_call(obex->conn, OBEX_ORG, OBEX_OBJECT, OBEX_CLIENT_IFACE, "RemoveSession",
+                                g_variant_new("(o)", session->path), NULL, G_DBUS_CALL_FLAGS_NONE,
+                                -1, NULL, NULL, NULL);
+      obex_session_free(session);
+   }
+   g_queue_clear_full(&obex->waiting, (GDestroyNotify)obex_session_free);
+   g_ptr_array_free(obex->incoming, TRUE);
+   g_hash_table_destroy(obex->items);
+   g_free(obex->inbox);
+   g_free(obex);
+}
@@ -0,0 +1,100 @@
+/**
+* @file obex.h
+* @brief OBEX Object Push through obexd, both ways.
+*
+* Files are pushed with org.bluez.obex Client1/ObjectPush1 on the session
+* bus. Every destination gets one session that all its files are queued
+* on, and up to OBEX_MAX_SESSIONS destinations are pushed to at once.
+* Incoming pushes are accepted by an Agent1 that names the file in the
+* inbox. obexd reads and writes the files itself, only paths go over the
+* bus, so no file content passes through this process.
+*/
+#ifndef OBEX_H
+#define OBEX_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#define OBEX_ORG "org.bluez.obex"
+#define OBEX_OBJECT "/org/bluez/obex"
+#define OBEX_CLIENT_IFACE "org.bluez.obex.Client1"
+#define OBEX_PUSH_IFACE "org.bluez.obex.ObjectPush1"
+#define OBEX_TRANSFER_IFACE "org.bluez.obex.Transfer1"
+#define OBEX_AGENT_MANAGER_IFACE "org.bluez.obex.AgentManager1"
+#define OBEX_AGENT_IFACE "org.bluez.obex.Agent1"
+#define OBEX_AGENT_PATH "/org/bluez/obex/TuxdropAgent"
+#define OBEX_MAX_SESSIONS 4      /** Destinations pushed to at once. */
+
+typedef enum
+{
+   OBEX_QUEUED,
+   OBEX_ACTIVE,
+   OBEX_SUSPENDED,
+   OBEX_COMPLETE,
+   OBEX_ERROR,
+} ObexStatus;
+
+/** @brief A file going out or coming in. */
+typedef struct _ObexTransfer
+{
+   gchar *path;                  /** Transfer1 object, NULL until obexd made it. */
+   gchar *address;               /** The peer. */
+   gchar *file;                  /** Local file, absolute. */
+   gboolean incoming;
+   ObexStatus status;
+   guint64 size;
+   guint64 transferred;
+   gint64 started;               /** Monotonic time it went active, 0 before. */
+   gint64 finished;
+   gchar *error;
+} ObexTransfer;
+
+typedef struct _Obex Obex;
+
+/**
+ * @brief Called when a transfer makes progress, and once more when it
+ *  ends as OBEX_COMPLETE or OBEX_ERROR.
+ */
+typedef void (*ObexFunc)(const ObexTransfer *transfer, gpointer user_data);
+
+/** Funcs **/
+/**
+ * @brief Starts following transfers.
+ *
+ * @param conn Connection handle to the session bus.
+ */
+Obex *obex_new(GDBusConnection *conn, ObexFunc func, gpointer user_data);
+
+/**
+ * @brief The Transfer1 Status string of a status.
+ */
+const char *obex_status_name(ObexStatus status);
+
+/**
+ * @brief Queues a file for a device.
+ *
+ * @param address MAC address of the device.
+ * @param file Path of the file, made absolute for obexd.
+ *
+ * @returns FALSE if the address is not a MAC address or the file isn't a
+ *  regular file.
+ */
+gboolean obex_send(Obex *obex, const char *address, const char *file);
+
+/**
+ * @brief Registers the agent, accepting every push into inbox.
+ *
+ * @returns FALSE if obexd refused the agent.
+ */
+gboolean obex_receive(Obex *obex, const char *inbox, GError **error);
+
+/**
+ * @brief Whether nothing is queued or going out.
+ */
+gboolean obex_idle(Obex *obex);
+
+/**
+ * @brief Ends the sessions and unregisters the agent.
+ */
+void obex_free(Obex *obex);
+
+#endif // OBEX_H
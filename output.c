@@ -0,0 +1,741 @@
+/**
+* @file output.c
+* @brief Buffered structured output in human, JSON lines or binary TLV form.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "output.h"
+
+/** @brief A block of formatted output. */
+typedef struct _OutputBuffer
+{
+   gsize len;
+   guint8 data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+/** @brief An open object or array. */
+typedef struct _OutputLevel
+{
+   gboolean array;
+   gboolean first;      /** Nothing written in it yet. */
+   const char *key;     /** Human form labels array items with it. */
+   int depth;           /** Indentation in human form. */
+} OutputLevel;
+
+static OutputFormat output_format = OUTPUT_HUMAN;
+static int output_fd = STDOUT_FILENO;
+static OutputBuffer *output_buf = NULL;
+static GThread *output_thread = NULL;
+static GAsyncQueue *output_full = NULL;   /** Buffers for the writer thread. */
+static GAsyncQueue *output_spare = NULL;  /** Buffers it has written. */
+static gchar output_stop;                 /** Address queued to end the writer thread. */
+static guint output_idle = 0;
+static OutputLevel output_levels[OUTPUT_MAX_DEPTH];
+static int output_level = -1;
+static gboolean output_oneline = FALSE;
+static gboolean output_line_first = FALSE;
+
+static void output_write(const guint8 *data, gsize len)
+{
+   while (len > 0)
+   {
+      gssize n = write(output_fd, data, len);
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return; // Nobody is reading any more, drop it.
+      }
+      data += n;
+      len -= n;
+   }
+}
+
+static gpointer output_thread_func(gpointer arg)
+{
+   OutputBuffer *buf = NULL;
+
+   while ((buf = g_async_queue_pop(output_full)) != (gpointer)&output_stop)
+   {
+      output_write(buf->data, buf->len);
+      buf->len = 0;
+      g_async_queue_push(output_spare, buf);
+   }
+   return NULL;
+}
+
+/**
+ * @brief Sends the current buffer on its way and starts an empty one.
+ */
+static void output_ship()
+{
+   if (output_buf == NULL || output_buf->len == 0)
+      return;
+
+   if (output_thread != NULL)
+   {
+      g_async_queue_push(output_full, output_buf);
+      // Only waits with OUTPUT_BUFFERS queued, the writer sets the pace.
+      output_buf = g_async_queue_pop(output_spare);
+      return;
+   }
+   // Text printed through stdio before these records goes first.
+   fflush(stdout);
+   output_write(output_buf->data, output_buf->len);
+   output_buf->len = 0;
+}
+
+static gboolean output_idle_cb(gpointer arg)
+{
+   output_idle = 0;
+   output_ship();
+   return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Makes room for len bytes in one piece, len is small.
+ */
+static guint8 *output_reserve(gsize len)
+{
+   if (output_buf == NULL)
+      output_buf = g_new0(OutputBuffer, 1);
+   if (OUTPUT_BUFFER_SIZE - output_buf->len < len)
+      output_ship();
+   return output_buf->data + output_buf->len;
+}
+
+static void output_put(const void *data, gsize len)
+{
+   const guint8 *p = data;
+
+   while (len > 0)
+   {
+      output_reserve(1);
+      gsize n = MIN(len, OUTPUT_BUFFER_SIZE - output_buf->len);
+      memcpy(output_buf->data + output_buf->len, p, n);
+      output_buf->len += n;
+      p += n;
+      len -= n;
+   }
+}
+
+static void output_putc(guint8 c)
+{
+   *output_reserve(1) = c;
+   output_buf->len += 1;
+}
+
+static void output_puts(const char *str)
+{
+   output_put(str, strlen(str));
+}
+
+/**
+ * @brief printf straight into the buffer, for numbers.
+ */
+static void G_GNUC_PRINTF(1, 2) output_fmt(const char *fmt, ...)
+{
+   va_list args;
+   gchar *tail = (gchar *)output_reserve(64);
+   gsize space = OUTPUT_BUFFER_SIZE - output_buf->len;
+
+   va_start(args, fmt);
+   gint n = g_vsnprintf(tail, space, fmt, args);
+   va_end(args);
+   output_buf->len += MIN((gsize)MAX(n, 0), space - 1);
+}
+
+static void output_varint(guint64 v)
+{
+   guint8 *p = output_reserve(10);
+   gsize n = 0;
+
+   do
+   {
+      p[n++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+      v >>= 7;
+   } while (v != 0);
+   output_buf->len += n;
+}
+
+static void output_tlv(OutputTag tag, const void *data, gsize len)
+{
+   output_putc(tag);
+   output_varint(len);
+   output_put(data, len);
+}
+
+static void output_json_str(const char *str, gsize len)
+{
+   static const char hex[] = "0123456789abcdef";
+   gsize run = 0;
+
+   output_putc('"');
+   for (gsize i = 0; i < len; i++)
+   {
+      guchar c = str[i];
+      if (c >= 0x20 && c != '"' && c != '\\')
+         continue;
+      //! Copies the plain run before the character in one go.
+      output_put(str + run, i - run);
+      run = i + 1;
+      if (c == '"' || c == '\\')
+      {
+         output_putc('\\');
+         output_putc(c);
+      }
+      else if (c == '\n')
+         output_puts("\\n");
+      else
+      {
+         output_puts("\\u00");
+         output_putc(hex[c >> 4]);
+         output_putc(hex[c & 0xF]);
+      }
+   }
+   output_put(str + run, len - run);
+   output_putc('"');
+}
+
+static void output_hex(const guint8 *data, gsize len)
+{
+   static const char hex[] = "0123456789abcdef";
+
+   for (gsize i = 0; i < len; i++)
+   {
+      guint8 *p = output_reserve(2);
+      p[0] = hex[data[i] >> 4];
+      p[1] = hex[data[i] & 0xF];
+      output_buf->len += 2;
+   }
+}
+
+static void output_indent(int depth)
+{
+   if (depth == 0)
+      return;
+   for (int i = 0; i < depth; i++)
+      output_putc(' ');
+   output_puts("| ");
+}
+
+//! Plain values, in the current format.
+
+static void output_string(const char *str, gsize len, gboolean quote)
+{
+   switch (output_format)
+   {
+      case OUTPUT_JSON:
+         output_json_str(str, len);
+         break;
+      case OUTPUT_TLV:
+         output_tlv(OUTPUT_TAG_STR, str, len);
+         break;
+      case OUTPUT_HUMAN:
+         if (quote)
+            output_putc('\'');
+         output_put(str, len);
+         if (quote)
+            output_putc('\'');
+         break;
+   }
+}
+
+static void output_sint(gint64 v)
+{
+   if (output_format == OUTPUT_TLV)
+   {
+      output_putc(OUTPUT_TAG_INT);
+      output_varint(((guint64)v << 1) ^ (guint64)(v >> 63));
+   }
+   else
+      output_fmt("%" G_GINT64_FORMAT, v);
+}
+
+static void output_uint(guint64 v)
+{
+   if (output_format == OUTPUT_TLV)
+   {
+      output_putc(OUTPUT_TAG_UINT);
+      output_varint(v);
+   }
+   else
+      output_fmt("%" G_GUINT64_FORMAT, v);
+}
+
+static void output_double(gdouble v)
+{
+   guint64 bits = 0;
+
+   switch (output_format)
+   {
+      case OUTPUT_JSON:
+         if (isfinite(v))
+            output_fmt("%.17g", v);
+         else
+            output_puts("null");
+         break;
+      case OUTPUT_TLV:
+         memcpy(&bits, &v, sizeof(bits));
+         bits = GUINT64_TO_LE(bits);
+         output_putc(OUTPUT_TAG_DOUBLE);
+         output_put(&bits, sizeof(bits));
+         break;
+      case OUTPUT_HUMAN:
+         output_fmt("%g", v);
+         break;
+   }
+}
+
+static void output_bool(gboolean v)
+{
+   if (output_format == OUTPUT_TLV)
+      output_putc(v ? OUTPUT_TAG_TRUE : OUTPUT_TAG_FALSE);
+   else
+      output_puts(v ? "true" : "false");
+}
+
+static void output_bytes(const guint8 *data, gsize len)
+{
+   switch (output_format)
+   {
+      case OUTPUT_JSON:
+         output_putc('"');
+         output_hex(data, len);
+         output_putc('"');
+         break;
+      case OUTPUT_TLV:
+         output_tlv(OUTPUT_TAG_BYTES, data, len);
+         break;
+      case OUTPUT_HUMAN:
+         output_puts("0x");
+         output_hex(data, len);
+         break;
+   }
+}
+
+static void output_variant(GVariant *val);
+
+/**
+ * @brief Writes a dictionary key. Objects only have string keys, so
+ *  numbers are written as their decimal text.
+ */
+static void output_variant_key(GVariant *key)
+{
+   gchar num[32];
+   const gchar *str = NULL;
+   gsize len = 0;
+
+   if (g_variant_is_of_type(key, G_VARIANT_TYPE_STRING) || g_variant_is_of_type(key, G_VARIANT_TYPE_OBJECT_PATH))
+      str = g_variant_get_string(key, &len);
+   else if (output_format != OUTPUT_HUMAN)
+   {
+      // Numeric keys, e.g. the company of ManufacturerData.
+      switch (g_variant_classify(key))
+      {
+         case G_VARIANT_CLASS_BYTE: len = g_snprintf(num, sizeof(num), "%u", g_variant_get_byte(key)); break;
+         case G_VARIANT_CLASS_UINT16: len = g_snprintf(num, sizeof(num), "%u", g_variant_get_uint16(key)); break;
+         case G_VARIANT_CLASS_INT16: len = g_snprintf(num, sizeof(num), "%d", g_variant_get_int16(key)); break;
+         case G_VARIANT_CLASS_UINT32: len = g_snprintf(num, sizeof(num), "%u", g_variant_get_uint32(key)); break;
+         case G_VARIANT_CLASS_INT32: len = g_snprintf(num, sizeof(num), "%d", g_variant_get_int32(key)); break;
+         default: len = g_snprintf(num, sizeof(num), "?"); break;
+      }
+      str = num;
+   }
+
+   switch (output_format)
+   {
+      case OUTPUT_JSON:
+         output_json_str(str, len);
+         output_putc(':');
+         break;
+      case OUTPUT_TLV:
+         output_tlv(OUTPUT_TAG_KEY, str, len);
+         break;
+      case OUTPUT_HUMAN:
+         output_variant(key);
+         output_puts(": ");
+         break;
+   }
+}
+
+static void output_container(GVariant *val, gboolean dict)
+{
+   gsize n = g_variant_n_children(val);
+
+   if (output_format == OUTPUT_TLV)
+      output_putc(dict ? OUTPUT_TAG_OBJECT : OUTPUT_TAG_ARRAY);
+   else
+      output_putc(dict ? '{' : '[');
+
+   for (gsize i = 0; i < n; i++)
+   {
+      GVariant *child = g_variant_get_child_value(val, i);
+      if (i > 0 && output_format != OUTPUT_TLV)
+         output_puts(output_format == OUTPUT_JSON ? "," : ", ");
+      if (dict)
+      {
+         GVariant *key = g_variant_get_child_value(child, 0);
+         GVariant *item = g_variant_get_child_value(child, 1);
+         output_variant_key(key);
+         output_variant(item);
+         g_variant_unref(key);
+         g_variant_unref(item);
+      }
+      else
+         output_variant(child);
+      g_variant_unref(child);
+   }
+
+   if (output_format == OUTPUT_TLV)
+      output_putc(OUTPUT_TAG_END);
+   else
+      output_putc(dict ? '}' : ']');
+}
+
+/**
+ * @brief Formats a value from its serialized form, no string per value.
+ */
+static void output_variant(GVariant *val)
+{
+   GVariant *inner = NULL;
+   const gchar *str = NULL;
+   gsize len = 0;
+
+   switch (g_variant_classify(val))
+   {
+      case G_VARIANT_CLASS_BOOLEAN: output_bool(g_variant_get_boolean(val)); break;
+      case G_VARIANT_CLASS_BYTE: output_uint(g_variant_get_byte(val)); break;
+      case G_VARIANT_CLASS_INT16: output_sint(g_variant_get_int16(val)); break;
+      case G_VARIANT_CLASS_UINT16: output_uint(g_variant_get_uint16(val)); break;
+      case G_VARIANT_CLASS_INT32: output_sint(g_variant_get_int32(val)); break;
+      case G_VARIANT_CLASS_UINT32: output_uint(g_variant_get_uint32(val)); break;
+      case G_VARIANT_CLASS_INT64: output_sint(g_variant_get_int64(val)); break;
+      case G_VARIANT_CLASS_UINT64: output_uint(g_variant_get_uint64(val)); break;
+      case G_VARIANT_CLASS_HANDLE: output_sint(g_variant_get_handle(val)); break;
+      case G_VARIANT_CLASS_DOUBLE: output_double(g_variant_get_double(val)); break;
+      case G_VARIANT_CLASS_STRING:
+      case G_VARIANT_CLASS_OBJECT_PATH:
+      case G_VARIANT_CLASS_SIGNATURE:
+         str = g_variant_get_string(val, &len);
+         output_string(str, len, TRUE);
+         break;
+      case G_VARIANT_CLASS_VARIANT:
+         inner = g_variant_get_variant(val);
+         if (output_format == OUTPUT_HUMAN)
+            output_putc('<');
+         output_variant(inner);
+         if (output_format == OUTPUT_HUMAN)
+            output_putc('>');
+         g_variant_unref(inner);
+         break;
+      case G_VARIANT_CLASS_MAYBE:
+         inner = g_variant_get_maybe(val);
+         if (inner != NULL)
+         {
+            output_variant(inner);
+            g_variant_unref(inner);
+         }
+         else if (output_format == OUTPUT_TLV)
+            output_putc(OUTPUT_TAG_NULL);
+         else
+            output_puts(output_format == OUTPUT_JSON ? "null" : "nothing");
+         break;
+      case G_VARIANT_CLASS_ARRAY:
+         if (g_variant_is_of_type(val, G_VARIANT_TYPE_BYTESTRING))
+         {
+            gconstpointer data = g_variant_get_fixed_array(val, &len, 1);
+            output_bytes(data, len);
+         }
+         else
+            output_container(val, g_variant_type_is_dict_entry(g_variant_type_element(g_variant_get_type(val))));
+         break;
+      case G_VARIANT_CLASS_TUPLE:
+      case G_VARIANT_CLASS_DICT_ENTRY:
+         output_container(val, FALSE);
+         break;
+   }
+}
+
+//! Record structure.
+
+/**
+ * @brief Writes whatever goes before a field or container: separator,
+ *  key, human indentation.
+ */
+static void output_field_begin(const char *key, gboolean scalar)
+{
+   OutputLevel *level = &output_levels[output_level];
+
+   switch (output_format)
+   {
+      case OUTPUT_JSON:
+         if (!level->first)
+            output_putc(',');
+         if (!level->array)
+         {
+            output_json_str(key, strlen(key));
+            output_putc(':');
+         }
+         break;
+      case OUTPUT_TLV:
+         if (!level->array)
+            output_tlv(OUTPUT_TAG_KEY, key, strlen(key));
+         break;
+      case OUTPUT_HUMAN:
+         if (!scalar)
+            break;
+         if (output_oneline)
+         {
+            if (!output_line_first)
+               output_putc(' ');
+            output_line_first = FALSE;
+            break;
+         }
+         // Array items sit one level in, labelled by the array.
+         output_indent(level->array ? level->depth + 1 : level->depth);
+         if (level->array ? level->key != NULL : key != NULL)
+         {
+            output_puts(level->array ? level->key : key);
+            output_puts(": ");
+         }
+         break;
+   }
+   level->first = FALSE;
+}
+
+static void output_field_end()
+{
+   if (output_format == OUTPUT_HUMAN && !output_oneline)
+      output_putc('\n');
+}
+
+static void output_container_begin(const char *key, gboolean array)
+{
+   OutputLevel *parent = &output_levels[output_level];
+
+   g_assert(output_level + 1 < OUTPUT_MAX_DEPTH);
+   output_field_begin(key, FALSE);
+   if (output_format == OUTPUT_JSON)
+      output_putc(array ? '[' : '{');
+   else if (output_format == OUTPUT_TLV)
+      output_putc(array ? OUTPUT_TAG_ARRAY : OUTPUT_TAG_OBJECT);
+
+   OutputLevel *level = &output_levels[++output_level];
+   level->array = array;
+   level->first = TRUE;
+   level->key = key ? key : parent->key;
+   level->depth = array ? parent->depth : parent->depth + 1;
+}
+
+static void output_container_end(gboolean array)
+{
+   if (output_format == OUTPUT_JSON)
+      output_putc(array ? ']' : '}');
+   else if (output_format == OUTPUT_TLV)
+      output_putc(OUTPUT_TAG_END);
+   output_level -= 1;
+}
+
+static void output_begin(const char *type, gboolean oneline)
+{
+   OutputLevel *level = &output_levels[0];
+
+   output_level = 0;
+   level->array = FALSE;
+   level->first = TRUE;
+   level->key = NULL;
+   level->depth = 0;
+   output_oneline = oneline;
+   output_line_first = TRUE;
+
+   //! The type leads every record, human form leaves it out.
+   if (output_format == OUTPUT_JSON)
+      output_putc('{');
+   else if (output_format == OUTPUT_TLV)
+      output_putc(OUTPUT_TAG_OBJECT);
+   else
+      return;
+   output_field_begin("type", TRUE);
+   output_string(type, strlen(type), FALSE);
+}
+
+/**
+ * @brief Starts a record with one field per line in human form.
+ */
+void output_record_begin(const char *type)
+{
+   output_begin(type, FALSE);
+}
+
+/**
+ * @brief Starts a record printed on a single line in human form.
+ */
+void output_line_begin(const char *type)
+{
+   output_begin(type, TRUE);
+}
+
+void output_record_end()
+{
+   if (output_format == OUTPUT_JSON)
+      output_puts("}\n");
+   else if (output_format == OUTPUT_TLV)
+      output_putc(OUTPUT_TAG_END);
+   else if (output_oneline)
+      output_putc('\n');
+   output_level = -1;
+
+   // Records written in one go of the main loop go out in one write.
+   if (output_idle == 0)
+      output_idle = g_idle_add_full(G_PRIORITY_LOW, output_idle_cb, NULL, NULL);
+}
+
+/**
+ * @brief Starts a nested object.
+ *
+ * @param key Its key, NULL inside arrays.
+ */
+void output_object_begin(const char *key)
+{
+   output_container_begin(key, FALSE);
+}
+
+void output_object_end()
+{
+   output_container_end(FALSE);
+}
+
+/**
+ * @brief Starts a nested array.
+ *
+ * @param key Its key, NULL inside arrays.
+ */
+void output_array_begin(const char *key)
+{
+   output_container_begin(key, TRUE);
+}
+
+void output_array_end()
+{
+   output_container_end(TRUE);
+}
+
+/**
+ * @brief Adds a string field, key NULL inside arrays.
+ */
+void output_str(const char *key, const char *val)
+{
+   output_field_begin(key, TRUE);
+   output_string(val, strlen(val), FALSE);
+   output_field_end();
+}
+
+/**
+ * @brief Adds an integer field, key NULL inside arrays.
+ */
+void output_int(const char *key, gint64 val)
+{
+   output_field_begin(key, TRUE);
+   output_sint(val);
+   output_field_end();
+}
+
+/**
+ * @brief Adds any GVariant as a field, key NULL inside arrays. Containers
+ *  are written as nested objects and arrays, byte arrays as bytes.
+ */
+void output_value(const char *key, GVariant *val)
+{
+   output_field_begin(key, TRUE);
+   output_variant(val);
+   output_field_end();
+}
+
+/**
+ * @brief Writes out everything buffered, through the writer thread if
+ *  there is one.
+ */
+void output_flush()
+{
+   output_ship();
+}
+
+/**
+ * @brief Flushes, waits for the writer thread and releases the buffers.
+ */
+void output_close()
+{
+   OutputBuffer *buf = NULL;
+
+   output_ship();
+   if (output_idle)
+      g_source_remove(output_idle);
+   output_idle = 0;
+
+   if (output_thread != NULL)
+   {
+      g_async_queue_push(output_full, &output_stop);
+      g_thread_join(output_thread);
+      output_thread = NULL;
+      while ((buf = g_async_queue_try_pop(output_spare)) != NULL)
+         g_free(buf);
+      g_clear_pointer(&output_full, g_async_queue_unref);
+      g_clear_pointer(&output_spare, g_async_queue_unref);
+   }
+   g_clear_pointer(&output_buf, g_free);
+}
+
+/**
+ * @brief Selects the format and where records go. Flushes whatever the
+ *  previous setup buffered.
+ *
+ * @param spec "human", "json" or "tlv", ":thread" appended writes from a
+ *  writer thread.
+ * @param fd Destination, stays open.
+ *
+ * @returns FALSE if spec names no format.
+ */
+gboolean output_open(const char *spec, int fd)
+{
+   gchar **parts = g_strsplit(spec, ":", 2);
+   OutputFormat format = OUTPUT_HUMAN;
+   gboolean threaded = (parts[0] != NULL && parts[1] != NULL && g_str_equal(parts[1], "thread"));
+
+   if (parts[0] == NULL || (parts[1] != NULL && !threaded))
+   {
+      g_strfreev(parts);
+      return FALSE;
+   }
+   if (g_str_equal(parts[0], "json"))
+      format = OUTPUT_JSON;
+   else if (g_str_equal(parts[0], "tlv"))
+      format = OUTPUT_TLV;
+   else if (!g_str_equal(parts[0], "human"))
+   {
+      g_strfreev(parts);
+      return FALSE;
+   }
+   g_strfreev(parts);
+
+   output_close();
+   output_format = format;
+   output_fd = fd;
+   output_buf = g_new0(OutputBuffer, 1);
+   if (threaded)
+   {
+      output_full = g_async_queue_new();
+      output_spare = g_async_queue_new();
+      for (int i = 1; i < OUTPUT_BUFFERS; i++)
+         g_async_queue_push(output_spare, g_new0(OutputBuffer, 1));
+      output_thread = g_thread_new("output", output_thread_func, NULL);
+   }
+   if (format == OUTPUT_TLV)
+      output_put(OUTPUT_TLV_MAGIC, strlen(OUTPUT_TLV_MAGIC));
+   return TRUE;
+}
@@ -0,0 +1,121 @@
+/**
+* @file output.h
+* @brief Buffered structured output in human, JSON lines or binary TLV form.
+*
+* Output is a stream of records made of keyed fields, nested objects and
+* arrays. Values are formatted straight from their typed fields into a
+* large buffer which goes out in one write when full, when the main loop
+* is idle, or on output_flush(). A writer thread can take the writes off
+* the main thread. Records are written from the main thread only.
+*
+* Human records print "key: value" per line, nested levels indented as
+* " | key: value". Line records print their values on one line, space
+* separated. JSON writes one object per record and line, with a "type"
+* member. TLV starts with OUTPUT_TLV_MAGIC, then every item is a tag:
+*  OUTPUT_TAG_KEY, _STR, _BYTES: varint length and the bytes,
+*  OUTPUT_TAG_INT: zigzag varint, OUTPUT_TAG_UINT: varint,
+*  OUTPUT_TAG_DOUBLE: 8 bytes little endian,
+*  OUTPUT_TAG_TRUE, _FALSE, _NULL: nothing more,
+*  OUTPUT_TAG_OBJECT, _ARRAY: items up to OUTPUT_TAG_END.
+* A record is an object whose first key is "type".
+*/
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include <glib.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_BUFFERS 4       /** In flight to the writer thread at most. */
+#define OUTPUT_MAX_DEPTH 16
+#define OUTPUT_TLV_MAGIC "TUXOUT01"
+
+typedef enum
+{
+   OUTPUT_HUMAN,
+   OUTPUT_JSON,
+   OUTPUT_TLV
+} OutputFormat;
+
+typedef enum
+{
+   OUTPUT_TAG_END = 0x00,
+   OUTPUT_TAG_OBJECT = 0x01,
+   OUTPUT_TAG_ARRAY = 0x02,
+   OUTPUT_TAG_KEY = 0x03,
+   OUTPUT_TAG_STR = 0x04,
+   OUTPUT_TAG_BYTES = 0x05,
+   OUTPUT_TAG_INT = 0x06,
+   OUTPUT_TAG_UINT = 0x07,
+   OUTPUT_TAG_DOUBLE = 0x08,
+   OUTPUT_TAG_TRUE = 0x09,
+   OUTPUT_TAG_FALSE = 0x0A,
+   OUTPUT_TAG_NULL = 0x0B
+} OutputTag;
+
+/**
+ * @brief Selects the format and where records go. Flushes whatever the
+ *  previous setup buffered.
+ *
+ * @param spec "human", "json" or "tlv", ":thread" appended writes from a
+ *  writer thread.
+ * @param fd Destination, stays open.
+ *
+ * @returns FALSE if spec names no format.
+ */
+gboolean output_open(const char *spec, int fd);
+
+/**
+ * @brief Starts a record with one field per line in human form.
+ */
+void output_record_begin(const char *type);
+
+/**
+ * @brief Starts a record printed on a single line in human form.
+ */
+void output_line_begin(const char *type);
+
+void output_record_end();
+
+/**
+ * @brief Starts a nested object.
+ *
+ * @param key Its key, NULL inside arrays.
+ */
+void output_object_begin(const char *key);
+void output_object_end();
+
+/**
+ * @brief Starts a nested array.
+ *
+ * @param key Its key, NULL inside arrays.
+ */
+void output_array_begin(const char *key);
+void output_array_end();
+
+/**
+ * @brief Adds a string field, key NULL inside arrays.
+ */
+void output_str(const char *key, const char *val);
+
+/**
+ * @brief Adds an integer field, key NULL inside arrays.
+ */
+void output_int(const char *key, gint64 val);
+
+/**
+ * @brief Adds any GVariant as a field, key NULL inside arrays. Containers
+ *  are written as nested objects and arrays, byte arrays as bytes.
+ */
+void output_value(const char *key, GVariant *val);
+
+/**
+ * @brief Writes out everything buffered, through the writer thread if
+ *  there is one.
+ */
+void output_flush();
+
+/**
+ * @brief Flushes, waits for the writer thread and releases the buffers.
+ */
+void output_close();
+
+#endif // OUTPUT_H
@@ -0,0 +1,545 @@
+/**
+* @file pool.c
+* @brief Device records kept across rescans, keyed by object path.
+*/
+#include "pool.h"
+#include "metrics.h"
+
+/** @brief One pooled device. Everything it points to lives in arena. */
+typedef struct _PoolRecord
+{
+   Device dev;
+   Arena *arena;
+   gconstpointer data;  /** Serialized a{sa{sv}} the record was parsed from. */
+   gsize size;
+   guint generation;    /** Last refresh the object was part of. */
+   guint refs;          /** Snapshots holding the record, writer only. */
+} PoolRecord;
+
+/** @brief A published snapshot and the records backing it. */
+typedef struct _PoolVersion
+{
+   DeviceSnapshot snap;
+   DevicePool *pool;
+   PoolRecord **records;
+} PoolVersion;
+
+/** @brief An object of the reply being staged. */
+typedef struct _PoolStaged
+{
+   PoolRecord *old;     /** Published record for the path, NULL if new. */
+   PoolRecord *fresh;   /** Reparsed record, NULL if old is unchanged. */
+} PoolStaged;
+
+/** @brief Links a staging task back to its pool, cut when the pool goes first. */
+typedef struct _PoolJob
+{
+   DevicePool *pool;
+} PoolJob;
+
+/** @brief A queued device_pool_refresh_async() call. */
+typedef struct _PoolRequest
+{
+   GDBusConnection *conn;
+   DiffFunc changes;
+   DevicePoolFunc done;
+   gpointer user_data;
+} PoolRequest;
+
+struct _DevicePool
+{
+   GHashTable *index;     /** Object path -> PoolRecord, published records. */
+   GPtrArray *spare;      /** Recycled PoolRecord, arenas already reset. */
+   GArray *staged;        /** PoolStaged of the reply being applied. */
+   PoolVersion *current;  /** Latest snapshot, loaded atomically by readers. */
+   EpochDomain *epoch;    /** Replaced snapshots wait here for their readers. */
+   guint generation;
+
+   GVariant *reply;
+   GVariant *objects;
+   GVariantIter iter;
+
+   GQueue requests;
+   gboolean fetching;     /** The head request is out, until its done returns. */
+   GCancellable *cancel;
+   PoolJob *job;          /** Staging task in flight, NULL if none. */
+   GMutex lock;
+   GCond staged_cond;
+   gboolean staging;      /** Worker is inside device_pool_step(). */
+
+   guint kept;            /** Stats of the last commit. */
+   guint parsed;
+   guint recycled;
+};
+
+static void device_pool_refresh_start(DevicePool *pool);
+
+DevicePool *device_pool_new()
+{
+   DevicePool *pool = g_new0(DevicePool, 1);
+   pool->index = g_hash_table_new(g_str_hash, g_str_equal);
+   pool->spare = g_ptr_array_new();
+   pool->staged = g_array_new(FALSE, FALSE, sizeof(PoolStaged));
+   pool->epoch = epoch_domain_new();
+   pool->current = g_new0(PoolVersion, 1);
+   pool->current->pool = pool;
+   pool->cancel = g_cancellable_new();
+   g_queue_init(&pool->requests);
+   g_mutex_init(&pool->lock);
+   g_cond_init(&pool->staged_cond);
+   return pool;
+}
+
+static PoolRecord *device_pool_take_record(DevicePool *pool)
+{
+   if (pool->spare->len > 0)
+      return g_ptr_array_remove_index_fast(pool->spare, pool->spare->len - 1);
+
+   PoolRecord *rec = g_new0(PoolRecord, 1);
+   rec->arena = arena_new(POOL_RECORD_CHUNK);
+   return rec;
+}
+
+static void device_pool_recycle(DevicePool *pool, PoolRecord *rec)
+{
+   Arena *arena = rec->arena;
+
+   // Keeps the first chunk, the next parse into this record won't malloc.
+   arena_reset(arena);
+   memset(rec, 0, sizeof(*rec));
+   rec->arena = arena;
+   g_ptr_array_add(pool->spare, rec);
+   pool->recycled += 1;
+}
+
+static PoolVersion *device_pool_version_new(DevicePool *pool, gsize num_devices)
+{
+   // One block, the snapshot is freed as a whole.
+   PoolVersion *version = g_malloc0(sizeof(PoolVersion)
+                                    + num_devices * (sizeof(Device) + sizeof(PoolRecord *)));
+   Device *devices = (Device *)(version + 1);
+
+   version->pool = pool;
+   version->records = (PoolRecord **)(devices + num_devices);
+   version->snap.generation = pool->generation;
+   version->snap.num_devices = num_devices;
+   version->snap.devices = devices;
+   return version;
+}
+
+static void device_pool_version_free(gpointer arg)
+{
+   PoolVersion *version = arg;
+
+   //! Records shared with a newer snapshot are still referenced there.
+   for (gsize i = 0; i < version->snap.num_devices; i++)
+   {
+      PoolRecord *rec = version->records[i];
+      if (--rec->refs == 0)
+         device_pool_recycle(version->pool, rec);
+   }
+   g_free(version);
+}
+
+static void device_pool_record_free(PoolRecord *rec)
+{
+   arena_free(rec->arena);
+   g_free(rec);
+}
+
+/**
+ * @brief Starts staging a GetManagedObjects reply. Nothing visible
+ *  changes until device_pool_commit().
+ *
+ * @param reply A (a{oa{sa{sv}}}) reply, not consumed.
+ */
+void device_pool_begin(DevicePool *pool, GVariant *reply)
+{
+   pool->reply = g_variant_ref(reply);
+   pool->objects = g_variant_get_child_value(reply, 0);
+   g_variant_iter_init(&pool->iter, pool->objects);
+   g_array_set_size(pool->staged, 0);
+   pool->generation += 1;
+}
+
+static void device_pool_stage(DevicePool *pool, GVariant *object, GVariant *interface_array)
+{
+   const gchar *path = g_variant_get_string(object, NULL);
+   gconstpointer data = g_variant_get_data(interface_array);
+   gsize size = g_variant_get_size(interface_array);
+   PoolStaged staged = { g_hash_table_lookup(pool->index, path), NULL };
+
+   if (staged.old != NULL)
+      staged.old->generation = pool->generation;
+
+   //! Byte identical interfaces parse to the same record, keep it.
+   if (staged.old == NULL || staged.old->size != size || memcmp(staged.old->data, data, size) != 0)
+   {
+      PoolRecord *rec = device_pool_take_record(pool);
+      rec->generation = pool->generation;
+      rec->size = size;
+      rec->data = memcpy(arena_alloc(rec->arena, size), data, size);
+
+      // The copy, not the reply, backs the record, so a kept record
+      // doesn't pin the whole reply it came from.
+      GVariant *copy = g_variant_new_from_data(G_VARIANT_TYPE("a{sa{sv}}"),
+                                               rec->data, size, FALSE, NULL, NULL);
+      arena_keep(rec->arena, copy);
+      rec->dev.arena = rec->arena;
+      bluez_parse_object(&rec->dev, arena_strdup(rec->arena, path), copy);
+      staged.fresh = rec;
+   }
+   g_array_append_val(pool->staged, staged);
+}
+
+/**
+ * @brief Stages up to max_objects more objects of the reply. Only reads
+ *  published records, so it may run on another thread while they are in
+ *  use, as long as nothing commits meanwhile.
+ *
+ * @returns TRUE once every object is staged.
+ */
+gboolean device_pool_step(DevicePool *pool, gsize max_objects)
+{
+   GVariant *object = NULL;
+   GVariant *interface_array = NULL;
+
+   for (gsize n = 0; n < max_objects; n++)
+   {
+      if (!g_variant_iter_next(&pool->iter, "{@o@a{sa{sv}}}", &object, &interface_array))
+         return TRUE;
+
+      device_pool_stage(pool, object, interface_array);
+      g_variant_unref(object);
+      g_variant_unref(interface_array);
+   }
+   return FALSE;
+}
+
+/**
+ * @brief Publishes the staged reply as a new snapshot. Changes are
+ *  reported through callback before the snapshot goes live. One thread
+ *  commits, the same one every time.
+ *
+ * @param callback Receives every change, may be NULL.
+ * @param user_data Passed to callback.
+ *
+ * @returns Records that were added, reparsed or removed.
+ */
+gsize device_pool_commit(DevicePool *pool, DiffFunc callback, gpointer user_data)
+{
+   GHashTableIter iter;
+   PoolRecord *rec = NULL;
+   PoolVersion *version = NULL;
+   PoolVersion *replaced = pool->current;
+   gsize changed = 0;
+   gsize cache_bytes = 0;
+
+   pool->kept = 0;
+   pool->parsed = 0;
+   pool->recycled = 0;
+
+   //! Report first, while both versions of every record are intact.
+   for (guint i = 0; i < pool->staged->len; i++)
+   {
+      PoolStaged *staged = &g_array_index(pool->staged, PoolStaged, i);
+      if (staged->fresh == NULL)
+         continue;
+      if (callback != NULL)
+         diff_device(staged->old ? &staged->old->dev : NULL, &staged->fresh->dev, callback, user_data);
+      changed += 1;
+   }
+
+   g_hash_table_iter_init(&iter, pool->index);
+   while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&rec))
+   {
+      if (rec->generation == pool->generation)
+         continue;
+      if (callback != NULL)
+         diff_device(&rec->dev, NULL, callback, user_data);
+      // Readers of the current snapshot may still use it.
+      g_hash_table_iter_remove(&iter);
+      changed += 1;
+   }
+
+   //! Swap in the reparsed records and build the snapshot in reply order.
+   version = device_pool_version_new(pool, pool->staged->len);
+   for (guint i = 0; i < pool->staged->len; i++)
+   {
+      PoolStaged *staged = &g_array_index(pool->staged, PoolStaged, i);
+      if (staged->fresh != NULL)
+      {
+         g_hash_table_replace(pool->index, staged->fresh->dev.obj_path, staged->fresh);
+         pool->parsed += 1;
+      }
+      else
+         pool->kept += 1;
+      rec = staged->fresh ? staged->fresh : staged->old;
+      rec->refs += 1;
+      cache_bytes += arena_used(rec->arena);
+      version->records[i] = rec;
+      ((Device *)version->snap.devices)[i] = rec->dev;
+   }
+
+   //! Publish, then recycle whatever no reader holds any more.
+   g_atomic_pointer_set(&pool->current, version);
+   epoch_retire(pool->epoch, replaced, device_pool_version_free);
+   epoch_reclaim(pool->epoch);
+   metrics_set(METRIC_DEVICES, version->snap.num_devices);
+   metrics_set(METRIC_CACHE_BYTES, cache_bytes);
+
+   g_array_set_size(pool->staged, 0);
+   g_clear_pointer(&pool->objects, g_variant_unref);
+   g_clear_pointer(&pool->reply, g_variant_unref);
+   return changed;
+}
+
+static void device_pool_request_done(DevicePool *pool, gsize changed)
+{
+   PoolRequest *request = g_queue_pop_head(&pool->requests);
+
+   //! Still fetching while done runs, a refresh it asks for only queues.
+   if (request->done != NULL)
+      request->done(pool, changed, request->user_data);
+   g_object_unref(request->conn);
+   g_free(request);
+
+   pool->fetching = FALSE;
+   if (!g_queue_is_empty(&pool->requests))
+      device_pool_refresh_start(pool);
+}
+
+static void device_pool_stage_thread(GTask *task, gpointer source, gpointer task_data, GCancellable *cancel)
+{
+   DevicePool *pool = ((PoolJob *)task_data)->pool;
+
+   device_pool_step(pool, G_MAXSIZE);
+
+   g_mutex_lock(&pool->lock);
+   pool->staging = FALSE;
+   g_cond_signal(&pool->staged_cond);
+   g_mutex_unlock(&pool->lock);
+   g_task_return_boolean(task, TRUE);
+}
+
+/**
+ * @brief Waits for the staging worker and cuts its task loose. The staged
+ *  reply is left for the caller to publish or drop.
+ */
+static void device_pool_join(DevicePool *pool)
+{
+   g_mutex_lock(&pool->lock);
+   while (pool->staging)
+      g_cond_wait(&pool->staged_cond, &pool->lock);
+   g_mutex_unlock(&pool->lock);
+   pool->job->pool = NULL;
+   pool->job = NULL;
+}
+
+static void device_pool_publish(DevicePool *pool)
+{
+   PoolRequest *request = g_queue_peek_head(&pool->requests);
+   device_pool_request_done(pool, device_pool_commit(pool, request->changes, request->user_data));
+}
+
+static void device_pool_staged_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   PoolJob *job = arg;
+   DevicePool *pool = job->pool;
+
+   g_free(job);
+   if (pool == NULL)
+      return;
+
+   //! Back on the main loop, the new records go live in one step.
+   pool->job = NULL;
+   device_pool_publish(pool);
+}
+
+static void device_pool_reply_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   DevicePool *pool = arg;
+   GError *error = NULL;
+   GVariant *result = NULL;
+
+   result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+   dbus_check_error(error);
+
+   device_pool_begin(pool, result);
+   g_variant_unref(result);
+
+   //! Staging runs on a worker, the main loop keeps dispatching signals.
+   pool->job = g_new0(PoolJob, 1);
+   pool->job->pool = pool;
+   pool->staging = TRUE;
+   GTask *task = g_task_new(NULL, NULL, device_pool_staged_cb, pool->job);
+   g_task_set_task_data(task, pool->job, NULL);
+   g_task_run_in_thread(task, device_pool_stage_thread);
+   g_object_unref(task);
+}
+
+/**
+ * @brief Stages and publishes a reply in one go.
+ */
+gsize device_pool_update(DevicePool *pool, GVariant *reply, DiffFunc callback, gpointer user_data)
+{
+   // A refresh staged in the background can't share the staging area,
+   // publish it first so both land in the order they were received.
+   if (pool->job != NULL)
+   {
+      device_pool_join(pool);
+      device_pool_publish(pool);
+   }
+   device_pool_begin(pool, reply);
+   device_pool_step(pool, G_MAXSIZE);
+   return device_pool_commit(pool, callback, user_data);
+}
+
+static void device_pool_refresh_start(DevicePool *pool)
+{
+   PoolRequest *request = g_queue_peek_head(&pool->requests);
+
+   pool->fetching = TRUE;
+   g_dbus_connection_call(request->conn,
+            BLUEZ_ORG,
+            "/",
+            FREE_OBJECT_MANAGER,
+            "GetManagedObjects",
+            NULL,
+            G_VARIANT_TYPE("(a{oa{sa{sv}}})"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            pool->cancel,
+            device_pool_reply_cb,
+            pool);
+}
+
+/**
+ * @brief Fetches GetManagedObjects and applies it to the pool. The reply
+ *  is staged on a worker thread and published from the main loop in one
+ *  step. Refreshes requested while one is running, its done included,
+ *  are queued behind it.
+ *
+ * @param conn Connection handle to dbus.
+ * @param changes Receives every change, may be NULL.
+ * @param done Called once the refresh is published, may be NULL.
+ * @param user_data Passed to changes and done.
+ */
+void device_pool_refresh_async(DevicePool *pool, GDBusConnection *conn,
+                               DiffFunc changes, DevicePoolFunc done, gpointer user_data)
+{
+   PoolRequest *request = g_new0(PoolRequest, 1);
+   request->conn = g_object_ref(conn);
+   request->changes = changes;
+   request->done = done;
+   request->user_data = user_data;
+
+   g_queue_push_tail(&pool->requests, request);
+   if (!pool->fetching)
+      device_pool_refresh_start(pool);
+}
+
+/**
+ * @brief The published records, in reply order.
+ *
+ * @param num_devices Set to the size of the array.
+ *
+ * @returns An array owned by the pool, valid until the next commit.
+ */
+Device *device_pool_devices(DevicePool *pool, gsize *num_devices)
+{
+   *num_devices = pool->current->snap.num_devices;
+   return (Device *)pool->current->snap.devices;
+}
+
+/**
+ * @brief Registers a reader thread, see device_pool_read_begin().
+ *
+ * @returns The reader, NULL if EPOCH_MAX_READERS are registered.
+ */
+EpochReader *device_pool_reader_new(DevicePool *pool)
+{
+   return epoch_reader_new(pool->epoch);
+}
+
+/**
+ * @brief Loads the latest snapshot without locking. Any thread may call
+ *  it, each with its own reader.
+ *
+ * @returns The snapshot, valid until device_pool_read_end().
+ */
+const DeviceSnapshot *device_pool_read_begin(DevicePool *pool, EpochReader *reader)
+{
+   epoch_enter(reader);
+   return &((PoolVersion *)g_atomic_pointer_get(&pool->current))->snap;
+}
+
+/**
+ * @brief Ends a read, the snapshot may be recycled from now on.
+ */
+void device_pool_read_end(EpochReader *reader)
+{
+   epoch_exit(reader);
+}
+
+/**
+ * @brief Unregisters a reader, outside of a read.
+ */
+void device_pool_reader_free(EpochReader *reader)
+{
+   epoch_reader_free(reader);
+}
+
+/**
+ * @brief Prints how many records the last commit kept, parsed and recycled.
+ */
+void device_pool_print_stats(const DevicePool *pool)
+{
+   g_print("Records: %u kept, %u parsed, %u recycled, %u spare\n",
+           pool->kept, pool->parsed, pool->recycled, pool->spare->len);
+}
+
+void device_pool_free(DevicePool *pool)
+{
+   PoolRequest *request = NULL;
+
+   if (pool == NULL)
+      return;
+   g_cancellable_cancel(pool->cancel);
+   // The worker uses the pool until it is done staging.
+   if (pool->job != NULL)
+      device_pool_join(pool);
+   while ((request = g_queue_pop_head(&pool->requests)) != NULL)
+   {
+      g_object_unref(request->conn);
+      g_free(request);
+   }
+
+   //! Records staged but never published.
+   for (guint i = 0; i < pool->staged->len; i++)
+   {
+      PoolStaged *staged = &g_array_index(pool->staged, PoolStaged, i);
+      if (staged->fresh != NULL)
+         device_pool_record_free(staged->fresh);
+   }
+   // Every published record ends up spare once no snapshot holds it.
+   epoch_domain_free(pool->epoch);
+   device_pool_version_free(pool->current);
+   for (guint i = 0; i < pool->spare->len; i++)
+      device_pool_record_free(g_ptr_array_index(pool->spare, i));
+
+   g_clear_pointer(&pool->objects, g_variant_unref);
+   g_clear_pointer(&pool->reply, g_variant_unref);
+   g_hash_table_destroy(pool->index);
+   g_ptr_array_free(pool->spare, TRUE);
+   g_array_free(pool->staged, TRUE);
+   g_object_unref(pool->cancel);
+   g_mutex_clear(&pool->lock);
+   g_cond_clear(&pool->staged_cond);
+   g_free(pool);
+}
@@ -0,0 +1,140 @@
+/**
+* @file pool.h
+* @brief Device records kept across rescans, keyed by object path.
+*
+* Each record owns a small arena holding a copy of its object's serialized
+* interfaces and everything parsed from them. A refresh compares every
+* object of a new GetManagedObjects reply against that copy: unchanged
+* records are kept as they are, changed and new ones are parsed into
+* recycled records, and records of vanished objects go back to the spare
+* list. Once the population is stable, rescans allocate no records.
+*
+* Every commit publishes an immutable snapshot. Readers on other threads
+* load it between device_pool_read_begin() and device_pool_read_end()
+* without locking. Records of a replaced snapshot are recycled once its
+* last reader has left.
+*/
+#ifndef POOL_H
+#define POOL_H
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "bluez.h"
+#include "diff.h"
+#include "epoch.h"
+
+#define POOL_RECORD_CHUNK 8192 /** Arena chunk per record, fits a typical device. */
+
+/** @brief A set of device records, see device_pool_new(). */
+typedef struct _DevicePool DevicePool;
+
+/** @brief The devices published by one commit, never modified. */
+typedef struct _DeviceSnapshot
+{
+   guint generation;      /** Refresh the snapshot was published by. */
+   gsize num_devices;
+   const Device *devices; /** In reply order. */
+} DeviceSnapshot;
+
+/**
+ * @brief Called once a refresh is published.
+ *
+ * @param pool The pool.
+ * @param changed Records that were added, reparsed or removed.
+ * @param user_data Passed to device_pool_refresh_async().
+ */
+typedef void (*DevicePoolFunc)(DevicePool *pool, gsize changed, gpointer user_data);
+
+DevicePool *device_pool_new();
+
+/**
+ * @brief Starts staging a GetManagedObjects reply. Nothing visible
+ *  changes until device_pool_commit().
+ *
+ * @param reply A (a{oa{sa{sv}}}) reply, not consumed.
+ */
+void device_pool_begin(DevicePool *pool, GVariant *reply);
+
+/**
+ * @brief Stages up to max_objects more objects of the reply. Only reads
+ *  published records, so it may run on another thread while they are in
+ *  use, as long as nothing commits meanwhile.
+ *
+ * @returns TRUE once every object is staged.
+ */
+gboolean device_pool_step(DevicePool *pool, gsize max_objects);
+
+/**
+ * @brief Publishes the staged reply as a new snapshot. Changes are
+ *  reported through callback before the snapshot goes live. One thread
+ *  commits, the same one every time.
+ *
+ * @param callback Receives every change, may be NULL.
+ * @param user_data Passed to callback.
+ *
+ * @returns Records that were added, reparsed or removed.
+ */
+gsize device_pool_commit(DevicePool *pool, DiffFunc callback, gpointer user_data);
+
+/**
+ * @brief Stages and publishes a reply in one go.
+ */
+gsize device_pool_update(DevicePool *pool, GVariant *reply, DiffFunc callback, gpointer user_data);
+
+/**
+ * @brief Fetches GetManagedObjects and applies it to the pool. The reply
+ *  is staged on a worker thread and published from the main loop in one
+ *  step. Refreshes requested while one is running, its done included,
+ *  are queued behind it.
+ *
+ * @param conn Connection handle to dbus.
+ * @param changes Receives every change, may be NULL.
+ * @param done Called once the refresh is published, may be NULL.
+ * @param user_data Passed to changes and done.
+ */
+void device_pool_refresh_async(DevicePool *pool, GDBusConnection *conn,
+                               DiffFunc changes, DevicePoolFunc done, gpointer user_data);
+
+/**
+ * @brief The published records, in reply order.
+ *
+ * @param num_devices Set to the size of the array.
+ *
+ * @returns An array owned by the pool, valid until the next commit.
+ *  Only for the thread that commits, others read snapshots.
+ */
+Device *device_pool_devices(DevicePool *pool, gsize *num_devices);
+
+/**
+ * @brief Registers a reader thread, see device_pool_read_begin().
+ *
+ * @returns The reader, NULL if EPOCH_MAX_READERS are registered.
+ */
+EpochReader *device_pool_reader_new(DevicePool *pool);
+
+/**
+ * @brief Loads the latest snapshot without locking. Any thread may call
+ *  it, each with its own reader.
+ *
+ * @returns The snapshot, valid until device_pool_read_end().
+ */
+const DeviceSnapshot *device_pool_read_begin(DevicePool *pool, EpochReader *reader);
+
+/**
+ * @brief Ends a read, the snapshot may be recycled from now on.
+ */
+void device_pool_read_end(EpochReader *reader);
+
+/**
+ * @brief Unregisters a reader, outside of a read.
+ */
+void device_pool_reader_free(EpochReader *reader);
+
+/**
+ * @brief Prints how many records the last commit kept, parsed and recycled.
+ */
+void device_pool_print_stats(const DevicePool *pool);
+
+void device_pool_free(DevicePool *pool);
+
+#endif // POOL_H
@@ -0,0 +1,209 @@
+/**
+* @file presence.c
+* @brief Zone presence of tags from their RSSI updates.
+*/
+#include <stdio.h>
+
+#include "presence.h"
+
+/** @brief State of one tag, no samples are kept. */
+typedef struct _PresenceTag
+{
+   gchar *path;
+   gdouble rssi;
+   gboolean present;
+   gboolean near;
+   gint64 heard;     /** Monotonic time of the last sample. */
+   GList link;       /** In Presence.by_heard, data is the tag. */
+} PresenceTag;
+
+struct _Presence
+{
+   PresenceConfig config;
+   PresenceEventFunc func;
+   gpointer user_data;
+   GHashTable *tags;    /** Path to PresenceTag, keys owned by the tags. */
+   GQueue by_heard;     /** Least recently heard first, expiry stops early. */
+   guint present;
+   guint timer;
+};
+
+static void presence_tag_free(PresenceTag *tag)
+{
+   g_free(tag->path);
+   g_free(tag);
+}
+
+static void presence_emit(Presence *presence, PresenceTag *tag, PresenceEventKind kind)
+{
+   PresenceEvent event = { kind, tag->path, tag->rssi, g_get_real_time() };
+
+   if (kind == PRESENCE_ENTER)
+      presence->present += 1;
+   else if (kind == PRESENCE_LEAVE)
+      presence->present -= 1;
+   presence->func(&event, presence->user_data);
+}
+
+static gboolean presence_tick_cb(gpointer arg)
+{
+   presence_expire(arg);
+   return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Fills config from "enter[:near[:hysteresis[:timeout]]]", dBm,
+ *  dB and seconds. Missing fields keep the defaults.
+ *
+ * @returns FALSE if the spec couldn't be parsed.
+ */
+gboolean presence_parse_config(const char *spec, PresenceConfig *config)
+{
+   gdouble timeout = PRESENCE_TIMEOUT_MS / 1000.0;
+
+   config->enter_dbm = PRESENCE_ENTER_DBM;
+   config->near_dbm = PRESENCE_NEAR_DBM;
+   config->hysteresis_db = PRESENCE_HYSTERESIS_DB;
+   config->smoothing = PRESENCE_SMOOTHING;
+   if (spec != NULL && sscanf(spec, "%d:%d:%u:%lf", &config->enter_dbm, &config->near_dbm,
+                              &config->hysteresis_db, &timeout) < 1)
+      return FALSE;
+   if (timeout <= 0)
+      return FALSE;
+   config->timeout_ms = timeout * 1000;
+   return TRUE;
+}
+
+/**
+ * @brief Creates an engine, timeouts are checked from the main loop.
+ */
+Presence *presence_new(const PresenceConfig *config, PresenceEventFunc func, gpointer user_data)
+{
+   Presence *presence = g_new0(Presence, 1);
+
+   presence->config = *config;
+   presence->func = func;
+   presence->user_data = user_data;
+   presence->tags = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)presence_tag_free);
+   g_queue_init(&presence->by_heard);
+   presence->timer = g_timeout_add(PRESENCE_TICK_MS, presence_tick_cb, presence);
+   return presence;
+}
+
+/**
+ * @brief Feeds one RSSI update. Events for the tag are emitted before
+ *  this returns.
+ */
+void presence_sample(Presence *presence, const char *path, gint16 rssi)
+{
+   const PresenceConfig *config = &presence->config;
+   PresenceTag *tag = g_hash_table_lookup(presence->tags, path);
+
+   if (tag == NULL)
+   {
+      tag = g_new0(PresenceTag, 1);
+      tag->path = g_strdup(path);
+      tag->rssi = rssi;
+      tag->link.data = tag;
+      g_hash_table_insert(presence->tags, tag->path, tag);
+   }
+   else
+   {
+      tag->rssi += config->smoothing * (rssi - tag->rssi);
+      g_queue_unlink(&presence->by_heard, &tag->link);
+   }
+   tag->heard = g_get_monotonic_time();
+   g_queue_push_tail_link(&presence->by_heard, &tag->link);
+
+   //! Crossing in needs the threshold, crossing out the threshold minus
+   //! the hysteresis, so noise around either doesn't flap.
+   if (!tag->present && tag->rssi >= config->enter_dbm)
+   {
+      tag->present = TRUE;
+      presence_emit(presence, tag, PRESENCE_ENTER);
+   }
+   else if (tag->present && tag->rssi < config->enter_dbm - (gint)config->hysteresis_db)
+   {
+      tag->present = FALSE;
+      tag->near = FALSE;
+      presence_emit(presence, tag, PRESENCE_LEAVE);
+      return;
+   }
+   if (!tag->present)
+      return;
+
+   if (!tag->near && tag->rssi >= config->near_dbm)
+   {
+      tag->near = TRUE;
+      presence_emit(presence, tag, PRESENCE_NEAR);
+   }
+   else if (tag->near && tag->rssi < config->near_dbm - (gint)config->hysteresis_db)
+   {
+      tag->near = FALSE;
+      presence_emit(presence, tag, PRESENCE_FAR);
+   }
+}
+
+/**
+ * @brief Sends leave for every tag not heard within the timeout and
+ *  forgets it. Runs every PRESENCE_TICK_MS on its own.
+ *
+ * @returns Number of tags forgotten.
+ */
+guint presence_expire(Presence *presence)
+{
+   gint64 limit = g_get_monotonic_time() - (gint64)presence->config.timeout_ms * 1000;
+   GList *link = NULL;
+   guint expired = 0;
+
+   while ((link = presence->by_heard.head) != NULL)
+   {
+      PresenceTag *tag = link->data;
+
+      if (tag->heard > limit)
+         break;
+      g_queue_unlink(&presence->by_heard, link);
+      if (tag->present)
+         presence_emit(presence, tag, PRESENCE_LEAVE);
+      g_hash_table_remove(presence->tags, tag->path);
+      expired += 1;
+   }
+   return expired;
+}
+
+/**
+ * @brief Number of tags currently in the zone.
+ */
+guint presence_count(Presence *presence)
+{
+   return presence->present;
+}
+
+const char *presence_event_name(PresenceEventKind kind)
+{
+   switch (kind)
+   {
+      case PRESENCE_ENTER:
+         return "enter";
+      case PRESENCE_LEAVE:
+         return "leave";
+      case PRESENCE_NEAR:
+         return "near";
+      case PRESENCE_FAR:
+         return "far";
+      default:
+         return "unknown";
+   }
+}
+
+/**
+ * @brief Stops the timer and frees every tag, without events.
+ */
+void presence_free(Presence *presence)
+{
+   if (presence == NULL)
+      return;
+   g_source_remove(presence->timer);
+   g_hash_table_destroy(presence->tags);
+   g_free(presence);
+}
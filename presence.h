@@ -0,0 +1,93 @@
+/**
+* @file presence.h
+* @brief Zone presence of tags from their RSSI updates.
+*
+* Every sample moves an exponentially smoothed RSSI per tag, nothing
+* else is kept. A tag enters the zone when the smoothed value reaches
+* enter_dbm and leaves when it drops hysteresis dB below it, or when it
+* isn't heard for the timeout. Inside the zone the same band around
+* near_dbm gives near and far. Decisions are taken as samples arrive,
+* timeouts within PRESENCE_TICK_MS.
+*/
+#ifndef PRESENCE_H
+#define PRESENCE_H
+#include <glib.h>
+
+#define PRESENCE_TICK_MS 200
+#define PRESENCE_ENTER_DBM -80
+#define PRESENCE_NEAR_DBM -60
+#define PRESENCE_HYSTERESIS_DB 5
+#define PRESENCE_TIMEOUT_MS 10000
+#define PRESENCE_SMOOTHING 0.3  /** Weight of a new sample. */
+
+typedef enum
+{
+   PRESENCE_ENTER,
+   PRESENCE_LEAVE,   /** Also ends near, no far is sent before it. */
+   PRESENCE_NEAR,
+   PRESENCE_FAR
+} PresenceEventKind;
+
+/** @brief Thresholds, see the file description. */
+typedef struct _PresenceConfig
+{
+   gint enter_dbm;
+   gint near_dbm;
+   guint hysteresis_db;
+   guint timeout_ms;
+   gdouble smoothing;
+} PresenceConfig;
+
+/** @brief A decision about one tag. */
+typedef struct _PresenceEvent
+{
+   PresenceEventKind kind;
+   const char *path;    /** Object path of the tag, valid during the call. */
+   gdouble rssi;        /** Smoothed RSSI at the time of the decision. */
+   gint64 time;         /** Wall clock, microseconds since the epoch. */
+} PresenceEvent;
+
+typedef void (*PresenceEventFunc)(const PresenceEvent *event, gpointer user_data);
+
+typedef struct _Presence Presence;
+
+/**
+ * @brief Fills config from "enter[:near[:hysteresis[:timeout]]]", dBm,
+ *  dB and seconds. Missing fields keep the defaults.
+ *
+ * @returns FALSE if the spec couldn't be parsed.
+ */
+gboolean presence_parse_config(const char *spec, PresenceConfig *config);
+
+/**
+ * @brief Creates an engine, timeouts are checked from the main loop.
+ */
+Presence *presence_new(const PresenceConfig *config, PresenceEventFunc func, gpointer user_data);
+
+/**
+ * @brief Feeds one RSSI update. Events for the tag are emitted before
+ *  this returns.
+ */
+void presence_sample(Presence *presence, const char *path, gint16 rssi);
+
+/**
+ * @brief Sends leave for every tag not heard within the timeout and
+ *  forgets it. Runs every PRESENCE_TICK_MS on its own.
+ *
+ * @returns Number of tags forgotten.
+ */
+guint presence_expire(Presence *presence);
+
+/**
+ * @brief Number of tags currently in the zone.
+ */
+guint presence_count(Presence *presence);
+
+const char *presence_event_name(PresenceEventKind kind);
+
+/**
+ * @brief Stops the timer and frees every tag, without events.
+ */
+void presence_free(Presence *presence);
+
+#endif // PRESENCE_H
@@ -0,0 +1,397 @@
+/**
+* @file record.c
+* @brief Records the bluez signal stream to a file and replays it.
+*/
+#include "record.h"
+#include "bluez.h"
+
+/** @brief A recording being played back. */
+struct _Replay
+{
+   GMappedFile *file;
+   GBytes *bytes;
+   const guint8 *data;
+   gsize len;
+   gsize pos;
+   gdouble speed;
+   ReplayFunc callback;
+   ReplayDoneFunc done;
+   gpointer user_data;
+   guint source;
+   gint64 started;      /** Monotonic time playback started. */
+   gint64 finished;
+   guint64 events;
+   guint64 late;
+   gint64 max_lag_us;
+   gboolean corrupt;
+};
+
+/** @brief A method call to bluez waiting for its reply. */
+typedef struct _RecordCall
+{
+   gchar *path;
+   gchar *iface;
+   gchar *method;
+} RecordCall;
+
+static FILE *record_fp = NULL;
+static GDBusConnection *record_conn = NULL;
+static guint record_sub = 0;
+static guint record_filter = 0;
+static gint64 record_started = 0;
+static GHashTable *record_calls = NULL;   /** Serial to RecordCall, filter only. */
+static GMutex record_lock;                /** Signals and replies write from different threads. */
+
+static void record_put_u16(guint8 *p, gsize v)
+{
+   guint16 le = GUINT16_TO_LE((guint16)v);
+   memcpy(p, &le, sizeof(le));
+}
+
+static void record_write(RecordKind kind, const char *sender, const char *path,
+                         const char *iface, const char *member, GVariant *body)
+{
+   const char *strings[] = { sender ? sender : "", path ? path : "", iface ? iface : "",
+                             member ? member : "", g_variant_get_type_string(body) };
+   guint8 header[RECORD_HEADER_SIZE];
+   guint64 time_us = 0;
+   GVariant *le_body = NULL;
+
+   //! Bodies are stored in little endian serialization.
+   if (G_BYTE_ORDER == G_BIG_ENDIAN)
+      le_body = g_variant_byteswap(body);
+   else
+      le_body = g_variant_ref(body);
+   guint32 body_len = GUINT32_TO_LE(g_variant_get_size(le_body));
+
+   header[0] = kind;
+   for (int i = 0; i < G_N_ELEMENTS(strings); i++)
+      record_put_u16(header + 9 + 2 * i, strlen(strings[i]) + 1);
+   memcpy(header + 19, &body_len, sizeof(body_len));
+
+   //! Stamped under the lock, so entries from both threads stay in time order.
+   g_mutex_lock(&record_lock);
+   if (record_fp != NULL)
+   {
+      time_us = GUINT64_TO_LE(g_get_monotonic_time() - record_started);
+      memcpy(header + 1, &time_us, sizeof(time_us));
+      fwrite(header, 1, sizeof(header), record_fp);
+      for (int i = 0; i < G_N_ELEMENTS(strings); i++)
+         fwrite(strings[i], 1, strlen(strings[i]) + 1, record_fp);
+      fwrite(g_variant_get_data(le_body), 1, g_variant_get_size(le_body), record_fp);
+   }
+   g_mutex_unlock(&record_lock);
+   g_variant_unref(le_body);
+}
+
+static void record_signal_cb(GDBusConnection *conn,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   record_write(RECORD_SIGNAL, sender_name, object_path, interface, signal_name, parameters);
+}
+
+static void record_call_free(RecordCall *call)
+{
+   g_free(call->path);
+   g_free(call->iface);
+   g_free(call->method);
+   g_free(call);
+}
+
+/**
+ * @brief Writes the reply or error of a recorded call, under the path,
+ *  interface and method of the call it answers.
+ */
+static void record_answer(RecordCall *call, GDBusMessage *message)
+{
+   GVariant *body = g_dbus_message_get_body(message);
+
+   //! An error is stored as (name, message), whatever body it came with.
+   if (g_dbus_message_get_message_type(message) == G_DBUS_MESSAGE_TYPE_ERROR)
+   {
+      const char *text = "";
+      if (body != NULL && g_variant_is_of_type(body, G_VARIANT_TYPE("(s)")))
+         g_variant_get(body, "(&s)", &text);
+      body = g_variant_new("(ss)", g_dbus_message_get_error_name(message), text);
+   }
+   else if (body == NULL)
+   {
+      body = g_variant_new("()");
+   }
+   else
+   {
+      body = g_variant_ref(body);
+   }
+   g_variant_ref_sink(body);
+   record_write(g_dbus_message_get_message_type(message) == G_DBUS_MESSAGE_TYPE_ERROR
+                ? RECORD_ERROR : RECORD_REPLY, BLUEZ_ORG, call->path, call->iface, call->method, body);
+   g_variant_unref(body);
+}
+
+static GDBusMessage *record_filter_cb(GDBusConnection *conn, GDBusMessage *message,
+                                      gboolean incoming, gpointer user_data)
+{
+   GDBusMessageType type = g_dbus_message_get_message_type(message);
+   guint32 serial = 0;
+   RecordCall *call = NULL;
+
+   //! Runs on the GDBus worker for both directions, like metrics_filter.
+   //! Whichever way a call was made, its answer passes through here.
+   if (!incoming)
+   {
+      if (type != G_DBUS_MESSAGE_TYPE_METHOD_CALL
+          || g_strcmp0(g_dbus_message_get_destination(message), BLUEZ_ORG) != 0
+          || (g_dbus_message_get_flags(message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED))
+         return message;
+      call = g_new(RecordCall, 1);
+      call->path = g_strdup(g_dbus_message_get_path(message));
+      call->iface = g_strdup(g_dbus_message_get_interface(message));
+      call->method = g_strdup(g_dbus_message_get_member(message));
+      g_hash_table_insert(record_calls, GUINT_TO_POINTER(g_dbus_message_get_serial(message)), call);
+      return message;
+   }
+
+   if (type != G_DBUS_MESSAGE_TYPE_METHOD_RETURN && type != G_DBUS_MESSAGE_TYPE_ERROR)
+      return message;
+   serial = g_dbus_message_get_reply_serial(message);
+   call = g_hash_table_lookup(record_calls, GUINT_TO_POINTER(serial));
+   if (call == NULL)
+      return message;
+   record_answer(call, message);
+   g_hash_table_remove(record_calls, GUINT_TO_POINTER(serial));
+   return message;
+}
+
+/**
+ * @brief Starts writing every signal bluez emits to file, and the answer
+ *  to every method call made to it on conn.
+ *
+ * @returns FALSE with error set if the file couldn't be created.
+ */
+gboolean record_start(GDBusConnection *conn, const char *file, GError **error)
+{
+   record_fp = fopen(file, "wb");
+   if (record_fp == NULL)
+   {
+      g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                  "Can't create %s: %s", file, g_strerror(errno));
+      return FALSE;
+   }
+   // Signals arrive in bursts, keep the writes off the hot path.
+   setvbuf(record_fp, NULL, _IOFBF, 1 << 16);
+   fwrite(RECORD_MAGIC, 1, strlen(RECORD_MAGIC), record_fp);
+
+   record_started = g_get_monotonic_time();
+   record_conn = conn;
+   // Filters may still run after removal, so the table stays for good.
+   if (record_calls == NULL)
+      record_calls = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                           (GDestroyNotify)record_call_free);
+   record_filter = g_dbus_connection_add_filter(conn, record_filter_cb, NULL, NULL);
+   record_sub = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		record_signal_cb,
+		NULL,
+		NULL);
+   return TRUE;
+}
+
+/**
+ * @brief Stops recording and flushes the file.
+ */
+void record_stop()
+{
+   if (record_fp == NULL)
+      return;
+   g_dbus_connection_signal_unsubscribe(record_conn, record_sub);
+   g_dbus_connection_remove_filter(record_conn, record_filter);
+   g_mutex_lock(&record_lock);
+   fclose(record_fp);
+   record_fp = NULL;
+   g_mutex_unlock(&record_lock);
+   record_conn = NULL;
+   record_sub = 0;
+   record_filter = 0;
+}
+
+/**
+ * @brief Maps a recording for playback.
+ *
+ * @returns NULL with error set if the file isn't a recording.
+ */
+Replay *replay_open(const char *file, GError **error)
+{
+   GMappedFile *mapped = g_mapped_file_new(file, FALSE, error);
+   if (mapped == NULL)
+      return NULL;
+
+   Replay *replay = g_new0(Replay, 1);
+   replay->file = mapped;
+   replay->bytes = g_mapped_file_get_bytes(mapped);
+   replay->data = g_bytes_get_data(replay->bytes, &replay->len);
+
+   if (replay->len < strlen(RECORD_MAGIC) || memcmp(replay->data, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0)
+   {
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a recording", file);
+      replay_free(replay);
+      return NULL;
+   }
+   replay->pos = strlen(RECORD_MAGIC);
+   return replay;
+}
+
+/**
+ * @brief Decodes the entry at the read position. The strings point into
+ *  the mapping and the body shares its memory.
+ *
+ * @returns Size of the entry, 0 if it is truncated or malformed.
+ */
+static gsize replay_peek(Replay *replay, RecordEvent *event)
+{
+   const guint8 *p = replay->data + replay->pos;
+   gsize left = replay->len - replay->pos;
+   const gchar *strings[5];
+   guint16 lens[5];
+   guint64 time_us = 0;
+   guint32 body_len = 0;
+   gsize size = RECORD_HEADER_SIZE;
+
+   if (left < RECORD_HEADER_SIZE)
+      return 0;
+   memcpy(&time_us, p + 1, sizeof(time_us));
+   memcpy(&body_len, p + 19, sizeof(body_len));
+   for (int i = 0; i < G_N_ELEMENTS(lens); i++)
+   {
+      memcpy(&lens[i], p + 9 + 2 * i, sizeof(lens[i]));
+      lens[i] = GUINT16_FROM_LE(lens[i]);
+      strings[i] = (const gchar *)p + size;
+      size += lens[i];
+      if (lens[i] == 0 || size > left || strings[i][lens[i] - 1] != '\0')
+         return 0;
+   }
+   body_len = GUINT32_FROM_LE(body_len);
+   if (size + body_len > left || !g_variant_type_string_is_valid(strings[4]))
+      return 0;
+
+   GBytes *body = g_bytes_new_from_bytes(replay->bytes, replay->pos + size, body_len);
+   event->body = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(strings[4]), body, FALSE));
+   g_bytes_unref(body);
+   if (G_BYTE_ORDER == G_BIG_ENDIAN)
+   {
+      GVariant *swapped = g_variant_byteswap(event->body);
+      g_variant_unref(event->body);
+      event->body = swapped;
+   }
+
+   event->kind = p[0];
+   event->time_us = GUINT64_FROM_LE(time_us);
+   event->sender = strings[0];
+   event->path = strings[1];
+   event->iface = strings[2];
+   event->member = strings[3];
+   return size + body_len;
+}
+
+static gboolean replay_step_cb(gpointer arg)
+{
+   Replay *replay = arg;
+   RecordEvent event = {0};
+
+   replay->source = 0;
+   for (int n = 0; n < REPLAY_CHUNK && replay->pos < replay->len; n++)
+   {
+      gint64 now = g_get_monotonic_time() - replay->started;
+      gsize size = replay_peek(replay, &event);
+      if (size == 0)
+      {
+         replay->corrupt = TRUE;
+         break;
+      }
+
+      gint64 due = replay->speed > 0 ? event.time_us / replay->speed : now;
+      if (due > now)
+      {
+         g_variant_unref(event.body);
+         replay->source = g_timeout_add((due - now + 999) / 1000, replay_step_cb, replay);
+         return G_SOURCE_REMOVE;
+      }
+
+      replay->callback(&event, replay->user_data);
+      g_variant_unref(event.body);
+      replay->pos += size;
+      replay->events += 1;
+
+      gint64 lag = g_get_monotonic_time() - replay->started - due;
+      replay->max_lag_us = MAX(replay->max_lag_us, lag);
+      replay->late += lag > REPLAY_LATE_US ? 1 : 0;
+   }
+
+   if (replay->pos < replay->len && !replay->corrupt)
+   {
+      // Same priority as bus traffic, so the rest of the app keeps running.
+      replay->source = g_idle_add_full(G_PRIORITY_DEFAULT, replay_step_cb, replay, NULL);
+      return G_SOURCE_REMOVE;
+   }
+
+   replay->finished = g_get_monotonic_time();
+   replay->done(replay, replay->user_data);
+   return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Delivers the recording from the main loop.
+ *
+ * @param replay From replay_open().
+ * @param speed Playback rate, 1 is real time, 0 delivers as fast as possible.
+ * @param callback Receives each event.
+ * @param done Called once after the last event.
+ * @param user_data Passed to callback and done.
+ */
+void replay_start(Replay *replay, gdouble speed, ReplayFunc callback, ReplayDoneFunc done, gpointer user_data)
+{
+   replay->speed = speed;
+   replay->callback = callback;
+   replay->done = done;
+   replay->user_data = user_data;
+   replay->started = g_get_monotonic_time();
+   replay->source = g_idle_add_full(G_PRIORITY_DEFAULT, replay_step_cb, replay, NULL);
+}
+
+/**
+ * @brief Prints how many events were delivered, how fast, and how late.
+ */
+void replay_print_stats(const Replay *replay)
+{
+   gint64 elapsed = MAX(replay->finished - replay->started, 1);
+
+   g_print("Replayed %" G_GUINT64_FORMAT " events in %.3f s (%.0f events/s)\n",
+           replay->events, elapsed / 1e6, replay->events * 1e6 / elapsed);
+   g_print("Late by more than %d ms: %" G_GUINT64_FORMAT ", worst %.3f ms\n",
+           REPLAY_LATE_US / 1000, replay->late, replay->max_lag_us / 1e3);
+   if (replay->corrupt)
+      fprintf(stderr, "tuxdrop: recording truncated after %" G_GUINT64_FORMAT " events\n", replay->events);
+}
+
+/**
+ * @brief Stops playback and unmaps the recording.
+ */
+void replay_free(Replay *replay)
+{
+   if (replay == NULL)
+      return;
+   if (replay->source)
+      g_source_remove(replay->source);
+   g_bytes_unref(replay->bytes);
+   g_mapped_file_unref(replay->file);
+   g_free(replay);
+}
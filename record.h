@@ -0,0 +1,95 @@
+/**
+* @file record.h
+* @brief Records the bluez signal stream to a file and replays it.
+*
+* A recording is RECORD_MAGIC followed by one entry per event, little endian:
+*  u8 kind, u64 microseconds since the recording started, u16 lengths of
+*  sender, path, interface, member and type string (each NUL terminated
+*  in the file), u32 body length, then the strings and the serialized
+*  GVariant body. Replies and errors carry the path, interface and method
+*  of the call they answer.
+*/
+#ifndef RECORD_H
+#define RECORD_H
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#define RECORD_MAGIC "TUXREC01"
+#define RECORD_HEADER_SIZE 23
+#define REPLAY_CHUNK 256          /** Events delivered per main loop iteration. */
+#define REPLAY_LATE_US 10000      /** Events delivered later than this count as late. */
+
+/** @brief What an entry holds. */
+typedef enum _RecordKind
+{
+   RECORD_SIGNAL,
+   RECORD_REPLY,
+   RECORD_ERROR          /** Body is (ss), the error name and message. */
+} RecordKind;
+
+/** @brief One recorded signal, or method reply or error. */
+typedef struct _RecordEvent
+{
+   RecordKind kind;
+   gint64 time_us;       /** Since the recording started. */
+   const gchar *sender;
+   const gchar *path;
+   const gchar *iface;
+   const gchar *member;  /** Signal name, or the method a reply answers. */
+   GVariant *body;       /** Signal parameters or reply, valid for the callback. */
+} RecordEvent;
+
+/** @brief A recording being played back, see replay_open(). */
+typedef struct _Replay Replay;
+
+/** @brief Receives each replayed event. */
+typedef void (*ReplayFunc)(const RecordEvent *event, gpointer user_data);
+
+/** @brief Called once the whole recording has been delivered. */
+typedef void (*ReplayDoneFunc)(Replay *replay, gpointer user_data);
+
+/**
+ * @brief Starts writing every signal bluez emits to file, and the answer
+ *  to every method call made to it on conn.
+ *
+ * @returns FALSE with error set if the file couldn't be created.
+ */
+gboolean record_start(GDBusConnection *conn, const char *file, GError **error);
+
+/**
+ * @brief Stops recording and flushes the file.
+ */
+void record_stop();
+
+/**
+ * @brief Maps a recording for playback.
+ *
+ * @returns NULL with error set if the file isn't a recording.
+ */
+Replay *replay_open(const char *file, GError **error);
+
+/**
+ * @brief Delivers the recording from the main loop.
+ *
+ * @param replay From replay_open().
+ * @param speed Playback rate, 1 is real time, 0 delivers as fast as possible.
+ * @param callback Receives each event.
+ * @param done Called once after the last event.
+ * @param user_data Passed to callback and done.
+ */
+void replay_start(Replay *replay, gdouble speed, ReplayFunc callback, ReplayDoneFunc done, gpointer user_data);
+
+/**
+ * @brief Prints how many events were delivered, how fast, and how late.
+ */
+void replay_print_stats(const Replay *replay);
+
+/**
+ * @brief Stops playback and unmaps the recording.
+ */
+void replay_free(Replay *replay);
+
+#endif // RECORD_H
@@ -0,0 +1,264 @@
+/**
+* @file schema.c
+* @brief Typed fields for the bluez properties the app knows about.
+*/
+#include <string.h>
+
+#include "schema.h"
+
+#define SCHEMA_NAME(name, ifaces, kind, field) #name,
+#define SCHEMA_IFACES(name, ifaces, kind, field) ifaces,
+
+static const char *schema_names[SCHEMA_SLOTS] = { SCHEMA_PROPERTIES(SCHEMA_NAME) };
+static const guint schema_ifaces[SCHEMA_SLOTS] = { SCHEMA_PROPERTIES(SCHEMA_IFACES) };
+
+static guint32 schema_seed = 0;
+static gint8 schema_table[SCHEMA_HASH_SIZE];  /** Slot + 1 per hash, 0 if free. */
+
+static inline guint32 schema_fnv(const char *str)
+{
+   guint32 h = 2166136261u;
+   for (; *str; str++)
+      h = (h ^ (guchar)*str) * 16777619u;
+   return h;
+}
+
+/**
+ * @brief Bucket of a name's FNV-1a hash. FNV-1a only carries low bits
+ *  upward, so the seed is mixed in after it and the bucket taken from the
+ *  top bits, where every bit of the seed counts.
+ */
+static inline guint32 schema_bucket(guint32 h, guint32 seed)
+{
+   h = (h ^ seed) * 0x9e3779b1u;
+   h ^= h >> 15;
+   return h >> (32 - SCHEMA_HASH_BITS);
+}
+
+static gint schema_slot_of(const char *prop)
+{
+   gint slot = schema_table[schema_bucket(schema_fnv(prop), schema_seed)] - 1;
+   if (slot < 0 || strcmp(schema_names[slot], prop) != 0)
+      return -1;
+   return slot;
+}
+
+/**
+ * @brief Searches the seed that gives every name a bucket of its own,
+ *  then checks every name finds its slot again.
+ */
+static void schema_build()
+{
+   guint32 fnv[SCHEMA_SLOTS];
+   guint32 seed = 1;
+
+   for (gint slot = 0; slot < SCHEMA_SLOTS; slot++)
+      fnv[slot] = schema_fnv(schema_names[slot]);
+   for (; seed <= SCHEMA_SEED_TRIES; seed++)
+   {
+      gboolean collision = FALSE;
+
+      memset(schema_table, 0, sizeof(schema_table));
+      for (gint slot = 0; slot < SCHEMA_SLOTS && !collision; slot++)
+      {
+         guint32 h = schema_bucket(fnv[slot], seed);
+         collision = (schema_table[h] != 0);
+         schema_table[h] = slot + 1;
+      }
+      if (!collision)
+      {
+         schema_seed = seed;
+         break;
+      }
+   }
+   // A list this long wants a bigger table, SCHEMA_HASH_BITS + 1.
+   if (seed > SCHEMA_SEED_TRIES)
+      g_error("schema: no perfect hash for %d properties in %d buckets", SCHEMA_SLOTS, SCHEMA_HASH_SIZE);
+
+   for (gint slot = 0; slot < SCHEMA_SLOTS; slot++)
+   {
+      if (schema_slot_of(schema_names[slot]) != slot)
+         g_error("schema: %s doesn't hash to its slot", schema_names[slot]);
+   }
+}
+
+/**
+ * @brief Maps an interface name to its SchemaIface bit, 0 if unknown.
+ */
+guint schema_iface(const char *iface)
+{
+   if (!g_str_has_prefix(iface, "org.bluez."))
+      return 0;
+   iface += strlen("org.bluez.");
+   if (g_str_equal(iface, "Device1"))
+      return SCHEMA_DEVICE;
+   if (g_str_equal(iface, "Adapter1"))
+      return SCHEMA_ADAPTER;
+   if (g_str_equal(iface, "Battery1"))
+      return SCHEMA_BATTERY;
+   if (g_str_equal(iface, "GattCharacteristic1"))
+      return SCHEMA_GATT_CHR;
+   if (g_str_equal(iface, "GattService1"))
+      return SCHEMA_GATT_SERVICE;
+   if (g_str_equal(iface, "GattDescriptor1"))
+      return SCHEMA_GATT_DESC;
+   return 0;
+}
+
+/**
+ * @brief Finds the slot of a property name.
+ *
+ * @returns The slot, -1 for properties not in the schema.
+ */
+gint schema_slot(const char *prop)
+{
+   static gsize built = 0;
+
+   // Parsing also runs on worker threads.
+   if (g_once_init_enter(&built))
+   {
+      schema_build();
+      g_once_init_leave(&built, 1);
+   }
+
+   return schema_slot_of(prop);
+}
+
+/**
+ * @brief Name of a slot, as bluez spells it.
+ */
+const char *schema_name(SchemaSlot slot)
+{
+   return slot < SCHEMA_SLOTS ? schema_names[slot] : NULL;
+}
+
+//! One decoder per kind, same signature so the X-macro can dispatch.
+
+static gboolean schema_decode_STR(GVariant *val, const char **field, gint slot)
+{
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_STRING) && !g_variant_is_of_type(val, G_VARIANT_TYPE_OBJECT_PATH))
+      return FALSE;
+   *field = g_variant_get_string(val, NULL);
+   return TRUE;
+}
+
+static gboolean schema_decode_ADDRESS(GVariant *val, SchemaAddress *field, gint slot)
+{
+   const char *str = NULL;
+   guint64 value = 0;
+
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_STRING))
+      return FALSE;
+   str = g_variant_get_string(val, NULL);
+   for (const char *p = str; *p; p++)
+   {
+      if (g_ascii_isxdigit(*p))
+         value = (value << 4) | g_ascii_xdigit_value(*p);
+   }
+   field->value = value;
+   field->str = str;
+   return TRUE;
+}
+
+static gboolean schema_decode_INT16(GVariant *val, gint16 *field, gint slot)
+{
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_INT16))
+      return FALSE;
+   *field = g_variant_get_int16(val);
+   return TRUE;
+}
+
+static gboolean schema_decode_UINT8(GVariant *val, guint8 *field, gint slot)
+{
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_BYTE))
+      return FALSE;
+   *field = g_variant_get_byte(val);
+   return TRUE;
+}
+
+static gboolean schema_decode_UINT16(GVariant *val, guint16 *field, gint slot)
+{
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_UINT16))
+      return FALSE;
+   *field = g_variant_get_uint16(val);
+   return TRUE;
+}
+
+static gboolean schema_decode_UINT32(GVariant *val, guint32 *field, gint slot)
+{
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_UINT32))
+      return FALSE;
+   *field = g_variant_get_uint32(val);
+   return TRUE;
+}
+
+static gboolean schema_decode_FLAG(GVariant *val, guint64 *field, gint slot)
+{
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_BOOLEAN))
+      return FALSE;
+   if (g_variant_get_boolean(val))
+      *field |= G_GUINT64_CONSTANT(1) << slot;
+   else
+      *field &= ~(G_GUINT64_CONSTANT(1) << slot);
+   return TRUE;
+}
+
+static gboolean schema_decode_GATT_FLAGS(GVariant *val, guint32 *field, gint slot)
+{
+   static const char *names[] =
+   {
+      "broadcast", "read", "write-without-response", "write",
+      "notify", "indicate", "authenticated-signed-writes", "reliable-write"
+   };
+   GVariantIter iter;
+   const gchar *flag = NULL;
+   guint32 bits = 0;
+
+   if (!g_variant_is_of_type(val, G_VARIANT_TYPE_STRING_ARRAY))
+      return FALSE;
+   g_variant_iter_init(&iter, val);
+   while (g_variant_iter_next(&iter, "&s", &flag))
+   {
+      for (int i = 0; i < G_N_ELEMENTS(names); i++)
+      {
+         if (g_str_equal(flag, names[i]))
+            bits |= 1u << i;
+      }
+   }
+   *field = bits;
+   return TRUE;
+}
+
+#define SCHEMA_DECODE(name, ifaces, kind, field) \
+   case SCHEMA_##name: \
+      ok = schema_decode_##kind(val, &info->field, slot); \
+      break;
+
+/**
+ * @brief Decodes a property into its typed field. Strings stay owned by
+ *  val.
+ *
+ * @param ifaces SchemaIface bit of the interface the property is on.
+ *
+ * @returns The slot written, -1 if the property isn't known on that
+ *  interface or has an unexpected type; info is left as it was then.
+ */
+gint schema_decode(SchemaInfo *info, guint ifaces, const char *prop, GVariant *val)
+{
+   gint slot = 0;
+   gboolean ok = FALSE;
+
+   if (ifaces == 0 || (slot = schema_slot(prop)) < 0 || !(schema_ifaces[slot] & ifaces))
+      return -1;
+
+   switch ((SchemaSlot)slot)
+   {
+      SCHEMA_PROPERTIES(SCHEMA_DECODE)
+      default:
+         break;
+   }
+   if (!ok)
+      return -1;
+   info->present |= G_GUINT64_CONSTANT(1) << slot;
+   return slot;
+}
@@ -0,0 +1,159 @@
+/**
+* @file schema.h
+* @brief Typed fields for the bluez properties the app knows about.
+*
+* SCHEMA_PROPERTIES lists every known property once: the interfaces it
+* appears on, how it is decoded and which SchemaInfo field it lands in.
+* A perfect hash over the names maps a property to its slot with one
+* hash and one string compare. Properties not in the list, or with an
+* unexpected type, are left to the generic name/GVariant path.
+*/
+#ifndef SCHEMA_H
+#define SCHEMA_H
+#include <glib.h>
+
+#define SCHEMA_HASH_BITS 6
+#define SCHEMA_HASH_SIZE (1 << SCHEMA_HASH_BITS)  /** At least twice the property count. */
+#define SCHEMA_SEED_TRIES (1 << 20)               /** Seeds tried before giving up. */
+
+/** @brief Interfaces with known properties, as a bit mask. */
+typedef enum
+{
+   SCHEMA_DEVICE = 1 << 0,        /** org.bluez.Device1 */
+   SCHEMA_ADAPTER = 1 << 1,       /** org.bluez.Adapter1 */
+   SCHEMA_BATTERY = 1 << 2,       /** org.bluez.Battery1 */
+   SCHEMA_GATT_CHR = 1 << 3,      /** org.bluez.GattCharacteristic1 */
+   SCHEMA_GATT_SERVICE = 1 << 4,  /** org.bluez.GattService1 */
+   SCHEMA_GATT_DESC = 1 << 5      /** org.bluez.GattDescriptor1 */
+} SchemaIface;
+
+#define SCHEMA_GATT (SCHEMA_GATT_SERVICE | SCHEMA_GATT_CHR | SCHEMA_GATT_DESC)
+
+/**
+ * @brief X(name, interfaces, kind, field) for every known property.
+ *  Kinds: STR (s or o, borrowed), ADDRESS (s, also parsed to 48 bits),
+ *  INT16, UINT8, UINT16, UINT32, FLAG (b, a bit of SchemaInfo.flags) and
+ *  GATT_FLAGS (as, SchemaGattFlag bits).
+ */
+#define SCHEMA_PROPERTIES(X) \
+   X(Address,          SCHEMA_DEVICE | SCHEMA_ADAPTER, ADDRESS,    address) \
+   X(Name,             SCHEMA_DEVICE | SCHEMA_ADAPTER, STR,        name) \
+   X(Alias,            SCHEMA_DEVICE | SCHEMA_ADAPTER, STR,        alias) \
+   X(Icon,             SCHEMA_DEVICE,                  STR,        icon) \
+   X(Adapter,          SCHEMA_DEVICE,                  STR,        adapter) \
+   X(Class,            SCHEMA_DEVICE | SCHEMA_ADAPTER, UINT32,     device_class) \
+   X(Appearance,       SCHEMA_DEVICE,                  UINT16,     appearance) \
+   X(RSSI,             SCHEMA_DEVICE,                  INT16,      rssi) \
+   X(TxPower,          SCHEMA_DEVICE,                  INT16,      tx_power) \
+   X(Paired,           SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(Bonded,           SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(Trusted,          SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(Blocked,          SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(Connected,        SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(ServicesResolved, SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(LegacyPairing,    SCHEMA_DEVICE,                  FLAG,       flags) \
+   X(Powered,          SCHEMA_ADAPTER,                 FLAG,       flags) \
+   X(Discoverable,     SCHEMA_ADAPTER,                 FLAG,       flags) \
+   X(Pairable,         SCHEMA_ADAPTER,                 FLAG,       flags) \
+   X(Discovering,      SCHEMA_ADAPTER,                 FLAG,       flags) \
+   X(Percentage,       SCHEMA_BATTERY,                 UINT8,      battery) \
+   X(UUID,             SCHEMA_GATT,                    STR,        uuid) \
+   X(Handle,           SCHEMA_GATT,                    UINT16,     handle) \
+   X(Primary,          SCHEMA_GATT_SERVICE,            FLAG,       flags) \
+   X(Service,          SCHEMA_GATT_CHR,                STR,        service) \
+   X(Characteristic,   SCHEMA_GATT_DESC,               STR,        characteristic) \
+   X(Notifying,        SCHEMA_GATT_CHR,                FLAG,       flags) \
+   X(Flags,            SCHEMA_GATT_CHR,                GATT_FLAGS, gatt_flags) \
+   X(MTU,              SCHEMA_GATT_CHR,                UINT16,     mtu)
+
+#define SCHEMA_SLOT(name, ifaces, kind, field) SCHEMA_##name,
+
+/** @brief One slot per known property, SCHEMA_RSSI and so on. */
+typedef enum
+{
+   SCHEMA_PROPERTIES(SCHEMA_SLOT)
+   SCHEMA_SLOTS
+} SchemaSlot;
+
+/** @brief Bits of GattCharacteristic1.Flags. */
+typedef enum
+{
+   SCHEMA_GATT_BROADCAST = 1 << 0,
+   SCHEMA_GATT_READ = 1 << 1,
+   SCHEMA_GATT_WRITE_WITHOUT_RESPONSE = 1 << 2,
+   SCHEMA_GATT_WRITE = 1 << 3,
+   SCHEMA_GATT_NOTIFY = 1 << 4,
+   SCHEMA_GATT_INDICATE = 1 << 5,
+   SCHEMA_GATT_SIGNED_WRITE = 1 << 6,
+   SCHEMA_GATT_RELIABLE_WRITE = 1 << 7
+} SchemaGattFlag;
+
+/** @brief An address kept both ways. */
+typedef struct _SchemaAddress
+{
+   guint64 value;       /** AA:BB:CC:DD:EE:FF as 0xAABBCCDDEEFF. */
+   const char *str;
+} SchemaAddress;
+
+/** @brief Known properties of one object, decoded. */
+typedef struct _SchemaInfo
+{
+   guint ifaces;        /** SchemaIface bits of the object's interfaces. */
+   guint64 present;     /** Bit per SchemaSlot decoded. */
+   guint64 flags;       /** Bit per FLAG slot that is TRUE. */
+   SchemaAddress address;
+   const char *name;
+   const char *alias;
+   const char *icon;
+   const char *adapter;
+   const char *uuid;
+   const char *service;
+   const char *characteristic;
+   guint32 device_class;
+   guint32 gatt_flags;  /** SchemaGattFlag bits. */
+   guint16 appearance;
+   guint16 handle;      /** GATT attribute handle. */
+   guint16 mtu;         /** ATT MTU of the link, for characteristics. */
+   gint16 rssi;
+   gint16 tx_power;
+   guint8 battery;
+} SchemaInfo;
+
+G_STATIC_ASSERT(SCHEMA_SLOTS <= 64);
+G_STATIC_ASSERT(SCHEMA_HASH_SIZE >= 2 * SCHEMA_SLOTS);
+
+/** @brief TRUE if the property was decoded. */
+#define schema_has(info, name) (((info)->present >> SCHEMA_##name) & 1)
+
+/** @brief Value of a FLAG property, FALSE when it is missing. */
+#define schema_flag(info, name) (((info)->flags >> SCHEMA_##name) & 1)
+
+/**
+ * @brief Maps an interface name to its SchemaIface bit, 0 if unknown.
+ */
+guint schema_iface(const char *iface);
+
+/**
+ * @brief Finds the slot of a property name.
+ *
+ * @returns The slot, -1 for properties not in the schema.
+ */
+gint schema_slot(const char *prop);
+
+/**
+ * @brief Name of a slot, as bluez spells it.
+ */
+const char *schema_name(SchemaSlot slot);
+
+/**
+ * @brief Decodes a property into its typed field. Strings stay owned by
+ *  val.
+ *
+ * @param ifaces SchemaIface bit of the interface the property is on.
+ *
+ * @returns The slot written, -1 if the property isn't known on that
+ *  interface or has an unexpected type; info is left as it was then.
+ */
+gint schema_decode(SchemaInfo *info, guint ifaces, const char *prop, GVariant *val);
+
+#endif // SCHEMA_H
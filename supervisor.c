@@ -0,0 +1,328 @@
+#include "supervisor.h"
+
+/** @brief One watched device. */
+typedef struct _SupervisorLink
+{
+   Supervisor *sup;
+   gchar *address;      /** Upper case, as bluez prints it. */
+   gchar *path;         /** Object path while bluez has the device. */
+   gboolean connected;
+   gboolean connecting; /** A Connect call is in flight. */
+   guint failures;      /** Attempts failed in a row, sets the backoff. */
+   gint64 attempted;    /** Monotonic time of the last Connect. */
+   guint retry_source;
+} SupervisorLink;
+
+struct _Supervisor
+{
+   GDBusConnection *conn;
+   GHashTable *links;   /** Last path element (dev_AA_BB_..) to link. */
+   GCancellable *cancel;
+   guint subs[3];
+};
+
+static void supervisor_link_free(SupervisorLink *link)
+{
+   if (link->retry_source)
+      g_source_remove(link->retry_source);
+   g_free(link->address);
+   g_free(link->path);
+   g_free(link);
+}
+
+static void supervisor_report(SupervisorLink *link, const char *event, const char *reason, guint delay_ms)
+{
+   output_line_begin("link");
+   output_str("event", event);
+   output_str("address", link->address);
+   if (reason != NULL)
+      output_str("reason", reason);
+   if (delay_ms)
+      output_int("retry_ms", delay_ms);
+   output_record_end();
+}
+
+static void supervisor_set_connected(SupervisorLink *link, gboolean connected)
+{
+   if (connected == link->connected)
+      return;
+   link->connected = connected;
+   if (connected)
+   {
+      link->failures = 0;
+      if (link->retry_source)
+      {
+         g_source_remove(link->retry_source);
+         link->retry_source = 0;
+      }
+   }
+   supervisor_report(link, connected ? "connected" : "disconnected", NULL, 0);
+}
+
+static void supervisor_connect(SupervisorLink *link);
+
+static gboolean supervisor_retry_cb(gpointer arg)
+{
+   SupervisorLink *link = arg;
+
+   link->retry_source = 0;
+   supervisor_connect(link);
+   return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Waits a random time between half and all of the backoff, so a
+ *  set of devices lost together doesn't retry in lockstep.
+ */
+static void supervisor_backoff(SupervisorLink *link, const char *reason)
+{
+   guint shift = MIN(link->failures, 16);
+   guint delay = MIN((guint64)SUPERVISOR_BACKOFF_MIN_MS << shift, SUPERVISOR_BACKOFF_MAX_MS);
+
+   delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+   link->failures += 1;
+   link->retry_source = g_timeout_add(delay, supervisor_retry_cb, link);
+   supervisor_report(link, "retry", reason, delay);
+}
+
+static void supervisor_connect_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+   // Cancelled means the supervisor is gone, and the link with it.
+   if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+   {
+      g_error_free(error);
+      return;
+   }
+
+   SupervisorLink *link = arg;
+   link->connecting = FALSE;
+   if (result != NULL)
+   {
+      g_variant_unref(result);
+      supervisor_set_connected(link, TRUE);
+      return;
+   }
+
+   gchar *remote = g_dbus_error_get_remote_error(error);
+   if (g_strcmp0(remote, "org.bluez.Error.AlreadyConnected") == 0)
+      supervisor_set_connected(link, TRUE);
+   else if (!link->connected && link->path != NULL && !link->retry_source)
+      supervisor_backoff(link, remote ? remote : error->message);
+   g_free(remote);
+   g_error_free(error);
+}
+
+static void supervisor_connect(SupervisorLink *link)
+{
+   if (link->connecting || link->connected || link->path == NULL)
+      return;
+   if (link->retry_source)
+   {
+      g_source_remove(link->retry_source);
+      link->retry_source = 0;
+   }
+
+   link->connecting = TRUE;
+   link->attempted = g_get_monotonic_time();
+   g_dbus_connection_call(link->sup->conn,
+            BLUEZ_ORG,
+            link->path,
+            BLUEZ_DEVICE_IFACE,
+            "Connect",
+            NULL,
+            NULL,
+            G_DBUS_CALL_FLAGS_NONE,
+            SUPERVISOR_CONNECT_TIMEOUT_MS,
+            link->sup->cancel,
+            supervisor_connect_cb,
+            link);
+}
+
+/**
+ * @brief The device was heard. Retries right away unless the last attempt
+ *  was very recent, a device that is in range but refuses doesn't get
+ *  hammered on every advert.
+ */
+static void supervisor_reappeared(SupervisorLink *link)
+{
+   gint64 since = g_get_monotonic_time() - link->attempted;
+
+   if (link->failures == 0 || since >= SUPERVISOR_REAPPEAR_MS * 1000)
+      supervisor_connect(link);
+}
+
+static SupervisorLink *supervisor_lookup(Supervisor *sup, const char *path)
+{
+   const char *name = strrchr(path, '/');
+   return name != NULL ? g_hash_table_lookup(sup->links, name + 1) : NULL;
+}
+
+static void supervisor_signal_cb(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   Supervisor *sup = user_data;
+   SupervisorLink *link = NULL;
+   const gchar *path = object_path;
+   GVariant *dict = NULL;
+   gboolean connected = FALSE;
+
+   if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &dict);
+      GVariant *props = g_variant_lookup_value(dict, BLUEZ_DEVICE_IFACE, G_VARIANT_TYPE_VARDICT);
+      g_variant_unref(dict);
+      if (props == NULL || (link = supervisor_lookup(sup, path)) == NULL)
+      {
+         if (props)
+            g_variant_unref(props);
+         return;
+      }
+      g_free(link->path);
+      link->path = g_strdup(path);
+      g_variant_lookup(props, "Connected", "b", &connected);
+      g_variant_unref(props);
+      supervisor_set_connected(link, connected);
+      supervisor_reappeared(link);
+   }
+   else if (g_str_equal(signal_name, "InterfacesRemoved"))
+   {
+      const gchar **ifaces = NULL;
+      g_variant_get(parameters, "(&o^a&s)", &path, &ifaces);
+      if ((link = supervisor_lookup(sup, path)) != NULL && g_strv_contains(ifaces, BLUEZ_DEVICE_IFACE))
+      {
+         //! Nothing to connect to until bluez sees the device again.
+         g_clear_pointer(&link->path, g_free);
+         if (link->retry_source)
+         {
+            g_source_remove(link->retry_source);
+            link->retry_source = 0;
+         }
+         supervisor_set_connected(link, FALSE);
+      }
+      g_free(ifaces);
+   }
+   else if ((link = supervisor_lookup(sup, path)) != NULL)
+   {
+      g_variant_get(parameters, "(&s@a{sv}@as)", NULL, &dict, NULL);
+      if (link->path == NULL)
+         link->path = g_strdup(path);
+      if (g_variant_lookup(dict, "Connected", "b", &connected))
+      {
+         supervisor_set_connected(link, connected);
+         // A drop is retried at once, the device was in range a moment ago.
+         if (!connected)
+         {
+            link->failures = 0;
+            supervisor_connect(link);
+         }
+      }
+      else if (!link->connected
+               && (g_variant_lookup(dict, "RSSI", "*", NULL)
+                   || g_variant_lookup(dict, "ManufacturerData", "*", NULL)
+                   || g_variant_lookup(dict, "ServiceData", "*", NULL)))
+      {
+         supervisor_reappeared(link);
+      }
+      g_variant_unref(dict);
+   }
+}
+
+/**
+ * @brief Starts watching bluez signals for the watchlist, empty at first.
+ *
+ * @param conn Connection handle to dbus.
+ */
+Supervisor *supervisor_new(GDBusConnection *conn)
+{
+   static const char *members[] = { "InterfacesAdded", "InterfacesRemoved", "PropertiesChanged" };
+   Supervisor *sup = g_new0(Supervisor, 1);
+
+   sup->conn = conn;
+   sup->links = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)supervisor_link_free);
+   sup->cancel = g_cancellable_new();
+   for (int i = 0; i < G_N_ELEMENTS(sup->subs); i++)
+   {
+      gboolean props = g_str_equal(members[i], "PropertiesChanged");
+      sup->subs[i] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		props ? FREE_PROPERTIES : FREE_OBJECT_MANAGER,
+		members[i],
+		NULL,
+		props ? BLUEZ_DEVICE_IFACE : NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		supervisor_signal_cb,
+		sup,
+		NULL);
+   }
+   return sup;
+}
+
+/**
+ * @brief Adds an address to the watchlist and connects it if bluez knows
+ *  the device and it isn't connected yet.
+ *
+ * @param address MAC address, any case.
+ * @param path Object path of the device, NULL until bluez reports it.
+ * @param connected Whether the device is connected now.
+ *
+ * @returns FALSE if address isn't a MAC address.
+ */
+gboolean supervisor_watch(Supervisor *sup, const char *address, const char *path, gboolean connected)
+{
+   SupervisorLink *link = NULL;
+   gchar *upper = NULL;
+   gchar *name = NULL;
+
+   if (strlen(address) != 17)
+      return FALSE;
+   for (int i = 0; i < 17; i++)
+   {
+      if (i % 3 == 2 ? address[i] != ':' : !g_ascii_isxdigit(address[i]))
+         return FALSE;
+   }
+
+   //! bluez names device objects dev_AA_BB_CC_DD_EE_FF, on any adapter.
+   upper = g_ascii_strup(address, -1);
+   name = g_strdelimit(g_strconcat("dev_", upper, NULL), ":", '_');
+   if (g_hash_table_contains(sup->links, name))
+   {
+      g_free(upper);
+      g_free(name);
+      return TRUE;
+   }
+
+   link = g_new0(SupervisorLink, 1);
+   link->sup = sup;
+   link->address = upper;
+   link->path = g_strdup(path);
+   link->connected = connected;
+   g_hash_table_insert(sup->links, name, link);
+
+   supervisor_report(link, connected ? "connected" : "watching", NULL, 0);
+   supervisor_connect(link);
+   return TRUE;
+}
+
+/**
+ * @brief Stops every retry, drops the subscriptions and frees sup.
+ *  Calls in flight are cancelled.
+ */
+void supervisor_free(Supervisor *sup)
+{
+   if (sup == NULL)
+      return;
+   g_cancellable_cancel(sup->cancel);
+   g_object_unref(sup->cancel);
+   for (int i = 0; i < G_N_ELEMENTS(sup->subs); i++)
+      g_dbus_connection_signal_unsubscribe(sup->conn, sup->subs[i]);
+   g_hash_table_destroy(sup->links);
+   g_free(sup);
+}
@@ -0,0 +1,53 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "dbus.h"
+#include "bluez.h"
+#include "output.h"
+
+#define SUPERVISOR_BACKOFF_MIN_MS 500
+#define SUPERVISOR_BACKOFF_MAX_MS 60000
+#define SUPERVISOR_REAPPEAR_MS 1000      /** Least time between attempts on adverts. */
+#define SUPERVISOR_CONNECT_TIMEOUT_MS 30000
+
+/**
+ * @brief Keeps a watchlist of devices connected.
+ *
+ *  A drop (Connected false) reconnects at once. A failed attempt retries
+ *  after an exponential backoff with jitter, and a device heard again
+ *  (InterfacesAdded or an advert while disconnected) is retried at once
+ *  instead of waiting out its backoff. Link changes are written as "link"
+ *  records.
+ */
+typedef struct _Supervisor Supervisor;
+
+/** Funcs **/
+/**
+ * @brief Starts watching bluez signals for the watchlist, empty at first.
+ *
+ * @param conn Connection handle to dbus.
+ */
+Supervisor *supervisor_new(GDBusConnection *conn);
+
+/**
+ * @brief Adds an address to the watchlist and connects it if bluez knows
+ *  the device and it isn't connected yet.
+ *
+ * @param address MAC address, any case.
+ * @param path Object path of the device, NULL until bluez reports it.
+ * @param connected Whether the device is connected now.
+ *
+ * @returns FALSE if address isn't a MAC address.
+ */
+gboolean supervisor_watch(Supervisor *sup, const char *address, const char *path, gboolean connected);
+
+/**
+ * @brief Stops every retry, drops the subscriptions and frees sup.
+ *  Calls in flight are cancelled.
+ */
+void supervisor_free(Supervisor *sup);
+
+#endif // SUPERVISOR_H
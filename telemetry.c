@@ -0,0 +1,358 @@
+#include "telemetry.h"
+
+/** @brief Cached state of one device. */
+typedef struct _TelemetryEntry
+{
+   gchar *path;
+   gchar *address;
+   gchar *name;         /** Name, or Alias when there is none. */
+   SchemaInfo info;     /** Strings point at the copies above, the rest NULL. */
+   gint64 refreshed;    /** Monotonic time of the last news. */
+} TelemetryEntry;
+
+struct _Telemetry
+{
+   GDBusConnection *conn;
+   GHashTable *entries;  /** Object path to TelemetryEntry. */
+   guint interval;
+   guint max_age;
+   guint timer;
+   guint subs[4];
+   gboolean collecting;  /** A pass waits for GetAll replies. */
+   gboolean closing;     /** Freed, the pass in flight finishes the job. */
+   gint64 started;
+};
+
+static void telemetry_entry_free(TelemetryEntry *entry)
+{
+   g_free(entry->path);
+   g_free(entry->address);
+   g_free(entry->name);
+   g_free(entry);
+}
+
+static TelemetryEntry *telemetry_entry(Telemetry *tel, const char *path)
+{
+   TelemetryEntry *entry = g_hash_table_lookup(tel->entries, path);
+
+   if (entry == NULL)
+   {
+      entry = g_new0(TelemetryEntry, 1);
+      entry->path = g_strdup(path);
+      g_hash_table_insert(tel->entries, entry->path, entry);
+   }
+   return entry;
+}
+
+/**
+ * @brief Points the decoded strings at the entry's own copies, the values
+ *  they were decoded from don't outlive the call.
+ */
+static void telemetry_entry_own_strings(TelemetryEntry *entry)
+{
+   entry->info.address.str = entry->address;
+   entry->info.name = entry->name;
+   entry->info.alias = NULL;
+   entry->info.icon = NULL;
+   entry->info.adapter = NULL;
+   entry->info.uuid = NULL;
+   entry->info.service = NULL;
+   entry->info.characteristic = NULL;
+}
+
+/**
+ * @brief Merges properties of one interface into the entry.
+ *
+ * @param ifaces SchemaIface bit of the interface.
+ * @param props Type a{sv}.
+ */
+static void telemetry_entry_apply(TelemetryEntry *entry, guint ifaces, GVariant *props)
+{
+   GVariantIter iter;
+   const gchar *prop = NULL;
+   GVariant *val = NULL;
+
+   g_variant_iter_init(&iter, props);
+   while (g_variant_iter_loop(&iter, "{&sv}", &prop, &val))
+   {
+      gint slot = schema_decode(&entry->info, ifaces, prop, val);
+
+      if (slot == SCHEMA_Address)
+      {
+         g_free(entry->address);
+         entry->address = g_strdup(entry->info.address.str);
+      }
+      else if (slot == SCHEMA_Name || (slot == SCHEMA_Alias && entry->name == NULL))
+      {
+         g_free(entry->name);
+         entry->name = g_strdup(slot == SCHEMA_Name ? entry->info.name : entry->info.alias);
+      }
+   }
+   telemetry_entry_own_strings(entry);
+   entry->info.ifaces |= ifaces;
+   entry->refreshed = g_get_monotonic_time();
+}
+
+static void telemetry_signal_cb(GDBusConnection *sig,
+				const gchar *sender_name,
+				const gchar *object_path,
+				const gchar *interface,
+				const gchar *signal_name,
+				GVariant *parameters,
+				gpointer user_data)
+{
+   Telemetry *tel = user_data;
+   TelemetryEntry *entry = NULL;
+   const gchar *path = NULL;
+   const gchar *iface = NULL;
+   GVariant *dict = NULL;
+
+   if (g_str_equal(signal_name, "InterfacesAdded"))
+   {
+      g_variant_get(parameters, "(&o@a{sa{sv}})", &path, &dict);
+      GVariant *device = g_variant_lookup_value(dict, BLUEZ_DEVICE_IFACE, G_VARIANT_TYPE_VARDICT);
+      GVariant *battery = g_variant_lookup_value(dict, BLUEZ_BATTERY_IFACE, G_VARIANT_TYPE_VARDICT);
+
+      if (device != NULL || (battery != NULL && g_hash_table_contains(tel->entries, path)))
+      {
+         entry = telemetry_entry(tel, path);
+         if (device != NULL)
+            telemetry_entry_apply(entry, SCHEMA_DEVICE, device);
+         if (battery != NULL)
+            telemetry_entry_apply(entry, SCHEMA_BATTERY, battery);
+      }
+      if (device)
+         g_variant_unref(device);
+      if (battery)
+         g_variant_unref(battery);
+      g_variant_unref(dict);
+   }
+   else if (g_str_equal(signal_name, "InterfacesRemoved"))
+   {
+      const gchar **ifaces = NULL;
+      g_variant_get(parameters, "(&o^a&s)", &path, &ifaces);
+      if ((entry = g_hash_table_lookup(tel->entries, path)) != NULL)
+      {
+         if (g_strv_contains(ifaces, BLUEZ_DEVICE_IFACE))
+         {
+            g_hash_table_remove(tel->entries, path);
+         }
+         else if (g_strv_contains(ifaces, BLUEZ_BATTERY_IFACE))
+         {
+            entry->info.ifaces &= ~SCHEMA_BATTERY;
+            entry->info.present &= ~(G_GUINT64_CONSTANT(1) << SCHEMA_Percentage);
+         }
+      }
+      g_free(ifaces);
+   }
+   else if ((entry = g_hash_table_lookup(tel->entries, object_path)) != NULL)
+   {
+      GVariantIter iter;
+      const gchar *prop = NULL;
+      GVariant *invalidated = NULL;
+
+      g_variant_get(parameters, "(&s@a{sv}@as)", &iface, &dict, &invalidated);
+      telemetry_entry_apply(entry, schema_iface(iface), dict);
+
+      //! RSSI is dropped once the device isn't heard any more.
+      g_variant_iter_init(&iter, invalidated);
+      while (g_variant_iter_next(&iter, "&s", &prop))
+      {
+         gint slot = schema_slot(prop);
+         if (slot >= 0)
+            entry->info.present &= ~(G_GUINT64_CONSTANT(1) << slot);
+      }
+      g_variant_unref(invalidated);
+      g_variant_unref(dict);
+   }
+}
+
+static gint telemetry_entry_cmp(gconstpointer a, gconstpointer b)
+{
+   return strcmp(((const TelemetryEntry *)a)->path, ((const TelemetryEntry *)b)->path);
+}
+
+static void telemetry_report(Telemetry *tel, guint fetched, guint failed)
+{
+   gint64 now = g_get_monotonic_time();
+   GList *entries = g_list_sort(g_hash_table_get_values(tel->entries), telemetry_entry_cmp);
+
+   output_record_begin("telemetry");
+   output_int("time", g_get_real_time() / G_USEC_PER_SEC);
+   output_int("devices", g_hash_table_size(tel->entries));
+   output_int("fetched", fetched);
+   output_int("failed", failed);
+   output_int("collect_us", now - tel->started);
+   output_array_begin("entries");
+   for (GList *l = entries; l != NULL; l = l->next)
+   {
+      TelemetryEntry *entry = l->data;
+      SchemaInfo *info = &entry->info;
+
+      output_object_begin(NULL);
+      output_str("path", entry->path);
+      if (entry->address)
+         output_str("address", entry->address);
+      if (entry->name)
+         output_str("name", entry->name);
+      if (schema_has(info, Percentage))
+         output_int("battery", info->battery);
+      if (schema_has(info, RSSI))
+         output_int("rssi", info->rssi);
+      if (schema_has(info, TxPower))
+         output_int("tx_power", info->tx_power);
+      output_int("connected", schema_flag(info, Connected));
+      output_int("paired", schema_flag(info, Paired));
+      output_int("age", (now - entry->refreshed) / G_USEC_PER_SEC);
+      output_object_end();
+   }
+   output_array_end();
+   output_record_end();
+   g_list_free(entries);
+}
+
+static void telemetry_destroy(Telemetry *tel)
+{
+   g_hash_table_destroy(tel->entries);
+   g_free(tel);
+}
+
+static void telemetry_reply_cb(const char *path, GVariant *params, GVariant *result, gpointer arg)
+{
+   Telemetry *tel = arg;
+   TelemetryEntry *entry = NULL;
+   const gchar *iface = NULL;
+   GVariant *props = NULL;
+
+   if (tel->closing || (entry = g_hash_table_lookup(tel->entries, path)) == NULL)
+      return;
+   g_variant_get(params, "(&s)", &iface);
+   g_variant_get(result, "(@a{sv})", &props);
+   telemetry_entry_apply(entry, schema_iface(iface), props);
+   g_variant_unref(props);
+}
+
+static void telemetry_done_cb(guint succeeded, guint failed, gint64 elapsed_us, gpointer arg)
+{
+   Telemetry *tel = arg;
+
+   tel->collecting = FALSE;
+   if (tel->closing)
+      telemetry_destroy(tel);
+   else
+      telemetry_report(tel, succeeded, failed);
+}
+
+static gboolean telemetry_timer_cb(gpointer arg)
+{
+   telemetry_collect(arg);
+   return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief Starts the cache and the report timer.
+ *
+ * @param conn Connection handle to dbus.
+ * @param interval Seconds between reports.
+ * @param max_age Seconds after which a device without news is fetched.
+ */
+Telemetry *telemetry_new(GDBusConnection *conn, guint interval, guint max_age)
+{
+   static const char *members[] = { "InterfacesAdded", "InterfacesRemoved", "PropertiesChanged", "PropertiesChanged" };
+   static const char *arg0[] = { NULL, NULL, BLUEZ_DEVICE_IFACE, BLUEZ_BATTERY_IFACE };
+   Telemetry *tel = g_new0(Telemetry, 1);
+
+   tel->conn = conn;
+   tel->interval = MAX(interval, 1);
+   tel->max_age = max_age;
+   tel->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)telemetry_entry_free);
+   for (int i = 0; i < G_N_ELEMENTS(tel->subs); i++)
+   {
+      tel->subs[i] = g_dbus_connection_signal_subscribe(conn,
+		BLUEZ_ORG,
+		arg0[i] ? FREE_PROPERTIES : FREE_OBJECT_MANAGER,
+		members[i],
+		NULL,
+		arg0[i],
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		telemetry_signal_cb,
+		tel,
+		NULL);
+   }
+   tel->timer = g_timeout_add_seconds(tel->interval, telemetry_timer_cb, tel);
+   return tel;
+}
+
+/**
+ * @brief Adds the Device1 objects of an array to the cache, as fresh.
+ */
+void telemetry_track(Telemetry *tel, const Device *devices, gsize num_devices)
+{
+   for (gsize i = 0; i < num_devices; i++)
+   {
+      const SchemaInfo *info = &devices[i].info;
+      TelemetryEntry *entry = NULL;
+
+      if (!(info->ifaces & SCHEMA_DEVICE))
+         continue;
+      entry = telemetry_entry(tel, devices[i].obj_path);
+      entry->info = *info;
+      g_free(entry->address);
+      entry->address = g_strdup(info->address.str);
+      g_free(entry->name);
+      entry->name = g_strdup(info->name ? info->name : info->alias);
+      telemetry_entry_own_strings(entry);
+      entry->refreshed = g_get_monotonic_time();
+   }
+}
+
+/**
+ * @brief Runs a pass now: fetches stale devices, then reports. Does
+ *  nothing while the previous pass still waits for replies.
+ */
+void telemetry_collect(Telemetry *tel)
+{
+   gint64 limit = g_get_monotonic_time() - (gint64)tel->max_age * G_USEC_PER_SEC;
+   BluezBatch *batch = NULL;
+   GHashTableIter iter;
+   TelemetryEntry *entry = NULL;
+
+   if (tel->collecting)
+      return;
+
+   //! Signals keep the cache current, only devices without news for
+   //! max_age are asked, all at once. With none stale the report goes
+   //! out right away.
+   batch = bluez_batch_new(tel->conn, TELEMETRY_WINDOW);
+   g_hash_table_iter_init(&iter, tel->entries);
+   while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry))
+   {
+      if (entry->refreshed > limit)
+         continue;
+      bluez_batch_add_get_all(batch, entry->path, BLUEZ_DEVICE_IFACE);
+      if (entry->info.ifaces & SCHEMA_BATTERY)
+         bluez_batch_add_get_all(batch, entry->path, BLUEZ_BATTERY_IFACE);
+   }
+
+   tel->collecting = TRUE;
+   tel->started = g_get_monotonic_time();
+   bluez_batch_set_reply_func(batch, telemetry_reply_cb);
+   bluez_batch_run(batch, telemetry_done_cb, tel);
+}
+
+/**
+ * @brief Stops the timer and the subscriptions. A pass in flight frees
+ *  the collector when its last reply arrives.
+ */
+void telemetry_free(Telemetry *tel)
+{
+   if (tel == NULL)
+      return;
+   g_source_remove(tel->timer);
+   for (int i = 0; i < G_N_ELEMENTS(tel->subs); i++)
+      g_dbus_connection_signal_unsubscribe(tel->conn, tel->subs[i]);
+   if (tel->collecting)
+      tel->closing = TRUE;
+   else
+      telemetry_destroy(tel);
+}
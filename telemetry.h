@@ -0,0 +1,55 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "dbus.h"
+#include "bluez.h"
+#include "schema.h"
+#include "output.h"
+
+#define TELEMETRY_INTERVAL 60    /** Seconds between reports. */
+#define TELEMETRY_MAX_AGE 600    /** Seconds a value is trusted without news. */
+#define TELEMETRY_WINDOW 64      /** GetAll calls in flight at once. */
+
+/**
+ * @brief Battery level and link state of every device, reported at an
+ *  interval.
+ *
+ *  Values come from a cache seeded with the device array and kept current
+ *  by PropertiesChanged and InterfacesAdded/Removed. Only devices the
+ *  cache hasn't heard about for max_age seconds are fetched, with
+ *  pipelined Properties.GetAll calls, before the report is written as a
+ *  single "telemetry" record.
+ */
+typedef struct _Telemetry Telemetry;
+
+/** Funcs **/
+/**
+ * @brief Starts the cache and the report timer.
+ *
+ * @param conn Connection handle to dbus.
+ * @param interval Seconds between reports.
+ * @param max_age Seconds after which a device without news is fetched.
+ */
+Telemetry *telemetry_new(GDBusConnection *conn, guint interval, guint max_age);
+
+/**
+ * @brief Adds the Device1 objects of an array to the cache, as fresh.
+ */
+void telemetry_track(Telemetry *tel, const Device *devices, gsize num_devices);
+
+/**
+ * @brief Runs a pass now: fetches stale devices, then reports. Does
+ *  nothing while the previous pass still waits for replies.
+ */
+void telemetry_collect(Telemetry *tel);
+
+/**
+ * @brief Stops the timer and the subscriptions. A pass in flight frees
+ *  the collector when its last reply arrives.
+ */
+void telemetry_free(Telemetry *tel);
+
+#endif // TELEMETRY_H
@@ -0,0 +1,690 @@
+/**
+* @file test.c
+* @brief Tests of the OBEX push path against a mock obexd.
+*
+* The mock runs on a private session bus (GTestDBus, so dbus-daemon must be
+* installed) in a thread of its own, since obex_receive() blocks on it. It
+* owns org.bluez.obex and answers Client1.CreateSession/RemoveSession,
+* ObjectPush1.SendFile and AgentManager1.RegisterAgent, drives every
+* Transfer1 to complete with PropertiesChanged, and pushes a file to the
+* agent once one registers.
+*/
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "obex.h"
+
+#define TEST_DEVICES 6             /** More than OBEX_MAX_SESSIONS. */
+#define TEST_FILES 2               /** Files per device. */
+#define TEST_STEP_MS 10            /** Between the progress signals of a transfer. */
+#define TEST_TIMEOUT_S 10
+#define TEST_PUSH_ADDRESS "11:22:33:44:55:66"
+#define TEST_PUSH_NAME "photo.jpg"
+#define TEST_PUSH_SIZE 4096
+
+static const char mock_xml[] =
+   "<node>"
+   "  <interface name='" OBEX_CLIENT_IFACE "'>"
+   "    <method name='CreateSession'>"
+   "      <arg type='s' name='destination' direction='in'/>"
+   "      <arg type='a{sv}' name='args' direction='in'/>"
+   "      <arg type='o' name='session' direction='out'/>"
+   "    </method>"
+   "    <method name='RemoveSession'>"
+   "      <arg type='o' name='session' direction='in'/>"
+   "    </method>"
+   "  </interface>"
+   "  <interface name='" OBEX_AGENT_MANAGER_IFACE "'>"
+   "    <method name='RegisterAgent'>"
+   "      <arg type='o' name='agent' direction='in'/>"
+   "    </method>"
+   "    <method name='UnregisterAgent'>"
+   "      <arg type='o' name='agent' direction='in'/>"
+   "    </method>"
+   "  </interface>"
+   "  <interface name='org.bluez.obex.Session1'>"
+   "    <property name='Destination' type='s' access='read'/>"
+   "  </interface>"
+   "  <interface name='" OBEX_PUSH_IFACE "'>"
+   "    <method name='SendFile'>"
+   "      <arg type='s' name='sourcefile' direction='in'/>"
+   "      <arg type='o' name='transfer' direction='out'/>"
+   "      <arg type='a{sv}' name='properties' direction='out'/>"
+   "    </method>"
+   "  </interface>"
+   "  <interface name='" OBEX_TRANSFER_IFACE "'>"
+   "    <property name='Status' type='s' access='read'/>"
+   "    <property name='Name' type='s' access='read'/>"
+   "    <property name='Size' type='t' access='read'/>"
+   "    <property name='Transferred' type='t' access='read'/>"
+   "    <property name='Session' type='o' access='read'/>"
+   "  </interface>"
+   "</node>";
+
+typedef struct _Mock Mock;
+typedef struct _MockSession MockSession;
+
+/** @brief A Transfer1 of the mock. */
+typedef struct _MockTransfer
+{
+   MockSession *session;
+   gchar *path;
+   gchar *name;
+   gchar *file;                  /** Read, or written for pushes. */
+   guint64 size;
+   guint64 transferred;
+   const char *status;
+   guint id;
+} MockTransfer;
+
+/** @brief A Session1 of the mock, outgoing or the one pushing to us. */
+struct _MockSession
+{
+   Mock *mock;
+   gchar *path;
+   gchar *address;
+   GPtrArray *transfers;         /** MockTransfer, owned. */
+   guint ids[2];
+};
+
+struct _Mock
+{
+   gchar *address;               /** Of the bus. */
+   GThread *thread;
+   GMainContext *context;
+   GMainLoop *loop;
+   GAsyncQueue *ready;
+   GDBusConnection *conn;
+   GDBusNodeInfo *info;
+   guint root_ids[2];
+   GHashTable *sessions;         /** Path to MockSession, owned. */
+   GHashTable *open;             /** Addresses with an open session. */
+   guint next_session;
+   gchar *agent_owner;
+   gchar *agent_path;
+   gchar *push_error;
+   gboolean unregistered;        /** The agent left, which also stops the mock. */
+
+   //! Read by the test once the thread is joined.
+   guint created;
+   guint removed;
+   guint max_open;
+   guint sends;
+   guint bad_target;
+   gboolean overlap;             /** Two sessions to one address at once. */
+};
+
+/** @brief What the test saw through the ObexFunc. */
+typedef struct _TestState
+{
+   GMainLoop *loop;
+   guint sent;
+   guint failed;
+   guint short_sent;             /** Completed with fewer bytes than their size. */
+   guint received;
+   gchar *received_file;
+   gchar *received_address;
+} TestState;
+
+//! Mock obexd.
+
+static void mock_timeout(Mock *mock, guint ms, GSourceFunc func, gpointer data)
+{
+   GSource *source = g_timeout_source_new(ms);
+
+   g_source_set_callback(source, func, data, NULL);
+   g_source_attach(source, mock->context);
+   g_source_unref(source);
+}
+
+static void mock_transfer_free(MockTransfer *transfer)
+{
+   if (transfer->id)
+      g_dbus_connection_unregister_object(transfer->session->mock->conn, transfer->id);
+   g_free(transfer->path);
+   g_free(transfer->name);
+   g_free(transfer->file);
+   g_free(transfer);
+}
+
+static void mock_session_free(MockSession *session)
+{
+   for (int i = 0; i < G_N_ELEMENTS(session->ids); i++)
+   {
+      if (session->ids[i])
+         g_dbus_connection_unregister_object(session->mock->conn, session->ids[i]);
+   }
+   g_ptr_array_free(session->transfers, TRUE);
+   g_free(session->path);
+   g_free(session->address);
+   g_free(session);
+}
+
+static GVariant *mock_session_get(GDBusConnection *conn, const gchar *sender, const gchar *path,
+                                  const gchar *iface, const gchar *prop, GError **error, gpointer arg)
+{
+   MockSession *session = arg;
+
+   if (g_str_equal(prop, "Destination"))
+      return g_variant_new_string(session->address);
+   return NULL;
+}
+
+static GVariant *mock_transfer_get(GDBusConnection *conn, const gchar *sender, const gchar *path,
+                                   const gchar *iface, const gchar *prop, GError **error, gpointer arg)
+{
+   MockTransfer *transfer = arg;
+
+   if (g_str_equal(prop, "Status"))
+      return g_variant_new_string(transfer->status);
+   if (g_str_equal(prop, "Name"))
+      return g_variant_new_string(transfer->name);
+   if (g_str_equal(prop, "Size"))
+      return g_variant_new_uint64(transfer->size);
+   if (g_str_equal(prop, "Transferred"))
+      return g_variant_new_uint64(transfer->transferred);
+   if (g_str_equal(prop, "Session"))
+      return g_variant_new_object_path(transfer->session->path);
+   return NULL;
+}
+
+static const GDBusInterfaceVTable mock_transfer_vtable = { NULL, mock_transfer_get, NULL };
+
+/**
+ * @brief Moves a transfer on, once per call: half way while active, then
+ *  complete. A pushed file is written just before it completes, as
+ *  obexd does.
+ */
+static gboolean mock_transfer_step(gpointer arg)
+{
+   MockTransfer *transfer = arg;
+   Mock *mock = transfer->session->mock;
+   const gchar *none[] = { NULL };
+   GVariantBuilder changed;
+
+   if (g_str_equal(transfer->status, "queued"))
+   {
+      transfer->status = "active";
+      transfer->transferred = transfer->size / 2;
+   }
+   else
+   {
+      if (!g_str_has_prefix(transfer->path, OBEX_OBJECT "/client"))
+      {
+         gchar *data = g_malloc(transfer->size);
+         memset(data, 'x', transfer->size);
+         g_file_set_contents(transfer->file, data, transfer->size, NULL);
+         g_free(data);
+      }
+      transfer->status = "complete";
+      transfer->transferred = transfer->size;
+   }
+
+   g_variant_builder_init(&changed, G_VARIANT_TYPE_VARDICT);
+   g_variant_builder_add(&changed, "{sv}", "Status", g_variant_new_string(transfer->status));
+   g_variant_builder_add(&changed, "{sv}", "Transferred", g_variant_new_uint64(transfer->transferred));
+   g_dbus_connection_emit_signal(mock->conn, NULL, transfer->path, "org.freedesktop.DBus.Properties",
+                                 "PropertiesChanged",
+                                 g_variant_new("(sa{sv}^as)", OBEX_TRANSFER_IFACE, &changed, none), NULL);
+   return G_SOURCE_REMOVE;
+}
+
+static MockTransfer *mock_transfer_new(MockSession *session, const char *name, guint64 size)
+{
+   Mock *mock = session->mock;
+   MockTransfer *transfer = g_new0(MockTransfer, 1);
+
+   transfer->session = session;
+   transfer->path = g_strdup_printf("%s/transfer%u", session->path, session->transfers->len);
+   transfer->name = g_strdup(name);
+   transfer->size = size;
+   transfer->status = "queued";
+   transfer->id = g_dbus_connection_register_object(mock->conn, transfer->path,
+                                                    g_dbus_node_info_lookup_interface(mock->info, OBEX_TRANSFER_IFACE),
+                                                    &mock_transfer_vtable, transfer, NULL, NULL);
+   g_ptr_array_add(session->transfers, transfer);
+   return transfer;
+}
+
+static void mock_push_method(GDBusConnection *conn,
+            const gchar *sender,
+            const gchar *path,
+            const gchar *interface,
+            const gchar *method,
+            GVariant *params,
+            GDBusMethodInvocation *invocation,
+            gpointer user_data)
+{
+   MockSession *session = user_data;
+   MockTransfer *transfer = NULL;
+   const gchar *file = NULL;
+   gchar *base = NULL;
+   GStatBuf st;
+   GVariantBuilder props;
+
+   g_variant_get(params, "(&s)", &file);
+   if (!g_path_is_absolute(file) || g_stat(file, &st) != 0)
+   {
+      g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.obex.Error.InvalidArguments",
+                                                 "Unable to find file");
+      return;
+   }
+
+   base = g_path_get_basename(file);
+   transfer = mock_transfer_new(session, base, st.st_size);
+   transfer->file = g_strdup(file);
+   g_free(base);
+   session->mock->sends += 1;
+
+   //! obexd sends the files of a session one after the other.
+   for (guint i = 0; i < 2; i++)
+      mock_timeout(session->mock, TEST_STEP_MS * (session->transfers->len + i), mock_transfer_step, transfer);
+
+   g_variant_builder_init(&props, G_VARIANT_TYPE_VARDICT);
+   g_variant_builder_add(&props, "{sv}", "Status", g_variant_new_string(transfer->status));
+   g_variant_builder_add(&props, "{sv}", "Name", g_variant_new_string(transfer->name));
+   g_variant_builder_add(&props, "{sv}", "Size", g_variant_new_uint64(transfer->size));
+   g_variant_builder_add(&props, "{sv}", "Session", g_variant_new_object_path(session->path));
+   g_dbus_method_invocation_return_value(invocation, g_variant_new("(oa{sv})", transfer->path, &props));
+}
+
+static const GDBusInterfaceVTable mock_push_vtable = { mock_push_method, NULL, NULL };
+static const GDBusInterfaceVTable mock_session_vtable = { NULL, mock_session_get, NULL };
+
+static MockSession *mock_session_new(Mock *mock, const char *kind, const char *address)
+{
+   MockSession *session = g_new0(MockSession, 1);
+
+   session->mock = mock;
+   session->path = g_strdup_printf(OBEX_OBJECT "/%s/session%u", kind, mock->next_session++);
+   session->address = g_strdup(address);
+   session->transfers = g_ptr_array_new_with_free_func((GDestroyNotify)mock_transfer_free);
+   session->ids[0] = g_dbus_connection_register_object(mock->conn, session->path,
+                                                       g_dbus_node_info_lookup_interface(mock->info,
+                                                                                         "org.bluez.obex.Session1"),
+                                                       &mock_session_vtable, session, NULL, NULL);
+   g_hash_table_insert(mock->sessions, session->path, session);
+   return session;
+}
+
+static void mock_authorized_cb(GObject *source, GAsyncResult *res, gpointer arg)
+{
+   MockTransfer *transfer = arg;
+   Mock *mock = transfer->session->mock;
+   GError *error = NULL;
+   GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+
+   if (result == NULL)
+   {
+      mock->push_error = g_strdup(error->message);
+      g_error_free(error);
+      return;
+   }
+   g_variant_get(result, "(s)", &transfer->file);
+   g_variant_unref(result);
+   for (guint i = 0; i < 2; i++)
+      mock_timeout(mock, TEST_STEP_MS * (i + 1), mock_transfer_step, transfer);
+}
+
+/**
+ * @brief A remote device pushes a file, the agent names it.
+ */
+static gboolean mock_push(gpointer arg)
+{
+   Mock *mock = arg;
+   MockSession *session = mock_session_new(mock, "server", TEST_PUSH_ADDRESS);
+   MockTransfer *transfer = mock_transfer_new(session, TEST_PUSH_NAME, TEST_PUSH_SIZE);
+
+   g_dbus_connection_call(mock->conn,
+            mock->agent_owner,
+            mock->agent_path,
+            OBEX_AGENT_IFACE,
+            "AuthorizePush",
+            g_variant_new("(o)", transfer->path),
+            G_VARIANT_TYPE("(s)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            mock_authorized_cb,
+            transfer);
+   return G_SOURCE_REMOVE;
+}
+
+static void mock_root_method(GDBusConnection *conn,
+            const gchar *sender,
+            const gchar *path,
+            const gchar *interface,
+            const gchar *method,
+            GVariant *params,
+            GDBusMethodInvocation *invocation,
+            gpointer user_data)
+{
+   Mock *mock = user_data;
+   MockSession *session = NULL;
+   const gchar *str = NULL;
+   const gchar *target = NULL;
+   GVariant *args = NULL;
+
+   if (g_str_equal(method, "CreateSession"))
+   {
+      g_variant_get(params, "(&s@a{sv})", &str, &args);
+      if (!g_variant_lookup(args, "Target", "&s", &target) || !g_str_equal(target, "opp"))
+         mock->bad_target += 1;
+      g_variant_unref(args);
+
+      mock->overlap |= g_hash_table_contains(mock->open, str);
+      g_hash_table_add(mock->open, g_strdup(str));
+      mock->created += 1;
+      mock->max_open = MAX(mock->max_open, g_hash_table_size(mock->open));
+
+      session = mock_session_new(mock, "client", str);
+      session->ids[1] = g_dbus_connection_register_object(conn, session->path,
+                                                          g_dbus_node_info_lookup_interface(mock->info,
+                                                                                            OBEX_PUSH_IFACE),
+                                                          &mock_push_vtable, session, NULL, NULL);
+      g_dbus_method_invocation_return_value(invocation, g_variant_new("(o)", session->path));
+   }
+   else if (g_str_equal(method, "RemoveSession"))
+   {
+      g_variant_get(params, "(&o)", &str);
+      if ((session = g_hash_table_lookup(mock->sessions, str)) == NULL)
+      {
+         g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.obex.Error.InvalidArguments",
+                                                    "Invalid path");
+         return;
+      }
+      g_hash_table_remove(mock->open, session->address);
+      g_hash_table_remove(mock->sessions, str);
+      mock->removed += 1;
+      g_dbus_method_invocation_return_value(invocation, NULL);
+   }
+   else if (g_str_equal(method, "RegisterAgent"))
+   {
+      g_variant_get(params, "(&o)", &str);
+      g_free(mock->agent_owner);
+      g_free(mock->agent_path);
+      mock->agent_owner = g_strdup(g_dbus_method_invocation_get_sender(invocation));
+      mock->agent_path = g_strdup(str);
+      g_dbus_method_invocation_return_value(invocation, NULL);
+      mock_timeout(mock, TEST_STEP_MS, mock_push, mock);
+   }
+   else
+   {
+      //! UnregisterAgent. obex_free() sends it after every RemoveSession,
+      //! on the same connection, so nothing the test waits for is left.
+      mock->unregistered = TRUE;
+      g_dbus_method_invocation_return_value(invocation, NULL);
+      g_main_loop_quit(mock->loop);
+   }
+}
+
+static const GDBusInterfaceVTable mock_root_vtable = { mock_root_method, NULL, NULL };
+
+static gpointer mock_thread(gpointer arg)
+{
+   Mock *mock = arg;
+   GError *error = NULL;
+   GVariant *result = NULL;
+   guint32 reply = 0;
+
+   g_main_context_push_thread_default(mock->context);
+   mock->conn = g_dbus_connection_new_for_address_sync(mock->address,
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+            NULL,
+            NULL,
+            &error);
+   g_assert_no_error(error);
+   mock->info = g_dbus_node_info_new_for_xml(mock_xml, &error);
+   g_assert_no_error(error);
+   mock->root_ids[0] = g_dbus_connection_register_object(mock->conn, OBEX_OBJECT,
+                                                         g_dbus_node_info_lookup_interface(mock->info,
+                                                                                           OBEX_CLIENT_IFACE),
+                                                         &mock_root_vtable, mock, NULL, &error);
+   g_assert_no_error(error);
+   mock->root_ids[1] = g_dbus_connection_register_object(mock->conn, OBEX_OBJECT,
+                                                         g_dbus_node_info_lookup_interface(mock->info,
+                                                                                           OBEX_AGENT_MANAGER_IFACE),
+                                                         &mock_root_vtable, mock, NULL, &error);
+   g_assert_no_error(error);
+
+   // Objects first, so nothing calls in before they are there.
+   result = g_dbus_connection_call_sync(mock->conn,
+            "org.freedesktop.DBus",
+            "/org/freedesktop/DBus",
+            "org.freedesktop.DBus",
+            "RequestName",
+            g_variant_new("(su)", OBEX_ORG, 0x4),
+            G_VARIANT_TYPE("(u)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            &error);
+   g_assert_no_error(error);
+   g_variant_get(result, "(u)", &reply);
+   g_variant_unref(result);
+   g_assert_cmpuint(reply, ==, 1);
+
+   g_async_queue_push(mock->ready, mock);
+   g_main_loop_run(mock->loop);
+
+   g_hash_table_destroy(mock->sessions);
+   for (int i = 0; i < G_N_ELEMENTS(mock->root_ids); i++)
+      g_dbus_connection_unregister_object(mock->conn, mock->root_ids[i]);
+   g_dbus_connection_close_sync(mock->conn, NULL, NULL);
+   g_object_unref(mock->conn);
+   g_dbus_node_info_unref(mock->info);
+   g_main_context_pop_thread_default(mock->context);
+   return NULL;
+}
+
+/**
+ * @brief Starts the mock on the bus at address, returns once it owns
+ *  the obexd name.
+ */
+static Mock *mock_start(const char *address)
+{
+   Mock *mock = g_new0(Mock, 1);
+
+   mock->address = g_strdup(address);
+   mock->context = g_main_context_new();
+   mock->loop = g_main_loop_new(mock->context, FALSE);
+   mock->ready = g_async_queue_new();
+   mock->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)mock_session_free);
+   mock->open = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   mock->thread = g_thread_new("mock-obexd", mock_thread, mock);
+   g_async_queue_pop(mock->ready);
+   return mock;
+}
+
+/**
+ * @brief Waits for the mock thread to end, once the agent unregistered.
+ *  Its counters stay readable until mock_free().
+ */
+static void mock_join(Mock *mock)
+{
+   g_thread_join(mock->thread);
+}
+
+static void mock_free(Mock *mock)
+{
+   g_hash_table_destroy(mock->open);
+   g_async_queue_unref(mock->ready);
+   g_main_loop_unref(mock->loop);
+   g_main_context_unref(mock->context);
+   g_free(mock->agent_owner);
+   g_free(mock->agent_path);
+   g_free(mock->push_error);
+   g_free(mock->address);
+   g_free(mock);
+}
+
+//! Tests.
+
+static void test_obex_cb(const ObexTransfer *transfer, gpointer user_data)
+{
+   TestState *state = user_data;
+
+   if (transfer->status != OBEX_COMPLETE && transfer->status != OBEX_ERROR)
+      return;
+
+   if (transfer->incoming)
+   {
+      state->received += 1;
+      state->received_file = g_strdup(transfer->file);
+      state->received_address = g_strdup(transfer->address);
+   }
+   else if (transfer->status == OBEX_ERROR)
+   {
+      state->failed += 1;
+   }
+   else
+   {
+      state->sent += 1;
+      state->short_sent += transfer->transferred < transfer->size;
+   }
+   if (state->sent + state->failed == TEST_DEVICES * TEST_FILES && state->received == 1)
+      g_main_loop_quit(state->loop);
+}
+
+static gboolean test_timeout_cb(gpointer arg)
+{
+   g_error("obex: transfers didn't finish in %d s", TEST_TIMEOUT_S);
+   return G_SOURCE_REMOVE;
+}
+
+static void test_remove_dir(const char *dir)
+{
+   GDir *handle = g_dir_open(dir, 0, NULL);
+   const gchar *name = NULL;
+
+   while (handle != NULL && (name = g_dir_read_name(handle)) != NULL)
+   {
+      gchar *file = g_build_filename(dir, name, NULL);
+      g_remove(file);
+      g_free(file);
+   }
+   if (handle != NULL)
+      g_dir_close(handle);
+   g_rmdir(dir);
+}
+
+/**
+ * @brief Pushes two files to each of more devices than may be pushed to
+ *  at once, while a device pushes one to us.
+ */
+static void test_obex_push(void)
+{
+   GTestDBus *bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+   TestState state = { 0 };
+   GError *error = NULL;
+   gchar *outbox = NULL;
+   gchar *inbox = NULL;
+   gchar *taken = NULL;
+   gchar *expected = NULL;
+   gchar *data = NULL;
+   gsize len = 0;
+
+   g_test_dbus_up(bus);
+   Mock *mock = mock_start(g_test_dbus_get_bus_address(bus));
+   GDBusConnection *conn = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(bus),
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+            NULL,
+            NULL,
+            &error);
+   g_assert_no_error(error);
+
+   outbox = g_dir_make_tmp("tuxdrop-out-XXXXXX", &error);
+   g_assert_no_error(error);
+   inbox = g_dir_make_tmp("tuxdrop-in-XXXXXX", &error);
+   g_assert_no_error(error);
+   // The pushed file must not overwrite this one.
+   taken = g_build_filename(inbox, TEST_PUSH_NAME, NULL);
+   g_file_set_contents(taken, "mine", -1, NULL);
+
+   state.loop = g_main_loop_new(NULL, FALSE);
+   Obex *obex = obex_new(conn, test_obex_cb, &state);
+
+   g_assert_false(obex_send(obex, "not an address", taken));
+   g_assert_false(obex_send(obex, "00:11:22:33:44:55", "/nonexistent/file"));
+   g_assert_true(obex_idle(obex));
+
+   for (guint dev = 0; dev < TEST_DEVICES; dev++)
+   {
+      for (guint i = 0; i < TEST_FILES; i++)
+      {
+         gchar *name = g_strdup_printf("file%u-%u", dev, i);
+         gchar *file = g_build_filename(outbox, name, NULL);
+         gchar *address = g_strdup_printf("00:11:22:33:44:%02X", dev);
+         gchar *content = g_strnfill(1000 * (dev + 1) + i, 'a' + dev);
+
+         g_file_set_contents(file, content, -1, NULL);
+         g_assert_true(obex_send(obex, address, file));
+         g_free(content);
+         g_free(address);
+         g_free(file);
+         g_free(name);
+      }
+   }
+   g_assert_false(obex_idle(obex));
+   g_assert_true(obex_receive(obex, inbox, &error));
+   g_assert_no_error(error);
+
+   guint timeout = g_timeout_add_seconds(TEST_TIMEOUT_S, test_timeout_cb, NULL);
+   g_main_loop_run(state.loop);
+   g_source_remove(timeout);
+
+   g_assert_cmpuint(state.sent, ==, TEST_DEVICES * TEST_FILES);
+   g_assert_cmpuint(state.failed, ==, 0);
+   g_assert_cmpuint(state.short_sent, ==, 0);
+   g_assert_true(obex_idle(obex));
+
+   g_assert_cmpuint(state.received, ==, 1);
+   g_assert_cmpstr(state.received_address, ==, TEST_PUSH_ADDRESS);
+   expected = g_strconcat(taken, ".1", NULL);
+   g_assert_cmpstr(state.received_file, ==, expected);
+
+   obex_free(obex);
+   g_dbus_connection_flush_sync(conn, NULL, &error);
+   g_assert_no_error(error);
+   g_object_unref(conn);
+   mock_join(mock);
+
+   //! One session per device, all its files on it, a few devices at once.
+   g_assert_cmpuint(mock->created, ==, TEST_DEVICES);
+   g_assert_cmpuint(mock->removed, ==, TEST_DEVICES);
+   g_assert_cmpuint(mock->sends, ==, TEST_DEVICES * TEST_FILES);
+   g_assert_cmpuint(mock->max_open, ==, OBEX_MAX_SESSIONS);
+   g_assert_cmpuint(mock->bad_target, ==, 0);
+   g_assert_false(mock->overlap);
+   g_assert_null(mock->push_error);
+   g_assert_true(mock->unregistered);
+
+   g_assert_true(g_file_get_contents(expected, &data, &len, NULL));
+   g_assert_cmpuint(len, ==, TEST_PUSH_SIZE);
+   g_free(data);
+   g_assert_true(g_file_get_contents(taken, &data, NULL, NULL));
+   g_assert_cmpstr(data, ==, "mine");
+   g_free(data);
+
+   mock_free(mock);
+   g_main_loop_unref(state.loop);
+   g_free(state.received_file);
+   g_free(state.received_address);
+   test_remove_dir(outbox);
+   test_remove_dir(inbox);
+   g_free(expected);
+   g_free(taken);
+   g_free(outbox);
+   g_free(inbox);
+   g_test_dbus_down(bus);
+   g_object_unref(bus);
+}
+
+int main(int argc, char **argv)
+{
+   g_test_init(&argc, &argv, NULL);
+   g_test_add_func("/obex/push", test_obex_push);
+   return g_test_run();
+}